@@ -0,0 +1,152 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Micro-benchmark for the JSON serializer (json_output.c), comparing it with the printf-based serializer it replaced.
+// As a bonus, it also checks that both produce exactly the same output.
+//
+// Run with `bundle exec rake bench:json_serializer`.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json_output.h"
+
+#define EVENT_COUNT 4096
+#define ITERATIONS 500
+
+// This is the original serializer, kept here only as a reference
+static size_t printf_event(char *buffer, size_t size, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  double now_microseconds = relative_timestamp_ns / 1000.0;
+  int length = 0;
+
+  if (event->type == EVENT_GVL_HOLDER) {
+    return snprintf(
+      buffer, size,
+      "  {\"ph\": \"i\", \"s\": \"t\", \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f, \"name\": \"%s\", "
+      "\"args\": {\"holder_thread_id\": %d, \"stack_id\": %u, \"wait_us\": %u}},\n",
+      process_id, event->thread_id, now_microseconds, event_type_name(event->type),
+      event->data.gvl_holder.thread_id, event->data.gvl_holder.stack_id, event->data.gvl_holder.wait_us
+    );
+  }
+
+  length += snprintf(
+    buffer + length, size - length,
+    "  {\"ph\": \"E\", \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f},\n" \
+    "  {\"ph\": \"B\", \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f, \"name\": \"%s\"},\n",
+    process_id, event->thread_id, now_microseconds,
+    process_id, event->thread_id, now_microseconds, event_type_name(event->type)
+  );
+
+  if (event->flags & (EVENT_FLAG_OS_THREAD_BEGIN | EVENT_FLAG_OS_THREAD_END)) {
+    length += snprintf(
+      buffer + length, size - length,
+      "  {\"ph\": \"E\", \"pid\": %"PRId64", \"tid\": %u, \"ts\": %f},\n",
+      OS_THREADS_VIEW_PID, event->native_thread_id, now_microseconds
+    );
+  }
+  if (event->flags & EVENT_FLAG_OS_THREAD_BEGIN) {
+    length += snprintf(
+      buffer + length, size - length,
+      "  {\"ph\": \"B\", \"pid\": %"PRId64", \"tid\": %u, \"ts\": %f, \"name\": \"Thread %d (%c)\"},\n",
+      OS_THREADS_VIEW_PID, event->native_thread_id, now_microseconds, event->thread_id, 'a' + (event->thread_id % 26)
+    );
+  }
+
+  if (event->flags & (EVENT_FLAG_FLOW_BEGIN | EVENT_FLAG_FLOW_END)) {
+    length += snprintf(
+      buffer + length, size - length,
+      "  {\"ph\": \"%s\", \"id\": %u, \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f, \"name\": \"gvl_handoff\", \"cat\": \"gvl\"%s},\n",
+      (event->flags & EVENT_FLAG_FLOW_BEGIN) ? "s" : "f", event->data.flow.id, process_id, event->thread_id, now_microseconds,
+      (event->flags & EVENT_FLAG_FLOW_BEGIN) ? "" : ", \"bp\": \"e\""
+    );
+  }
+
+  return length;
+}
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_nsec + (now.tv_sec * INT64_C(1000000000));
+}
+
+int main(void) {
+  static gvl_event events[EVENT_COUNT];
+  static const uint8_t flag_options[] = {
+    0, 0, EVENT_FLAG_FLOW_BEGIN, EVENT_FLAG_FLOW_END, EVENT_FLAG_OS_THREAD_BEGIN, EVENT_FLAG_OS_THREAD_END | EVENT_FLAG_FLOW_BEGIN,
+  };
+  int64_t timestamp_ns = 0;
+
+  srand(42);
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    timestamp_ns += rand() % 100000;
+    events[i] = (gvl_event) {
+      .timestamp_ns = timestamp_ns,
+      .thread_id = rand() % 1000,
+      .native_thread_id = 100000 + rand() % 1000,
+      .type = rand() % EVENT_TYPE_COUNT,
+      .flags = flag_options[rand() % sizeof(flag_options)],
+      .data.flow.id = rand(),
+    };
+  }
+
+  char expected[JSON_OUTPUT_MAX_EVENT_SIZE];
+  char actual[JSON_OUTPUT_MAX_EVENT_SIZE];
+  int64_t process_id = 12345;
+  size_t total_bytes = 0;
+
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    size_t expected_length = printf_event(expected, sizeof(expected), &events[i], process_id, events[i].timestamp_ns);
+    size_t actual_length = json_output_event(actual, &events[i], process_id, events[i].timestamp_ns);
+    if (expected_length != actual_length || memcmp(expected, actual, actual_length) != 0) {
+      fprintf(stderr, "Output mismatch for event %d!\nExpected:\n%.*s\nGot:\n%.*s\n", i, (int) expected_length, expected, (int) actual_length, actual);
+      return 1;
+    }
+    total_bytes += actual_length;
+  }
+
+  volatile size_t sink = 0;
+
+  int64_t started_at = now_ns();
+  for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+    for (int i = 0; i < EVENT_COUNT; i++) sink += printf_event(expected, sizeof(expected), &events[i], process_id, events[i].timestamp_ns);
+  }
+  double printf_ns_per_event = (now_ns() - started_at) / (double) (ITERATIONS * EVENT_COUNT);
+
+  started_at = now_ns();
+  for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+    for (int i = 0; i < EVENT_COUNT; i++) sink += json_output_event(actual, &events[i], process_id, events[i].timestamp_ns);
+  }
+  double json_output_ns_per_event = (now_ns() - started_at) / (double) (ITERATIONS * EVENT_COUNT);
+
+  printf("Output matches for %d events (%.1f bytes/event on average)\n", EVENT_COUNT, total_bytes / (double) EVENT_COUNT);
+  printf("printf:      %8.1f ns/event\n", printf_ns_per_event);
+  printf("json_output: %8.1f ns/event (%.1fx faster)\n", json_output_ns_per_event, printf_ns_per_event / json_output_ns_per_event);
+
+  return 0;
+}
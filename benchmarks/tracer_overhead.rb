@@ -0,0 +1,215 @@
+# frozen_string_literal: true
+
+# Measures how much GvlTracing slows down a few workloads, and how that changes with the number of threads.
+#
+# Run with `bundle exec rake bench`. The results get printed (and saved to `BENCH_OUTPUT`, `tmp/bench.json` by default)
+# as JSON, so they can be compared between versions. Use `BENCH_THREADS` (e.g. "1,8"), `BENCH_WORKLOADS` (e.g. "fib"),
+# `BENCH_MODES` (e.g. "off,json") and `BENCH_REPETITIONS` to run a subset.
+#
+# Every workload does the same total amount of work no matter how many threads it gets split across, so ops/s for the
+# same workload can be compared across thread counts.
+
+$LOAD_PATH.unshift(File.expand_path("../lib", __dir__))
+
+require "gvl-tracing"
+require "fileutils"
+require "json"
+require "tmpdir"
+
+module TracerOverheadBenchmark
+  FIB_CALLS = 640
+  PING_PONG_ACQUISITIONS = 2_000
+  CONDVAR_SIGNALS = 10_000
+  IO_OPERATIONS = 20_000
+
+  def self.fib(n) = (n < 2) ? n : fib(n - 1) + fib(n - 2)
+
+  def self.split(total, threads) = Array.new(threads) { |i| total / threads + ((i < total % threads) ? 1 : 0) }
+
+  # CPU-bound threads, which only get to switch when their timeslice runs out
+  def self.fib_workload(threads)
+    split(FIB_CALLS, threads).map { |calls| Thread.new { calls.times { fib(18) } } }.each(&:join)
+    FIB_CALLS
+  end
+
+  # Same as examples/ping-pong.rb: threads taking turns with a single resource, guarded by a mutex and condvar
+  def self.ping_pong_workload(threads)
+    mutex = Thread::Mutex.new
+    condvar = Thread::ConditionVariable.new
+    resources = [Object.new]
+
+    split(PING_PONG_ACQUISITIONS, threads).map do |acquisitions|
+      Thread.new do
+        acquisitions.times do
+          resource = mutex.synchronize do
+            condvar.wait(mutex) while resources.empty?
+            resources.pop
+          end
+          sleep(0.0001)
+          mutex.synchronize do
+            resources << resource
+            condvar.signal
+          end
+        end
+      end
+    end.each(&:join)
+
+    PING_PONG_ACQUISITIONS
+  end
+
+  # Same as examples/other/coalesce.rb: lots of threads waiting on a condvar that keeps getting signaled
+  def self.condvar_storm_workload(threads)
+    mutex = Thread::Mutex.new
+    condvar = Thread::ConditionVariable.new
+    done = false
+
+    waiters = Array.new(threads) do
+      Thread.new do
+        mutex.synchronize { condvar.wait(mutex) until done }
+      end
+    end
+
+    CONDVAR_SIGNALS.times do
+      mutex.synchronize { condvar.signal }
+      Thread.pass # Give the thread that got signaled a chance to wake up
+    end
+    mutex.synchronize do
+      done = true
+      condvar.broadcast
+    end
+    waiters.each(&:join)
+
+    CONDVAR_SIGNALS
+  end
+
+  # Threads doing small reads/writes on pipes and files, which release the GVL every time
+  def self.io_mix_workload(threads)
+    Dir.mktmpdir do |dir|
+      file_path = File.join(dir, "data")
+      File.write(file_path, "x" * 4096)
+      chunk = "y" * 512
+
+      split(IO_OPERATIONS, threads).map do |operations|
+        Thread.new do
+          reader, writer = IO.pipe
+          operations.times do |i|
+            if i % 10 == 0
+              File.read(file_path)
+            else
+              writer.write(chunk)
+              reader.readpartial(chunk.bytesize)
+            end
+          end
+        ensure
+          reader&.close
+          writer&.close
+        end
+      end.each(&:join)
+    end
+
+    IO_OPERATIONS
+  end
+
+  WORKLOADS = {
+    "fib" => method(:fib_workload),
+    "ping_pong" => method(:ping_pong_workload),
+    "condvar_storm" => method(:condvar_storm_workload),
+    "io_mix" => method(:io_mix_workload),
+  }.freeze
+
+  MODES = {
+    "off" => nil,
+    "json" => {},
+    "json_os_threads_view" => {os_threads_view_enabled: true},
+  }.freeze
+
+  def self.env_list(name, default) = ENV[name]&.split(",")&.map(&:strip) || default
+
+  def self.now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+  # Every event is a "B" line for the process (the OS threads view uses pid 0 for its own slices)
+  def self.count_events(trace_path) = File.foreach(trace_path).count { |line| line.include?('"ph": "B"') && !line.include?('"pid": 0,') }
+
+  def self.run_once(workload, threads, options, trace_path)
+    GC.start
+    GvlTracing.start(trace_path, **options) if options
+    started_at = now
+    operations = workload.call(threads)
+    elapsed = now - started_at
+    GvlTracing.stop if options
+
+    result = {elapsed_s: elapsed, operations: operations}
+    return result unless options
+
+    result.merge(
+      events: count_events(trace_path) + GvlTracing.dropped_events,
+      dropped_events: GvlTracing.dropped_events,
+      bytes: File.size(trace_path)
+    )
+  end
+
+  # The extra time the workload took with tracing on, spread over all of the events that were recorded
+  def self.ns_per_hook(measurement, baseline)
+    return if measurement[:events] == 0
+
+    ((measurement[:elapsed_s] - baseline[:elapsed_s]) * 1e9 / measurement[:events]).round(1)
+  end
+
+  def self.median(results) = results.sort_by { |result| result[:elapsed_s] }[results.size / 2]
+
+  def self.run
+    thread_counts = env_list("BENCH_THREADS", %w[1 2 4 8 16 32 64]).map { |threads| Integer(threads) }
+    workloads = WORKLOADS.slice(*env_list("BENCH_WORKLOADS", WORKLOADS.keys))
+    modes = MODES.slice(*(["off"] | env_list("BENCH_MODES", MODES.keys)))
+    repetitions = Integer(ENV.fetch("BENCH_REPETITIONS", "3"))
+    output_path = ENV.fetch("BENCH_OUTPUT", "tmp/bench.json")
+    trace_path = File.join(Dir.tmpdir, "gvl-tracing-bench-#{Process.pid}.json")
+
+    results = workloads.flat_map do |workload_name, workload|
+      thread_counts.flat_map do |threads|
+        workload.call(threads) # Warm up
+
+        baseline = nil
+        modes.map do |mode, options|
+          measurement = median(Array.new(repetitions) { run_once(workload, threads, options, trace_path) })
+          baseline ||= measurement
+
+          result = {
+            workload: workload_name,
+            threads: threads,
+            mode: mode,
+            elapsed_s: measurement[:elapsed_s].round(6),
+            ops_per_s: (measurement[:operations] / measurement[:elapsed_s]).round(1),
+            throughput_loss: (1 - baseline[:elapsed_s] / measurement[:elapsed_s]).round(4),
+          }
+          if options
+            result.merge!(
+              events: measurement[:events],
+              dropped_events: measurement[:dropped_events],
+              ns_per_hook: ns_per_hook(measurement, baseline),
+              bytes: measurement[:bytes],
+              bytes_per_s: (measurement[:bytes] / measurement[:elapsed_s]).round
+            )
+          end
+          warn result.to_json
+          result
+        end
+      end
+    end
+
+    report = JSON.pretty_generate(
+      ruby_version: RUBY_VERSION,
+      ruby_description: RUBY_DESCRIPTION,
+      gvl_tracing_version: GvlTracing::VERSION,
+      repetitions: repetitions,
+      results: results
+    )
+
+    File.delete(trace_path) if File.exist?(trace_path)
+    FileUtils.mkdir_p(File.dirname(output_path))
+    File.write(output_path, report)
+    puts report
+  end
+end
+
+TracerOverheadBenchmark.run if $PROGRAM_NAME == __FILE__
@@ -0,0 +1,760 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+#include <ruby/thread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "analyzer.h"
+#include "json_output.h"
+
+// Chunks smaller than this are not worth a thread of their own
+#define MIN_CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_JOBS 64
+#define MAX_TOP 1000
+// Caps the memory used for the contended windows (8 bytes each) if the trace has some bogus timestamp
+#define MAX_WINDOWS (1 << 22)
+// The wants_gvl durations get kept in a histogram with 16 buckets for every power of two, so percentiles are off by at
+// most ~6%
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (64 * SUB_BUCKETS)
+// Thread ids at or above this are the extra tracks for spans and fibers (see json_output.h), which are skipped
+#define FIRST_EXTRA_TRACK_TID SPAN_TRACK_TID(0)
+
+#define LITERAL(string) string, (sizeof(string) - 1)
+
+typedef enum {
+  STATE_RUNNING,
+  STATE_WANTS_GVL,
+  STATE_WAITING, // Includes all the waiting:* states
+  STATE_SLEEPING,
+  STATE_GC,
+  STATE_OTHER, // E.g. started, died or coalesced
+  // Only used by the GC track
+  STATE_GC_MARKING,
+  STATE_GC_SWEEPING,
+  STATE_COUNT,
+} slice_state;
+
+typedef struct {
+  uint64_t key; // (pid << 32) | tid, 0 if the entry is not used (pid 0 is the OS threads view, which gets skipped)
+  bool has_events;
+  bool seen_begin;
+  // An end that came before any begin in the chunk, which ends whatever slice was open at the end of the previous one
+  bool has_first_end;
+  int64_t first_end_ns;
+  // The slice that's still open at the end of the chunk
+  bool has_open;
+  uint8_t open_state;
+  int64_t open_since_ns;
+  int64_t first_ns;
+  int64_t last_ns;
+  uint64_t state_ns[STATE_COUNT];
+  uint64_t wants_gvl_count;
+  char *name; // Last thread_name seen for this thread, if any
+} thread_entry;
+
+typedef struct {
+  thread_entry *entries;
+  size_t capacity; // Always a power of two (or 0)
+  size_t count;
+} thread_table;
+
+typedef struct {
+  uint64_t key;
+  int64_t started_at_ns;
+  int64_t duration_ns;
+} stall;
+
+typedef struct {
+  thread_table threads;
+  uint64_t histogram[HISTOGRAM_BUCKETS];
+  uint64_t wants_gvl_total_ns;
+  int64_t wants_gvl_max_ns;
+  stall *stalls; // Min-heap by duration, keeping the `top` longest ones
+  uint32_t stall_count;
+  uint64_t *windows; // Time spent waiting for the GVL in each window, by window number
+  size_t window_count;
+  bool failed; // Ran out of memory
+} accumulator;
+
+typedef struct {
+  int64_t window_ns;
+  uint32_t top;
+} analysis_options;
+
+typedef struct {
+  const char *start;
+  const char *end;
+  const char *data_end;
+  const analysis_options *options;
+  accumulator result;
+} chunk;
+
+typedef struct {
+  int64_t pid;
+  int64_t first_ns;
+  int64_t last_ns;
+  uint64_t gc_marking_ns;
+  uint64_t gc_sweeping_ns;
+} process_summary;
+
+typedef struct {
+  const char *data;
+  size_t size;
+  uint32_t chunk_count;
+  chunk chunks[MAX_JOBS];
+  analysis_options options;
+  accumulator merged;
+  process_summary *processes;
+  size_t process_count;
+  bool failed;
+} analysis;
+
+static void *parse_chunk(void *chunk_ptr);
+static void *run_analysis(void *analysis_ptr);
+static void merge_chunk(analysis *analysis, chunk *chunk);
+static void finish_open_slices(analysis *analysis);
+static VALUE build_result(VALUE analysis_ptr);
+static VALUE free_analysis(VALUE analysis_ptr);
+
+static inline uint64_t key_for(int64_t pid, int64_t tid) { return ((uint64_t) pid << 32) | (uint32_t) tid; }
+static inline int64_t pid_for(uint64_t key) { return (int64_t) (key >> 32); }
+static inline int64_t tid_for(uint64_t key) { return (int64_t) (uint32_t) key; }
+
+// Returns NULL if `create` is false and there's no such entry, or if allocation failed
+static thread_entry *thread_table_find(thread_table *table, uint64_t key, bool create) {
+  if (table->capacity > 0) {
+    size_t mask = table->capacity - 1;
+    for (size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 40 & mask; ; i = (i + 1) & mask) {
+      if (table->entries[i].key == key) return &table->entries[i];
+      if (table->entries[i].key == 0) break;
+    }
+  }
+  if (!create) return NULL;
+
+  if ((table->count + 1) * 2 > table->capacity) {
+    size_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    thread_entry *new_entries = calloc(new_capacity, sizeof(thread_entry));
+    if (new_entries == NULL) return NULL;
+
+    for (size_t i = 0; i < table->capacity; i++) {
+      if (table->entries[i].key == 0) continue;
+      size_t j = (table->entries[i].key * 0x9E3779B97F4A7C15ULL) >> 40 & (new_capacity - 1);
+      while (new_entries[j].key != 0) j = (j + 1) & (new_capacity - 1);
+      new_entries[j] = table->entries[i];
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 40 & mask;
+  while (table->entries[i].key != 0) i = (i + 1) & mask;
+  table->entries[i].key = key;
+  table->count++;
+  return &table->entries[i];
+}
+
+static inline uint32_t histogram_index(uint64_t value) {
+  if (value < SUB_BUCKETS) return (uint32_t) value;
+  uint32_t magnitude = 63 - __builtin_clzll(value);
+  uint32_t sub_bucket = (uint32_t) (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+// The middle of the range of values that go into the bucket
+static inline uint64_t histogram_value(uint32_t index) {
+  if (index < SUB_BUCKETS) return index;
+  uint32_t magnitude = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+  uint64_t bucket_size = 1ULL << (magnitude - SUB_BUCKET_BITS);
+  return ((SUB_BUCKETS + (index % SUB_BUCKETS)) * bucket_size) + bucket_size / 2;
+}
+
+static void stall_push(accumulator *acc, uint32_t top, stall new_stall) {
+  stall *heap = acc->stalls;
+  uint32_t i;
+
+  if (acc->stall_count < top) {
+    i = acc->stall_count++;
+    // Sift up
+    while (i > 0 && heap[(i - 1) / 2].duration_ns > new_stall.duration_ns) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = new_stall;
+    return;
+  }
+
+  if (top == 0 || heap[0].duration_ns >= new_stall.duration_ns) return;
+
+  // Replace the shortest one, and sift down
+  i = 0;
+  while (true) {
+    uint32_t child = 2 * i + 1;
+    if (child >= acc->stall_count) break;
+    if (child + 1 < acc->stall_count && heap[child + 1].duration_ns < heap[child].duration_ns) child++;
+    if (heap[child].duration_ns >= new_stall.duration_ns) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = new_stall;
+}
+
+// Makes sure there are at least `count` windows
+static bool windows_reserve(accumulator *acc, size_t count) {
+  if (count <= acc->window_count) return true;
+
+  size_t new_count = acc->window_count == 0 ? 1024 : acc->window_count;
+  while (new_count < count) new_count *= 2;
+  uint64_t *new_windows = realloc(acc->windows, new_count * sizeof(uint64_t));
+  if (new_windows == NULL) {
+    acc->failed = true;
+    return false;
+  }
+  memset(new_windows + acc->window_count, 0, (new_count - acc->window_count) * sizeof(uint64_t));
+  acc->windows = new_windows;
+  acc->window_count = new_count;
+  return true;
+}
+
+static void windows_add(accumulator *acc, int64_t window_ns, int64_t start_ns, int64_t end_ns) {
+  if (start_ns < 0 || end_ns <= start_ns) return;
+
+  size_t last_window = (size_t) ((end_ns - 1) / window_ns);
+  if (last_window >= MAX_WINDOWS || !windows_reserve(acc, last_window + 1)) return;
+
+  for (size_t window = (size_t) (start_ns / window_ns); window <= last_window; window++) {
+    int64_t window_start_ns = (int64_t) window * window_ns;
+    int64_t from_ns = start_ns > window_start_ns ? start_ns : window_start_ns;
+    int64_t to_ns = end_ns < window_start_ns + window_ns ? end_ns : window_start_ns + window_ns;
+    acc->windows[window] += (uint64_t) (to_ns - from_ns);
+  }
+}
+
+static void account_slice(
+  accumulator *acc,
+  const analysis_options *options,
+  thread_entry *entry,
+  uint8_t state,
+  int64_t start_ns,
+  int64_t end_ns
+) {
+  if (end_ns < start_ns) return;
+  int64_t duration_ns = end_ns - start_ns;
+  entry->state_ns[state] += (uint64_t) duration_ns;
+  if (state != STATE_WANTS_GVL) return;
+
+  entry->wants_gvl_count++;
+  acc->histogram[histogram_index((uint64_t) duration_ns)]++;
+  acc->wants_gvl_total_ns += (uint64_t) duration_ns;
+  if (duration_ns > acc->wants_gvl_max_ns) acc->wants_gvl_max_ns = duration_ns;
+  stall_push(acc, options->top, (stall) { .key = entry->key, .started_at_ns = start_ns, .duration_ns = duration_ns });
+  windows_add(acc, options->window_ns, start_ns, end_ns);
+}
+
+static void end_slice(accumulator *acc, const analysis_options *options, thread_entry *entry, int64_t now_ns) {
+  if (entry->has_open) {
+    account_slice(acc, options, entry, entry->open_state, entry->open_since_ns, now_ns);
+    entry->has_open = false;
+  } else if (!entry->seen_begin && !entry->has_first_end) {
+    entry->has_first_end = true;
+    entry->first_end_ns = now_ns;
+  }
+}
+
+// Returns a pointer to right after `literal`, or NULL if it's not in [p, end)
+static inline const char *skip_past(const char *p, const char *end, const char *literal, size_t length) {
+  while (p + length <= end) {
+    const char *candidate = memchr(p, literal[0], end - p - length + 1);
+    if (candidate == NULL) return NULL;
+    if (memcmp(candidate, literal, length) == 0) return candidate + length;
+    p = candidate + 1;
+  }
+  return NULL;
+}
+
+static inline const char *parse_int(const char *p, const char *end, int64_t *result) {
+  if (p == NULL || p >= end || *p < '0' || *p > '9') return NULL;
+  int64_t value = 0;
+  while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+  *result = value;
+  return p;
+}
+
+// Timestamps are in microseconds, with a fractional part
+static inline const char *parse_timestamp_ns(const char *p, const char *end, int64_t *result) {
+  int64_t microseconds;
+  p = parse_int(p, end, &microseconds);
+  if (p == NULL) return NULL;
+
+  int64_t nanoseconds = 0;
+  int digits = 0;
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      if (digits < 3) nanoseconds = nanoseconds * 10 + (*p - '0');
+      digits++;
+    }
+  }
+  for (; digits < 3; digits++) nanoseconds *= 10;
+  *result = microseconds * 1000 + nanoseconds;
+  return p;
+}
+
+static inline uint8_t state_for(const char *name, size_t length) {
+  #define NAME_IS(string) (length == sizeof(string) - 1 && memcmp(name, string, length) == 0)
+  if (NAME_IS("running")) return STATE_RUNNING;
+  if (NAME_IS("wants_gvl")) return STATE_WANTS_GVL;
+  if (length >= 7 && memcmp(name, "waiting", 7) == 0) return STATE_WAITING;
+  if (NAME_IS("sleeping")) return STATE_SLEEPING;
+  if (NAME_IS("gc")) return STATE_GC;
+  if (NAME_IS("minor_gc_marking") || NAME_IS("major_gc_marking")) return STATE_GC_MARKING;
+  if (NAME_IS("gc_sweeping")) return STATE_GC_SWEEPING;
+  return STATE_OTHER;
+  #undef NAME_IS
+}
+
+// Thread names only ever have quotes and backslashes escaped
+static char *unescape_name(const char *name, size_t length) {
+  char *result = malloc(length + 1);
+  if (result == NULL) return NULL;
+
+  size_t out = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (name[i] == '\\' && i + 1 < length) i++;
+    result[out++] = name[i];
+  }
+  result[out] = '\0';
+  return result;
+}
+
+// Returns the end of the quoted string that starts at `p` (pointing at its closing quote), or NULL
+static inline const char *string_end(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == '\\') p++;
+    else if (*p == '"') return p;
+  }
+  return NULL;
+}
+
+static void parse_line(accumulator *acc, const analysis_options *options, const char *p, const char *end) {
+  p = skip_past(p, end, LITERAL("{\"ph\": \""));
+  if (p == NULL || p >= end) return;
+  char phase = *p;
+  if (phase != 'B' && phase != 'E' && phase != 'M') return;
+
+  int64_t pid, tid;
+  p = parse_int(skip_past(p, end, LITERAL("\"pid\": ")), end, &pid);
+  if (p == NULL || pid == OS_THREADS_VIEW_PID || pid > UINT32_MAX) return;
+  // Some metadata (e.g. the process name) is not for a thread
+  p = parse_int(skip_past(p, end, LITERAL("\"tid\": ")), end, &tid);
+  if (p == NULL || tid >= FIRST_EXTRA_TRACK_TID) return;
+
+  thread_entry *entry = thread_table_find(&acc->threads, key_for(pid, tid), true);
+  if (entry == NULL) {
+    acc->failed = true;
+    return;
+  }
+
+  if (phase == 'M') {
+    const char *name = skip_past(p, end, LITERAL("\"name\": \"thread_name\", \"args\": {\"name\": \""));
+    const char *name_end = name != NULL ? string_end(name, end) : NULL;
+    if (name_end == NULL) return;
+    free(entry->name);
+    entry->name = unescape_name(name, name_end - name);
+    return;
+  }
+
+  int64_t timestamp_ns;
+  p = parse_timestamp_ns(skip_past(p, end, LITERAL("\"ts\": ")), end, &timestamp_ns);
+  if (p == NULL) return;
+
+  if (!entry->has_events) {
+    entry->has_events = true;
+    entry->first_ns = timestamp_ns;
+  }
+  entry->last_ns = timestamp_ns;
+
+  // A begin also ends whatever was open, which is how the GC track goes from marking to sweeping
+  end_slice(acc, options, entry, timestamp_ns);
+  if (phase == 'E') return;
+
+  const char *name = skip_past(p, end, LITERAL("\"name\": \""));
+  const char *name_end = name != NULL ? string_end(name, end) : NULL;
+  entry->seen_begin = true;
+  entry->has_open = true;
+  entry->open_state = name_end != NULL ? state_for(name, name_end - name) : STATE_OTHER;
+  entry->open_since_ns = timestamp_ns;
+}
+
+static void *parse_chunk(void *chunk_ptr) {
+  chunk *chunk = chunk_ptr;
+  const char *p = chunk->start;
+
+  while (p < chunk->end && !chunk->result.failed) {
+    const char *line_end = memchr(p, '\n', chunk->data_end - p);
+    if (line_end == NULL) line_end = chunk->data_end;
+    parse_line(&chunk->result, chunk->options, p, line_end);
+    p = line_end + 1;
+  }
+
+  return NULL;
+}
+
+static bool accumulator_init(accumulator *acc, uint32_t top) {
+  memset(acc, 0, sizeof(accumulator));
+  acc->stalls = calloc(top > 0 ? top : 1, sizeof(stall));
+  return acc->stalls != NULL;
+}
+
+static void accumulator_free(accumulator *acc) {
+  for (size_t i = 0; i < acc->threads.capacity; i++) free(acc->threads.entries[i].name);
+  free(acc->threads.entries);
+  free(acc->stalls);
+  free(acc->windows);
+  memset(acc, 0, sizeof(accumulator));
+}
+
+// Splits the file into chunks at line boundaries, parses them in parallel, and merges the results in order
+static void *run_analysis(void *analysis_ptr) {
+  analysis *analysis = analysis_ptr;
+  pthread_t workers[MAX_JOBS];
+  bool started[MAX_JOBS] = { false };
+
+  for (uint32_t i = 0; i < analysis->chunk_count; i++) {
+    chunk *chunk = &analysis->chunks[i];
+    const char *start = analysis->data + analysis->size * i / analysis->chunk_count;
+    const char *end = analysis->data + analysis->size * (i + 1) / analysis->chunk_count;
+    // Each chunk starts at the first line that starts inside it, and ends with the line that crosses its end
+    if (i > 0 && start[-1] != '\n') {
+      const char *newline = memchr(start, '\n', analysis->data + analysis->size - start);
+      start = newline != NULL ? newline + 1 : analysis->data + analysis->size;
+    }
+    chunk->start = start;
+    chunk->end = end;
+    chunk->data_end = analysis->data + analysis->size;
+    chunk->options = &analysis->options;
+    if (!accumulator_init(&chunk->result, analysis->options.top)) chunk->result.failed = true;
+  }
+
+  // The first chunk gets parsed by this thread, and if a worker can't be started, its chunk gets parsed here too
+  for (uint32_t i = 1; i < analysis->chunk_count; i++) {
+    started[i] = pthread_create(&workers[i], NULL, parse_chunk, &analysis->chunks[i]) == 0;
+  }
+  parse_chunk(&analysis->chunks[0]);
+  for (uint32_t i = 1; i < analysis->chunk_count; i++) {
+    if (started[i]) pthread_join(workers[i], NULL);
+    else parse_chunk(&analysis->chunks[i]);
+  }
+
+  if (!accumulator_init(&analysis->merged, analysis->options.top)) analysis->failed = true;
+  for (uint32_t i = 0; i < analysis->chunk_count; i++) {
+    if (analysis->chunks[i].result.failed) analysis->failed = true;
+    if (!analysis->failed) merge_chunk(analysis, &analysis->chunks[i]);
+    accumulator_free(&analysis->chunks[i].result);
+  }
+  if (!analysis->failed) finish_open_slices(analysis);
+
+  return NULL;
+}
+
+static void merge_chunk(analysis *analysis, chunk *chunk) {
+  accumulator *merged = &analysis->merged;
+  accumulator *result = &chunk->result;
+
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) merged->histogram[i] += result->histogram[i];
+  merged->wants_gvl_total_ns += result->wants_gvl_total_ns;
+  if (result->wants_gvl_max_ns > merged->wants_gvl_max_ns) merged->wants_gvl_max_ns = result->wants_gvl_max_ns;
+  for (uint32_t i = 0; i < result->stall_count; i++) stall_push(merged, analysis->options.top, result->stalls[i]);
+  if (!windows_reserve(merged, result->window_count)) {
+    analysis->failed = true;
+    return;
+  }
+  for (size_t i = 0; i < result->window_count; i++) merged->windows[i] += result->windows[i];
+
+  for (size_t i = 0; i < result->threads.capacity; i++) {
+    thread_entry *entry = &result->threads.entries[i];
+    if (entry->key == 0) continue;
+
+    thread_entry *target = thread_table_find(&merged->threads, entry->key, true);
+    if (target == NULL) {
+      analysis->failed = true;
+      return;
+    }
+
+    if (entry->name != NULL) {
+      free(target->name);
+      target->name = entry->name;
+      entry->name = NULL;
+    }
+    if (!entry->has_events) continue;
+
+    // Whatever the thread was doing at the end of the previous chunks ends with the first event in this one
+    if (target->has_open && entry->has_first_end) {
+      account_slice(merged, &analysis->options, target, target->open_state, target->open_since_ns, entry->first_end_ns);
+      target->has_open = false;
+    }
+    if (!target->has_events) target->first_ns = entry->first_ns;
+    target->has_events = true;
+    target->last_ns = entry->last_ns;
+    for (int state = 0; state < STATE_COUNT; state++) target->state_ns[state] += entry->state_ns[state];
+    target->wants_gvl_count += entry->wants_gvl_count;
+    if (entry->has_open) {
+      target->has_open = true;
+      target->open_state = entry->open_state;
+      target->open_since_ns = entry->open_since_ns;
+    }
+  }
+}
+
+static process_summary *process_for(analysis *analysis, int64_t pid) {
+  for (size_t i = 0; i < analysis->process_count; i++) {
+    if (analysis->processes[i].pid == pid) return &analysis->processes[i];
+  }
+
+  process_summary *new_processes = realloc(analysis->processes, (analysis->process_count + 1) * sizeof(process_summary));
+  if (new_processes == NULL) return NULL;
+  analysis->processes = new_processes;
+  analysis->processes[analysis->process_count] = (process_summary) { .pid = pid, .first_ns = INT64_MAX, .last_ns = INT64_MIN };
+  return &analysis->processes[analysis->process_count++];
+}
+
+// Threads that were still around when tracing stopped never get their last slice ended, so it ends when the trace for
+// their process does. Threads that died, or the one that stopped tracing, are left as they are.
+static void finish_open_slices(analysis *analysis) {
+  thread_table *threads = &analysis->merged.threads;
+
+  for (size_t i = 0; i < threads->capacity; i++) {
+    thread_entry *entry = &threads->entries[i];
+    if (entry->key == 0 || !entry->has_events) continue;
+
+    process_summary *process = process_for(analysis, pid_for(entry->key));
+    if (process == NULL) {
+      analysis->failed = true;
+      return;
+    }
+    if (entry->first_ns < process->first_ns) process->first_ns = entry->first_ns;
+    if (entry->last_ns > process->last_ns) process->last_ns = entry->last_ns;
+  }
+
+  for (size_t i = 0; i < threads->capacity; i++) {
+    thread_entry *entry = &threads->entries[i];
+    if (entry->key == 0 || !entry->has_events) continue;
+
+    process_summary *process = process_for(analysis, pid_for(entry->key));
+    if (entry->has_open && entry->open_state != STATE_OTHER) {
+      account_slice(&analysis->merged, &analysis->options, entry, entry->open_state, entry->open_since_ns, process->last_ns);
+      entry->has_open = false;
+    }
+    process->gc_marking_ns += entry->state_ns[STATE_GC_MARKING];
+    process->gc_sweeping_ns += entry->state_ns[STATE_GC_SWEEPING];
+  }
+}
+
+static int compare_stall_duration(const void *a, const void *b) {
+  int64_t duration_a = ((const stall *) a)->duration_ns;
+  int64_t duration_b = ((const stall *) b)->duration_ns;
+  return duration_a < duration_b ? 1 : duration_a > duration_b ? -1 : 0;
+}
+
+static uint64_t percentile_ns(const accumulator *acc, uint64_t count, double percentile) {
+  if (count == 0) return 0;
+
+  uint64_t rank = (uint64_t) ceil(percentile / 100.0 * count);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += acc->histogram[i];
+    if (seen >= rank) {
+      uint64_t value = histogram_value(i);
+      return value < (uint64_t) acc->wants_gvl_max_ns ? value : (uint64_t) acc->wants_gvl_max_ns;
+    }
+  }
+  return (uint64_t) acc->wants_gvl_max_ns;
+}
+
+static VALUE build_result(VALUE analysis_ptr) {
+  analysis *analysis = (void *) analysis_ptr;
+  accumulator *merged = &analysis->merged;
+  VALUE result = rb_hash_new();
+
+  int64_t first_ns = INT64_MAX;
+  int64_t last_ns = INT64_MIN;
+  VALUE processes = rb_ary_new_capa(analysis->process_count);
+  for (size_t i = 0; i < analysis->process_count; i++) {
+    process_summary *process = &analysis->processes[i];
+    if (process->first_ns < first_ns) first_ns = process->first_ns;
+    if (process->last_ns > last_ns) last_ns = process->last_ns;
+
+    VALUE entry = rb_hash_new();
+    rb_hash_aset(entry, ID2SYM(rb_intern("pid")), LL2NUM(process->pid));
+    rb_hash_aset(entry, ID2SYM(rb_intern("duration_ns")), LL2NUM(process->last_ns - process->first_ns));
+    rb_hash_aset(entry, ID2SYM(rb_intern("gc_marking_ns")), ULL2NUM(process->gc_marking_ns));
+    rb_hash_aset(entry, ID2SYM(rb_intern("gc_sweeping_ns")), ULL2NUM(process->gc_sweeping_ns));
+    rb_ary_push(processes, entry);
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("duration_ns")), LL2NUM(analysis->process_count > 0 ? last_ns - first_ns : 0));
+  rb_hash_aset(result, ID2SYM(rb_intern("processes")), processes);
+
+  static const char *state_keys[] = { "running_ns", "wants_gvl_ns", "waiting_ns", "sleeping_ns", "gc_ns", "other_ns" };
+  VALUE threads = rb_ary_new();
+  uint64_t wants_gvl_count = 0;
+  for (size_t i = 0; i < merged->threads.capacity; i++) {
+    thread_entry *entry = &merged->threads.entries[i];
+    if (entry->key == 0 || !entry->has_events || tid_for(entry->key) == GC_TRACK_TID) continue;
+
+    VALUE thread = rb_hash_new();
+    rb_hash_aset(thread, ID2SYM(rb_intern("pid")), LL2NUM(pid_for(entry->key)));
+    rb_hash_aset(thread, ID2SYM(rb_intern("thread_id")), LL2NUM(tid_for(entry->key)));
+    rb_hash_aset(thread, ID2SYM(rb_intern("name")), entry->name != NULL ? rb_utf8_str_new_cstr(entry->name) : Qnil);
+    for (int state = 0; state <= STATE_OTHER; state++) {
+      rb_hash_aset(thread, ID2SYM(rb_intern(state_keys[state])), ULL2NUM(entry->state_ns[state]));
+    }
+    rb_hash_aset(thread, ID2SYM(rb_intern("wants_gvl_count")), ULL2NUM(entry->wants_gvl_count));
+    rb_ary_push(threads, thread);
+    wants_gvl_count += entry->wants_gvl_count;
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("threads")), threads);
+
+  VALUE wants_gvl = rb_hash_new();
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("count")), ULL2NUM(wants_gvl_count));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("total_ns")), ULL2NUM(merged->wants_gvl_total_ns));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("p50_ns")), ULL2NUM(percentile_ns(merged, wants_gvl_count, 50)));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("p90_ns")), ULL2NUM(percentile_ns(merged, wants_gvl_count, 90)));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("p99_ns")), ULL2NUM(percentile_ns(merged, wants_gvl_count, 99)));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("p999_ns")), ULL2NUM(percentile_ns(merged, wants_gvl_count, 99.9)));
+  rb_hash_aset(wants_gvl, ID2SYM(rb_intern("max_ns")), LL2NUM(merged->wants_gvl_max_ns));
+  rb_hash_aset(result, ID2SYM(rb_intern("wants_gvl")), wants_gvl);
+
+  qsort(merged->stalls, merged->stall_count, sizeof(stall), compare_stall_duration);
+  VALUE stalls = rb_ary_new_capa(merged->stall_count);
+  for (uint32_t i = 0; i < merged->stall_count; i++) {
+    VALUE entry = rb_hash_new();
+    rb_hash_aset(entry, ID2SYM(rb_intern("pid")), LL2NUM(pid_for(merged->stalls[i].key)));
+    rb_hash_aset(entry, ID2SYM(rb_intern("thread_id")), LL2NUM(tid_for(merged->stalls[i].key)));
+    rb_hash_aset(entry, ID2SYM(rb_intern("started_at_ns")), LL2NUM(merged->stalls[i].started_at_ns));
+    rb_hash_aset(entry, ID2SYM(rb_intern("duration_ns")), LL2NUM(merged->stalls[i].duration_ns));
+    rb_ary_push(stalls, entry);
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("longest_stalls")), stalls);
+
+  // The stalls are no longer needed, so the heap gets reused to pick the most contended windows
+  merged->stall_count = 0;
+  for (size_t i = 0; i < merged->window_count; i++) {
+    if (merged->windows[i] == 0) continue;
+    stall window = { .started_at_ns = (int64_t) i * analysis->options.window_ns, .duration_ns = (int64_t) merged->windows[i] };
+    stall_push(merged, analysis->options.top, window);
+  }
+  qsort(merged->stalls, merged->stall_count, sizeof(stall), compare_stall_duration);
+  VALUE windows = rb_ary_new_capa(merged->stall_count);
+  for (uint32_t i = 0; i < merged->stall_count; i++) {
+    VALUE entry = rb_hash_new();
+    rb_hash_aset(entry, ID2SYM(rb_intern("started_at_ns")), LL2NUM(merged->stalls[i].started_at_ns));
+    rb_hash_aset(entry, ID2SYM(rb_intern("wants_gvl_ns")), LL2NUM(merged->stalls[i].duration_ns));
+    rb_ary_push(windows, entry);
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("contended_windows")), windows);
+  rb_hash_aset(result, ID2SYM(rb_intern("window_ns")), LL2NUM(analysis->options.window_ns));
+
+  return result;
+}
+
+static VALUE free_analysis(VALUE analysis_ptr) {
+  analysis *analysis = (void *) analysis_ptr;
+  accumulator_free(&analysis->merged);
+  free(analysis->processes);
+  free(analysis);
+  return Qnil;
+}
+
+VALUE analyzer_analyze(VALUE path, VALUE jobs, VALUE window_ms, VALUE top) {
+  Check_Type(path, T_STRING);
+  if (!RB_INTEGER_TYPE_P(jobs) || NUM2LONG(jobs) <= 0) rb_raise(rb_eArgError, "jobs must be a positive integer");
+  if (!RB_INTEGER_TYPE_P(window_ms) || NUM2LONG(window_ms) <= 0) rb_raise(rb_eArgError, "window_ms must be a positive integer");
+  if (!RB_INTEGER_TYPE_P(top) || NUM2LONG(top) < 0 || NUM2LONG(top) > MAX_TOP) {
+    rb_raise(rb_eArgError, "top must be an integer between 0 and %d", MAX_TOP);
+  }
+
+  int fd = open(StringValueCStr(path), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) rb_syserr_fail_str(errno, path);
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    int error = errno;
+    close(fd);
+    rb_syserr_fail_str(error, path);
+  }
+  size_t size = (size_t) file_stat.st_size;
+  if (size == 0) {
+    close(fd);
+    rb_raise(rb_eArgError, "%"PRIsVALUE" is empty", path);
+  }
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int mmap_error = errno;
+  close(fd);
+  if (data == MAP_FAILED) rb_syserr_fail_str(mmap_error, path);
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  size_t first = 0;
+  while (first < size && first < 64 && (data[first] == ' ' || data[first] == '\n' || data[first] == '\r')) first++;
+  if (first >= size || data[first] != '[') {
+    munmap(data, size);
+    rb_raise(rb_eArgError, "%"PRIsVALUE" is not a JSON trace (perfetto and compressed traces are not supported)", path);
+  }
+
+  analysis *analysis = calloc(1, sizeof(*analysis));
+  if (analysis == NULL) {
+    munmap(data, size);
+    rb_raise(rb_eNoMemError, "Failed to allocate memory for analyzing %"PRIsVALUE, path);
+  }
+  analysis->data = data;
+  analysis->size = size;
+  analysis->options = (analysis_options) { .window_ns = NUM2LONG(window_ms) * 1000000LL, .top = NUM2UINT(top) };
+  size_t chunk_count = size / MIN_CHUNK_SIZE + 1;
+  if (chunk_count > (size_t) NUM2LONG(jobs)) chunk_count = (size_t) NUM2LONG(jobs);
+  if (chunk_count > MAX_JOBS) chunk_count = MAX_JOBS;
+  analysis->chunk_count = (uint32_t) chunk_count;
+
+  rb_thread_call_without_gvl(run_analysis, analysis, NULL, NULL);
+  munmap(data, size);
+
+  if (analysis->failed) {
+    free_analysis((VALUE) analysis);
+    rb_raise(rb_eNoMemError, "Failed to allocate memory for analyzing %"PRIsVALUE, path);
+  }
+
+  return rb_ensure(build_result, (VALUE) analysis, free_analysis, (VALUE) analysis);
+}
@@ -0,0 +1,46 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Analyzer: Reads back a trace written in the JSON format and summarizes it (used by `gvl-tracing-analyze`), without
+// having to load it into perfetto or parse it as JSON, neither of which copes with multi-GB traces.
+//
+// Rather than being a general JSON parser, this only understands the lines that json_output.c (and the rest of the
+// writer) emits, one event per line. Every state change for a thread is an "E" line ending its previous slice followed
+// by a "B" line starting the next one, so keeping just the open slice for each thread is enough to know how long it
+// spent in each state.
+//
+// The file gets mapped into memory and split into chunks at line boundaries, which get parsed in parallel. Slices that
+// span more than one chunk get stitched together when the results for each chunk get merged, in order. Memory use
+// depends on the number of threads and how long the trace is (for the contended windows), not on the size of the file.
+//
+// Like the event buffers, this does not touch any Ruby objects until the results get converted at the end, so the
+// parsing happens without the GVL.
+
+#pragma once
+
+#include <ruby/ruby.h>
+
+// Returns a hash with the results, see GvlTracing::Analyze. Raises if the file can't be read or is not a JSON trace.
+VALUE analyzer_analyze(VALUE path, VALUE jobs, VALUE window_ms, VALUE top);
@@ -0,0 +1,170 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coalescer.h"
+
+#define INITIAL_CAPACITY 64
+
+typedef struct {
+  bool used;
+  bool has_pending;
+  int32_t thread_id;
+  gvl_event pending; // Started a slice that has not ended yet
+  gvl_event first_folded; // If only one slice ends up being folded, it gets written as-is
+  coalesced_slice folded;
+} thread_entry;
+
+// Open addressing hash table, keyed by thread id. Entries never get removed (until `coalescer_stop`), but they get reused
+// if the same thread id shows up again.
+static thread_entry *threads = NULL;
+static uint32_t capacity = 0;
+static uint32_t used = 0;
+static int64_t min_slice_ns = 0;
+static void (*event_consumer)(const gvl_event *event, void *context);
+static void (*slice_consumer)(const coalesced_slice *slice, void *context);
+
+bool coalescer_start(
+  int64_t new_min_slice_ns,
+  void (*new_event_consumer)(const gvl_event *event, void *context),
+  void (*new_slice_consumer)(const coalesced_slice *slice, void *context)
+) {
+  threads = calloc(INITIAL_CAPACITY, sizeof(thread_entry));
+  if (threads == NULL) return false;
+
+  capacity = INITIAL_CAPACITY;
+  used = 0;
+  min_slice_ns = new_min_slice_ns;
+  event_consumer = new_event_consumer;
+  slice_consumer = new_slice_consumer;
+  return true;
+}
+
+void coalescer_stop(void) {
+  free(threads);
+  threads = NULL;
+  capacity = 0;
+  used = 0;
+}
+
+static thread_entry *find_in(thread_entry *table, uint32_t table_capacity, int32_t thread_id) {
+  uint32_t index = ((uint32_t) thread_id * 2654435761u) & (table_capacity - 1);
+  while (table[index].used && table[index].thread_id != thread_id) index = (index + 1) & (table_capacity - 1);
+  return &table[index];
+}
+
+// Returns NULL if the table needed to grow and that failed
+static thread_entry *entry_for(int32_t thread_id) {
+  thread_entry *entry = find_in(threads, capacity, thread_id);
+  if (entry->used) return entry;
+
+  if ((used + 1) * 2 > capacity) {
+    uint32_t new_capacity = capacity * 2;
+    thread_entry *new_threads = calloc(new_capacity, sizeof(thread_entry));
+    if (new_threads == NULL) return NULL;
+
+    for (uint32_t i = 0; i < capacity; i++) {
+      if (threads[i].used) *find_in(new_threads, new_capacity, threads[i].thread_id) = threads[i];
+    }
+    free(threads);
+    threads = new_threads;
+    capacity = new_capacity;
+    entry = find_in(threads, capacity, thread_id);
+  }
+
+  used++;
+  *entry = (thread_entry) { .used = true, .thread_id = thread_id };
+  return entry;
+}
+
+static void flush_folded(thread_entry *entry, void *context) {
+  if (entry->folded.slices == 1) {
+    event_consumer(&entry->first_folded, context);
+  } else if (entry->folded.slices > 1) {
+    slice_consumer(&entry->folded, context);
+  }
+  entry->folded.slices = 0;
+}
+
+static void flush_entry(thread_entry *entry, void *context) {
+  flush_folded(entry, context);
+  if (entry->has_pending) event_consumer(&entry->pending, context);
+  entry->has_pending = false;
+}
+
+static void fold_pending(thread_entry *entry, int64_t duration_ns) {
+  coalesced_slice *folded = &entry->folded;
+
+  if (folded->slices == 0) {
+    memset(folded, 0, sizeof(*folded));
+    folded->thread_id = entry->thread_id;
+    folded->timestamp_ns = entry->pending.timestamp_ns;
+    entry->first_folded = entry->pending;
+  }
+
+  folded->slices++;
+  folded->count[entry->pending.type]++;
+  folded->time_ns[entry->pending.type] += duration_ns;
+}
+
+void coalescer_push(const gvl_event *event, void *context) {
+  // Instant events don't start/end slices, and GC phases and counters go on their own tracks, so there's nothing to fold
+  if (!event_type_is_thread_slice(event->type)) {
+    event_consumer(event, context);
+    return;
+  }
+
+  thread_entry *entry = entry_for(event->thread_id);
+  if (entry == NULL) {
+    // Out of memory; let's just not coalesce anything for this thread
+    event_consumer(event, context);
+    return;
+  }
+
+  if (entry->has_pending) {
+    int64_t duration_ns = event->timestamp_ns - entry->pending.timestamp_ns;
+
+    if (duration_ns < min_slice_ns) {
+      fold_pending(entry, duration_ns);
+    } else {
+      flush_folded(entry, context);
+      event_consumer(&entry->pending, context);
+    }
+  }
+
+  entry->pending = *event;
+  entry->has_pending = true;
+
+  // Nothing else will come for this thread, so there's no point in holding back this event
+  if (event->type == EVENT_DIED || event->type == EVENT_STOPPED_TRACING) flush_entry(entry, context);
+}
+
+void coalescer_flush(void *context) {
+  for (uint32_t i = 0; i < capacity; i++) {
+    if (threads[i].used) flush_entry(&threads[i], context);
+  }
+}
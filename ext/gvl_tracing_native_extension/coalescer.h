@@ -0,0 +1,65 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Folds short slices: When enabled (see `min_slice_us` in `GvlTracing.start`), consecutive slices on the same thread
+// that are shorter than the minimum get replaced by a single "coalesced" slice that keeps how many slices of each state
+// were folded, and how long they took in total. This keeps traces of e.g. lots of threads ping-ponging the GVL a lot
+// smaller, and usable in perfetto.
+//
+// We only know how long a slice was once the next event for the same thread comes in, so each thread always has one
+// event held back here. Runs on the writer thread, between `event_buffer_drain_all` and the output format, so it's
+// Ruby-agnostic and does not need any locking.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gvl_event.h"
+
+typedef struct {
+  int32_t thread_id;
+  int64_t timestamp_ns; // When the first folded slice started
+  uint32_t slices;
+  uint32_t count[EVENT_TYPE_COUNT];
+  uint64_t time_ns[EVENT_TYPE_COUNT];
+} coalesced_slice;
+
+// The consumers get called with whatever `context` was passed to `coalescer_push`/`coalescer_flush`.
+// Returns false on allocation failure.
+bool coalescer_start(
+  int64_t min_slice_ns,
+  void (*event_consumer)(const gvl_event *event, void *context),
+  void (*slice_consumer)(const coalesced_slice *slice, void *context)
+);
+
+// Has the same signature as the consumers passed to `event_buffer_drain_all`
+void coalescer_push(const gvl_event *event, void *context);
+
+// Writes out all events/slices being held back, e.g. before the trace gets closed
+void coalescer_flush(void *context);
+
+// Releases the per-thread state. Must be called after flushing, and before the next `coalescer_start`.
+void coalescer_stop(void);
@@ -0,0 +1,75 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "context_stats.h"
+
+// Indexed by label id; the first entry is never used, since 0 means no label
+static context_stats totals[SPAN_NAMES_MAX + 1];
+static uint32_t generation = 1;
+
+// Many threads can be updating the same label at the same time, so unlike the per-thread stats, these need actual atomic
+// increments
+static inline void add(uint64_t *counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void context_stats_reset(void) {
+  __atomic_fetch_add(&generation, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i <= SPAN_NAMES_MAX; i++) {
+    __atomic_store_n(&totals[i].count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&totals[i].wants_gvl_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&totals[i].wants_gvl_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&totals[i].running_ns, 0, __ATOMIC_RELAXED);
+  }
+}
+
+uint32_t context_stats_generation(void) { return __atomic_load_n(&generation, __ATOMIC_RELAXED); }
+
+void context_stats_label_set(uint32_t label_id) {
+  if (label_id != 0 && label_id <= SPAN_NAMES_MAX) add(&totals[label_id].count, 1);
+}
+
+void context_stats_add(uint32_t label_id, event_type state, int64_t elapsed_ns) {
+  if (label_id == 0 || label_id > SPAN_NAMES_MAX || elapsed_ns <= 0) return;
+
+  if (state == EVENT_WANTS_GVL) {
+    add(&totals[label_id].wants_gvl_ns, elapsed_ns);
+    add(&totals[label_id].wants_gvl_count, 1);
+  } else if (state == EVENT_RUNNING) {
+    add(&totals[label_id].running_ns, elapsed_ns);
+  }
+}
+
+void context_stats_each(void (*consumer)(uint32_t label_id, const context_stats *stats, void *context), void *context) {
+  for (uint32_t i = 1; i <= SPAN_NAMES_MAX; i++) {
+    context_stats copy = {
+      .count = __atomic_load_n(&totals[i].count, __ATOMIC_RELAXED),
+      .wants_gvl_ns = __atomic_load_n(&totals[i].wants_gvl_ns, __ATOMIC_RELAXED),
+      .wants_gvl_count = __atomic_load_n(&totals[i].wants_gvl_count, __ATOMIC_RELAXED),
+      .running_ns = __atomic_load_n(&totals[i].running_ns, __ATOMIC_RELAXED),
+    };
+    if (copy.count > 0 || copy.wants_gvl_count > 0 || copy.running_ns > 0) consumer(i, &copy, context);
+  }
+}
@@ -0,0 +1,58 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Per-context totals for `GvlTracing.set_context`: for each label (e.g. an endpoint), how long threads spent waiting
+// for the GVL and running while they had that label set. Labels get interned with span_names.h, so their ids are small,
+// and the totals are just a flat array indexed by id, which the GVL hooks update without taking any locks.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "gvl_event.h"
+#include "span_names.h"
+
+// Label ids get stored in each event using 16 bits
+_Static_assert(SPAN_NAMES_MAX <= UINT16_MAX, "span names ids must fit in gvl_event.context_id");
+
+typedef struct {
+  uint64_t count; // How many times the label was set (e.g. how many requests there were)
+  uint64_t wants_gvl_ns;
+  uint64_t wants_gvl_count;
+  uint64_t running_ns;
+} context_stats;
+
+// Zeroes the totals. Time that threads spent with a label before the reset does not get counted afterwards.
+void context_stats_reset(void);
+// Used to tell if a thread's last state change happened before the last reset
+uint32_t context_stats_generation(void);
+
+void context_stats_label_set(uint32_t label_id);
+
+// Called from the GVL hooks, with how long a thread with `label_id` set spent in `state`
+void context_stats_add(uint32_t label_id, event_type state, int64_t elapsed_ns);
+
+// Calls `consumer` with a copy of the totals for every label that was set since the last reset
+void context_stats_each(void (*consumer)(uint32_t label_id, const context_stats *stats, void *context), void *context);
@@ -0,0 +1,209 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "event_buffer.h"
+
+// List of all buffers. New buffers are only ever added at the head (while holding the mutex), and buffers are only ever
+// removed by the (single) consumer, so the consumer can walk the list without holding the mutex.
+static event_buffer *all_buffers = NULL;
+static pthread_mutex_t all_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dropped_events = 0;
+
+uint32_t event_buffer_capacity_for(uint32_t requested_capacity) {
+  uint32_t capacity = 1;
+  while (capacity < requested_capacity && capacity < (UINT32_C(1) << 31)) capacity <<= 1;
+  return capacity;
+}
+
+event_buffer *event_buffer_new(uint32_t capacity) {
+
+  // Note: We deliberately don't use ruby_xcalloc here, since this gets called from hooks that don't hold the GVL
+  event_buffer *buffer = calloc(1, sizeof(event_buffer) + (sizeof(event_buffer_slot) * capacity));
+  if (buffer == NULL) return NULL;
+
+  buffer->capacity = capacity;
+  for (uint32_t i = 0; i < capacity; i++) buffer->slots[i].sequence = i;
+
+  pthread_mutex_lock(&all_buffers_mutex);
+  buffer->next = all_buffers;
+  __atomic_store_n(&all_buffers, buffer, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&all_buffers_mutex);
+
+  return buffer;
+}
+
+size_t event_buffer_memsize(const event_buffer *buffer) {
+  return sizeof(event_buffer) + (sizeof(event_buffer_slot) * buffer->capacity);
+}
+
+void event_buffer_release(event_buffer *buffer) {
+  if (buffer != NULL) __atomic_store_n(&buffer->owner_gone, true, __ATOMIC_RELEASE);
+}
+
+// This is a bounded queue using per-slot sequence numbers (as described by Dmitry Vyukov). A producer claims a
+// position by bumping `write_position`, copies the event, and then publishes it by bumping the slot's sequence; the
+// consumer only reads slots whose sequence says they've been published.
+bool event_buffer_push(event_buffer *buffer, const gvl_event *event) {
+  uint32_t mask = buffer->capacity - 1;
+  uint32_t position = __atomic_load_n(&buffer->write_position, __ATOMIC_RELAXED);
+  event_buffer_slot *slot;
+
+  while (true) {
+    slot = &buffer->slots[position & mask];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int32_t difference = (int32_t) (sequence - position);
+
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&buffer->write_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (difference < 0) {
+      // Consumer hasn't caught up yet; we never block the hooks, so this event is lost
+      __atomic_fetch_add(&dropped_events, 1, __ATOMIC_RELAXED);
+      return false;
+    } else {
+      position = __atomic_load_n(&buffer->write_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->event = *event;
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Returns the oldest event in the buffer, or NULL if there's none yet. Consumer-only.
+static inline const gvl_event *event_buffer_peek(event_buffer *buffer) {
+  uint32_t position = buffer->read_position;
+  event_buffer_slot *slot = &buffer->slots[position & (buffer->capacity - 1)];
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+  if ((int32_t) (sequence - (position + 1)) < 0) return NULL; // Empty (or next event still being written)
+
+  return &slot->event;
+}
+
+// Frees up the slot returned by the last `event_buffer_peek`. Consumer-only.
+static inline void event_buffer_consume(event_buffer *buffer) {
+  uint32_t position = buffer->read_position;
+  event_buffer_slot *slot = &buffer->slots[position & (buffer->capacity - 1)];
+  __atomic_store_n(&slot->sequence, position + buffer->capacity, __ATOMIC_RELEASE);
+  buffer->read_position = position + 1;
+}
+
+static inline bool event_buffer_empty(event_buffer *buffer) {
+  return __atomic_load_n(&buffer->write_position, __ATOMIC_ACQUIRE) == buffer->read_position;
+}
+
+// Min-heap of buffers, keyed on the timestamp of their oldest event. Used to merge the events from all threads so that
+// they come out (mostly) in timestamp order. Only used by the consumer.
+static event_buffer **heap = NULL;
+static size_t heap_size = 0;
+static size_t heap_capacity = 0;
+
+static inline int64_t heap_key(size_t index) { return event_buffer_peek(heap[index])->timestamp_ns; }
+
+static inline void heap_swap(size_t a, size_t b) {
+  event_buffer *temp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = temp;
+}
+
+static void heap_sift_down(size_t index) {
+  while (true) {
+    size_t smallest = index, left = (2 * index) + 1, right = left + 1;
+    if (left < heap_size && heap_key(left) < heap_key(smallest)) smallest = left;
+    if (right < heap_size && heap_key(right) < heap_key(smallest)) smallest = right;
+    if (smallest == index) return;
+    heap_swap(index, smallest);
+    index = smallest;
+  }
+}
+
+static bool heap_push(event_buffer *buffer) {
+  if (heap_size == heap_capacity) {
+    size_t new_capacity = heap_capacity ? heap_capacity * 2 : 64;
+    event_buffer **new_heap = realloc(heap, sizeof(event_buffer *) * new_capacity);
+    if (new_heap == NULL) return false;
+    heap = new_heap;
+    heap_capacity = new_capacity;
+  }
+
+  size_t index = heap_size++;
+  heap[index] = buffer;
+  while (index > 0 && heap_key(index) < heap_key((index - 1) / 2)) {
+    heap_swap(index, (index - 1) / 2);
+    index = (index - 1) / 2;
+  }
+  return true;
+}
+
+void event_buffer_drain_all(void (*consumer)(const gvl_event *event, void *context), void *context) {
+  bool found_released = false;
+
+  heap_size = 0;
+  for (event_buffer *buffer = __atomic_load_n(&all_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+    // Read owner_gone *before* draining, so that if it's set we know the owner won't push anything after we're done
+    if (__atomic_load_n(&buffer->owner_gone, __ATOMIC_ACQUIRE)) found_released = true;
+
+    if (event_buffer_peek(buffer) != NULL && !heap_push(buffer)) {
+      // Out of memory for the heap; at least don't lose the events, even if they come out of order
+      for (const gvl_event *event; (event = event_buffer_peek(buffer)) != NULL; event_buffer_consume(buffer)) consumer(event, context);
+    }
+  }
+
+  while (heap_size > 0) {
+    event_buffer *buffer = heap[0];
+    consumer(event_buffer_peek(buffer), context);
+    event_buffer_consume(buffer);
+
+    if (event_buffer_peek(buffer) == NULL) heap[0] = heap[--heap_size];
+    if (heap_size > 0) heap_sift_down(0);
+  }
+
+  if (!found_released) return;
+
+  pthread_mutex_lock(&all_buffers_mutex);
+  event_buffer **link = &all_buffers;
+  while (*link != NULL) {
+    event_buffer *buffer = *link;
+    if (__atomic_load_n(&buffer->owner_gone, __ATOMIC_ACQUIRE) && event_buffer_empty(buffer)) {
+      *link = buffer->next;
+      free(buffer);
+    } else {
+      link = &buffer->next;
+    }
+  }
+  pthread_mutex_unlock(&all_buffers_mutex);
+}
+
+uint64_t event_buffer_dropped_events(void) {
+  return __atomic_load_n(&dropped_events, __ATOMIC_RELAXED);
+}
+
+void event_buffer_reset_dropped_events(void) {
+  __atomic_store_n(&dropped_events, 0, __ATOMIC_RELAXED);
+}
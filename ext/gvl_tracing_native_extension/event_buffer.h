@@ -0,0 +1,80 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Per-thread event buffers: Each Ruby thread gets its own preallocated ring of fixed-size binary event records. The GVL
+// hooks only ever copy a record into the ring (no formatting, no locks, no I/O), and a background native thread drains
+// all rings and takes care of serializing the events to the output.
+//
+// Note that this file is deliberately Ruby-agnostic: the GVL hooks often run without holding the GVL, and the drain
+// side runs on a native thread that Ruby knows nothing about, so none of this code can touch Ruby objects.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gvl_event.h"
+
+typedef struct {
+  uint32_t sequence;
+  gvl_event event;
+} event_buffer_slot;
+
+typedef struct event_buffer {
+  struct event_buffer *next;
+  uint32_t capacity;
+  uint32_t write_position;
+  uint32_t read_position; // Only ever touched by the consumer
+  bool owner_gone;
+  event_buffer_slot slots[];
+} event_buffer;
+
+// Rounds up the requested capacity (in events) to what the buffers actually use (a power of two)
+uint32_t event_buffer_capacity_for(uint32_t requested_capacity);
+
+// Allocates a new buffer and registers it, so that it gets seen by `event_buffer_drain_all`. Capacity must come from
+// `event_buffer_capacity_for`. Safe to call without the GVL. Returns NULL on allocation failure.
+event_buffer *event_buffer_new(uint32_t capacity);
+
+size_t event_buffer_memsize(const event_buffer *buffer);
+
+// Signals that the owner is done with the buffer. The buffer is only actually freed by `event_buffer_drain_all`, after
+// all of its events have been consumed, so it's always safe for the consumer to be reading from it.
+void event_buffer_release(event_buffer *buffer);
+
+// Returns false (and counts the event as dropped) if the buffer is full. Never blocks.
+//
+// This is designed for a single producer, but it's also safe if in some corner case more than one thread ends up
+// pushing into the same buffer (e.g. Ruby emits the thread STARTED event from the parent thread).
+bool event_buffer_push(event_buffer *buffer, const gvl_event *event);
+
+// Calls `consumer` for every event currently available in every registered buffer, and frees buffers that have been
+// released and fully drained. Only one thread may be draining at any given time.
+void event_buffer_drain_all(void (*consumer)(const gvl_event *event, void *context), void *context);
+
+// Total number of events that did not fit in their buffer since the last `event_buffer_reset_dropped_events`
+uint64_t event_buffer_dropped_events(void);
+void event_buffer_reset_dropped_events(void);
@@ -44,6 +44,12 @@ have_header("pthread.h")
 have_func("pthread_getname_np", "pthread.h")
 have_func("pthread_threadid_np", "pthread.h")
 have_func("rb_internal_thread_specific_get", "ruby/thread.h") # 3.3+
+have_func("sched_getcpu", "sched.h") # Linux-only
+have_func("posix_fallocate", "fcntl.h") # Not on macOS
+
+# Optional, used for compressing the output
+$defs << "-DGVL_TRACING_GZIP" if have_header("zlib.h") && have_library("z", "deflate", "zlib.h")
+$defs << "-DGVL_TRACING_ZSTD" if have_header("zstd.h") && have_library("zstd", "ZSTD_compressStream2", "zstd.h")
 
 append_cflags("-Werror-implicit-function-declaration")
 append_cflags("-Wunused-parameter")
@@ -0,0 +1,72 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+
+#include <stdint.h>
+
+#include "fibers.h"
+
+// 0 is used for fibers that can't keep a serial
+static uint32_t next_serial = 1;
+// Updated with atomics, since with Ractors more than one thread can be switching fibers at the same time
+static fiber_totals totals = { 0 };
+// No "@" prefix, so it does not show up in Fiber#instance_variables
+static ID serial_id;
+
+void fibers_init(void) {
+  serial_id = rb_intern("__gvl_tracing_fiber_serial");
+}
+
+void fibers_reset(void) {
+  __atomic_store_n(&totals.switches, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&totals.wants_gvl_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&totals.wants_gvl_ns, 0, __ATOMIC_RELAXED);
+}
+
+uint32_t fibers_serial_for(VALUE fiber) {
+  VALUE serial = rb_ivar_get(fiber, serial_id);
+  if (serial != Qnil) return NUM2UINT(serial);
+  if (RB_OBJ_FROZEN(fiber)) return 0;
+
+  uint32_t new_serial = __atomic_fetch_add(&next_serial, 1, __ATOMIC_RELAXED);
+  rb_ivar_set(fiber, serial_id, UINT2NUM(new_serial));
+  return new_serial;
+}
+
+void fibers_on_switch(void) {
+  __atomic_add_fetch(&totals.switches, 1, __ATOMIC_RELAXED);
+}
+
+void fibers_on_wants_gvl(int64_t wait_ns) {
+  __atomic_add_fetch(&totals.wants_gvl_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&totals.wants_gvl_ns, wait_ns > 0 ? (uint64_t) wait_ns : 0, __ATOMIC_RELAXED);
+}
+
+void fibers_totals(fiber_totals *result) {
+  result->switches = __atomic_load_n(&totals.switches, __ATOMIC_RELAXED);
+  result->wants_gvl_count = __atomic_load_n(&totals.wants_gvl_count, __ATOMIC_RELAXED);
+  result->wants_gvl_ns = __atomic_load_n(&totals.wants_gvl_ns, __ATOMIC_RELAXED);
+}
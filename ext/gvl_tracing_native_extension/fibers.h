@@ -0,0 +1,63 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Fibers: With `fibers: true`, every fiber switch gets recorded, so that apps running many fibers on each thread (e.g.
+// using `async`) can see which fiber was running when. The fibers get a track next to their thread, with a slice for
+// each time a fiber got to run.
+//
+// Like threads, each fiber gets identified by a serial, which it gets the first time it's seen switching in and keeps
+// for as long as it's around (including across traces). Looking up the serial is the only thing done on each switch,
+// other than pushing the event into the thread's buffer.
+//
+// The totals get written at the end of the trace, including how long threads running fibers spent waiting for the GVL:
+// during that time, their current fiber was ready to run, but couldn't.
+
+#pragma once
+
+#include <ruby/ruby.h>
+
+#include <stdint.h>
+
+typedef struct {
+  uint64_t switches;
+  // How many times (and for how long) threads that switched fibers during the trace waited to get the GVL back
+  uint64_t wants_gvl_count;
+  uint64_t wants_gvl_ns;
+} fiber_totals;
+
+// Must be called once, from the extension's init function
+void fibers_init(void);
+
+void fibers_reset(void);
+
+// Returns the serial for `fiber`, assigning one if needed. Must be called with the GVL (e.g. from the fiber switch
+// hook). Returns 0 for fibers that can't keep a serial (frozen ones).
+uint32_t fibers_serial_for(VALUE fiber);
+
+void fibers_on_switch(void);
+// Called when a thread that switched fibers during the trace gets the GVL back, with how long it waited for it
+void fibers_on_wants_gvl(int64_t wait_ns);
+
+void fibers_totals(fiber_totals *totals);
@@ -0,0 +1,104 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight_recorder.h"
+
+static gvl_event *ring = NULL;
+static uint32_t ring_capacity = 0;
+static uint64_t appended_events = 0; // Total since start; the next event goes into `appended_events % ring_capacity`
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t pending_dump_wait_ns = 0;
+
+bool flight_recorder_start(uint32_t capacity) {
+  gvl_event *new_ring = malloc(sizeof(gvl_event) * (size_t) capacity);
+  if (new_ring == NULL) return false;
+
+  pthread_mutex_lock(&ring_mutex);
+  free(ring);
+  ring = new_ring;
+  ring_capacity = capacity;
+  appended_events = 0;
+  pthread_mutex_unlock(&ring_mutex);
+
+  __atomic_store_n(&pending_dump_wait_ns, 0, __ATOMIC_RELAXED);
+
+  return true;
+}
+
+void flight_recorder_stop(void) {
+  pthread_mutex_lock(&ring_mutex);
+  free(ring);
+  ring = NULL;
+  ring_capacity = 0;
+  appended_events = 0;
+  pthread_mutex_unlock(&ring_mutex);
+}
+
+void flight_recorder_append(const gvl_event *event, __attribute__((unused)) void *_unused) {
+  pthread_mutex_lock(&ring_mutex);
+  if (ring != NULL) {
+    ring[appended_events % ring_capacity] = *event;
+    appended_events++;
+  }
+  pthread_mutex_unlock(&ring_mutex);
+}
+
+gvl_event *flight_recorder_snapshot(int64_t since_ns, size_t *count) {
+  gvl_event *result = NULL;
+  *count = 0;
+
+  pthread_mutex_lock(&ring_mutex);
+
+  uint64_t available = appended_events < ring_capacity ? appended_events : ring_capacity;
+  if (available > 0) result = malloc(sizeof(gvl_event) * available);
+
+  if (result != NULL) {
+    for (uint64_t i = appended_events - available; i < appended_events; i++) {
+      const gvl_event *event = &ring[i % ring_capacity];
+      if (event->timestamp_ns >= since_ns) result[(*count)++] = *event;
+    }
+  }
+
+  pthread_mutex_unlock(&ring_mutex);
+
+  if (*count == 0) {
+    free(result);
+    return NULL;
+  }
+  return result;
+}
+
+void flight_recorder_request_dump(int64_t wait_ns) {
+  int64_t no_request = 0;
+  __atomic_compare_exchange_n(&pending_dump_wait_ns, &no_request, wait_ns > 0 ? wait_ns : 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+int64_t flight_recorder_take_dump_request(void) {
+  return __atomic_exchange_n(&pending_dump_wait_ns, 0, __ATOMIC_RELAXED);
+}
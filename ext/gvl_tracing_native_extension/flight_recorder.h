@@ -0,0 +1,63 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Flight recorder: rather than writing every event to a file, keeps the most recent events in a fixed-size in-memory
+// ring, using the same binary records as the per-thread event buffers. The ring only gets turned into an actual trace
+// when it gets dumped, which can be requested explicitly or triggered automatically by a long wait for the GVL.
+//
+// Events get appended by the writer thread (as it drains the per-thread buffers), while dumps can come from either the
+// writer thread or a Ruby thread, so the ring is protected by a mutex. The hooks never touch the ring directly; the
+// only thing they can do is request a dump, which is lock-free.
+//
+// Like the event buffers, this is Ruby-agnostic.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gvl_event.h"
+
+// Allocates the ring, with space for `capacity` events. Returns false on allocation failure.
+bool flight_recorder_start(uint32_t capacity);
+
+// Frees the ring; snapshots taken afterwards are empty
+void flight_recorder_stop(void);
+
+// Appends an event, overwriting the oldest one if the ring is full. Has the same signature as the consumers passed to
+// `event_buffer_drain_all`.
+void flight_recorder_append(const gvl_event *event, void *_unused);
+
+// Returns a copy of the events with timestamp >= `since_ns`, in the order they were appended, and sets `count`.
+// The caller must free the result. Returns NULL (and a `count` of 0) if there are no such events or if allocation failed.
+gvl_event *flight_recorder_snapshot(int64_t since_ns, size_t *count);
+
+// Called from the GVL hooks when a thread waited for the GVL for longer than the configured threshold. Never blocks;
+// if there's already a pending request, this one gets folded into it.
+void flight_recorder_request_dump(int64_t wait_ns);
+
+// Returns the wait that triggered the pending dump request (clearing it), or 0 if there's no pending request
+int64_t flight_recorder_take_dump_request(void);
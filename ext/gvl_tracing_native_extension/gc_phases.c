@@ -0,0 +1,182 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "gc_phases.h"
+
+typedef enum {
+  PHASE_NONE,
+  PHASE_MARKING,
+  PHASE_SWEEPING,
+} gc_phase;
+
+static const char *major_by_names[] = { NULL, "nofree", "oldgen", "shady", "force", "oldmalloc", "unknown" };
+static const char *triggered_by_names[] = { "unknown", "newobj", "malloc", "method", "capi", "stress" };
+
+static gc_totals totals = { 0 };
+// The cycle currently going on. PHASE_NONE if there's none (or if it started before the last reset, since then we
+// don't know when it started).
+static gc_phase cycle_phase = PHASE_NONE;
+static bool cycle_major = false;
+static int64_t cycle_phase_started_at_ns = 0;
+// The step currently going on (0 if none). A step gets counted towards the phase the cycle was in when it began, so a
+// step that finishes marking and then does some sweeping gets counted as marking.
+static int64_t step_started_at_ns = 0;
+static gc_phase step_phase = PHASE_NONE;
+static bool step_major = false;
+
+// Keys and values for GC.latest_gc_info/GC.stat. These are all static symbols, so they never get collected.
+static VALUE major_by_key;
+static VALUE gc_by_key;
+static VALUE immediate_sweep_key;
+static VALUE heap_live_slots_key;
+static VALUE heap_free_slots_key;
+static VALUE major_by_values[GC_MAJOR_BY_UNKNOWN];
+static VALUE triggered_by_values[GC_TRIGGERED_BY_STRESS + 1];
+
+void gc_phases_init(void) {
+  major_by_key = ID2SYM(rb_intern("major_by"));
+  gc_by_key = ID2SYM(rb_intern("gc_by"));
+  immediate_sweep_key = ID2SYM(rb_intern("immediate_sweep"));
+  heap_live_slots_key = ID2SYM(rb_intern("heap_live_slots"));
+  heap_free_slots_key = ID2SYM(rb_intern("heap_free_slots"));
+
+  major_by_values[GC_MAJOR_BY_NONE] = Qnil;
+  for (int i = GC_MAJOR_BY_NONE + 1; i < GC_MAJOR_BY_UNKNOWN; i++) major_by_values[i] = ID2SYM(rb_intern(major_by_names[i]));
+  triggered_by_values[GC_TRIGGERED_BY_UNKNOWN] = Qnil;
+  for (int i = GC_TRIGGERED_BY_UNKNOWN + 1; i <= GC_TRIGGERED_BY_STRESS; i++) {
+    triggered_by_values[i] = ID2SYM(rb_intern(triggered_by_names[i]));
+  }
+
+  // The first time these get called, Ruby interns all of their keys, which allocates; this makes sure that does not
+  // happen from inside the GC hooks
+  rb_gc_latest_gc_info(major_by_key);
+  rb_gc_stat(heap_live_slots_key);
+}
+
+void gc_phases_reset(void) {
+  memset(&totals, 0, sizeof(totals));
+  cycle_phase = PHASE_NONE;
+  step_started_at_ns = 0;
+  step_phase = PHASE_NONE;
+}
+
+static inline gc_cycle_totals *totals_for(bool major) {
+  return major ? &totals.major : &totals.minor;
+}
+
+void gc_phases_on_enter(int64_t now_ns) {
+  step_started_at_ns = now_ns;
+  step_phase = cycle_phase;
+  step_major = cycle_major;
+}
+
+void gc_phases_on_exit(int64_t now_ns) {
+  if (step_started_at_ns == 0) return;
+
+  gc_cycle_totals *cycle_totals = totals_for(step_major);
+  uint64_t duration_ns = now_ns - step_started_at_ns;
+  if (step_phase == PHASE_MARKING) {
+    cycle_totals->marking_pause_ns += duration_ns;
+  } else if (step_phase == PHASE_SWEEPING) {
+    cycle_totals->sweeping_pause_ns += duration_ns;
+  }
+
+  step_started_at_ns = 0;
+}
+
+static uint32_t heap_counter(VALUE key) {
+  size_t value = rb_gc_stat(key);
+  return value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+}
+
+static void sample_heap_counters(gvl_event *event) {
+  event->data.gc.heap_live_slots = heap_counter(heap_live_slots_key);
+  event->data.gc.heap_free_slots = heap_counter(heap_free_slots_key);
+}
+
+void gc_phases_on_start(int64_t now_ns, gvl_event *event) {
+  VALUE major_by = rb_gc_latest_gc_info(major_by_key);
+  VALUE gc_by = rb_gc_latest_gc_info(gc_by_key);
+
+  event->data.gc.major_by = GC_MAJOR_BY_UNKNOWN;
+  for (int i = GC_MAJOR_BY_NONE; i < GC_MAJOR_BY_UNKNOWN; i++) {
+    if (major_by == major_by_values[i]) event->data.gc.major_by = i;
+  }
+  event->data.gc.triggered_by = GC_TRIGGERED_BY_UNKNOWN;
+  for (int i = GC_TRIGGERED_BY_UNKNOWN + 1; i <= GC_TRIGGERED_BY_STRESS; i++) {
+    if (gc_by == triggered_by_values[i]) event->data.gc.triggered_by = i;
+  }
+  event->data.gc.immediate_sweep = RTEST(rb_gc_latest_gc_info(immediate_sweep_key));
+  sample_heap_counters(event);
+
+  bool major = event->data.gc.major_by != GC_MAJOR_BY_NONE;
+  event->type = major ? EVENT_MAJOR_GC_MARKING : EVENT_MINOR_GC_MARKING;
+
+  cycle_phase = PHASE_MARKING;
+  cycle_major = major;
+  cycle_phase_started_at_ns = now_ns;
+  totals_for(major)->count++;
+
+  // The step that started the cycle also does the first bit of marking
+  if (step_started_at_ns != 0) {
+    step_phase = PHASE_MARKING;
+    step_major = major;
+  }
+}
+
+void gc_phases_on_end_mark(int64_t now_ns, gvl_event *event) {
+  event->type = EVENT_GC_SWEEPING;
+
+  if (cycle_phase != PHASE_MARKING) return;
+
+  totals_for(cycle_major)->marking_ns += now_ns - cycle_phase_started_at_ns;
+  cycle_phase = PHASE_SWEEPING;
+  cycle_phase_started_at_ns = now_ns;
+}
+
+void gc_phases_on_end_sweep(int64_t now_ns, gvl_event *event) {
+  event->type = EVENT_GC_FINISHED;
+  sample_heap_counters(event);
+
+  if (cycle_phase == PHASE_SWEEPING) totals_for(cycle_major)->sweeping_ns += now_ns - cycle_phase_started_at_ns;
+  cycle_phase = PHASE_NONE;
+}
+
+void gc_phases_totals(gc_totals *result) {
+  *result = totals;
+}
+
+const char *gc_major_by_name(uint8_t major_by) {
+  return major_by <= GC_MAJOR_BY_UNKNOWN ? major_by_names[major_by] : "unknown";
+}
+
+const char *gc_triggered_by_name(uint8_t triggered_by) {
+  return triggered_by <= GC_TRIGGERED_BY_STRESS ? triggered_by_names[triggered_by] : "unknown";
+}
@@ -0,0 +1,99 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// GC phases: The per-thread "gc" slices show when each thread was stopped doing GC work, but with incremental marking
+// and lazy sweeping a single GC cycle gets spread over many short steps, so it's hard to tell from those what kind of
+// GC was going on. The GC also gets its own track, with a slice for the marking and the sweeping of each cycle, tagged
+// with why the GC happened and the heap counters before/after.
+//
+// The time spent in each kind of cycle also gets totaled up, and written at the end of the trace.
+//
+// All functions get called from the GC hooks (or while no GC can be running), and Ruby never runs more than one GC at a
+// time, so none of this needs any locking.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "gvl_event.h"
+
+// Why a major GC was needed (GC.latest_gc_info(:major_by)); minor GCs always get GC_MAJOR_BY_NONE
+typedef enum {
+  GC_MAJOR_BY_NONE,
+  GC_MAJOR_BY_NOFREE,
+  GC_MAJOR_BY_OLDGEN,
+  GC_MAJOR_BY_SHADY,
+  GC_MAJOR_BY_FORCE,
+  GC_MAJOR_BY_OLDMALLOC,
+  GC_MAJOR_BY_UNKNOWN,
+} gc_major_by;
+
+// What triggered the GC (GC.latest_gc_info(:gc_by))
+typedef enum {
+  GC_TRIGGERED_BY_UNKNOWN,
+  GC_TRIGGERED_BY_NEWOBJ,
+  GC_TRIGGERED_BY_MALLOC,
+  GC_TRIGGERED_BY_METHOD,
+  GC_TRIGGERED_BY_CAPI,
+  GC_TRIGGERED_BY_STRESS,
+} gc_triggered_by;
+
+typedef struct {
+  uint64_t count;
+  // Wall time from the start to the end of each phase, including any time the application ran in between steps
+  uint64_t marking_ns;
+  uint64_t sweeping_ns;
+  // Time threads actually spent stopped doing GC steps for each phase
+  uint64_t marking_pause_ns;
+  uint64_t sweeping_pause_ns;
+} gc_cycle_totals;
+
+typedef struct {
+  gc_cycle_totals minor;
+  gc_cycle_totals major;
+} gc_totals;
+
+// Must be called once, from the extension's init function
+void gc_phases_init(void);
+
+// Clears the totals. Since tracing can start in the middle of a GC cycle, steps and phases of that cycle don't count.
+void gc_phases_reset(void);
+
+// Called from the GC_ENTER/GC_EXIT hooks, for every GC step
+void gc_phases_on_enter(int64_t now_ns);
+void gc_phases_on_exit(int64_t now_ns);
+
+// Called from the GC_START/GC_END_MARK/GC_END_SWEEP hooks. These update the totals, and fill in the type and data for
+// the event that goes on the GC track. Only the start of a cycle samples the reason (and only the start and the end of
+// a cycle sample the heap counters), so the much more frequent GC steps and GVL hooks don't pay for any of this.
+void gc_phases_on_start(int64_t now_ns, gvl_event *event);
+void gc_phases_on_end_mark(int64_t now_ns, gvl_event *event);
+void gc_phases_on_end_sweep(int64_t now_ns, gvl_event *event);
+
+void gc_phases_totals(gc_totals *totals);
+
+// Returns NULL for GC_MAJOR_BY_NONE (e.g. minor GCs)
+const char *gc_major_by_name(uint8_t major_by);
+const char *gc_triggered_by_name(uint8_t triggered_by);
@@ -0,0 +1,176 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The binary event records that get passed from the GVL hooks to the writer thread (and then to each output format).
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  EVENT_STARTED_TRACING,
+  EVENT_STOPPED_TRACING,
+  EVENT_STARTED,
+  EVENT_DIED,
+  EVENT_WANTS_GVL,
+  EVENT_RUNNING,
+  EVENT_WAITING,
+  EVENT_GC,
+  EVENT_SLEEPING,
+  // Same as EVENT_WAITING, when we know what the thread was blocked on (see wait_reasons.h)
+  EVENT_WAITING_IO_READ,
+  EVENT_WAITING_IO_WRITE,
+  EVENT_WAITING_IO_SELECT,
+  EVENT_WAITING_MUTEX,
+  EVENT_WAITING_QUEUE,
+  EVENT_WAITING_CONDVAR,
+  EVENT_WAITING_PROCESS,
+  EVENT_WAITING_DNS,
+  EVENT_WAITING_SOCKET,
+  EVENT_GVL_HOLDER, // Instant event, see gvl_holder.h
+  EVENT_COALESCED, // Only used for the slices written by coalescer.h
+  // Events for the GC track (see gc_phases.h), rather than for the thread that recorded them
+  EVENT_MINOR_GC_MARKING,
+  EVENT_MAJOR_GC_MARKING,
+  EVENT_GC_SWEEPING,
+  EVENT_GC_FINISHED, // Only ends the sweeping slice
+  EVENT_GVL_COUNTERS, // Sample of how many threads are in each state, for the counter tracks
+  // Custom spans (see gvl_tracing.h), which get their own track next to the thread's
+  EVENT_SPAN_BEGIN,
+  EVENT_SPAN_END,
+  EVENT_FIBER_SWITCH, // See fibers.h; also gets its own track next to the thread's
+  EVENT_TYPE_COUNT, // Must be last
+} event_type;
+
+// Used with the OS threads view: in addition to the event itself, the native thread started (or stopped) running
+// the Ruby thread
+#define EVENT_FLAG_OS_THREAD_BEGIN (1 << 0)
+#define EVENT_FLAG_OS_THREAD_END   (1 << 1)
+// Used for GVL handoffs: the event starts (the thread released the GVL) or ends (the thread acquired it) a flow
+#define EVENT_FLAG_FLOW_BEGIN      (1 << 2)
+#define EVENT_FLAG_FLOW_END        (1 << 3)
+// The event ends the thread holding the GVL, and records how much CPU time it got meanwhile (see `cpu_time:`)
+#define EVENT_FLAG_CPU_TIME        (1 << 4)
+
+typedef struct {
+  int64_t timestamp_ns;
+  int32_t thread_id;
+  uint32_t native_thread_id;
+  uint8_t type;
+  uint8_t flags;
+  uint16_t context_id; // Label set with GvlTracing.set_context when the event happened (0 if none), see context_stats.h
+  // Extra information, only used by some event types
+  union {
+    // Used by the events that start/end a GVL handoff, which are also the ones that can carry EVENT_FLAG_CPU_TIME
+    struct {
+      uint32_t id;
+      uint32_t on_cpu_us; // How long the thread was actually on a CPU while it held the GVL
+      int32_t cpu; // Which CPU the thread was on when it released the GVL (-1 if unknown)
+    } flow;
+    struct {
+      int32_t thread_id;
+      uint32_t stack_id; // 0 if the stack could not be recorded
+      uint32_t wait_us;
+    } gvl_holder;
+    struct {
+      uint32_t heap_live_slots; // Only set for the start (marking) and end (finished) of a cycle
+      uint32_t heap_free_slots;
+      uint8_t major_by; // See gc_major_by
+      uint8_t triggered_by; // See gc_triggered_by
+      bool immediate_sweep;
+    } gc;
+    struct {
+      uint32_t wants_gvl;
+      uint32_t running;
+      uint32_t waiting; // Includes sleeping threads
+    } gvl_counters;
+    struct {
+      uint32_t name_id; // See span_names.h; only set for EVENT_SPAN_BEGIN
+    } span;
+    struct {
+      uint32_t serial; // The fiber that the thread switched to
+    } fiber;
+  } data;
+} gvl_event;
+
+static inline const char *event_type_name(event_type type) {
+  switch (type) {
+    case EVENT_STARTED_TRACING: return "started_tracing";
+    case EVENT_STOPPED_TRACING: return "stopped_tracing";
+    case EVENT_STARTED:         return "started";
+    case EVENT_DIED:            return "died";
+    case EVENT_WANTS_GVL:       return "wants_gvl";
+    case EVENT_RUNNING:         return "running";
+    case EVENT_WAITING:         return "waiting";
+    case EVENT_GC:              return "gc";
+    case EVENT_SLEEPING:        return "sleeping";
+    case EVENT_WAITING_IO_READ:   return "waiting:io_read";
+    case EVENT_WAITING_IO_WRITE:  return "waiting:io_write";
+    case EVENT_WAITING_IO_SELECT: return "waiting:io_select";
+    case EVENT_WAITING_MUTEX:     return "waiting:mutex";
+    case EVENT_WAITING_QUEUE:     return "waiting:queue";
+    case EVENT_WAITING_CONDVAR:   return "waiting:condvar";
+    case EVENT_WAITING_PROCESS:   return "waiting:process";
+    case EVENT_WAITING_DNS:       return "waiting:dns";
+    case EVENT_WAITING_SOCKET:    return "waiting:socket";
+    case EVENT_GVL_HOLDER:      return "gvl_holder";
+    case EVENT_COALESCED:       return "coalesced";
+    case EVENT_MINOR_GC_MARKING: return "minor_gc_marking";
+    case EVENT_MAJOR_GC_MARKING: return "major_gc_marking";
+    case EVENT_GC_SWEEPING:     return "gc_sweeping";
+    case EVENT_GC_FINISHED:     return "gc_finished";
+    case EVENT_GVL_COUNTERS:    return "gvl_threads";
+    case EVENT_SPAN_BEGIN:      return "span_begin";
+    case EVENT_SPAN_END:        return "span_end";
+    case EVENT_FIBER_SWITCH:    return "fiber_switch";
+    case EVENT_TYPE_COUNT:      break;
+  }
+  return "bug_unknown_event";
+}
+
+// Most events start a new slice for the thread (ending the previous one), but instant events are just markers
+static inline bool event_type_is_instant(event_type type) {
+  return type == EVENT_GVL_HOLDER;
+}
+
+// Waiting for something other than the GVL (and not sleeping)
+static inline bool event_type_is_waiting(event_type type) {
+  return type == EVENT_WAITING || (type >= EVENT_WAITING_IO_READ && type <= EVENT_WAITING_SOCKET);
+}
+
+static inline bool event_type_is_gc_phase(event_type type) {
+  return type >= EVENT_MINOR_GC_MARKING && type <= EVENT_GC_FINISHED;
+}
+
+static inline bool event_type_is_span(event_type type) {
+  return type == EVENT_SPAN_BEGIN || type == EVENT_SPAN_END;
+}
+
+// Events that end the previous slice for their thread and start a new one (and thus can be folded by the coalescer)
+static inline bool event_type_is_thread_slice(event_type type) {
+  return !event_type_is_instant(type) && !event_type_is_gc_phase(type) && !event_type_is_span(type) &&
+    type != EVENT_GVL_COUNTERS && type != EVENT_FIBER_SWITCH;
+}
@@ -0,0 +1,257 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+#include <ruby/debug.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gvl_holder.h"
+
+// Used to mark function arguments that are deliberately left unused
+#ifdef __GNUC__
+  #define UNUSED_ARG  __attribute__((unused))
+#else
+  #define UNUSED_ARG
+#endif
+
+// Both tables are fixed-size (and never resized, so ids stay valid); once they fill up, new stacks get recorded as
+// unknown (stack id 0).
+#define FRAME_TABLE_CAPACITY 4096
+#define STACK_TABLE_CAPACITY 1024
+#define MAX_LOAD_PERCENT 75
+
+typedef struct {
+  VALUE frame; // 0 == empty entry
+  int line;
+} frame_entry;
+
+typedef struct {
+  bool used;
+  uint32_t hash;
+  uint32_t depth;
+  uint32_t frame_ids[GVL_HOLDER_MAX_DEPTH];
+  uint64_t count;
+  uint64_t total_wait_ns;
+} stack_entry;
+
+static int64_t threshold_ns = 0;
+static frame_entry *frame_table = NULL;
+static uint32_t frame_table_size = 0;
+static stack_entry *stack_table = NULL;
+static uint32_t stack_table_size = 0;
+static VALUE frames_holder = Qnil;
+
+// The last thread that released the GVL after holding it for longer than the threshold
+static struct {
+  bool valid;
+  int32_t thread_id;
+  uint32_t stack_id;
+  int64_t released_at_ns;
+} last_holder = { 0 };
+
+static void frames_holder_mark(UNUSED_ARG void *_unused);
+
+static const rb_data_type_t frames_holder_type = {
+  .wrap_struct_name = "GvlTracing::__gvlHolderFrames",
+  .function = { .dmark = frames_holder_mark },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void gvl_holder_init(void) {
+  rb_global_variable(&frames_holder);
+  // The frames we sample need to be kept alive (and not moved) until we turn them into strings
+  // (Ruby skips marking objects with a NULL data pointer, so we pass in a dummy one)
+  frames_holder = TypedData_Wrap_Struct(rb_cObject, &frames_holder_type, &frame_table);
+}
+
+void gvl_holder_start(int64_t new_threshold_ns) {
+  threshold_ns = new_threshold_ns;
+  last_holder.valid = false;
+  frame_table_size = 0;
+  stack_table_size = 0;
+
+  // The tables are only allocated the first time they're needed, and then get reused
+  if (frame_table != NULL) memset(frame_table, 0, FRAME_TABLE_CAPACITY * sizeof(frame_entry));
+  if (stack_table != NULL) memset(stack_table, 0, STACK_TABLE_CAPACITY * sizeof(stack_entry));
+
+  if (threshold_ns <= 0) return;
+
+  if (frame_table == NULL) frame_table = ruby_xcalloc(FRAME_TABLE_CAPACITY, sizeof(frame_entry));
+  if (stack_table == NULL) stack_table = ruby_xcalloc(STACK_TABLE_CAPACITY, sizeof(stack_entry));
+}
+
+bool gvl_holder_enabled(void) { return threshold_ns > 0; }
+
+static inline uint32_t mix(uint32_t hash, uint64_t value) {
+  value ^= value >> 33;
+  value *= UINT64_C(0xff51afd7ed558ccd);
+  value ^= value >> 33;
+  return (hash * 31) ^ (uint32_t) value;
+}
+
+// Returns the frame id (index + 1), or 0 if the table is full
+static uint32_t intern_frame(VALUE frame, int line) {
+  uint32_t index = mix(0, frame ^ ((uint64_t) line << 48)) & (FRAME_TABLE_CAPACITY - 1);
+
+  while (frame_table[index].frame != 0) {
+    if (frame_table[index].frame == frame && frame_table[index].line == line) return index + 1;
+    index = (index + 1) & (FRAME_TABLE_CAPACITY - 1);
+  }
+
+  if (frame_table_size * 100 >= FRAME_TABLE_CAPACITY * MAX_LOAD_PERCENT) return 0;
+
+  frame_table[index] = (frame_entry) { .frame = frame, .line = line };
+  frame_table_size++;
+  return index + 1;
+}
+
+// Returns the stack id (index + 1), or 0 if the table is full
+static uint32_t intern_stack(const uint32_t *frame_ids, uint32_t depth) {
+  uint32_t hash = depth;
+  for (uint32_t i = 0; i < depth; i++) hash = mix(hash, frame_ids[i]);
+
+  uint32_t index = hash & (STACK_TABLE_CAPACITY - 1);
+  while (stack_table[index].used) {
+    stack_entry *entry = &stack_table[index];
+    if (entry->hash == hash && entry->depth == depth && memcmp(entry->frame_ids, frame_ids, depth * sizeof(uint32_t)) == 0) {
+      return index + 1;
+    }
+    index = (index + 1) & (STACK_TABLE_CAPACITY - 1);
+  }
+
+  if (stack_table_size * 100 >= STACK_TABLE_CAPACITY * MAX_LOAD_PERCENT) return 0;
+
+  stack_entry *entry = &stack_table[index];
+  entry->used = true;
+  entry->hash = hash;
+  entry->depth = depth;
+  memcpy(entry->frame_ids, frame_ids, depth * sizeof(uint32_t));
+  stack_table_size++;
+  return index + 1;
+}
+
+void gvl_holder_on_release(int32_t thread_id, int64_t held_since_ns, int64_t now_ns) {
+  if (threshold_ns <= 0 || held_since_ns == 0 || (now_ns - held_since_ns) < threshold_ns) return;
+
+  VALUE frames[GVL_HOLDER_MAX_DEPTH];
+  int lines[GVL_HOLDER_MAX_DEPTH];
+  uint32_t frame_ids[GVL_HOLDER_MAX_DEPTH];
+
+  // Note: rb_profile_frames does not allocate, so it's OK to call from the GVL hooks
+  int depth = rb_profile_frames(0, GVL_HOLDER_MAX_DEPTH, frames, lines);
+
+  uint32_t stack_id = 0;
+  bool all_frames_interned = true;
+  for (int i = 0; i < depth && all_frames_interned; i++) {
+    frame_ids[i] = intern_frame(frames[i], lines[i]);
+    all_frames_interned = frame_ids[i] != 0;
+  }
+  if (depth > 0 && all_frames_interned) stack_id = intern_stack(frame_ids, depth);
+
+  last_holder.valid = true;
+  last_holder.thread_id = thread_id;
+  last_holder.stack_id = stack_id;
+  last_holder.released_at_ns = now_ns;
+}
+
+bool gvl_holder_on_acquire(
+  int32_t thread_id,
+  int64_t ready_at_ns,
+  int64_t now_ns,
+  int32_t *holder_thread_id,
+  uint32_t *holder_stack_id
+) {
+  if (threshold_ns <= 0 || ready_at_ns == 0 || (now_ns - ready_at_ns) < threshold_ns) return false;
+
+  // Only blame threads that released the GVL while we were waiting for it
+  if (!last_holder.valid || last_holder.thread_id == thread_id || last_holder.released_at_ns < ready_at_ns) return false;
+
+  *holder_thread_id = last_holder.thread_id;
+  *holder_stack_id = last_holder.stack_id;
+
+  if (last_holder.stack_id != 0) {
+    stack_entry *entry = &stack_table[last_holder.stack_id - 1];
+    entry->count++;
+    entry->total_wait_ns += now_ns - ready_at_ns;
+  }
+
+  return true;
+}
+
+static VALUE frame_to_string(const frame_entry *entry) {
+  VALUE label = rb_profile_frame_full_label(entry->frame);
+  VALUE path = rb_profile_frame_path(entry->frame);
+
+  return rb_sprintf(
+    "%"PRIsVALUE":%d:in `%"PRIsVALUE"'",
+    NIL_P(path) ? rb_str_new_cstr("(unknown)") : path,
+    entry->line,
+    NIL_P(label) ? rb_str_new_cstr("(unknown)") : label
+  );
+}
+
+static int compare_total_wait(const void *a, const void *b) {
+  uint64_t wait_a = stack_table[*(const uint32_t *) a].total_wait_ns;
+  uint64_t wait_b = stack_table[*(const uint32_t *) b].total_wait_ns;
+  return (wait_a < wait_b) - (wait_a > wait_b);
+}
+
+VALUE gvl_holder_summary(void) {
+  VALUE result = rb_ary_new();
+  if (stack_table == NULL) return result;
+
+  uint32_t indexes[STACK_TABLE_CAPACITY];
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < STACK_TABLE_CAPACITY; i++) {
+    if (stack_table[i].used && stack_table[i].count > 0) indexes[count++] = i;
+  }
+  qsort(indexes, count, sizeof(uint32_t), compare_total_wait);
+
+  for (uint32_t i = 0; i < count; i++) {
+    stack_entry *entry = &stack_table[indexes[i]];
+
+    VALUE frames = rb_ary_new_capa(entry->depth);
+    for (uint32_t j = 0; j < entry->depth; j++) rb_ary_push(frames, frame_to_string(&frame_table[entry->frame_ids[j] - 1]));
+
+    VALUE stack = rb_hash_new();
+    rb_hash_aset(stack, ID2SYM(rb_intern("stack_id")), UINT2NUM(indexes[i] + 1));
+    rb_hash_aset(stack, ID2SYM(rb_intern("count")), ULL2NUM(entry->count));
+    rb_hash_aset(stack, ID2SYM(rb_intern("total_wait_ns")), ULL2NUM(entry->total_wait_ns));
+    rb_hash_aset(stack, ID2SYM(rb_intern("frames")), frames);
+    rb_ary_push(result, stack);
+  }
+
+  return result;
+}
+
+static void frames_holder_mark(UNUSED_ARG void *_unused) {
+  if (frame_table == NULL) return;
+
+  for (uint32_t i = 0; i < FRAME_TABLE_CAPACITY; i++) {
+    if (frame_table[i].frame != 0) rb_gc_mark(frame_table[i].frame);
+  }
+}
@@ -0,0 +1,73 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// GVL holder attribution: A long `wants_gvl` slice tells us a thread was starved, but not who starved it. When enabled,
+// threads that release the GVL after holding it for longer than the threshold get their stack sampled, and threads that
+// waited for the GVL for longer than the threshold get attributed to the last such thread.
+//
+// Stacks are deduplicated: each distinct frame gets interned once into a frame table, and each distinct stack (list of
+// frame ids) gets interned once into a stack table, so a repeat culprit costs a few hash lookups and no allocations.
+//
+// Note that unlike most other files, this one does deal with Ruby objects: the sampled frames are kept as-is and only
+// get turned into strings when the summary is requested. All functions must be called while holding the GVL.
+//
+// Only threads in the main Ractor get sampled and attributed. Other Ractors each have their own GVL, so their threads
+// would run these at the same time as the main Ractor's threads; keeping them out is what makes it safe to use the
+// tables (and the last holder) without any locking. It also keeps waits from getting blamed on a thread that was
+// holding some other Ractor's GVL.
+
+#pragma once
+
+#include <ruby/ruby.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GVL_HOLDER_MAX_DEPTH 32
+
+// Must be called once, from the extension's init function
+void gvl_holder_init(void);
+
+// Clears all stacks and starts attributing waits longer than `threshold_ns`. A threshold of 0 disables attribution.
+void gvl_holder_start(int64_t threshold_ns);
+bool gvl_holder_enabled(void);
+
+// Called when a thread releases the GVL (while it's still holding it). Samples the current stack if the thread has been
+// holding the GVL for longer than the threshold.
+void gvl_holder_on_release(int32_t thread_id, int64_t held_since_ns, int64_t now_ns);
+
+// Called when a thread acquires the GVL. If it waited for longer than the threshold and a (sampled) thread held the GVL
+// in the meanwhile, returns true and fills in who held it.
+bool gvl_holder_on_acquire(
+  int32_t thread_id,
+  int64_t ready_at_ns,
+  int64_t now_ns,
+  int32_t *holder_thread_id,
+  uint32_t *holder_stack_id
+);
+
+// Returns an array of {stack_id:, count:, total_wait_ns:, frames: [...]} hashes, for every stack that got attributed
+// at least one wait, sorted by total_wait_ns (biggest first)
+VALUE gvl_holder_summary(void);
@@ -30,14 +30,37 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
+#include "analyzer.h"
+#include "coalescer.h"
+#include "context_stats.h"
 #include "direct-bind.h"
+#include "event_buffer.h"
+#include "fibers.h"
+#include "flight_recorder.h"
+#include "gc_phases.h"
+#include "gvl_holder.h"
+#include "handoff_matrix.h"
+#include "json_output.h"
+#include "output.h"
+#include "perfetto_output.h"
+#include "ractors.h"
+#include "span_names.h"
+#include "stats.h"
+#include "thread_filter.h"
+#include "thread_registry.h"
+#include "timestamps.h"
+#include "wait_reasons.h"
 
 #include "extconf.h"
+#include "gvl_tracing.h"
 
 #ifdef HAVE_PTHREAD_H
   #include <pthread.h>
@@ -47,6 +70,10 @@
   #include <unistd.h>
 #endif
 
+#ifdef HAVE_SCHED_GETCPU
+  #include <sched.h>
+#endif
+
 // Used to mark function arguments that are deliberately left unused
 #ifdef __GNUC__
   #define UNUSED_ARG  __attribute__((unused))
@@ -60,9 +87,35 @@
   #define RUBY_3_2
 #endif
 
-// For the OS threads view, we emit data as if it was for another pid so it gets grouped separately in perfetto.
-// This is a really big hack, but I couldn't think of a better way?
-#define OS_THREADS_VIEW_PID (INT64_C(0))
+// How often the writer thread wakes up to drain the per-thread event buffers
+#define WRITER_FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+// Threads going in and out of the GVL can easily change state hundreds of thousands of times per second, so the hooks
+// only sample the counter tracks this often (the writer thread then catches up with any change they skipped)
+#define GVL_COUNTERS_MIN_INTERVAL_NS (100 * 1000)
+// The counters for the number of threads in each state get packed into a single word, so that moving a thread from
+// one state to another is a single atomic add, and a sample is always consistent
+#define GVL_COUNTER_BITS 21
+#define GVL_COUNTER_MASK ((UINT64_C(1) << GVL_COUNTER_BITS) - 1)
+// Upper bound on the number of events each thread can have pending for the writer thread
+#define MAX_BUFFER_SIZE (1 << 24)
+// Upper bound on the number of events the flight recorder keeps in memory
+#define MAX_FLIGHT_RECORDER_EVENTS (1 << 26)
+// Handoffs get tracked separately for each Ractor, since each has its own GVL; threads in Ractors past this one don't
+// get their handoffs tracked
+#define MAX_HANDOFF_RACTORS 64
+
+typedef enum {
+  OUTPUT_FORMAT_JSON,
+  OUTPUT_FORMAT_PERFETTO,
+} output_format;
+
+// Which of the counter tracks the thread is being counted on
+typedef enum {
+  GVL_COUNTER_NONE,
+  GVL_COUNTER_WANTS_GVL,
+  GVL_COUNTER_RUNNING,
+  GVL_COUNTER_WAITING,
+} gvl_counter;
 
 typedef struct {
   bool initialized;
@@ -72,40 +125,202 @@ typedef struct {
   #endif
   VALUE thread;
   rb_event_flag_t previous_state; // Used to coalesce similar events
+  uint32_t previous_state_session; // Value of `tracing_session` when `previous_state` was recorded
+  int64_t ready_at_ns; // When the thread last started waiting for the GVL (0 if not waiting)
+  int64_t resumed_at_ns; // When the thread last acquired the GVL (0 if not holding it)
+  event_buffer *buffer; // Lazily allocated; owned by this thread but drained by the writer thread
+  thread_stats *stats; // Lazily allocated; owned by this thread but read by GvlTracing.stats
+  thread_registry_handle registry_handle; // THREAD_REGISTRY_NO_HANDLE if not registered (yet, or anymore)
+  VALUE last_name; // Name this thread had when we last looked (only ever compared, never used, so it does not get marked)
+  uint8_t last_type; // What the thread was doing before any GC (GC doesn't update it), so it can be restored afterwards
+  uint8_t gvl_counter; // See gvl_counter
+  uint32_t gvl_counter_session; // Value of `tracing_session` when `gvl_counter` was set
+  uint32_t span_depth; // How many custom spans the thread has open
+  uint32_t span_session; // Value of `tracing_session` when `span_depth` was set
+  int64_t cpu_sampled_at_ns; // When the thread acquired the GVL, if its CPU time was sampled then (0 if not)
+  int64_t cpu_time_at_resume_ns; // CPU time the thread had used when it acquired the GVL
+  uint32_t context_id; // Label set with GvlTracing.set_context (0 if none); see context_stats.h
+  uint8_t context_state; // What the thread was doing as of `context_state_since_ns`, for the per-context totals
+  uint32_t context_generation; // Value of `context_stats_generation()` when `context_state_since_ns` was set
+  int64_t context_state_since_ns;
+  uint32_t fiber_session; // Value of `tracing_session` when the thread last switched fibers
+  uint32_t ractor; // See ractors.h; RACTORS_UNKNOWN until the thread is seen holding its Ractor's GVL
+  bool traced; // Whether the thread passed the thread filters, see thread_filter.h
+  uint32_t filter_generation; // What `traced` was decided for
+  #ifdef RUBY_3_2
+    uint32_t filter_left_generation; // Value of `thread_filter_left_generation()` when it last looked for a decision
+  #endif
 } thread_local_state;
 
 // Global mutable state
 static rb_atomic_t thread_serial = 0;
-static FILE *output_file = NULL;
 static rb_internal_thread_event_hook_t *current_hook = NULL;
-static double started_tracing_at_microseconds = 0;
+// The last thread to release the GVL, and the id of the flow that starts there, packed into a single word so the hooks
+// can update it without locks: (flow id << 32) | thread id. 0 means nobody released the GVL since it was last acquired.
+// Indexed by Ractor (see ractors.h), since each Ractor's GVL gets handed off separately.
+static uint64_t last_gvl_release[MAX_HANDOFF_RACTORS + 1] = { 0 };
+static uint32_t last_flow_id = 0;
+// How many threads are in each state, see GVL_COUNTER_BITS. Threads only start being counted after their first event.
+static uint64_t gvl_counters = 0;
+static uint64_t last_gvl_counters_sample = 0;
+static int64_t last_gvl_counters_sample_at_ns = 0;
+// Set while events are being recorded, either to the output file or to the flight recorder
+static bool tracing_enabled = false;
+static bool flight_recorder_enabled = false;
+// Incremented every time tracing starts, so that per-thread state from previous runs can be detected and reset
+static uint32_t tracing_session = 0;
+static bool coalescer_enabled = false;
+static int64_t coalescer_min_slice_ns = 0;
+static bool stats_enabled = false;
+static int64_t stats_stopped_at_ns = 0;
+// Whether to sample each thread's CPU time when it acquires/releases the GVL, for the trace and/or for the stats
+static bool trace_cpu_time = false;
+static bool stats_cpu_time = false;
+static int64_t started_tracing_at_ns = 0;
+// The thread that started tracing always shows up, since it gets the started/stopped tracing events, even if it got
+// filtered out
+static int32_t started_tracing_thread_id = 0;
+static int64_t stopped_tracing_at_ns = 0;
 static int64_t process_id = 0;
 static VALUE gc_tracepoint = Qnil;
+// Only set while tracing with `fibers: true`, see fibers.h
+static VALUE fiber_tracepoint = Qnil;
+// GC phases don't belong to any thread, and they need to stay in order, so they all go into the same buffer
+static event_buffer *gc_phases_buffer = NULL;
+static bool gc_track_named = false; // Only touched by whoever is writing the output
+// Which Ractor groups got a name in the JSON trace so far (see ractors.h); also only touched by whoever is writing it
+static uint64_t ractor_groups_named[RACTORS_MAX_GROUPS / 64 + 1];
 #pragma GCC diagnostic ignored "-Wunused-variable"
 static int thread_storage_key = 0;
-static VALUE all_seen_threads = Qnil;
-static pthread_mutex_t all_seen_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Threads that exited before this don't need to be in the registry anymore
+static int64_t keep_exited_threads_since_ns = INT64_MAX;
 static bool os_threads_view_enabled;
 static uint32_t timeslice_meta_ms = 0;
-
-static ID sleep_id;
+static uint32_t buffer_capacity = 0;
+static output_format current_output_format = OUTPUT_FORMAT_JSON;
+static output_compression current_output_compression = OUTPUT_COMPRESSION_NONE;
+static char trace_metadata[64];
+static pthread_t writer_thread;
+static bool writer_stop_requested = false;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+static void (*writer_consumer)(const gvl_event *event, void *context);
+static int64_t flight_recorder_window_ns = 0;
+static int64_t flight_recorder_started_at_ns = 0;
+static int64_t auto_dump_threshold_ns = 0; // 0 if automatic dumps are disabled
+static int64_t next_auto_dump_at_ns = 0; // Only touched by the writer thread
+static char *auto_dump_path = NULL;
+static uint32_t flight_recorder_capacity = 0;
+// Where the trace is being written to, so that forked children can write to a file next to it (or connect to the same
+// socket)
+static char *trace_path = NULL;
+static bool streaming_to_socket = false;
+static bool writing_to_mmap = false;
+// Set while the writer thread is stopped so that the process can fork, see tracing_before_fork
+static bool paused_for_fork = false;
+static uint32_t auto_dumps = 0;
+// Dumps can be requested from Ruby and from the writer thread at the same time, but there's only one output
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ID to_s_id;
+static ID group_id;
 static VALUE (*is_thread_alive)(VALUE thread);
+static VALUE (*thread_name_for)(VALUE thread);
 
 static inline void initialize_timeslice_meta(void);
 static VALUE tracing_init_local_storage(VALUE, VALUE);
-static VALUE tracing_start(UNUSED_ARG VALUE _self, VALUE output_path, VALUE os_threads_view_enabled_arg);
+static VALUE tracing_start(UNUSED_ARG VALUE _self, VALUE output_path, VALUE options);
+static VALUE start_option(VALUE options, const char *name);
 static VALUE tracing_stop(VALUE _self);
-static double timestamp_microseconds(void);
-static double render_event(thread_local_state *, const char *event_name);
+static uint32_t parse_buffer_size(VALUE buffer_size);
+static output_format parse_format(VALUE format);
+static output_compression parse_compression(VALUE compression);
+static void initialize_trace_metadata(void);
+static void write_trace_header(void);
+static void write_thread_name(int32_t thread_id, uint32_t ractor, const char *thread_name, const char *separator);
+static void write_trace_footer(void);
+static size_t write_thread_names(int64_t alive_since_ns, const char *first_separator);
+static void write_thread_filter_label(const char *separator);
+static VALUE tracing_dropped_events(UNUSED_ARG VALUE _self);
+static VALUE tracing_dropped_batches(UNUSED_ARG VALUE _self);
+static VALUE tracing_gvl_holder_stacks(UNUSED_ARG VALUE _self);
+static VALUE tracing_handoff_matrix(UNUSED_ARG VALUE _self);
+static VALUE flight_recorder_start_ruby(UNUSED_ARG VALUE _self, VALUE options);
+static VALUE flight_recorder_stop_ruby(UNUSED_ARG VALUE _self);
+static VALUE flight_recorder_dump_ruby(UNUSED_ARG VALUE _self, VALUE path);
+static void *write_dump(void *request_ptr);
+static void auto_dump_path_for(uint32_t dump_number, char *path, size_t path_size);
+static void maybe_auto_dump(void);
+static VALUE stats_start(UNUSED_ARG VALUE _self, VALUE cpu_time);
+static VALUE stats_stop(UNUSED_ARG VALUE _self);
+static VALUE stats_get(UNUSED_ARG VALUE _self);
+static VALUE span_begin_ruby(UNUSED_ARG VALUE _self, VALUE name);
+static VALUE span_end_ruby(UNUSED_ARG VALUE _self);
+static VALUE set_context_ruby(UNUSED_ARG VALUE _self, VALUE label);
+static VALUE context_stats_ruby(UNUSED_ARG VALUE _self);
+static VALUE analyze_ruby(UNUSED_ARG VALUE _self, VALUE path, VALUE jobs, VALUE window_ms, VALUE top);
+static VALUE clock_ruby(UNUSED_ARG VALUE _self);
+static VALUE trace_thread_ruby(UNUSED_ARG VALUE _self, VALUE thread);
+static VALUE refresh_thread_filter_ruby(UNUSED_ARG VALUE _self, VALUE thread);
+static inline bool thread_traced(thread_local_state *state);
+static inline bool in_main_ractor(thread_local_state *state);
+static void decide_thread_filter(VALUE thread);
+static void set_thread_traced(thread_local_state *state, bool traced);
+static void skip_gvl_handoff(thread_local_state *state);
+static void write_clock_calibration(void);
+static inline void account_context(thread_local_state *state, event_type new_state, int64_t now_ns);
+static VALUE tracing_before_fork(UNUSED_ARG VALUE _self);
+static VALUE tracing_after_fork(UNUSED_ARG VALUE _self, VALUE in_child);
+static bool continue_tracing_in_child(void);
+static void path_for_child(const char *path, char *child_path, size_t child_path_size);
+static void discard_event(const gvl_event *event, void *context);
+static void install_hooks(void);
+static void remove_hooks(void);
+static inline int64_t timestamp_ns(void);
+static inline void sample_cpu_time_on_resume(thread_local_state *state, int64_t now_ns);
+static void record_event(thread_local_state *state, event_type type, uint8_t flags, int64_t now_ns);
+static inline gvl_event new_event(thread_local_state *state, event_type type, uint8_t flags, int64_t now_ns);
+static void record_gvl_handoff(thread_local_state *state, rb_event_flag_t event_id, gvl_event *event);
+static void reset_gvl_handoffs(void);
+static void reset_gvl_counters(thread_local_state *state);
+static void update_gvl_counters(thread_local_state *state, event_type type, int64_t now_ns);
+static gvl_event gvl_counters_event(int32_t thread_id, uint64_t counters, int64_t now_ns);
+static void sample_gvl_counters_if_changed(void);
+static void push_event(thread_local_state *state, gvl_event *event);
+static void write_gvl_holder_stacks(void);
+static void write_gc_totals(void);
+static void record_stats(thread_local_state *state, event_type type, int64_t now_ns);
+static void release_thread_resources(thread_local_state *state);
 static void on_thread_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *_unused1, void *_unused2);
 static void on_gc_event(VALUE tpval, void *_unused1);
-static size_t thread_local_state_memsize(UNUSED_ARG const void *_unused);
+static void on_fiber_switch(VALUE tpval, void *_unused1);
+static void disable_fiber_tracepoint(void);
+static void write_fiber_totals(void);
+static size_t thread_local_state_memsize(const void *data);
 static void thread_local_state_mark(void *data);
+static void thread_local_state_free(void *data);
 static inline int32_t thread_id_for(thread_local_state *state);
 static VALUE ruby_thread_id_for(UNUSED_ARG VALUE _self, VALUE thread);
-static VALUE trim_all_seen_threads(UNUSED_ARG VALUE _self);
-static void render_os_thread_event(thread_local_state *state, double now_microseconds);
-static void finish_previous_os_thread_event(double now_microseconds);
+static void register_thread(thread_local_state *state, uint32_t native_thread_id, int64_t now_ns);
+#ifdef RUBY_3_3_PLUS
+  static void set_thread_ractor(thread_local_state *state, uint32_t ractor);
+#endif
+static uint32_t ractor_group_for_thread(int32_t thread_id);
+static void capture_thread_name(thread_local_state *state, VALUE thread);
+static void set_thread_name(thread_registry_handle registry_handle, VALUE thread, VALUE name);
+static void set_thread_library(thread_registry_handle registry_handle, VALUE thread);
+static void refresh_thread_names(void);
+static void forget_dead_threads(void);
+static int64_t keep_exited_threads_for(int64_t now_ns);
+static int start_writer_thread(void (*consumer)(const gvl_event *event, void *context));
+static void *writer_thread_main(UNUSED_ARG void *_unused);
+static void stop_writer_thread(void);
+static void render_event(const gvl_event *event, void *base_timestamp_ns);
+static void render_json_event(const gvl_event *event, int64_t relative_timestamp_ns);
+static void render_coalesced_slice(const coalesced_slice *slice, void *base_timestamp_ns);
+static int64_t json_pid_for_thread(int32_t thread_id);
+static void release_gc_phases_buffer(void);
+static void stop_coalescer(void);
 static inline uint32_t current_native_thread_id(void);
 
 #pragma GCC diagnostic ignored "-Wunused-const-variable"
@@ -113,7 +328,7 @@ static const rb_data_type_t thread_local_state_type = {
   .wrap_struct_name = "GvlTracing::__threadLocal",
   .function = {
     .dmark = thread_local_state_mark,
-    .dfree = RUBY_DEFAULT_FREE,
+    .dfree = thread_local_state_free,
     .dsize = thread_local_state_memsize,
   },
   .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
@@ -127,6 +342,9 @@ static const rb_data_type_t thread_local_state_type = {
 #else
   // Thread-local state
   static _Thread_local thread_local_state __thread_local_state = { 0 };
+  // Used to release the event buffer and stats when the native thread exits, since nothing frees the thread-local state
+  static pthread_key_t thread_exit_key;
+  static void on_native_thread_exit(void *state) { release_thread_resources(state); }
 
   static inline thread_local_state *GT_CURRENT_THREAD_LOCAL_STATE(void);
   #define GT_LOCAL_STATE(thread, allocate) GT_CURRENT_THREAD_LOCAL_STATE()
@@ -136,27 +354,60 @@ static const rb_data_type_t thread_local_state_type = {
 void Init_gvl_tracing_native_extension(void) {
   #ifdef RUBY_3_3_PLUS
     thread_storage_key = rb_internal_thread_specific_key_create();
+  #else
+    int error = pthread_key_create(&thread_exit_key, on_native_thread_exit);
+    if (error) rb_syserr_fail(error, "Failed to create GvlTracing pthread key");
   #endif
 
-  rb_global_variable(&gc_tracepoint);
-  rb_global_variable(&all_seen_threads);
+  if (!timestamps_init(getenv("GVL_TRACING_CLOCK"))) rb_syserr_fail(errno, "Failed to read CLOCK_MONOTONIC");
 
-  all_seen_threads = rb_ary_new();
+  rb_global_variable(&gc_tracepoint);
+  rb_global_variable(&fiber_tracepoint);
 
-  sleep_id = rb_intern("sleep");
+  to_s_id = rb_intern("to_s");
+  group_id = rb_intern("group");
 
   VALUE gvl_tracing_module = rb_define_module("GvlTracing");
 
   rb_define_singleton_method(gvl_tracing_module, "_init_local_storage", tracing_init_local_storage, 1);
   rb_define_singleton_method(gvl_tracing_module, "_start", tracing_start, 2);
   rb_define_singleton_method(gvl_tracing_module, "_stop", tracing_stop, 0);
+  rb_define_singleton_method(gvl_tracing_module, "dropped_events", tracing_dropped_events, 0);
+  rb_define_singleton_method(gvl_tracing_module, "dropped_batches", tracing_dropped_batches, 0);
+  rb_define_singleton_method(gvl_tracing_module, "gvl_holder_stacks", tracing_gvl_holder_stacks, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_handoff_matrix", tracing_handoff_matrix, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_start_flight_recorder", flight_recorder_start_ruby, 1);
+  rb_define_singleton_method(gvl_tracing_module, "_stop_flight_recorder", flight_recorder_stop_ruby, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_dump", flight_recorder_dump_ruby, 1);
+  rb_define_singleton_method(gvl_tracing_module, "_start_stats", stats_start, 1);
+  rb_define_singleton_method(gvl_tracing_module, "stop_stats", stats_stop, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_stats", stats_get, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_begin_span", span_begin_ruby, 1);
+  rb_define_singleton_method(gvl_tracing_module, "_end_span", span_end_ruby, 0);
+  rb_define_singleton_method(gvl_tracing_module, "set_context", set_context_ruby, 1);
+  rb_define_singleton_method(gvl_tracing_module, "context_stats", context_stats_ruby, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_before_fork", tracing_before_fork, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_after_fork", tracing_after_fork, 1);
   rb_define_singleton_method(gvl_tracing_module, "_thread_id_for", ruby_thread_id_for, 1);
-  rb_define_singleton_method(gvl_tracing_module, "trim_all_seen_threads", trim_all_seen_threads, 0);
+  rb_define_singleton_method(gvl_tracing_module, "_analyze", analyze_ruby, 4);
+  rb_define_singleton_method(gvl_tracing_module, "clock", clock_ruby, 0);
+  rb_define_singleton_method(gvl_tracing_module, "trace_thread", trace_thread_ruby, 1);
+  // Threads get created and renamed in any Ractor, so the hooks in gvl-tracing.rb call this from all of them
+  rb_ext_ractor_safe(true);
+  rb_define_singleton_method(gvl_tracing_module, "_refresh_thread_filter", refresh_thread_filter_ruby, 1);
+  rb_ext_ractor_safe(false);
 
   initialize_timeslice_meta();
+  gvl_holder_init();
+  gc_phases_init();
+  fibers_init();
+  ractors_init();
+  thread_filter_init();
+  wait_reasons_refresh();
 
   direct_bind_initialize(gvl_tracing_module, true);
   is_thread_alive = direct_bind_get_cfunc_with_arity(rb_cThread, rb_intern("alive?"), 0, true).func;
+  thread_name_for = direct_bind_get_cfunc_with_arity(rb_cThread, rb_intern("name"), 0, true).func;
 }
 
 static inline void initialize_timeslice_meta(void) {
@@ -169,6 +420,7 @@ static inline void initialize_timeslice_meta(void) {
 static inline void initialize_thread_local_state(thread_local_state *state) {
   state->initialized = true;
   state->current_thread_serial = RUBY_ATOMIC_FETCH_ADD(thread_serial, 1);
+  state->last_type = EVENT_RUNNING;
 
   #ifdef RUBY_3_2
     state->native_thread_id = current_native_thread_id();
@@ -176,50 +428,761 @@ static inline void initialize_thread_local_state(thread_local_state *state) {
 }
 
 static VALUE tracing_init_local_storage(UNUSED_ARG VALUE _self, VALUE threads) {
-  #ifdef RUBY_3_3_PLUS
-    for (long i = 0, len = RARRAY_LEN(threads); i < len; i++) {
-        VALUE thread = RARRAY_AREF(threads, i);
-        GT_LOCAL_STATE(thread, true);
-    }
-  #endif
+  for (long i = 0, len = RARRAY_LEN(threads); i < len; i++) {
+    VALUE thread = RARRAY_AREF(threads, i);
+    #ifdef RUBY_3_3_PLUS
+      GT_LOCAL_STATE(thread, true);
+    #endif
+    // The filters were just set, so this is when the threads that already exist find out if they're being traced
+    if (tracing_enabled && thread_filter_enabled()) decide_thread_filter(thread);
+  }
   return Qtrue;
 }
 
-static VALUE tracing_start(UNUSED_ARG VALUE _self, VALUE output_path, VALUE os_threads_view_enabled_arg) {
+// `options` has every keyword argument of `GvlTracing.start` (see gvl-tracing.rb), other than `socket`, which is just
+// true or false: when true, `output_path` is the path of the socket to stream to
+static VALUE tracing_start(UNUSED_ARG VALUE _self, VALUE output_path, VALUE options) {
   Check_Type(output_path, T_STRING);
+  Check_Type(options, T_HASH);
+  VALUE socket = start_option(options, "socket");
+  VALUE os_threads_view_enabled_arg = start_option(options, "os_threads_view_enabled");
+  VALUE buffer_size = start_option(options, "buffer_size");
+  VALUE format = start_option(options, "format");
+  VALUE compression = start_option(options, "compression");
+  VALUE gvl_holder_threshold_us = start_option(options, "gvl_holder_threshold_us");
+  VALUE min_slice_us = start_option(options, "min_slice_us");
+  VALUE cpu_time = start_option(options, "cpu_time");
+  VALUE fibers = start_option(options, "fibers");
+  VALUE mmap = start_option(options, "mmap");
+  VALUE include_threads = start_option(options, "include_threads");
+  VALUE exclude_threads = start_option(options, "exclude_threads");
   if (os_threads_view_enabled_arg != Qtrue && os_threads_view_enabled_arg != Qfalse) rb_raise(rb_eArgError, "os_threads_view_enabled must be true/false");
+  if (cpu_time != Qtrue && cpu_time != Qfalse) rb_raise(rb_eArgError, "cpu_time must be true/false");
+  if (fibers != Qtrue && fibers != Qfalse) rb_raise(rb_eArgError, "fibers must be true/false");
+  if (mmap != Qtrue && mmap != Qfalse) rb_raise(rb_eArgError, "mmap must be true/false");
+  uint32_t requested_buffer_capacity = parse_buffer_size(buffer_size);
+  output_format output_format = parse_format(format);
+  output_compression output_compression = parse_compression(compression);
+  if (gvl_holder_threshold_us != Qnil && (!RB_INTEGER_TYPE_P(gvl_holder_threshold_us) || NUM2LL(gvl_holder_threshold_us) <= 0)) {
+    rb_raise(rb_eArgError, "gvl_holder_threshold_us must be nil or a positive integer");
+  }
+  if (min_slice_us != Qnil && (!RB_INTEGER_TYPE_P(min_slice_us) || NUM2LL(min_slice_us) <= 0)) {
+    rb_raise(rb_eArgError, "min_slice_us must be nil or a positive integer");
+  }
+  // The OS threads view slices are derived from the same events, and would not match up if some of them got folded
+  if (min_slice_us != Qnil && os_threads_view_enabled_arg == Qtrue) {
+    rb_raise(rb_eArgError, "min_slice_us can't be used together with os_threads_view_enabled");
+  }
+  // Batches can get dropped when streaming, which would leave a compressed stream unreadable
+  if (socket == Qtrue && output_compression != OUTPUT_COMPRESSION_NONE) {
+    rb_raise(rb_eArgError, "compression can't be used when streaming to a socket");
+  }
+  // The point of memory-mapped output is that the file is usable as-is if the process dies, which compressed streams are
+  // not until they're finished
+  if (mmap == Qtrue && (socket == Qtrue || output_compression != OUTPUT_COMPRESSION_NONE)) {
+    rb_raise(rb_eArgError, "mmap can't be used together with socket or compression");
+  }
+  thread_filter_check(include_threads, "include_threads");
+  thread_filter_check(exclude_threads, "exclude_threads");
 
-  trim_all_seen_threads(Qnil);
-
-  if (output_file != NULL) rb_raise(rb_eRuntimeError, "Already started");
-  output_file = fopen(StringValuePtr(output_path), "w");
-  if (output_file == NULL) rb_syserr_fail(errno, "Failed to open GvlTracing output file");
+  if (output_is_open() || tracing_enabled) rb_raise(rb_eRuntimeError, "Already started");
+  if (!stats_enabled) context_stats_reset();
+  if (min_slice_us != Qnil && !coalescer_start(NUM2LL(min_slice_us) * 1000, render_event, render_coalesced_slice)) {
+    rb_raise(rb_eNoMemError, "Failed to allocate GvlTracing coalescer");
+  }
+  coalescer_enabled = (min_slice_us != Qnil);
+  coalescer_min_slice_ns = coalescer_enabled ? NUM2LL(min_slice_us) * 1000 : 0;
+  int open_error =
+    socket == Qtrue ? output_open_socket(StringValueCStr(output_path)) :
+    mmap == Qtrue ? output_open_mmap(StringValueCStr(output_path)) :
+    output_open(StringValueCStr(output_path), output_compression);
+  if (open_error) {
+    stop_coalescer();
+    rb_syserr_fail(open_error, socket == Qtrue ? "Failed to connect to GvlTracing collector socket" : "Failed to open GvlTracing output file");
+  }
+  free(trace_path);
+  trace_path = strdup(StringValueCStr(output_path));
+  streaming_to_socket = (socket == Qtrue);
+  writing_to_mmap = (mmap == Qtrue);
 
   thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
-  started_tracing_at_microseconds = timestamp_microseconds();
+  started_tracing_at_ns = timestamp_ns();
   process_id = getpid();
   os_threads_view_enabled = (os_threads_view_enabled_arg == Qtrue);
+  trace_cpu_time = (cpu_time == Qtrue);
+  buffer_capacity = event_buffer_capacity_for(requested_buffer_capacity);
+  current_output_format = output_format;
+  current_output_compression = output_compression;
+  event_buffer_reset_dropped_events();
+  tracing_session++;
+  gvl_holder_start(gvl_holder_threshold_us == Qnil ? 0 : NUM2LL(gvl_holder_threshold_us) * 1000);
+  handoff_matrix_reset();
+  gc_phases_reset();
+  fibers_reset();
+  wait_reasons_refresh();
+  gc_phases_buffer = event_buffer_new(buffer_capacity);
+  reset_gvl_handoffs();
+  __atomic_store_n(&last_flow_id, 0, __ATOMIC_RELAXED);
+  reset_gvl_counters(state);
+  thread_filter_set(include_threads, exclude_threads);
+
+  initialize_trace_metadata();
+  write_trace_header();
+
+  record_event(state, EVENT_STARTED_TRACING, os_threads_view_enabled ? EVENT_FLAG_OS_THREAD_BEGIN : 0, started_tracing_at_ns);
+  // The current thread is holding the GVL, but we haven't seen it acquire it
+  state->resumed_at_ns = started_tracing_at_ns;
+  if (trace_cpu_time) sample_cpu_time_on_resume(state, started_tracing_at_ns);
+
+  int error = start_writer_thread(coalescer_enabled ? coalescer_push : render_event);
+  if (error) {
+    if (current_output_format == OUTPUT_FORMAT_PERFETTO) perfetto_output_finish();
+    output_close();
+    stop_coalescer();
+    release_gc_phases_buffer();
+    rb_syserr_fail(error, "Failed to start GvlTracing writer thread");
+  }
+
+  // Threads that exited before now won't show up in this trace, so there's no need to keep them around
+  keep_exited_threads_since_ns = started_tracing_at_ns;
+  thread_registry_trim(keep_exited_threads_since_ns);
+  thread_registry_reset_tracks();
+  forget_dead_threads();
+  register_thread(state, current_native_thread_id(), started_tracing_at_ns);
+  started_tracing_thread_id = thread_id_for(state);
+
+  tracing_enabled = true;
+  install_hooks();
+  if (fibers == Qtrue) {
+    fiber_tracepoint = rb_tracepoint_new(0, RUBY_EVENT_FIBER_SWITCH, on_fiber_switch, NULL);
+    rb_tracepoint_enable(fiber_tracepoint);
+  }
+
+  return Qtrue;
+}
+
+// Raises KeyError if `options` is missing it, which would be a bug in gvl-tracing.rb
+static VALUE start_option(VALUE options, const char *name) {
+  return rb_hash_fetch(options, ID2SYM(rb_intern(name)));
+}
+
+static uint32_t parse_buffer_size(VALUE buffer_size) {
+  if (!RB_INTEGER_TYPE_P(buffer_size) || NUM2LONG(buffer_size) <= 0 || NUM2LONG(buffer_size) > MAX_BUFFER_SIZE) {
+    rb_raise(rb_eArgError, "buffer_size must be a positive integer (up to %d)", MAX_BUFFER_SIZE);
+  }
+  return NUM2UINT(buffer_size);
+}
 
+static output_format parse_format(VALUE format) {
+  if (format == ID2SYM(rb_intern("json"))) return OUTPUT_FORMAT_JSON;
+  if (format == ID2SYM(rb_intern("perfetto"))) return OUTPUT_FORMAT_PERFETTO;
+  rb_raise(rb_eArgError, "format must be :json or :perfetto");
+}
+
+static output_compression parse_compression(VALUE compression) {
+  output_compression output_compression = OUTPUT_COMPRESSION_NONE;
+  if (compression == ID2SYM(rb_intern("gzip"))) {
+    output_compression = OUTPUT_COMPRESSION_GZIP;
+  } else if (compression == ID2SYM(rb_intern("zstd"))) {
+    output_compression = OUTPUT_COMPRESSION_ZSTD;
+  } else if (compression != Qnil) {
+    rb_raise(rb_eArgError, "compression must be nil, :gzip or :zstd");
+  }
+  if (!output_compression_supported(output_compression)) {
+    rb_raise(rb_eArgError, "%"PRIsVALUE" compression is not available (gvl-tracing was built without it)", compression);
+  }
+  return output_compression;
+}
+
+// The metadata gets computed upfront, since flight recorder dumps can get written by the writer thread, which can't
+// call into Ruby
+static void initialize_trace_metadata(void) {
   VALUE ruby_version = rb_const_get(rb_cObject, rb_intern("RUBY_VERSION"));
   Check_Type(ruby_version, T_STRING);
 
-  VALUE metadata = rb_obj_dup(ruby_version);
   if (timeslice_meta_ms > 0) {
-    rb_str_append(metadata, rb_sprintf(", %ums", timeslice_meta_ms));
+    snprintf(trace_metadata, sizeof(trace_metadata), "%s, %ums", StringValueCStr(ruby_version), timeslice_meta_ms);
+  } else {
+    snprintf(trace_metadata, sizeof(trace_metadata), "%s", StringValueCStr(ruby_version));
+  }
+}
+
+static void write_trace_header(void) {
+  gc_track_named = false;
+  memset(ractor_groups_named, 0, sizeof(ractor_groups_named));
+
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    char process_name[sizeof(trace_metadata) + 32];
+    snprintf(process_name, sizeof(process_name), "Ruby threads view (%s)", trace_metadata);
+    perfetto_output_start(process_id, process_name, os_threads_view_enabled);
+    write_clock_calibration();
+  } else {
+    output_printf("[\n");
+    output_printf(
+      "  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_name\", \"args\": {\"name\": \"Ruby threads view (%s)\"}},\n",
+      process_id, trace_metadata
+    );
+
+    if (os_threads_view_enabled) {
+      output_printf("  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_name\", \"args\": {\"name\": \"OS threads view\"}},\n", OS_THREADS_VIEW_PID);
+    }
+    write_clock_calibration();
+  }
+}
+
+// When timestamps come from the CPU's counter, we record how it got converted, so a trace can be lined up with
+// anything else that was recorded using the counter (see timestamps.h)
+static void write_clock_calibration(void) {
+  if (timestamps_current_source() != TIMESTAMPS_TSC) return;
+  timestamps_calibration calibration = timestamps_current_calibration();
+
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_clock_calibration(&calibration);
+  } else {
+    output_printf(
+      "  {\"ph\": \"i\", \"s\": \"p\", \"pid\": %"PRId64", \"ts\": 0, \"name\": \"clock\", \"args\": {"
+      "\"source\": \"tsc\", \"ticks_per_second\": %"PRIu64", \"calibrated_at_ticks\": %"PRIu64", \"calibrated_at_ns\": %"PRId64"}},\n",
+      process_id, calibration.ticks_per_second, calibration.calibrated_at_ticks, calibration.calibrated_at_ns
+    );
+  }
+}
+
+// Note: For the JSON format, `separator` gets written before the entry, since the last entry can't have a trailing comma
+static void write_thread_name(int32_t thread_id, uint32_t ractor, const char *thread_name, const char *separator) {
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_thread_name(thread_id, ractor, thread_name);
+  } else {
+    output_printf(
+      "%s  {\"ph\": \"M\", \"pid\": %"PRId64", \"tid\": %d, \"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+      separator, ractors_pid(process_id, ractors_group(ractor)), thread_id, thread_name
+    );
+  }
+}
+
+static void write_trace_footer(void) {
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_finish();
+  } else {
+    output_printf("\n]\n");
+  }
+}
+
+static VALUE tracing_stop(UNUSED_ARG VALUE _self) {
+  if (!tracing_enabled || flight_recorder_enabled) rb_raise(rb_eRuntimeError, "Tracing not running");
+
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  tracing_enabled = false;
+  if (!stats_enabled) remove_hooks();
+  bool fibers_traced = fiber_tracepoint != Qnil;
+  disable_fiber_tracepoint();
+  release_gc_phases_buffer();
+
+  __atomic_store_n(&stopped_tracing_at_ns, timestamp_ns(), __ATOMIC_RELAXED); // The writer thread reads it, see below
+  record_event(state, EVENT_STOPPED_TRACING, os_threads_view_enabled ? EVENT_FLAG_OS_THREAD_END : 0, stopped_tracing_at_ns);
+
+  // The writer thread does a last pass over the buffers before exiting, so after this everything has been written
+  stop_writer_thread();
+
+  // ...except for what the coalescer was holding back
+  if (coalescer_enabled) coalescer_flush(&started_tracing_at_ns);
+  stop_coalescer();
+
+  refresh_thread_names();
+  if (gvl_holder_enabled()) write_gvl_holder_stacks();
+  write_gc_totals();
+  if (fibers_traced) write_fiber_totals();
+  size_t names_written = write_thread_names(started_tracing_at_ns, "");
+  if (thread_filter_enabled()) write_thread_filter_label(names_written > 0 ? ",\n" : "");
+  write_trace_footer();
+
+  // The registry only needs to keep exited threads while they can still show up in a trace
+  keep_exited_threads_since_ns = INT64_MAX;
+  thread_registry_trim(keep_exited_threads_since_ns);
+
+  int close_error = output_close();
+  if (close_error) rb_syserr_fail(close_error, "Failed to close GvlTracing output file");
+
+  return Qtrue;
+}
+
+// Writes the names for the threads that were alive at or after `alive_since_ns`, and returns how many got written.
+// Since this can get called from the writer thread, the names come only from the registry (see `refresh_thread_names`).
+static size_t write_thread_names(int64_t alive_since_ns, const char *first_separator) {
+  size_t written = 0;
+  size_t count = 0;
+  thread_registry_name *names = thread_registry_names(alive_since_ns, &count);
+
+  const char *separator = first_separator;
+  for (size_t i = 0; i < count; i++) {
+    // Threads that were filtered out have no events, and would only show up as empty tracks
+    if (thread_filter_enabled() && !names[i].traced && names[i].thread_id != started_tracing_thread_id) continue;
+
+    write_thread_name(names[i].thread_id, names[i].ractor, names[i].name, separator);
+    separator = ",\n";
+    written++;
+    int64_t pid = ractors_pid(process_id, ractors_group(names[i].ractor));
+
+    // In the perfetto format, the spans track is already a child of the thread's track, so it needs no name
+    if (names[i].has_spans && current_output_format == OUTPUT_FORMAT_JSON) {
+      output_printf(
+        ",\n  {\"ph\": \"M\", \"pid\": %"PRId64", \"tid\": %"PRId64", \"name\": \"thread_name\", \"args\": {\"name\": \"%s spans\"}}",
+        pid, SPAN_TRACK_TID(names[i].thread_id), names[i].name
+      );
+    }
+    if (names[i].has_fibers && current_output_format == OUTPUT_FORMAT_JSON) {
+      output_printf(
+        ",\n  {\"ph\": \"M\", \"pid\": %"PRId64", \"tid\": %"PRId64", \"name\": \"thread_name\", \"args\": {\"name\": \"%s fibers\"}}",
+        pid, FIBER_TRACK_TID(names[i].thread_id), names[i].name
+      );
+    }
   }
 
-  fprintf(output_file, "[\n");
-  fprintf(output_file,
-    "  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_name\", \"args\": {\"name\": \"Ruby threads view (%s)\"}},\n",
-    process_id, StringValuePtr(metadata)
+  free(names);
+  return written;
+}
+
+// Makes it clear the trace is missing the threads that got filtered out (see thread_filter.h). In the JSON format
+// this also makes sure there's an entry after the last comma, when none of the threads that got traced had a name.
+static void write_thread_filter_label(const char *separator) {
+  if (current_output_format != OUTPUT_FORMAT_JSON) return;
+
+  output_printf(
+    "%s  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_labels\", \"args\": {\"labels\": \"thread filters\"}}",
+    separator, process_id
   );
+}
+
+static VALUE tracing_dropped_events(UNUSED_ARG VALUE _self) {
+  return ULL2NUM(event_buffer_dropped_events());
+}
+
+static VALUE tracing_dropped_batches(UNUSED_ARG VALUE _self) {
+  return ULL2NUM(output_dropped_batches());
+}
+
+static VALUE tracing_gvl_holder_stacks(UNUSED_ARG VALUE _self) {
+  return gvl_holder_summary();
+}
+
+static void collect_handoff(const handoff_matrix_entry *entry, void *handoffs) {
+  VALUE handoff = rb_hash_new();
+  rb_hash_aset(handoff, ID2SYM(rb_intern("releaser_thread_id")), INT2FIX(entry->releaser_thread_id));
+  rb_hash_aset(handoff, ID2SYM(rb_intern("acquirer_thread_id")), INT2FIX(entry->acquirer_thread_id));
+  rb_hash_aset(handoff, ID2SYM(rb_intern("count")), ULL2NUM(entry->count));
+  rb_hash_aset(handoff, ID2SYM(rb_intern("mean_wait_ns")), ULL2NUM(entry->count > 0 ? entry->total_wait_ns / entry->count : 0));
+  rb_ary_push((VALUE) handoffs, handoff);
+}
 
-  double now_microseconds = render_event(state, "started_tracing");
+// Returns an array of {releaser_thread_id:, acquirer_thread_id:, count:, mean_wait_ns:} hashes
+static VALUE tracing_handoff_matrix(UNUSED_ARG VALUE _self) {
+  VALUE handoffs = rb_ary_new();
+  handoff_matrix_each(collect_handoff, (void *) handoffs);
+  return handoffs;
+}
+
+// The summary gets written as instant events at the end of the trace, one per stack
+static void write_gvl_holder_stacks(void) {
+  VALUE summary = gvl_holder_summary();
+  int64_t relative_timestamp_ns = stopped_tracing_at_ns - started_tracing_at_ns;
+
+  for (long i = 0, len = RARRAY_LEN(summary); i < len; i++) {
+    VALUE stack = RARRAY_AREF(summary, i);
+    uint32_t stack_id = NUM2UINT(rb_hash_aref(stack, ID2SYM(rb_intern("stack_id"))));
+    uint64_t count = NUM2ULL(rb_hash_aref(stack, ID2SYM(rb_intern("count"))));
+    uint64_t total_wait_ns = NUM2ULL(rb_hash_aref(stack, ID2SYM(rb_intern("total_wait_ns"))));
+    VALUE joined_frames = rb_ary_join(rb_hash_aref(stack, ID2SYM(rb_intern("frames"))), rb_str_new_cstr("\n"));
+
+    if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+      perfetto_output_gvl_holder_stack(relative_timestamp_ns, stack_id, count, total_wait_ns, StringValueCStr(joined_frames));
+    } else {
+      // Stacks can be deep, so unlike for the events, the buffer gets sized to fit
+      size_t frames_length = RSTRING_LEN(joined_frames);
+      char *buffer = ALLOC_N(char, JSON_OUTPUT_MAX_GVL_HOLDER_STACK_SIZE(frames_length));
+      output_write(buffer, json_output_gvl_holder_stack(
+        buffer, stack_id, count, total_wait_ns, RSTRING_PTR(joined_frames), frames_length, process_id, relative_timestamp_ns
+      ));
+      ruby_xfree(buffer);
+    }
+    RB_GC_GUARD(joined_frames);
+  }
+
+  RB_GC_GUARD(summary);
+}
+
+static void write_gc_totals(void) {
+  gc_totals totals;
+  gc_phases_totals(&totals);
+  int64_t relative_timestamp_ns = stopped_tracing_at_ns - started_tracing_at_ns;
+
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_gc_totals(relative_timestamp_ns, &totals);
+  } else {
+    char buffer[JSON_OUTPUT_MAX_EVENT_SIZE];
+    output_write(buffer, json_output_gc_totals(buffer, &totals, process_id, relative_timestamp_ns));
+  }
+}
+
+static void write_fiber_totals(void) {
+  fiber_totals totals;
+  fibers_totals(&totals);
+  int64_t relative_timestamp_ns = stopped_tracing_at_ns - started_tracing_at_ns;
+
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_fiber_totals(relative_timestamp_ns, &totals);
+  } else {
+    char buffer[JSON_OUTPUT_MAX_EVENT_SIZE];
+    output_write(buffer, json_output_fiber_totals(buffer, &totals, process_id, relative_timestamp_ns));
+  }
+}
 
-  if (os_threads_view_enabled) {
-    fprintf(output_file, "  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_name\", \"args\": {\"name\": \"OS threads view\"}},\n", OS_THREADS_VIEW_PID);
-    render_os_thread_event(state, now_microseconds);
+// `options` has every keyword argument of `GvlTracing.start_flight_recorder` (see gvl-tracing.rb)
+static VALUE flight_recorder_start_ruby(UNUSED_ARG VALUE _self, VALUE options) {
+  Check_Type(options, T_HASH);
+  VALUE window = start_option(options, "window");
+  VALUE max_events = start_option(options, "max_events");
+  VALUE buffer_size = start_option(options, "buffer_size");
+  VALUE format = start_option(options, "format");
+  VALUE compression = start_option(options, "compression");
+  VALUE auto_dump_threshold_ms = start_option(options, "auto_dump_threshold_ms");
+  VALUE auto_dump_path_arg = start_option(options, "auto_dump_path");
+  if (!RB_FLOAT_TYPE_P(window) && !RB_INTEGER_TYPE_P(window)) rb_raise(rb_eArgError, "window must be a number of seconds");
+  double window_seconds = NUM2DBL(window);
+  if (!(window_seconds > 0)) rb_raise(rb_eArgError, "window must be a positive number of seconds");
+  if (!RB_INTEGER_TYPE_P(max_events) || NUM2LONG(max_events) <= 0 || NUM2LONG(max_events) > MAX_FLIGHT_RECORDER_EVENTS) {
+    rb_raise(rb_eArgError, "max_events must be a positive integer (up to %d)", MAX_FLIGHT_RECORDER_EVENTS);
   }
+  uint32_t requested_buffer_capacity = parse_buffer_size(buffer_size);
+  output_format output_format = parse_format(format);
+  output_compression output_compression = parse_compression(compression);
+  if (auto_dump_threshold_ms != Qnil && (!RB_INTEGER_TYPE_P(auto_dump_threshold_ms) || NUM2LL(auto_dump_threshold_ms) <= 0)) {
+    rb_raise(rb_eArgError, "auto_dump_threshold_ms must be nil or a positive integer");
+  }
+  Check_Type(auto_dump_path_arg, T_STRING);
+
+  if (output_is_open() || tracing_enabled) rb_raise(rb_eRuntimeError, "Already started");
+  if (!flight_recorder_start(NUM2UINT(max_events))) rb_raise(rb_eNoMemError, "Failed to allocate GvlTracing flight recorder");
+  flight_recorder_capacity = NUM2UINT(max_events);
+  if (!stats_enabled) context_stats_reset();
+
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  started_tracing_at_ns = timestamp_ns();
+  flight_recorder_started_at_ns = started_tracing_at_ns;
+  flight_recorder_window_ns = (int64_t) (window_seconds * 1000000000.0);
+  process_id = getpid();
+  os_threads_view_enabled = false;
+  trace_cpu_time = false;
+  buffer_capacity = event_buffer_capacity_for(requested_buffer_capacity);
+  current_output_format = output_format;
+  current_output_compression = output_compression;
+  event_buffer_reset_dropped_events();
+  tracing_session++;
+  gvl_holder_start(0);
+  handoff_matrix_reset();
+  gc_phases_reset();
+  wait_reasons_refresh();
+  gc_phases_buffer = event_buffer_new(buffer_capacity);
+  reset_gvl_handoffs();
+  __atomic_store_n(&last_flow_id, 0, __ATOMIC_RELAXED);
+  reset_gvl_counters(state);
+  thread_filter_set(Qnil, Qnil); // The flight recorder always records every thread
+  initialize_trace_metadata();
+
+  free(auto_dump_path);
+  auto_dump_path = strdup(StringValueCStr(auto_dump_path_arg));
+  auto_dumps = 0;
+  next_auto_dump_at_ns = 0;
+  auto_dump_threshold_ns = (auto_dump_threshold_ms == Qnil || auto_dump_path == NULL) ? 0 : NUM2LL(auto_dump_threshold_ms) * 1000 * 1000;
+
+  record_event(state, EVENT_STARTED_TRACING, 0, started_tracing_at_ns);
+  state->resumed_at_ns = started_tracing_at_ns;
+
+  int error = start_writer_thread(flight_recorder_append);
+  if (error) {
+    flight_recorder_stop();
+    auto_dump_threshold_ns = 0;
+    release_gc_phases_buffer();
+    rb_syserr_fail(error, "Failed to start GvlTracing writer thread");
+  }
+
+  // Same as tracing_start; the hooks then keep moving this forward, as the window moves
+  keep_exited_threads_since_ns = started_tracing_at_ns;
+  thread_registry_trim(keep_exited_threads_since_ns);
+  thread_registry_reset_tracks();
+  forget_dead_threads();
+  register_thread(state, current_native_thread_id(), started_tracing_at_ns);
+
+  tracing_enabled = true;
+  flight_recorder_enabled = true;
+  install_hooks();
+
+  return Qtrue;
+}
+
+// Returns the paths of the automatic dumps that were written
+static VALUE flight_recorder_stop_ruby(UNUSED_ARG VALUE _self) {
+  if (!flight_recorder_enabled) rb_raise(rb_eRuntimeError, "Flight recorder not running");
+
+  tracing_enabled = false;
+  flight_recorder_enabled = false;
+  if (!stats_enabled) remove_hooks();
+  release_gc_phases_buffer();
+
+  // Any automatic dump in progress happens on the writer thread, so it gets finished here...
+  stop_writer_thread();
+  auto_dump_threshold_ns = 0;
+
+  // ...and this waits for any dump requested from Ruby that's still being written
+  pthread_mutex_lock(&dump_mutex);
+  flight_recorder_stop();
+  pthread_mutex_unlock(&dump_mutex);
+
+  keep_exited_threads_since_ns = INT64_MAX;
+  thread_registry_trim(keep_exited_threads_since_ns);
+
+  VALUE paths = rb_ary_new_capa(auto_dumps);
+  for (uint32_t i = 1; i <= auto_dumps; i++) {
+    char path[PATH_MAX];
+    auto_dump_path_for(i, path, sizeof(path));
+    rb_ary_push(paths, rb_str_new_cstr(path));
+  }
+
+  free(auto_dump_path);
+  auto_dump_path = NULL;
+
+  return paths;
+}
+
+typedef struct {
+  const char *path;
+  const char *reason;
+  int64_t wait_ns;
+  int error;
+} dump_request;
+
+// Writes the last `window` seconds kept by the flight recorder as a regular trace. This can't touch any Ruby objects,
+// since it gets called from the writer thread, and without the GVL from Ruby.
+static void *write_dump(void *request_ptr) {
+  dump_request *request = (dump_request *) request_ptr;
+
+  pthread_mutex_lock(&dump_mutex);
+
+  int64_t now_ns = timestamp_ns();
+
+  int64_t base_timestamp_ns = now_ns - flight_recorder_window_ns;
+  if (base_timestamp_ns < flight_recorder_started_at_ns) base_timestamp_ns = flight_recorder_started_at_ns;
+
+  size_t count = 0;
+  gvl_event *events = flight_recorder_snapshot(base_timestamp_ns, &count);
+
+  request->error = output_open(request->path, current_output_compression);
+  if (request->error == 0) {
+    write_trace_header();
+    for (size_t i = 0; i < count; i++) render_event(&events[i], &base_timestamp_ns);
+
+    // Marks when the dump happened and why; this is also what allows the thread names below to start with a comma
+    int64_t relative_timestamp_ns = now_ns - base_timestamp_ns;
+    if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+      perfetto_output_flight_recorder_dump(relative_timestamp_ns, request->reason, request->wait_ns);
+    } else {
+      char buffer[JSON_OUTPUT_MAX_EVENT_SIZE];
+      output_write(buffer, json_output_flight_recorder_dump(buffer, request->reason, request->wait_ns, process_id, relative_timestamp_ns));
+    }
+
+    write_thread_names(base_timestamp_ns, ",\n");
+
+    write_trace_footer();
+    request->error = output_close();
+  }
+
+  pthread_mutex_unlock(&dump_mutex);
+
+  free(events);
+  return NULL;
+}
+
+// Called from the Process._fork hook (see lib/gvl-tracing.rb) right before forking. The writer thread gets stopped, so
+// that it's not in the middle of writing (or holding a lock) when the process gets copied, and the output gets flushed,
+// so the child doesn't write it out again. Returns true if tracing_after_fork needs to be called after forking.
+static VALUE tracing_before_fork(UNUSED_ARG VALUE _self) {
+  if (!tracing_enabled || paused_for_fork) return Qfalse;
+
+  stop_writer_thread();
+  if (!flight_recorder_enabled) output_flush();
+  // This waits for any dump requested from Ruby that's still being written (and the writer thread is stopped, so it
+  // can't be holding it), so that the child gets an unlocked copy of the mutex (see tracing_after_fork)
+  pthread_mutex_lock(&dump_mutex);
+  paused_for_fork = true;
+
+  return Qtrue;
+}
+
+// Called in both the parent and the child (or only in the parent, if forking failed). Returns, for the child, how it's
+// still recording (:tracing or :flight_recorder), or nil if it's not.
+static VALUE tracing_after_fork(UNUSED_ARG VALUE _self, VALUE in_child) {
+  if (!paused_for_fork) return Qnil;
+  paused_for_fork = false;
+  // The child's copy of the mutex is owned by this same thread, so unlocking it is fine on both sides
+  pthread_mutex_unlock(&dump_mutex);
+
+  if (in_child == Qtrue && !continue_tracing_in_child()) return Qnil;
+
+  int error = start_writer_thread(writer_consumer);
+  if (error) rb_syserr_fail(error, "Failed to restart GvlTracing writer thread after fork");
+
+  if (in_child != Qtrue) return Qnil;
+  return ID2SYM(rb_intern(flight_recorder_enabled ? "flight_recorder" : "tracing"));
+}
+
+// The child only has the thread that called fork, so it starts over as if tracing had just been started there, except
+// that timestamps stay relative to when tracing started in the parent, so the traces from every process line up.
+// Returns false if the child can't keep tracing.
+static bool continue_tracing_in_child(void) {
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  int64_t now_ns = timestamp_ns();
+  char child_path[PATH_MAX];
+
+  process_id = getpid();
+
+  // Whatever the other threads of the parent recorded since the writer's last pass belongs to the parent's trace
+  event_buffer_drain_all(discard_event, NULL);
+  int32_t thread_id = thread_id_for(state);
+  thread_registry_retain(&thread_id, 1, now_ns);
+  thread_registry_reset_tracks();
+  handoff_matrix_reset();
+  gc_phases_reset();
+  fibers_reset();
+  state->fiber_session = 0;
+  reset_gvl_handoffs();
+  reset_gvl_counters(state);
+
+  if (flight_recorder_enabled) {
+    flight_recorder_stop();
+    if (!flight_recorder_start(flight_recorder_capacity)) {
+      rb_warn("GvlTracing: Failed to allocate flight recorder in forked process %"PRId64", stopping", process_id);
+      tracing_enabled = false;
+      flight_recorder_enabled = false;
+      if (!stats_enabled) remove_hooks();
+      release_gc_phases_buffer();
+      return false;
+    }
+    flight_recorder_started_at_ns = now_ns;
+    auto_dumps = 0;
+    next_auto_dump_at_ns = 0;
+    if (auto_dump_path != NULL) {
+      path_for_child(auto_dump_path, child_path, sizeof(child_path));
+      free(auto_dump_path);
+      auto_dump_path = strdup(child_path);
+    }
+  } else {
+    output_abandon();
+    // Each connection to the collector gets its own trace, so there's no need for a different path
+    if (streaming_to_socket) snprintf(child_path, sizeof(child_path), "%s", trace_path);
+    else path_for_child(trace_path, child_path, sizeof(child_path));
+
+    int error =
+      streaming_to_socket ? output_open_socket(child_path) :
+      writing_to_mmap ? output_open_mmap(child_path) :
+      output_open(child_path, current_output_compression);
+    if (error) {
+      rb_warn("GvlTracing: Failed to open %s in forked process %"PRId64" (%s), stopping", child_path, process_id, strerror(error));
+      tracing_enabled = false;
+      if (!stats_enabled) remove_hooks();
+      disable_fiber_tracepoint();
+      stop_coalescer();
+      release_gc_phases_buffer();
+      return false;
+    }
+    free(trace_path);
+    trace_path = strdup(child_path);
+
+    // Slices the coalescer was holding back are for the parent's threads
+    if (coalescer_enabled) {
+      coalescer_stop();
+      coalescer_enabled = coalescer_start(coalescer_min_slice_ns, render_event, render_coalesced_slice);
+      if (!coalescer_enabled) writer_consumer = render_event;
+    }
+    if (current_output_format == OUTPUT_FORMAT_PERFETTO) perfetto_output_finish(); // Forget the parent's tracks
+    write_trace_header();
+  }
+
+  started_tracing_thread_id = thread_id;
+  record_event(state, EVENT_STARTED_TRACING, os_threads_view_enabled ? EVENT_FLAG_OS_THREAD_BEGIN : 0, now_ns);
+  state->resumed_at_ns = now_ns;
+  return true;
+}
+
+// E.g. "gvl.json" becomes "gvl-1234.json" in process 1234
+static void path_for_child(const char *path, char *child_path, size_t child_path_size) {
+  const char *basename = strrchr(path, '/');
+  basename = basename ? basename + 1 : path;
+  // Skips the first character, so hidden files (".gvl") are not all extension
+  const char *extension = *basename ? strchr(basename + 1, '.') : NULL;
+  if (extension == NULL) extension = path + strlen(path);
+
+  snprintf(child_path, child_path_size, "%.*s-%"PRId64"%s", (int) (extension - path), path, process_id, extension);
+}
+
+static void discard_event(UNUSED_ARG const gvl_event *event, UNUSED_ARG void *context) {}
+
+static void auto_dump_path_for(uint32_t dump_number, char *path, size_t path_size) {
+  snprintf(
+    path, path_size, "%s-%u%s%s",
+    auto_dump_path, dump_number,
+    current_output_format == OUTPUT_FORMAT_PERFETTO ? ".pftrace" : ".json",
+    current_output_compression == OUTPUT_COMPRESSION_GZIP ? ".gz" : current_output_compression == OUTPUT_COMPRESSION_ZSTD ? ".zst" : ""
+  );
+}
+
+// Called from the writer thread. After each automatic dump, we wait for a full window to go by before doing another
+// one, so that a burst of long waits does not result in a burst of dumps with mostly the same events. The requests are
+// kept (and not dropped) in the meanwhile, so every long wait still ends up in some dump.
+static void maybe_auto_dump(void) {
+  int64_t now_ns = timestamp_ns();
+  if (now_ns < next_auto_dump_at_ns) return;
+
+  int64_t wait_ns = flight_recorder_take_dump_request();
+  if (wait_ns == 0) return;
+
+  char path[PATH_MAX];
+  auto_dump_path_for(auto_dumps + 1, path, sizeof(path));
+
+  // Thread names come from the registry, so they're as of the last time each thread released the GVL (or exited)
+  dump_request request = { .path = path, .reason = "wants_gvl", .wait_ns = wait_ns };
+  write_dump(&request);
+
+  if (request.error == 0) auto_dumps++;
+  next_auto_dump_at_ns = now_ns + flight_recorder_window_ns;
+}
+
+static VALUE flight_recorder_dump_ruby(UNUSED_ARG VALUE _self, VALUE path) {
+  Check_Type(path, T_STRING);
+  if (!flight_recorder_enabled) rb_raise(rb_eRuntimeError, "Flight recorder not running");
+
+  refresh_thread_names();
+
+  // The path gets copied, since other threads can run (and the GC can move things around) while the dump gets written
+  // (StringValueCStr goes first, as it raises if the path has a NUL in it, and that would leak the copy)
+  const char *path_chars = StringValueCStr(path);
+  long path_length = RSTRING_LEN(path);
+  char *path_copy = ALLOC_N(char, path_length + 1);
+  memcpy(path_copy, path_chars, path_length + 1);
+  dump_request request = { .path = path_copy, .reason = "manual" };
+
+  // Rendering a large window can take a while, and there's no need to stop other threads from running meanwhile
+  rb_thread_call_without_gvl(write_dump, &request, NULL, NULL);
+
+  ruby_xfree(path_copy);
+  RB_GC_GUARD(path);
+
+  if (request.error) rb_syserr_fail(request.error, "Failed to write GvlTracing flight recorder dump");
+
+  return Qtrue;
+}
+
+// The hooks are shared between tracing and stats, so they get installed when either gets started, and only get removed
+// once both are stopped.
+static void install_hooks(void) {
+  if (current_hook != NULL) return;
 
   current_hook = rb_internal_thread_add_event_hook(
     on_thread_event,
@@ -233,70 +1196,576 @@ static VALUE tracing_start(UNUSED_ARG VALUE _self, VALUE output_path, VALUE os_t
     NULL
   );
 
-  gc_tracepoint = rb_tracepoint_new(0, (RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT), on_gc_event, NULL);
+  gc_tracepoint = rb_tracepoint_new(
+    0,
+    (
+      RUBY_INTERNAL_EVENT_GC_ENTER |
+      RUBY_INTERNAL_EVENT_GC_EXIT |
+      RUBY_INTERNAL_EVENT_GC_START |
+      RUBY_INTERNAL_EVENT_GC_END_MARK |
+      RUBY_INTERNAL_EVENT_GC_END_SWEEP
+    ),
+    on_gc_event,
+    NULL
+  );
 
   rb_tracepoint_enable(gc_tracepoint);
+}
+
+static void remove_hooks(void) {
+  if (current_hook == NULL) return;
+
+  rb_internal_thread_remove_event_hook(current_hook);
+  current_hook = NULL;
+  rb_tracepoint_disable(gc_tracepoint);
+  gc_tracepoint = Qnil;
+}
+
+static void disable_fiber_tracepoint(void) {
+  if (fiber_tracepoint == Qnil) return;
+
+  rb_tracepoint_disable(fiber_tracepoint);
+  fiber_tracepoint = Qnil;
+}
+
+static VALUE stats_start(UNUSED_ARG VALUE _self, VALUE cpu_time) {
+  if (cpu_time != Qtrue && cpu_time != Qfalse) rb_raise(rb_eArgError, "cpu_time must be true/false");
+  if (stats_enabled) rb_raise(rb_eRuntimeError, "Stats already running");
+
+  stats_reset();
+  if (!tracing_enabled) context_stats_reset();
+  wait_reasons_refresh();
+  stats_cpu_time = (cpu_time == Qtrue);
+  stats_enabled = true;
+  install_hooks();
 
-  RB_GC_GUARD(metadata);
+  // The current thread is obviously running, but it wouldn't otherwise get any stats until its next state change
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  int64_t now_ns = timestamp_ns();
+  record_stats(state, EVENT_RUNNING, now_ns);
+  if (stats_cpu_time) sample_cpu_time_on_resume(state, now_ns);
 
   return Qtrue;
 }
 
-static VALUE tracing_stop(UNUSED_ARG VALUE _self) {
-  if (output_file == NULL) rb_raise(rb_eRuntimeError, "Tracing not running");
+static VALUE stats_stop(UNUSED_ARG VALUE _self) {
+  if (!stats_enabled) rb_raise(rb_eRuntimeError, "Stats not running");
+
+  stats_stopped_at_ns = timestamp_ns();
+  stats_enabled = false;
+  if (!tracing_enabled) remove_hooks();
+
+  return Qtrue;
+}
+
+static VALUE stats_to_hash(const thread_stats *stats) {
+  VALUE result = rb_hash_new();
+
+  rb_hash_aset(result, ID2SYM(rb_intern("running_ns")), ULL2NUM(stats->time_ns[EVENT_RUNNING]));
+  rb_hash_aset(result, ID2SYM(rb_intern("wants_gvl_ns")), ULL2NUM(stats->time_ns[EVENT_WANTS_GVL]));
+  // waiting_ns covers every kind of waiting, as it did before we could tell them apart
+  uint64_t waiting_ns = 0;
+  for (int type = 0; type < EVENT_TYPE_COUNT; type++) {
+    if (event_type_is_waiting(type)) waiting_ns += stats->time_ns[type];
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("waiting_ns")), ULL2NUM(waiting_ns));
+  rb_hash_aset(result, ID2SYM(rb_intern("sleeping_ns")), ULL2NUM(stats->time_ns[EVENT_SLEEPING]));
+  rb_hash_aset(result, ID2SYM(rb_intern("gc_ns")), ULL2NUM(stats->time_ns[EVENT_GC]));
+  rb_hash_aset(result, ID2SYM(rb_intern("wants_gvl_count")), ULL2NUM(stats->wants_gvl_count));
+  if (stats_cpu_time) {
+    // Time the thread held the GVL but was not actually running, e.g. because it got descheduled by the OS (or throttled
+    // due to its container's CPU limits)
+    rb_hash_aset(result, ID2SYM(rb_intern("gvl_held_on_cpu_ns")), ULL2NUM(stats->gvl_held_on_cpu_ns));
+    rb_hash_aset(result, ID2SYM(rb_intern("gvl_held_off_cpu_ns")), ULL2NUM(stats->gvl_held_ns - stats->gvl_held_on_cpu_ns));
+  }
+
+  VALUE histogram = rb_ary_new_capa(STATS_HISTOGRAM_BUCKETS);
+  for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) rb_ary_push(histogram, ULL2NUM(stats->wants_gvl_histogram[i]));
+  rb_hash_aset(result, ID2SYM(rb_intern("wants_gvl_histogram")), histogram);
+
+  // ...and then the breakdown, e.g. "waiting:io_read" gets reported as waiting_io_read_ns
+  for (int type = 0; type < EVENT_TYPE_COUNT; type++) {
+    if (type == EVENT_WAITING || !event_type_is_waiting(type)) continue;
+    char key[32];
+    snprintf(key, sizeof(key), "%s_ns", event_type_name(type));
+    key[strlen("waiting")] = '_';
+    rb_hash_aset(result, ID2SYM(rb_intern(key)), ULL2NUM(stats->time_ns[type]));
+  }
+
+  return result;
+}
+
+static void collect_thread_stats(const thread_stats *stats, void *threads) {
+  VALUE thread_stats = stats_to_hash(stats);
+  rb_hash_aset(thread_stats, ID2SYM(rb_intern("thread_id")), INT2FIX(stats->thread_id));
+  rb_hash_aset(thread_stats, ID2SYM(rb_intern("ractor_id")), UINT2NUM(ractors_group(stats->ractor)));
+  rb_ary_push((VALUE) threads, thread_stats);
+}
+
+// Returns [per-thread stats, combined stats for threads that have since died]
+static VALUE stats_get(UNUSED_ARG VALUE _self) {
+  VALUE threads = rb_ary_new();
+  thread_stats dead_threads;
+
+  stats_snapshot(stats_enabled ? timestamp_ns() : stats_stopped_at_ns, collect_thread_stats, (void *) threads, &dead_threads);
+
+  return rb_ary_new_from_args(2, threads, stats_to_hash(&dead_threads));
+}
+
+uint32_t gvl_tracing_span_name(const char *name) {
+  return span_names_intern(name, strlen(name));
+}
+
+bool gvl_tracing_begin_span(uint32_t span_name_id) {
+  if (!tracing_enabled) return false;
 
   thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
-  rb_internal_thread_remove_event_hook(current_hook);
-  rb_tracepoint_disable(gc_tracepoint);
-  gc_tracepoint = Qnil;
+  if (!thread_traced(state)) return false;
 
-  double now_microseconds = render_event(state, "stopped_tracing");
-  if (os_threads_view_enabled) finish_previous_os_thread_event(now_microseconds);
+  int64_t now_ns = timestamp_ns();
 
-  // closing the json syntax in the output file is handled in GvlTracing.stop code
+  // Spans that were open when a previous run of GvlTracing stopped don't count anymore
+  if (state->span_session != tracing_session) {
+    state->span_session = tracing_session;
+    state->span_depth = 0;
+    if (state->registry_handle == THREAD_REGISTRY_NO_HANDLE) register_thread(state, current_native_thread_id(), now_ns);
+    thread_registry_set_has_spans(state->registry_handle);
+  }
+  state->span_depth++;
 
-  if (fclose(output_file) != 0) rb_syserr_fail(errno, "Failed to close GvlTracing output file");
+  gvl_event event = new_event(state, EVENT_SPAN_BEGIN, 0, now_ns);
+  event.data.span.name_id = span_name_id;
+  push_event(state, &event);
+  return true;
+}
 
-  output_file = NULL;
+void gvl_tracing_end_span(void) {
+  if (!tracing_enabled) return;
 
-  #ifdef RUBY_3_3_PLUS
-    return all_seen_threads;
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  // Ending a span that started before tracing did would otherwise end whatever other span is open
+  if (state->span_session != tracing_session || state->span_depth == 0) return;
+
+  state->span_depth--;
+  record_event(state, EVENT_SPAN_END, 0, timestamp_ns());
+}
+
+// Returns false (without interning the name) if tracing is not running, in which case there's no need to end the span
+static VALUE span_begin_ruby(UNUSED_ARG VALUE _self, VALUE name) {
+  if (!tracing_enabled) return Qfalse;
+
+  if (RB_SYMBOL_P(name)) name = rb_sym2str(name);
+  StringValue(name);
+  return gvl_tracing_begin_span(span_names_intern(RSTRING_PTR(name), RSTRING_LEN(name))) ? Qtrue : Qfalse;
+}
+
+static VALUE span_end_ruby(UNUSED_ARG VALUE _self) {
+  gvl_tracing_end_span();
+  return Qnil;
+}
+
+// Labels what the current thread is doing from now on (e.g. which endpoint it's serving), or clears the label if nil.
+// This gets called a lot (e.g. twice per request), so it only interns the label and does not allocate.
+static VALUE set_context_ruby(UNUSED_ARG VALUE _self, VALUE label) {
+  uint32_t context_id = 0;
+  if (label != Qnil) {
+    if (RB_SYMBOL_P(label)) label = rb_sym2str(label);
+    StringValue(label);
+    context_id = span_names_intern(RSTRING_PTR(label), RSTRING_LEN(label));
+  }
+
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  // The time the thread has been running so far belongs to the previous label
+  if (tracing_enabled || stats_enabled) account_context(state, EVENT_RUNNING, timestamp_ns());
+  state->context_id = context_id;
+  context_stats_label_set(context_id);
+
+  return Qnil;
+}
+
+static void collect_context_stats(uint32_t label_id, const context_stats *stats, void *result) {
+  VALUE label_stats = rb_hash_new();
+  rb_hash_aset(label_stats, ID2SYM(rb_intern("count")), ULL2NUM(stats->count));
+  rb_hash_aset(label_stats, ID2SYM(rb_intern("wants_gvl_ns")), ULL2NUM(stats->wants_gvl_ns));
+  rb_hash_aset(label_stats, ID2SYM(rb_intern("wants_gvl_count")), ULL2NUM(stats->wants_gvl_count));
+  rb_hash_aset(label_stats, ID2SYM(rb_intern("running_ns")), ULL2NUM(stats->running_ns));
+  rb_hash_aset((VALUE) result, rb_str_new_cstr(span_names_get(label_id)), label_stats);
+}
+
+// Returns a hash of label => {count:, wants_gvl_ns:, wants_gvl_count:, running_ns:}
+static VALUE context_stats_ruby(UNUSED_ARG VALUE _self) {
+  VALUE result = rb_hash_new();
+  context_stats_each(collect_context_stats, (void *) result);
+  return result;
+}
+
+static VALUE analyze_ruby(UNUSED_ARG VALUE _self, VALUE path, VALUE jobs, VALUE window_ms, VALUE top) {
+  return analyzer_analyze(path, jobs, window_ms, top);
+}
+
+static VALUE trace_thread_ruby(UNUSED_ARG VALUE _self, VALUE thread) {
+  thread_filter_trace_thread(thread);
+  return refresh_thread_filter_ruby(Qnil, thread);
+}
+
+// Called from the hooks in gvl-tracing.rb whenever a thread gets created, renamed or added to a ThreadGroup. The filters
+// can only be used from the main Ractor, so the threads of other Ractors keep the default.
+static VALUE refresh_thread_filter_ruby(UNUSED_ARG VALUE _self, VALUE thread) {
+  if (!tracing_enabled || !thread_filter_enabled() || ractors_current() != RACTORS_MAIN) return thread;
+
+  if (is_thread_alive(thread)) decide_thread_filter(thread);
+  return thread;
+}
+
+// Which clock the timestamps are coming from (see timestamps.h)
+static VALUE clock_ruby(UNUSED_ARG VALUE _self) {
+  return ID2SYM(rb_intern(timestamps_source_name(timestamps_current_source())));
+}
+
+// Adds the time since the thread's last state change to the totals for its label. Called from the GVL hooks, so
+// this must not touch any Ruby objects.
+static inline void account_context(thread_local_state *state, event_type new_state, int64_t now_ns) {
+  uint32_t generation = context_stats_generation();
+  if (state->context_id != 0 && state->context_generation == generation && state->context_state_since_ns != 0) {
+    context_stats_add(state->context_id, state->context_state, now_ns - state->context_state_since_ns);
+  }
+  state->context_state = new_state;
+  state->context_generation = generation;
+  state->context_state_since_ns = now_ns;
+}
+
+static inline int64_t timestamp_ns(void) {
+  return timestamps_now_ns();
+}
+
+// CPU time used so far by the current thread, or 0 if it could not be read. Unlike CLOCK_MONOTONIC, reading this clock
+// usually means an actual syscall, which is why sampling it is optional.
+static inline int64_t thread_cpu_time_ns(void) {
+  struct timespec cpu_time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time) != 0) return 0;
+  return cpu_time.tv_nsec + (cpu_time.tv_sec * INT64_C(1000000000));
+}
+
+static inline int32_t current_cpu(void) {
+  #ifdef HAVE_SCHED_GETCPU
+    return sched_getcpu();
   #else
-    return rb_funcall(rb_cThread, rb_intern("list"), 0);
+    return -1;
   #endif
 }
 
-static double timestamp_microseconds(void) {
-  struct timespec current_monotonic;
-  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) rb_syserr_fail(errno, "Failed to read CLOCK_MONOTONIC");
-  return (current_monotonic.tv_nsec / 1000.0) + (current_monotonic.tv_sec * 1000.0 * 1000.0);
+static inline bool cpu_time_enabled(void) {
+  return (tracing_enabled && trace_cpu_time) || (stats_enabled && stats_cpu_time);
+}
+
+static inline void sample_cpu_time_on_resume(thread_local_state *state, int64_t now_ns) {
+  state->cpu_time_at_resume_ns = thread_cpu_time_ns();
+  state->cpu_sampled_at_ns = state->cpu_time_at_resume_ns ? now_ns : 0;
+}
+
+// This gets called from the GVL hooks, so it needs to be cheap: it just copies a small record into the thread's buffer,
+// and leaves all the formatting and I/O to the writer thread.
+static void record_event(thread_local_state *state, event_type type, uint8_t flags, int64_t now_ns) {
+  gvl_event event = new_event(state, type, flags, now_ns);
+  push_event(state, &event);
+}
+
+static inline gvl_event new_event(thread_local_state *state, event_type type, uint8_t flags, int64_t now_ns) {
+  return (gvl_event) {
+    .timestamp_ns = now_ns,
+    .thread_id = thread_id_for(state),
+    .native_thread_id = (flags & (EVENT_FLAG_OS_THREAD_BEGIN | EVENT_FLAG_OS_THREAD_END)) ? current_native_thread_id() : 0,
+    .type = type,
+    .flags = flags,
+    .context_id = (uint16_t) state->context_id,
+  };
+}
+
+// Links the thread that released the GVL with the next thread that acquires it. Note that because the hooks can run
+// without the GVL, there's a small window where a thread can release the GVL and the next thread acquires it before the
+// release gets published; in that case, we just miss that link.
+static void record_gvl_handoff(thread_local_state *state, rb_event_flag_t event_id, gvl_event *event) {
+  uint32_t ractor = ractors_group(state->ractor);
+  if (ractor > MAX_HANDOFF_RACTORS) return;
+  uint64_t *last_release = &last_gvl_release[ractor];
+
+  if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED || event_id == RUBY_INTERNAL_THREAD_EVENT_EXITED) {
+    uint32_t flow_id = __atomic_add_fetch(&last_flow_id, 1, __ATOMIC_RELAXED);
+    if (flow_id == 0) flow_id = __atomic_add_fetch(&last_flow_id, 1, __ATOMIC_RELAXED); // 0 is reserved
+
+    __atomic_store_n(last_release, (((uint64_t) flow_id) << 32) | (uint32_t) event->thread_id, __ATOMIC_RELEASE);
+    event->flags |= EVENT_FLAG_FLOW_BEGIN;
+    event->data.flow.id = flow_id;
+  } else if (event_id == RUBY_INTERNAL_THREAD_EVENT_RESUMED) {
+    uint64_t release = __atomic_exchange_n(last_release, 0, __ATOMIC_ACQ_REL);
+    int32_t releaser_thread_id = (int32_t) (uint32_t) release;
+
+    // Threads getting back the GVL they just released are not really handoffs
+    if (release == 0 || releaser_thread_id == event->thread_id) return;
+
+    event->flags |= EVENT_FLAG_FLOW_END;
+    event->data.flow.id = (uint32_t) (release >> 32);
+    handoff_matrix_record(releaser_thread_id, event->thread_id, state->ready_at_ns ? event->timestamp_ns - state->ready_at_ns : 0);
+  }
+}
+
+static void reset_gvl_handoffs(void) {
+  for (int i = 0; i <= MAX_HANDOFF_RACTORS; i++) __atomic_store_n(&last_gvl_release[i], 0, __ATOMIC_RELAXED);
+}
+
+// Threads that got filtered out don't get handoffs, but the GVL still goes through them, so whatever got released
+// before is not going to be handed off to the next thread that does get traced
+static void skip_gvl_handoff(thread_local_state *state) {
+  uint32_t ractor = ractors_group(state->ractor);
+  if (ractor <= MAX_HANDOFF_RACTORS) __atomic_store_n(&last_gvl_release[ractor], 0, __ATOMIC_RELAXED);
+}
+
+static void push_event(thread_local_state *state, gvl_event *event) {
+  if (state->buffer == NULL || state->buffer->capacity != buffer_capacity) {
+    // The buffer size can change between start/stop calls, in which case we just switch over to a new buffer
+    event_buffer_release(state->buffer);
+    state->buffer = event_buffer_new(buffer_capacity);
+    #ifdef RUBY_3_2
+      pthread_setspecific(thread_exit_key, state);
+    #endif
+    if (state->buffer == NULL) return;
+  }
+
+  event_buffer_push(state->buffer, event);
+}
+
+// Called when tracing starts: only the current thread is known to be doing anything (running)
+static void reset_gvl_counters(thread_local_state *state) {
+  state->gvl_counter = GVL_COUNTER_RUNNING;
+  state->gvl_counter_session = tracing_session;
+  __atomic_store_n(&gvl_counters, UINT64_C(1) << GVL_COUNTER_BITS, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_gvl_counters_sample, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_gvl_counters_sample_at_ns, 0, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t gvl_counter_unit(uint8_t counter) {
+  switch (counter) {
+    case GVL_COUNTER_WANTS_GVL: return UINT64_C(1) << (2 * GVL_COUNTER_BITS);
+    case GVL_COUNTER_RUNNING:   return UINT64_C(1) << GVL_COUNTER_BITS;
+    case GVL_COUNTER_WAITING:   return UINT64_C(1);
+  }
+  return 0;
+}
+
+// Moves the thread from the counter for its previous state to the one for its new state, and records a sample of the
+// counters, unless another thread did so very recently
+static void update_gvl_counters(thread_local_state *state, event_type type, int64_t now_ns) {
+  uint8_t counter = GVL_COUNTER_NONE;
+  switch (type) {
+    case EVENT_WANTS_GVL: counter = GVL_COUNTER_WANTS_GVL; break;
+    case EVENT_RUNNING:   counter = GVL_COUNTER_RUNNING;   break;
+    case EVENT_SLEEPING:  counter = GVL_COUNTER_WAITING;   break;
+    default: if (event_type_is_waiting(type)) counter = GVL_COUNTER_WAITING; break;
+  }
+
+  // Whatever the thread was counted as in a previous start/stop of GvlTracing does not count anymore
+  if (state->gvl_counter_session != tracing_session) {
+    state->gvl_counter_session = tracing_session;
+    state->gvl_counter = GVL_COUNTER_NONE;
+  }
+  if (counter == state->gvl_counter) return;
+
+  uint64_t counters =
+    __atomic_add_fetch(&gvl_counters, gvl_counter_unit(counter) - gvl_counter_unit(state->gvl_counter), __ATOMIC_RELAXED);
+  state->gvl_counter = counter;
+
+  int64_t last_sample_at_ns = __atomic_load_n(&last_gvl_counters_sample_at_ns, __ATOMIC_RELAXED);
+  if (now_ns - last_sample_at_ns < GVL_COUNTERS_MIN_INTERVAL_NS) return;
+  if (!__atomic_compare_exchange_n(
+    &last_gvl_counters_sample_at_ns, &last_sample_at_ns, now_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+  )) return;
+
+  __atomic_store_n(&last_gvl_counters_sample, counters, __ATOMIC_RELAXED);
+  gvl_event event = gvl_counters_event(thread_id_for(state), counters, now_ns);
+  push_event(state, &event);
+}
+
+static gvl_event gvl_counters_event(int32_t thread_id, uint64_t counters, int64_t now_ns) {
+  gvl_event event = { .timestamp_ns = now_ns, .thread_id = thread_id, .type = EVENT_GVL_COUNTERS };
+  event.data.gvl_counters.wants_gvl = (counters >> (2 * GVL_COUNTER_BITS)) & GVL_COUNTER_MASK;
+  event.data.gvl_counters.running = (counters >> GVL_COUNTER_BITS) & GVL_COUNTER_MASK;
+  event.data.gvl_counters.waiting = counters & GVL_COUNTER_MASK;
+  return event;
+}
+
+// Called from the writer thread after each pass, so that the counter tracks don't get stuck on a stale value when the
+// hooks skipped sampling the last change
+static void sample_gvl_counters_if_changed(void) {
+  uint64_t counters = __atomic_load_n(&gvl_counters, __ATOMIC_RELAXED);
+  if (counters == __atomic_load_n(&last_gvl_counters_sample, __ATOMIC_RELAXED)) return;
+
+  int64_t now_ns = timestamp_ns();
+  // The final sample happens after tracing stopped, but still belongs to the trace, so it can't come after its end
+  int64_t stopped_at_ns = __atomic_load_n(&stopped_tracing_at_ns, __ATOMIC_RELAXED);
+  if (stopped_at_ns > started_tracing_at_ns && now_ns > stopped_at_ns) now_ns = stopped_at_ns;
+
+  __atomic_store_n(&last_gvl_counters_sample, counters, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_gvl_counters_sample_at_ns, now_ns, __ATOMIC_RELAXED);
+  gvl_event event = gvl_counters_event(-1, counters, now_ns);
+  writer_consumer(&event, &started_tracing_at_ns);
+}
+
+// Called when the thread has just acquired the GVL: if it waited for too long, record who was holding it
+static void record_gvl_holder(thread_local_state *state, int64_t now_ns) {
+  int32_t thread_id = thread_id_for(state);
+  gvl_event event = { .timestamp_ns = now_ns, .thread_id = thread_id, .type = EVENT_GVL_HOLDER };
+
+  if (!gvl_holder_on_acquire(
+    thread_id, state->ready_at_ns, now_ns, &event.data.gvl_holder.thread_id, &event.data.gvl_holder.stack_id
+  )) return;
+
+  int64_t wait_us = (now_ns - state->ready_at_ns) / 1000;
+  event.data.gvl_holder.wait_us = wait_us > UINT32_MAX ? UINT32_MAX : (uint32_t) wait_us;
+
+  push_event(state, &event);
+}
+
+// Same as record_event, this gets called from the GVL hooks, and only updates a few counters.
+static void record_stats(thread_local_state *state, event_type type, int64_t now_ns) {
+  if (state->stats == NULL) {
+    state->stats = thread_stats_new(thread_id_for(state));
+    #ifdef RUBY_3_2
+      pthread_setspecific(thread_exit_key, state);
+    #endif
+    if (state->stats == NULL) return;
+    state->stats->ractor = state->ractor;
+  }
+
+  thread_stats_transition(state->stats, type, now_ns);
+}
+
+static void release_thread_resources(thread_local_state *state) {
+  // The writer thread/stats snapshot take care of freeing these, once they're done with them
+  event_buffer_release(state->buffer);
+  state->buffer = NULL;
+  thread_stats_release(state->stats);
+  state->stats = NULL;
+
+  // Only still set if we missed the thread exiting (e.g. because the hooks were not installed at the time)
+  thread_registry_remove(state->registry_handle);
+  state->registry_handle = THREAD_REGISTRY_NO_HANDLE;
+}
+
+static int start_writer_thread(void (*consumer)(const gvl_event *event, void *context)) {
+  writer_consumer = consumer;
+  writer_stop_requested = false;
+  return pthread_create(&writer_thread, NULL, writer_thread_main, NULL);
+}
+
+static void *writer_thread_main(UNUSED_ARG void *_unused) {
+  pthread_mutex_lock(&writer_mutex);
+  while (!writer_stop_requested) {
+    pthread_mutex_unlock(&writer_mutex);
+
+    event_buffer_drain_all(writer_consumer, &started_tracing_at_ns);
+    sample_gvl_counters_if_changed();
+    if (auto_dump_threshold_ns > 0) maybe_auto_dump();
+    output_send_batch();
+
+    pthread_mutex_lock(&writer_mutex);
+    if (writer_stop_requested) break;
+
+    // Note: We use CLOCK_REALTIME because it's the only clock pthread_cond_timedwait supports everywhere (e.g. macOS);
+    // if it jumps around we'll just flush a bit earlier/later than usual.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WRITER_FLUSH_INTERVAL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&writer_wakeup, &writer_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&writer_mutex);
+
+  // Final pass, to get any events recorded right before we were asked to stop
+  event_buffer_drain_all(writer_consumer, &started_tracing_at_ns);
+  sample_gvl_counters_if_changed();
+
+  return NULL;
+}
+
+static void stop_writer_thread(void) {
+  pthread_mutex_lock(&writer_mutex);
+  writer_stop_requested = true;
+  pthread_cond_signal(&writer_wakeup);
+  pthread_mutex_unlock(&writer_mutex);
+
+  int error = pthread_join(writer_thread, NULL);
+  if (error) rb_syserr_fail(error, "Failed to stop GvlTracing writer thread");
+}
+
+// Called from the writer thread, or when dumping the flight recorder. Timestamps in the output are relative to
+// `base_timestamp_ns` (which is when tracing started, except for dumps).
+static void render_event(const gvl_event *event, void *base_timestamp_ns) {
+  int64_t relative_timestamp_ns = event->timestamp_ns - *((int64_t *) base_timestamp_ns);
+
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_event(event, relative_timestamp_ns);
+  } else {
+    render_json_event(event, relative_timestamp_ns);
+  }
 }
 
-// Render output using trace event format for perfetto:
-// https://chromium.googlesource.com/catapult/+/refs/heads/main/docs/trace-event-format.md
-static double render_event(thread_local_state *state, const char *event_name) {
-  // Event data
-  double now_microseconds = timestamp_microseconds() - started_tracing_at_microseconds;
+static void render_json_event(const gvl_event *event, int64_t relative_timestamp_ns) {
+  // The GC track gets named the first time it shows up, so traces where no GC happened don't get an empty track
+  if (!gc_track_named && event_type_is_gc_phase(event->type)) {
+    output_printf(
+      "  {\"ph\": \"M\", \"pid\": %"PRId64", \"tid\": %"PRId64", \"name\": \"thread_name\", \"args\": {\"name\": \"GC\"}},\n",
+      process_id, GC_TRACK_TID
+    );
+    gc_track_named = true;
+  }
 
-  // Each event is converted into two events in the output: one that signals the end of the previous event
-  // (whatever it was), and one that signals the start of the actual event we're processing.
-  // Yes, this seems to be slightly bending the intention of the output format, but it seemed easier to do this way.
+  // GC and the counter tracks are for the whole process, the rest goes in the thread's Ractor group
+  int64_t pid = process_id;
+  if (!event_type_is_gc_phase(event->type) && event->type != EVENT_GVL_COUNTERS) pid = json_pid_for_thread(event->thread_id);
 
-  // Important note: We've observed some rendering issues in perfetto if the tid or pid are numbers that are "too big",
-  // see https://github.com/ivoanjo/gvl-tracing/pull/4#issuecomment-1196463364 for an example.
+  char buffer[JSON_OUTPUT_MAX_EVENT_SIZE];
+  output_write(buffer, json_output_event(buffer, event, pid, relative_timestamp_ns));
+}
 
-  fprintf(output_file,
-    // Finish previous duration
-    "  {\"ph\": \"E\", \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f},\n" \
-    // Current event
-    "  {\"ph\": \"B\", \"pid\": %"PRId64", \"tid\": %d, \"ts\": %f, \"name\": \"%s\"},\n",
-    // Args for first line
-    process_id, thread_id_for(state), now_microseconds,
-    // Args for second line
-    process_id, thread_id_for(state), now_microseconds, event_name
+// Returns the pid for the thread's Ractor group, which gets named the first time it shows up (same as the GC track)
+static int64_t json_pid_for_thread(int32_t thread_id) {
+  uint32_t group = ractor_group_for_thread(thread_id);
+  int64_t pid = ractors_pid(process_id, group);
+  uint64_t bit = UINT64_C(1) << (group % 64);
+  if (group == RACTORS_MAIN || (ractor_groups_named[group / 64] & bit)) return pid;
+
+  ractor_groups_named[group / 64] |= bit;
+  output_printf(
+    "  {\"ph\": \"M\", \"pid\": %"PRId64", \"name\": \"process_name\", \"args\": {\"name\": \"Ractor %u%s (Ruby threads view)\"}},\n",
+    pid, group, group == RACTORS_MAX_GROUPS ? "+" : ""
   );
+  return pid;
+}
+
+// Same as render_event, but for the slices folded by the coalescer
+static void render_coalesced_slice(const coalesced_slice *slice, void *base_timestamp_ns) {
+  int64_t relative_timestamp_ns = slice->timestamp_ns - *((int64_t *) base_timestamp_ns);
 
-  return now_microseconds;
+  if (current_output_format == OUTPUT_FORMAT_PERFETTO) {
+    perfetto_output_coalesced_slice(slice, relative_timestamp_ns);
+  } else {
+    char buffer[JSON_OUTPUT_MAX_EVENT_SIZE];
+    int64_t pid = json_pid_for_thread(slice->thread_id);
+    output_write(buffer, json_output_coalesced_slice(buffer, slice, pid, relative_timestamp_ns));
+  }
+}
+
+static void release_gc_phases_buffer(void) {
+  event_buffer_release(gc_phases_buffer);
+  gc_phases_buffer = NULL;
+}
+
+static void stop_coalescer(void) {
+  if (coalescer_enabled) coalescer_stop();
+  coalescer_enabled = false;
 }
 
 static void on_thread_event(rb_event_flag_t event_id, const rb_internal_thread_event_data_t *event_data, UNUSED_ARG void *_unused2) {
@@ -306,85 +1775,241 @@ static void on_thread_event(rb_event_flag_t event_id, const rb_internal_thread_e
 
   if (!state) return;
 
-  if (!state->thread) {
-    #ifdef RUBY_3_3_PLUS
-      state->thread = event_data->thread;
-    #else
-      if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED) { state->thread = rb_thread_current(); }
-    #endif
-  }
+  #ifdef RUBY_3_3_PLUS
+    if (!state->thread) state->thread = event_data->thread;
+  #else
+    // Ruby 3.2 caches and reuses native threads, so the thread-local state can outlive the Ruby thread it was first
+    // used for (and we may have missed its EXITED event, if it happened while the hooks were not installed). Since we
+    // don't mark `state->thread` on 3.2, we always refresh it to avoid using a thread that was already collected.
+    if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED) state->thread = rb_thread_current();
+  #endif
   // In some cases, Ruby seems to emit multiple suspended events for the same thread in a row (e.g. when multiple threads)
   // are waiting on a Thread::ConditionVariable.new that gets signaled. We coalesce these events to make the resulting
   // timeline easier to see.
   //
-  // I haven't observed other situations where we'd want to coalesce events, but we may apply this to all events in the
-  // future. One annoying thing to remember when generalizing this is how to reset the `previous_state` across multiple
-  // start/stop calls to GvlTracing.
+  // For the more general case of lots of really short slices, see `min_slice_us` (coalescer.h).
+  //
+  // The `previous_state` is left over from whatever the thread was doing the last time it was seen, so it gets reset
+  // if that was in a previous start/stop of GvlTracing.
+  if (state->previous_state_session != tracing_session) {
+    state->previous_state_session = tracing_session;
+    state->previous_state = 0;
+  }
   if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED && event_id == state->previous_state) return;
   state->previous_state = event_id;
 
-  if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED &&
-      // Check that thread is not being shut down
-      (state->thread != Qnil && is_thread_alive(state->thread))
-  ) {
-    ID current_method = 0;
-    VALUE current_method_owner = Qnil;
-    rb_frame_method_id_and_class(&current_method, &current_method_owner);
-
-    if (current_method == sleep_id && current_method_owner == rb_mKernel) {
-      render_event(state, "sleeping");
-      return;
-    }
-  }
-
-  const char* event_name = "bug_unknown_event";
+  event_type type = EVENT_WAITING;
   switch (event_id) {
-    case RUBY_INTERNAL_THREAD_EVENT_READY:     event_name = "wants_gvl"; break;
-    case RUBY_INTERNAL_THREAD_EVENT_RESUMED:   event_name = "running";   break;
-    case RUBY_INTERNAL_THREAD_EVENT_SUSPENDED: event_name = "waiting";   break;
-    case RUBY_INTERNAL_THREAD_EVENT_STARTED:   event_name = "started";   break;
-    case RUBY_INTERNAL_THREAD_EVENT_EXITED:    event_name = "died";      break;
+    case RUBY_INTERNAL_THREAD_EVENT_READY:     type = EVENT_WANTS_GVL; break;
+    case RUBY_INTERNAL_THREAD_EVENT_RESUMED:   type = EVENT_RUNNING;   break;
+    case RUBY_INTERNAL_THREAD_EVENT_SUSPENDED: type = EVENT_WAITING;   break;
+    case RUBY_INTERNAL_THREAD_EVENT_STARTED:   type = EVENT_STARTED;   break;
+    case RUBY_INTERNAL_THREAD_EVENT_EXITED:    type = EVENT_DIED;      break;
   };
-  double now_microseconds = render_event(state, event_name);
 
-  if (os_threads_view_enabled) {
+  int64_t now_ns = timestamp_ns();
+
+  #ifdef RUBY_3_2
+    // The native thread is getting reused by a new Ruby thread; if we missed the previous one exiting (e.g. because the
+    // hooks were not installed at the time), this is when we find out
+    if (event_id == RUBY_INTERNAL_THREAD_EVENT_STARTED && state->registry_handle != THREAD_REGISTRY_NO_HANDLE) {
+      thread_registry_exited(state->registry_handle, now_ns, keep_exited_threads_for(now_ns));
+      state->registry_handle = THREAD_REGISTRY_NO_HANDLE;
+    }
+    // Either way, what got decided for the previous Ruby thread does not apply to the new one
+    if (event_id == RUBY_INTERNAL_THREAD_EVENT_STARTED) state->filter_generation = 0;
+    // Decisions for this thread made from other threads get left for it (see thread_filter.h). They're looked up by
+    // thread, which is only known for sure when it's about to release the GVL (see above).
+    if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED && state->filter_left_generation != thread_filter_left_generation()) {
+      state->filter_left_generation = thread_filter_left_generation();
+      bool traced;
+      if (thread_filter_take_decision(state->thread, &traced)) set_thread_traced(state, traced);
+    }
+  #endif
+  if (state->registry_handle == THREAD_REGISTRY_NO_HANDLE) register_thread(state, current_native_thread_id(), now_ns);
+
+  bool releasing_gvl = event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED &&
+    // Check that thread is not being shut down
+    (state->thread != Qnil && is_thread_alive(state->thread));
+
+  bool traced = tracing_enabled && thread_traced(state);
+
+  if (releasing_gvl) {
+    // The thread is about to release the GVL, so this is our chance to sample what it was doing while holding it. This
+    // includes threads that got filtered out, since they can still be the ones holding up the threads being traced.
+    if (tracing_enabled && gvl_holder_enabled() && in_main_ractor(state)) {
+      gvl_holder_on_release(thread_id_for(state), state->resumed_at_ns, now_ns);
+    }
+
+    // Threads that got filtered out don't need to know exactly why they're waiting, unless it's for the stats
+    if (traced || stats_enabled) {
+      ID current_method = 0;
+      VALUE current_method_owner = Qnil;
+      rb_frame_method_id_and_class(&current_method, &current_method_owner);
+
+      if (current_method != 0) type = wait_reason_for(current_method, current_method_owner);
+    }
+
+    capture_thread_name(state, state->thread);
+  }
+  state->last_type = type;
+  account_context(state, type, now_ns);
+
+  uint8_t flags = 0;
+  if (os_threads_view_enabled && type != EVENT_SLEEPING) {
     if (event_id == RUBY_INTERNAL_THREAD_EVENT_RESUMED) {
-      render_os_thread_event(state, now_microseconds);
+      flags = EVENT_FLAG_OS_THREAD_BEGIN;
     } else if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED || event_id == RUBY_INTERNAL_THREAD_EVENT_EXITED) {
-      finish_previous_os_thread_event(now_microseconds);
+      flags = EVENT_FLAG_OS_THREAD_END;
+    }
+  }
+
+  // How much of the time since the thread acquired the GVL it actually spent running on a CPU
+  int64_t held_ns = 0;
+  int64_t on_cpu_ns = 0;
+  bool released_gvl = event_id & (RUBY_INTERNAL_THREAD_EVENT_SUSPENDED | RUBY_INTERNAL_THREAD_EVENT_EXITED);
+  if (released_gvl && state->cpu_sampled_at_ns != 0) {
+    if (cpu_time_enabled()) {
+      held_ns = now_ns - state->cpu_sampled_at_ns;
+      on_cpu_ns = thread_cpu_time_ns() - state->cpu_time_at_resume_ns;
+    }
+    state->cpu_sampled_at_ns = 0;
+  }
+
+  if (traced) {
+    gvl_event event = new_event(state, type, flags, now_ns);
+    record_gvl_handoff(state, event_id, &event);
+    if (trace_cpu_time && held_ns > 0) {
+      event.flags |= EVENT_FLAG_CPU_TIME;
+      event.data.flow.on_cpu_us = on_cpu_ns <= 0 ? 0 : on_cpu_ns / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t) (on_cpu_ns / 1000);
+      event.data.flow.cpu = current_cpu();
+    }
+    push_event(state, &event);
+    update_gvl_counters(state, type, now_ns);
+  } else if (tracing_enabled) {
+    // Threads that got filtered out still count in the gvl_threads counters, so that they show how many threads were
+    // competing for the GVL overall
+    if (event_id & (RUBY_INTERNAL_THREAD_EVENT_SUSPENDED | RUBY_INTERNAL_THREAD_EVENT_EXITED | RUBY_INTERNAL_THREAD_EVENT_RESUMED)) {
+      skip_gvl_handoff(state);
+    }
+    update_gvl_counters(state, type, now_ns);
+  }
+  if (stats_enabled) {
+    record_stats(state, type, now_ns);
+    if (stats_cpu_time && held_ns > 0 && state->stats != NULL) thread_stats_gvl_released(state->stats, held_ns, on_cpu_ns);
+  }
+
+  if (event_id == RUBY_INTERNAL_THREAD_EVENT_READY) {
+    state->ready_at_ns = now_ns;
+  } else if (event_id == RUBY_INTERNAL_THREAD_EVENT_RESUMED) {
+    if (traced && gvl_holder_enabled() && in_main_ractor(state)) record_gvl_holder(state, now_ns);
+    if (auto_dump_threshold_ns > 0 &&
+        state->ready_at_ns >= flight_recorder_started_at_ns &&
+        now_ns - state->ready_at_ns >= auto_dump_threshold_ns
+    ) {
+      flight_recorder_request_dump(now_ns - state->ready_at_ns);
+    }
+    if (traced && state->fiber_session == tracing_session && state->ready_at_ns != 0) {
+      fibers_on_wants_gvl(now_ns - state->ready_at_ns);
     }
+    state->ready_at_ns = 0;
+    state->resumed_at_ns = now_ns;
+    if (cpu_time_enabled()) sample_cpu_time_on_resume(state, now_ns);
+  } else if (event_id == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED) {
+    state->resumed_at_ns = 0;
+  }
+
+  if (event_id == RUBY_INTERNAL_THREAD_EVENT_EXITED) {
+    #ifdef RUBY_3_3_PLUS
+      // Last chance to get the name (on 3.2 `state->thread` may be a thread that's already gone, so we rely on the name
+      // we got the last time the thread released the GVL). Threads without a name keep whatever they got before, since
+      // for the main thread of a Ractor that's going away, there's no main thread to compare against anymore.
+      if (RB_TYPE_P(thread_name_for(state->thread), T_STRING)) capture_thread_name(state, state->thread);
+    #endif
+    thread_registry_exited(state->registry_handle, now_ns, keep_exited_threads_for(now_ns));
+    state->registry_handle = THREAD_REGISTRY_NO_HANDLE;
+
+    // The thread is done with its buffer and stats; they get freed once everything in them has been consumed
+    release_thread_resources(state);
+    #ifdef RUBY_3_2
+      pthread_setspecific(thread_exit_key, NULL);
+    #endif
+  }
+}
+
+// Fiber switches always happen while holding the GVL, so the current thread is the one that switched
+static void on_fiber_switch(UNUSED_ARG VALUE tpval, UNUSED_ARG void *_unused1) {
+  if (!tracing_enabled) return;
+
+  thread_local_state *state = GT_CURRENT_THREAD_LOCAL_STATE();
+  if (!thread_traced(state)) return;
+
+  int64_t now_ns = timestamp_ns();
+  if (state->registry_handle == THREAD_REGISTRY_NO_HANDLE) register_thread(state, current_native_thread_id(), now_ns);
+  if (state->fiber_session != tracing_session) {
+    state->fiber_session = tracing_session;
+    thread_registry_set_has_fibers(state->registry_handle);
   }
+
+  gvl_event event = new_event(state, EVENT_FIBER_SWITCH, 0, now_ns);
+  event.data.fiber.serial = fibers_serial_for(rb_fiber_current());
+  push_event(state, &event);
+  fibers_on_switch();
 }
 
 static void on_gc_event(VALUE tpval, UNUSED_ARG void *_unused1) {
-  const char* event_name = "bug_unknown_event";
+  rb_event_flag_t event_id = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval));
+  int64_t now_ns = timestamp_ns();
   thread_local_state *state = GT_LOCAL_STATE(rb_thread_current(), false); // no alloc during GC
 
-  if (!state) return;
+  if (event_id & (RUBY_INTERNAL_EVENT_GC_START | RUBY_INTERNAL_EVENT_GC_END_MARK | RUBY_INTERNAL_EVENT_GC_END_SWEEP)) {
+    if (!tracing_enabled) return;
 
-  switch (rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval))) {
-    case RUBY_INTERNAL_EVENT_GC_ENTER: event_name = "gc"; break;
-    // TODO: is it possible the thread wasn't running? Might need to save the last state.
-    case RUBY_INTERNAL_EVENT_GC_EXIT: event_name = "running"; break;
+    // These go on the GC track; the thread id just records which thread happened to be doing the GC work
+    gvl_event event = { .timestamp_ns = now_ns, .thread_id = state ? thread_id_for(state) : -1 };
+    switch (event_id) {
+      case RUBY_INTERNAL_EVENT_GC_START:     gc_phases_on_start(now_ns, &event);     break;
+      case RUBY_INTERNAL_EVENT_GC_END_MARK:  gc_phases_on_end_mark(now_ns, &event);  break;
+      case RUBY_INTERNAL_EVENT_GC_END_SWEEP: gc_phases_on_end_sweep(now_ns, &event); break;
+    }
+    if (gc_phases_buffer != NULL) event_buffer_push(gc_phases_buffer, &event);
+    return;
   }
-  render_event(state, event_name);
-}
 
-static size_t thread_local_state_memsize(UNUSED_ARG const void *_unused) { return sizeof(thread_local_state); }
+  if (tracing_enabled) {
+    if (event_id == RUBY_INTERNAL_EVENT_GC_ENTER) {
+      gc_phases_on_enter(now_ns);
+    } else {
+      gc_phases_on_exit(now_ns);
+    }
+  }
 
-static void thread_local_state_mark(void *data) {
-  thread_local_state *state = (thread_local_state *)data;
-  rb_gc_mark(state->thread); // Marking thread to make sure it stays pinned
+  if (!state) return;
+
+  // Afterwards, the thread goes back to whatever it was doing before the GC, rather than assuming it was running
+  event_type type = (event_id == RUBY_INTERNAL_EVENT_GC_ENTER) ? EVENT_GC : state->last_type;
+
+  account_context(state, type, now_ns);
+  if (tracing_enabled && thread_traced(state)) record_event(state, type, 0, now_ns);
+  if (stats_enabled) record_stats(state, type, now_ns);
 }
 
-static inline void all_seen_threads_mutex_lock(void) {
-  int error = pthread_mutex_lock(&all_seen_threads_mutex);
-  if (error) rb_syserr_fail(error, "Failed to lock GvlTracing mutex");
+static size_t thread_local_state_memsize(const void *data) {
+  const thread_local_state *state = (const thread_local_state *) data;
+  return sizeof(thread_local_state) +
+    (state->buffer ? event_buffer_memsize(state->buffer) : 0) +
+    (state->stats ? sizeof(thread_stats) : 0);
 }
 
-static inline void all_seen_threads_mutex_unlock(void) {
-  int error = pthread_mutex_unlock(&all_seen_threads_mutex);
-  if (error) rb_syserr_fail(error, "Failed to unlock GvlTracing mutex");
+static void thread_local_state_free(void *data) {
+  thread_local_state *state = (thread_local_state *) data;
+  release_thread_resources(state);
+  ruby_xfree(state);
+}
+
+static void thread_local_state_mark(void *data) {
+  thread_local_state *state = (thread_local_state *)data;
+  rb_gc_mark(state->thread); // Marking thread to make sure it stays pinned
 }
 
 #ifdef RUBY_3_3_PLUS
@@ -398,12 +2023,16 @@ static inline void all_seen_threads_mutex_unlock(void) {
       RB_GC_GUARD(wrapper);
       initialize_thread_local_state(state);
 
-      // Keep thread around, to be able to extract names at the end
-      // We grab a lock here since thread creation can happen in multiple Ractors, and we want to make sure only one
-      // of them is mutating the array at a time. @ivoanjo: I think this is enough to make this safe....?
-      all_seen_threads_mutex_lock();
-      rb_ary_push(all_seen_threads, thread);
-      all_seen_threads_mutex_unlock();
+      // This is the only place where we can allocate for any thread (and not just the current one), so it's where we
+      // get the library the thread came from; the name usually only gets set later.
+      register_thread(state, thread == rb_thread_current() ? current_native_thread_id() : 0, timestamp_ns());
+      set_thread_library(state->registry_handle, thread);
+    }
+    // Threads only ever get allocated from their own Ractor, but Ruby can emit the STARTED event from the thread that
+    // created them, which for a new Ractor's main thread is in another Ractor. So this waits until the thread is the
+    // current one.
+    if (state && state->ractor == RACTORS_UNKNOWN && allocate && thread == rb_thread_current()) {
+      set_thread_ractor(state, ractors_current());
     }
     return state;
   }
@@ -446,47 +2075,196 @@ static VALUE ruby_thread_id_for(UNUSED_ARG VALUE _self, VALUE thread) {
   return INT2FIX(thread_id_for(state));
 }
 
-// Can only be called while GvlTracing is not active + while holding the GVL
-static VALUE trim_all_seen_threads(UNUSED_ARG VALUE _self) {
-  all_seen_threads_mutex_lock();
+// Safe to call without the GVL. On 3.2 this gets called again every time the native thread gets reused by a new Ruby
+// thread, since the thread-local state stays the same.
+static void register_thread(thread_local_state *state, uint32_t native_thread_id, int64_t now_ns) {
+  if (state->registry_handle != THREAD_REGISTRY_NO_HANDLE) return;
+
+  state->registry_handle = thread_registry_add(thread_id_for(state), native_thread_id, now_ns);
+  if (state->ractor != RACTORS_UNKNOWN) thread_registry_set_ractor(state->registry_handle, state->ractor);
+  state->last_name = Qfalse; // Never a valid name, so the next capture_thread_name always records the name
+  // The filters may have been decided already, e.g. when tracing started
+  if (thread_filter_enabled() && state->traced && state->filter_generation == thread_filter_generation()) {
+    thread_registry_set_traced(state->registry_handle, true);
+  }
+  #ifdef RUBY_3_2
+    // Makes sure the record gets removed when the native thread exits, even if we miss the EXITED event
+    pthread_setspecific(thread_exit_key, state);
+  #endif
+}
+
+#ifdef RUBY_3_3_PLUS
+  static void set_thread_ractor(thread_local_state *state, uint32_t ractor) {
+    state->ractor = ractor;
+    ractors_set_thread(thread_id_for(state), ractor);
+    thread_registry_set_ractor(state->registry_handle, ractor);
+    if (state->stats != NULL) __atomic_store_n(&state->stats->ractor, ractor, __ATOMIC_RELAXED);
+  }
+#endif
+
+// Threads get shown in their Ractor's group, see ractors.h
+static uint32_t ractor_group_for_thread(int32_t thread_id) {
+  return ractors_seen() ? ractors_group(ractors_for_thread(thread_id)) : RACTORS_MAIN;
+}
+
+// GVL holder attribution only covers the main Ractor (see gvl_holder.h). Threads only get their Ractor once they've held
+// its GVL, so until then they don't count as being in the main one.
+static inline bool in_main_ractor(thread_local_state *state) {
+  #ifdef RUBY_3_3_PLUS
+    return state->ractor == RACTORS_MAIN;
+  #else
+    (void) state;
+    return true;
+  #endif
+}
+
+// Cheap enough to check for every event: the decision only gets made in `decide_thread_filter`, from Ruby
+static inline bool thread_traced(thread_local_state *state) {
+  if (!thread_filter_enabled()) return true;
+  return state->filter_generation == thread_filter_generation() ? state->traced : thread_filter_default();
+}
 
-  VALUE alive_threads = rb_ary_new();
+// Decides if the thread's events get recorded. This calls into Ruby, so it only ever gets called from Ruby, never from
+// the GVL hooks (see thread_filter.h).
+static void decide_thread_filter(VALUE thread) {
+  VALUE group = thread_filter_uses_groups() ? rb_funcall(thread, group_id, 0) : Qnil;
+  bool traced = thread_filter_traces(thread, thread_name_for(thread), group);
 
-  for (long i = 0, len = RARRAY_LEN(all_seen_threads); i < len; i++) {
-    VALUE thread = RARRAY_AREF(all_seen_threads, i);
-    if (rb_funcall(thread, rb_intern("alive?"), 0) == Qtrue) {
-      rb_ary_push(alive_threads, thread);
+  #ifdef RUBY_3_3_PLUS
+    set_thread_traced(GT_LOCAL_STATE(thread, true), traced);
+  #else
+    if (thread == rb_thread_current()) {
+      // Anything left for it earlier (e.g. by the thread that created it) is out of date now
+      bool left_traced;
+      thread_filter_take_decision(thread, &left_traced);
+      set_thread_traced(GT_CURRENT_THREAD_LOCAL_STATE(), traced);
+    } else {
+      thread_filter_leave_decision(thread, traced);
     }
+  #endif
+}
+
+// Safe to call without the GVL
+static void set_thread_traced(thread_local_state *state, bool traced) {
+  state->traced = traced;
+  state->filter_generation = thread_filter_generation();
+  if (state->registry_handle != THREAD_REGISTRY_NO_HANDLE) thread_registry_set_traced(state->registry_handle, traced);
+}
+
+// Thread names can change at any time, so we check them every time a thread releases the GVL (and when it exits). This
+// needs to be cheap: Thread#name just returns the string the thread was given (or nil) without allocating, and that
+// only gets copied into the registry if it's not the same string as last time.
+static void capture_thread_name(thread_local_state *state, VALUE thread) {
+  if (state->registry_handle == THREAD_REGISTRY_NO_HANDLE) return;
+
+  VALUE name = thread_name_for(thread);
+  if (name == state->last_name) return;
+
+  state->last_name = name;
+  set_thread_name(state->registry_handle, thread, name);
+}
+
+static void set_thread_name(thread_registry_handle registry_handle, VALUE thread, VALUE name) {
+  if (RB_TYPE_P(name, T_STRING)) {
+    thread_registry_set_name(registry_handle, RSTRING_PTR(name), RSTRING_LEN(name));
+  } else if (thread == rb_thread_main()) {
+    thread_registry_set_name(registry_handle, "Main Thread", strlen("Main Thread"));
+  } else {
+    thread_registry_set_name(registry_handle, NULL, 0);
   }
+}
 
-  rb_ary_replace(all_seen_threads, alive_threads);
+// Same as matching Thread#to_s against `lib(?!.*lib)/([a-zA-Z-]+)`, e.g. for a thread created at
+// ".../gems/puma-6.4.0/lib/puma/thread_pool.rb:106" the library is "puma". Must be called while holding the GVL, since
+// Thread#to_s allocates.
+static void set_thread_library(thread_registry_handle registry_handle, VALUE thread) {
+  if (registry_handle == THREAD_REGISTRY_NO_HANDLE) return;
+
+  VALUE description = rb_funcall(thread, to_s_id, 0);
+  const char *text = RSTRING_PTR(description);
+  long text_length = RSTRING_LEN(description);
+  const char *library = NULL;
+  long library_length = 0;
+
+  for (long i = text_length - 3; i >= 0; i--) {
+    if (memcmp(text + i, "lib", 3) != 0) continue;
+
+    // Only the last "lib" can match, so we stop here either way
+    if (i + 3 < text_length && text[i + 3] == '/') {
+      library = text + i + 4;
+      while (library + library_length < text + text_length) {
+        char c = library[library_length];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-')) break;
+        library_length++;
+      }
+    }
+    break;
+  }
 
-  all_seen_threads_mutex_unlock();
-  return Qtrue;
+  thread_registry_set_library(registry_handle, library_length > 0 ? library : NULL, library_length);
+  RB_GC_GUARD(description);
 }
 
-// Creates an event that follows the current native thread. Note that this assumes that whatever event
-// made us call `render_os_thread_event` is an event about the current (native) thread; if the event is not about the
-// current thread, the results will be incorrect.
-static void render_os_thread_event(thread_local_state *state, double now_microseconds) {
-  finish_previous_os_thread_event(now_microseconds);
+// Called while holding the GVL, before writing any thread names: makes sure the names of live threads are up-to-date,
+// even for threads that did not release the GVL since they last changed their name.
+static void refresh_thread_names(void) {
+  VALUE threads = rb_funcall(rb_cThread, rb_intern("list"), 0);
 
-  // Hack: If we name threads as "Thread N", perfetto seems to color them all with the same color, which looks awful.
-  // I did not check the code, but in practice perfetto seems to be doing some kind of hashing based only on regular
-  // chars, so here we append a different letter to each thread to cause the color hashing to differ.
-  char color_suffix_hack = ('a' + (thread_id_for(state) % 26));
+  for (long i = 0, len = RARRAY_LEN(threads); i < len; i++) {
+    VALUE thread = RARRAY_AREF(threads, i);
 
-  fprintf(output_file,
-    "  {\"ph\": \"B\", \"pid\": %"PRId64", \"tid\": %u, \"ts\": %f, \"name\": \"Thread %d (%c)\"},\n",
-    OS_THREADS_VIEW_PID, current_native_thread_id(), now_microseconds, thread_id_for(state), color_suffix_hack
-  );
+    #ifdef RUBY_3_3_PLUS
+      thread_local_state *state = GT_LOCAL_STATE(thread, false);
+      if (state != NULL) capture_thread_name(state, thread);
+    #else
+      // We can only get to the thread-local state of the current thread, so the others get looked up by their id
+      VALUE native_thread_id = rb_funcall(thread, rb_intern("native_thread_id"), 0);
+      if (native_thread_id == Qnil) continue;
+
+      thread_registry_handle registry_handle = thread_registry_find(NUM2INT(native_thread_id));
+      if (registry_handle == THREAD_REGISTRY_NO_HANDLE) continue;
+
+      set_thread_name(registry_handle, thread, thread_name_for(thread));
+      set_thread_library(registry_handle, thread);
+    #endif
+  }
+
+  RB_GC_GUARD(threads);
 }
 
-static void finish_previous_os_thread_event(double now_microseconds) {
-  fprintf(output_file,
-    "  {\"ph\": \"E\", \"pid\": %"PRId64", \"tid\": %u, \"ts\": %f},\n",
-    OS_THREADS_VIEW_PID, current_native_thread_id(), now_microseconds
-  );
+// Drops the records for threads that died without us seeing them exit, e.g. because the hooks were not installed at
+// the time. Must be called while holding the GVL.
+static void forget_dead_threads(void) {
+  int64_t now_ns = timestamp_ns(); // Threads that start after this may not be in the list, but they're not dead either
+  VALUE threads = rb_funcall(rb_cThread, rb_intern("list"), 0);
+  size_t capacity = RARRAY_LEN(threads) > 0 ? (size_t) RARRAY_LEN(threads) : 1;
+  int32_t *thread_ids = ALLOC_N(int32_t, capacity);
+  size_t count = 0;
+
+  for (long i = 0, len = RARRAY_LEN(threads); i < len && count < capacity; i++) {
+    VALUE thread = RARRAY_AREF(threads, i);
+
+    #ifdef RUBY_3_3_PLUS
+      thread_local_state *state = GT_LOCAL_STATE(thread, false);
+      if (state != NULL) thread_ids[count++] = thread_id_for(state);
+    #else
+      VALUE native_thread_id = rb_funcall(thread, rb_intern("native_thread_id"), 0);
+      if (RB_INTEGER_TYPE_P(native_thread_id)) thread_ids[count++] = NUM2INT(native_thread_id);
+    #endif
+  }
+
+  thread_registry_retain(thread_ids, count, now_ns);
+
+  ruby_xfree(thread_ids);
+  RB_GC_GUARD(threads);
+}
+
+// Threads that exit while tracing is running need to be kept until it stops, since their names only get written at the
+// end. The flight recorder only needs the threads that are still in its window.
+static int64_t keep_exited_threads_for(int64_t now_ns) {
+  int64_t keep_since_ns = keep_exited_threads_since_ns;
+  if (flight_recorder_enabled && now_ns - flight_recorder_window_ns > keep_since_ns) keep_since_ns = now_ns - flight_recorder_window_ns;
+  return keep_since_ns;
 }
 
 static inline uint32_t current_native_thread_id(void) {
@@ -0,0 +1,87 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Public API for native extensions: lets e.g. a database driver add its own spans ("query", "connect", ...) to the
+// trace, next to the GVL states of the thread doing the work, without going through Ruby method calls.
+//
+// Spans get recorded the same way as the GVL events: a small record gets copied into the thread's event buffer, and
+// the writer thread does the rest. When tracing is not running, beginning/ending a span is just a check of a flag.
+//
+// Usage:
+//
+//   static uint32_t query_span; // In your Init_ function: query_span = gvl_tracing_span_name("db query");
+//
+//   bool traced = gvl_tracing_begin_span(query_span);
+//   ... do the work (e.g. in rb_thread_call_without_gvl) ...
+//   if (traced) gvl_tracing_end_span();
+//
+// Since your extension probably does not want to depend on gvl-tracing being loaded (or even installed), the functions
+// can also be looked up at run time with `gvl_tracing_api_lookup`, in which case you only need a copy of this header.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <dlfcn.h>
+
+// glibc only defines RTLD_DEFAULT with _GNU_SOURCE
+#ifndef RTLD_DEFAULT
+  #define RTLD_DEFAULT ((void *) 0)
+#endif
+
+#ifdef __GNUC__
+  #define GVL_TRACING_API __attribute__((visibility("default")))
+#else
+  #define GVL_TRACING_API
+#endif
+
+// Returns an id for the span name, which only needs to be done once per name. Longer names get truncated to 128 bytes.
+// Returns 0 if there are too many different names (>4096), in which case the spans get named "unknown_span".
+GVL_TRACING_API uint32_t gvl_tracing_span_name(const char *name);
+
+// Must be called while holding the GVL, from the thread the span is for. Returns false if tracing is not running.
+GVL_TRACING_API bool gvl_tracing_begin_span(uint32_t span_name_id);
+
+// Ends the most recent span that the current thread began. Must be called while holding the GVL.
+GVL_TRACING_API void gvl_tracing_end_span(void);
+
+typedef struct {
+  uint32_t (*span_name)(const char *name);
+  bool (*begin_span)(uint32_t span_name_id);
+  void (*end_span)(void);
+} gvl_tracing_api;
+
+// Fills in `api`, returning false (and leaving it untouched) if gvl-tracing has not been loaded (yet)
+static inline bool gvl_tracing_api_lookup(gvl_tracing_api *api) {
+  void *span_name = dlsym(RTLD_DEFAULT, "gvl_tracing_span_name");
+  void *begin_span = dlsym(RTLD_DEFAULT, "gvl_tracing_begin_span");
+  void *end_span = dlsym(RTLD_DEFAULT, "gvl_tracing_end_span");
+  if (span_name == NULL || begin_span == NULL || end_span == NULL) return false;
+
+  api->span_name = (uint32_t (*)(const char *)) span_name;
+  api->begin_span = (bool (*)(uint32_t)) begin_span;
+  api->end_span = (void (*)(void)) end_span;
+  return true;
+}
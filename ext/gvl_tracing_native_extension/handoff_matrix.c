@@ -0,0 +1,106 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "handoff_matrix.h"
+
+#define HANDOFF_MATRIX_CAPACITY 4096 // Must be a power of two
+#define MAX_PROBES 64
+
+typedef struct {
+  uint64_t key; // 0 == empty entry
+  uint64_t count;
+  uint64_t total_wait_ns;
+} matrix_slot;
+
+static matrix_slot matrix[HANDOFF_MATRIX_CAPACITY];
+static uint64_t dropped = 0;
+
+// Thread ids can be 0, so keys get offset by one to be able to use 0 as the empty marker
+static inline uint64_t key_for(int32_t releaser_thread_id, int32_t acquirer_thread_id) {
+  return ((((uint64_t) (uint32_t) releaser_thread_id) << 32) | (uint32_t) acquirer_thread_id) + 1;
+}
+
+static inline uint32_t slot_for(uint64_t key) {
+  key ^= key >> 33;
+  key *= UINT64_C(0xff51afd7ed558ccd);
+  key ^= key >> 33;
+  return (uint32_t) key & (HANDOFF_MATRIX_CAPACITY - 1);
+}
+
+void handoff_matrix_reset(void) {
+  memset(matrix, 0, sizeof(matrix));
+  __atomic_store_n(&dropped, 0, __ATOMIC_RELAXED);
+}
+
+void handoff_matrix_record(int32_t releaser_thread_id, int32_t acquirer_thread_id, int64_t wait_ns) {
+  uint64_t key = key_for(releaser_thread_id, acquirer_thread_id);
+  uint32_t index = slot_for(key);
+
+  for (int probe = 0; probe < MAX_PROBES; probe++, index = (index + 1) & (HANDOFF_MATRIX_CAPACITY - 1)) {
+    matrix_slot *slot = &matrix[index];
+    uint64_t current_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+    if (current_key == 0) {
+      // Claim the empty slot; if someone else got it first, check if they claimed it for the same key
+      uint64_t expected = 0;
+      if (!__atomic_compare_exchange_n(&slot->key, &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        current_key = expected;
+      } else {
+        current_key = key;
+      }
+    }
+
+    if (current_key == key) {
+      __atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&slot->total_wait_ns, wait_ns > 0 ? (uint64_t) wait_ns : 0, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+}
+
+void handoff_matrix_each(void (*consumer)(const handoff_matrix_entry *entry, void *context), void *context) {
+  for (uint32_t i = 0; i < HANDOFF_MATRIX_CAPACITY; i++) {
+    uint64_t key = __atomic_load_n(&matrix[i].key, __ATOMIC_ACQUIRE);
+    if (key == 0) continue;
+
+    key -= 1;
+    handoff_matrix_entry entry = {
+      .releaser_thread_id = (int32_t) (uint32_t) (key >> 32),
+      .acquirer_thread_id = (int32_t) (uint32_t) key,
+      .count = __atomic_load_n(&matrix[i].count, __ATOMIC_RELAXED),
+      .total_wait_ns = __atomic_load_n(&matrix[i].total_wait_ns, __ATOMIC_RELAXED),
+    };
+    consumer(&entry, context);
+  }
+}
+
+uint64_t handoff_matrix_dropped(void) {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
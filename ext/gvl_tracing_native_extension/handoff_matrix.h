@@ -0,0 +1,51 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Aggregated GVL handoffs: For every pair of (thread that released the GVL, thread that acquired it next), counts how
+// many times it happened and how long the acquirer had been waiting for the GVL.
+//
+// This gets updated from the GVL hooks, so it's a fixed-size lock-free hash table (and Ruby-agnostic).
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+  int32_t releaser_thread_id;
+  int32_t acquirer_thread_id;
+  uint64_t count;
+  uint64_t total_wait_ns;
+} handoff_matrix_entry;
+
+// Must not be called concurrently with handoff_matrix_record
+void handoff_matrix_reset(void);
+
+void handoff_matrix_record(int32_t releaser_thread_id, int32_t acquirer_thread_id, int64_t wait_ns);
+
+// Calls `consumer` for every (releaser, acquirer) pair that was recorded since the last reset
+void handoff_matrix_each(void (*consumer)(const handoff_matrix_entry *entry, void *context), void *context);
+
+// Number of handoffs that did not fit in the table (e.g. in apps with thousands of threads)
+uint64_t handoff_matrix_dropped(void);
@@ -0,0 +1,507 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+
+#include "gc_phases.h"
+#include "json_output.h"
+#include "span_names.h"
+
+#define APPEND_LITERAL(out, literal) (memcpy((out), (literal), sizeof(literal) - 1), (out) + sizeof(literal) - 1)
+
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static char *append_uint64(char *out, uint64_t value) {
+  char digits[20];
+  char *start = digits + sizeof(digits);
+
+  while (value >= 100) {
+    start -= 2;
+    memcpy(start, &digit_pairs[(value % 100) * 2], 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    start -= 2;
+    memcpy(start, &digit_pairs[value * 2], 2);
+  } else {
+    *--start = (char) ('0' + value);
+  }
+
+  size_t length = digits + sizeof(digits) - start;
+  memcpy(out, start, length);
+  return out + length;
+}
+
+static char *append_int64(char *out, int64_t value) {
+  if (value < 0) {
+    *out++ = '-';
+    return append_uint64(out, -((uint64_t) value));
+  }
+  return append_uint64(out, (uint64_t) value);
+}
+
+// Same output as printf("%f", nanoseconds / 1000.0)
+static char *append_timestamp_us(char *out, int64_t timestamp_ns) {
+  uint64_t absolute_ns = (uint64_t) timestamp_ns;
+  if (timestamp_ns < 0) {
+    *out++ = '-';
+    absolute_ns = -((uint64_t) timestamp_ns);
+  }
+
+  out = append_uint64(out, absolute_ns / 1000);
+  unsigned int fraction = absolute_ns % 1000;
+  out[0] = '.';
+  out[1] = (char) ('0' + fraction / 100);
+  memcpy(out + 2, &digit_pairs[(fraction % 100) * 2], 2);
+  memcpy(out + 4, "000", 3);
+  return out + 7;
+}
+
+static char *append_string(char *out, const char *value) {
+  size_t length = strlen(value);
+  memcpy(out, value, length);
+  return out + length;
+}
+
+// Escapes what JSON needs escaped (quotes, backslashes and control characters); everything else gets copied as-is
+static char *append_escaped_string(char *out, const char *value, size_t length) {
+  static const char hex_digits[] = "0123456789abcdef";
+
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char) value[i];
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = (char) c;
+    } else if (c < 0x20) {
+      out = APPEND_LITERAL(out, "\\u00");
+      *out++ = hex_digits[c >> 4];
+      *out++ = hex_digits[c & 0xf];
+    } else {
+      *out++ = (char) c;
+    }
+  }
+  return out;
+}
+
+// {"ph": "i", "s": S, "pid": P, "ts": TS, "name": "NAME", "args": {
+static char *append_instant_start(char *out, const char *scope, const char *name, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"i\", \"s\": \"");
+  out = append_string(out, scope);
+  out = APPEND_LITERAL(out, "\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, name);
+  return APPEND_LITERAL(out, "\", \"args\": {");
+}
+
+// {"ph": "E", "pid": P, "tid": T, "ts": TS},
+static char *append_end(char *out, int64_t process_id, int64_t thread_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"E\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  return APPEND_LITERAL(out, "},\n");
+}
+
+// Same as append_end, for events that also record how much CPU time the thread got while holding the GVL. Perfetto
+// adds the args of an "E" to the slice it ends.
+static char *append_end_with_cpu_time(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"E\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, event->thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"args\": {\"cpu_us\": ");
+  out = append_uint64(out, event->data.flow.on_cpu_us);
+  if (event->data.flow.cpu >= 0) {
+    out = APPEND_LITERAL(out, ", \"cpu\": ");
+    out = append_int64(out, event->data.flow.cpu);
+  }
+  return APPEND_LITERAL(out, "}},\n");
+}
+
+// Begins the slice for the event on its thread
+static char *append_begin(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, event->thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, event_type_name(event->type));
+  if (event->context_id == 0) return APPEND_LITERAL(out, "\"},\n");
+
+  out = APPEND_LITERAL(out, "\", \"args\": {\"context\": \"");
+  out = append_string(out, span_names_get_json(event->context_id));
+  return APPEND_LITERAL(out, "\"}},\n");
+}
+
+// Creates an event that follows the native thread the event was recorded on. Note that this assumes that whatever event
+// got flagged with `EVENT_FLAG_OS_THREAD_BEGIN` is an event about the current (native) thread; if the event is not
+// about the current thread, the results will be incorrect.
+static char *append_os_thread_begin(char *out, const gvl_event *event, int64_t relative_timestamp_ns) {
+  // Hack: If we name threads as "Thread N", perfetto seems to color them all with the same color, which looks awful.
+  // I did not check the code, but in practice perfetto seems to be doing some kind of hashing based only on regular
+  // chars, so here we append a different letter to each thread to cause the color hashing to differ.
+  char color_suffix_hack = ('a' + (event->thread_id % 26));
+
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, OS_THREADS_VIEW_PID);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_uint64(out, event->native_thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"Thread ");
+  out = append_int64(out, event->thread_id);
+  out = APPEND_LITERAL(out, " (");
+  *out++ = color_suffix_hack;
+  return APPEND_LITERAL(out, ")\"},\n");
+}
+
+// GVL handoffs get shown as arrows from the slice of the thread that released the GVL to the thread that got it
+static char *append_flow(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  bool flow_begin = event->flags & EVENT_FLAG_FLOW_BEGIN;
+
+  out = flow_begin ? APPEND_LITERAL(out, "  {\"ph\": \"s\", \"id\": ") : APPEND_LITERAL(out, "  {\"ph\": \"f\", \"id\": ");
+  out = append_uint64(out, event->data.flow.id);
+  out = APPEND_LITERAL(out, ", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, event->thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"gvl_handoff\", \"cat\": \"gvl\"");
+  if (!flow_begin) out = APPEND_LITERAL(out, ", \"bp\": \"e\"");
+  return APPEND_LITERAL(out, "},\n");
+}
+
+static char *append_gvl_holder(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"i\", \"s\": \"t\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, event->thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, event_type_name(event->type));
+  out = APPEND_LITERAL(out, "\", \"args\": {\"holder_thread_id\": ");
+  out = append_int64(out, event->data.gvl_holder.thread_id);
+  out = APPEND_LITERAL(out, ", \"stack_id\": ");
+  out = append_uint64(out, event->data.gvl_holder.stack_id);
+  out = APPEND_LITERAL(out, ", \"wait_us\": ");
+  out = append_uint64(out, event->data.gvl_holder.wait_us);
+  return APPEND_LITERAL(out, "}},\n");
+}
+
+static char *append_heap_counters(char *out, const gvl_event *event) {
+  out = APPEND_LITERAL(out, ", \"heap_live_slots\": ");
+  out = append_uint64(out, event->data.gc.heap_live_slots);
+  out = APPEND_LITERAL(out, ", \"heap_free_slots\": ");
+  return append_uint64(out, event->data.gc.heap_free_slots);
+}
+
+// The GC track only ever has one slice going on: marking starts one, sweeping ends it and starts another, and finished
+// just ends it
+static char *append_gc_phase(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  if (event->type == EVENT_GC_FINISHED) {
+    out = APPEND_LITERAL(out, "  {\"ph\": \"E\", \"pid\": ");
+    out = append_int64(out, process_id);
+    out = APPEND_LITERAL(out, ", \"tid\": ");
+    out = append_int64(out, GC_TRACK_TID);
+    out = APPEND_LITERAL(out, ", \"ts\": ");
+    out = append_timestamp_us(out, relative_timestamp_ns);
+    out = APPEND_LITERAL(out, ", \"args\": {\"thread_id\": ");
+    out = append_int64(out, event->thread_id);
+    out = append_heap_counters(out, event);
+    return APPEND_LITERAL(out, "}},\n");
+  }
+
+  if (event->type == EVENT_GC_SWEEPING) out = append_end(out, process_id, GC_TRACK_TID, relative_timestamp_ns);
+
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, GC_TRACK_TID);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, event_type_name(event->type));
+  out = APPEND_LITERAL(out, "\", \"args\": {\"thread_id\": ");
+  out = append_int64(out, event->thread_id);
+
+  if (event->type != EVENT_GC_SWEEPING) {
+    const char *major_by = gc_major_by_name(event->data.gc.major_by);
+    if (major_by) {
+      out = APPEND_LITERAL(out, ", \"major_by\": \"");
+      out = append_string(out, major_by);
+      out = APPEND_LITERAL(out, "\"");
+    }
+    out = APPEND_LITERAL(out, ", \"triggered_by\": \"");
+    out = append_string(out, gc_triggered_by_name(event->data.gc.triggered_by));
+    out = event->data.gc.immediate_sweep ?
+      APPEND_LITERAL(out, "\", \"immediate_sweep\": true") : APPEND_LITERAL(out, "\", \"immediate_sweep\": false");
+    out = append_heap_counters(out, event);
+  }
+
+  return APPEND_LITERAL(out, "}},\n");
+}
+
+// Perfetto shows each of the args as a separate counter track, named e.g. "gvl_threads wants_gvl"
+static char *append_gvl_counters(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = APPEND_LITERAL(out, "  {\"ph\": \"C\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, event_type_name(event->type));
+  out = APPEND_LITERAL(out, "\", \"args\": {\"wants_gvl\": ");
+  out = append_uint64(out, event->data.gvl_counters.wants_gvl);
+  out = APPEND_LITERAL(out, ", \"running\": ");
+  out = append_uint64(out, event->data.gvl_counters.running);
+  out = APPEND_LITERAL(out, ", \"waiting\": ");
+  out = append_uint64(out, event->data.gvl_counters.waiting);
+  return APPEND_LITERAL(out, "}},\n");
+}
+
+// Spans nest, so unlike the GVL slices a span end doesn't begin anything
+static char *append_span(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  if (event->type == EVENT_SPAN_END) return append_end(out, process_id, SPAN_TRACK_TID(event->thread_id), relative_timestamp_ns);
+
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, SPAN_TRACK_TID(event->thread_id));
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, span_names_get_json(event->data.span.name_id));
+  return APPEND_LITERAL(out, "\"},\n");
+}
+
+// Only one fiber runs at a time, so each switch ends the previous fiber's slice. The very first switch for each thread
+// also writes an end, which viewers ignore.
+static char *append_fiber_switch(char *out, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  out = append_end(out, process_id, FIBER_TRACK_TID(event->thread_id), relative_timestamp_ns);
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, FIBER_TRACK_TID(event->thread_id));
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"fiber ");
+  out = append_uint64(out, event->data.fiber.serial);
+  return APPEND_LITERAL(out, "\"},\n");
+}
+
+size_t json_output_event(char *buffer, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns) {
+  char *out = buffer;
+
+  if (event->type == EVENT_GVL_HOLDER) {
+    out = append_gvl_holder(out, event, process_id, relative_timestamp_ns);
+    return out - buffer;
+  }
+
+  if (event_type_is_gc_phase(event->type)) {
+    out = append_gc_phase(out, event, process_id, relative_timestamp_ns);
+    return out - buffer;
+  }
+
+  if (event->type == EVENT_GVL_COUNTERS) {
+    out = append_gvl_counters(out, event, process_id, relative_timestamp_ns);
+    return out - buffer;
+  }
+
+  if (event_type_is_span(event->type)) {
+    out = append_span(out, event, process_id, relative_timestamp_ns);
+    return out - buffer;
+  }
+
+  if (event->type == EVENT_FIBER_SWITCH) {
+    out = append_fiber_switch(out, event, process_id, relative_timestamp_ns);
+    return out - buffer;
+  }
+
+  // Each event is converted into two events in the output: one that signals the end of the previous event
+  // (whatever it was), and one that signals the start of the actual event we're processing.
+  // Yes, this seems to be slightly bending the intention of the output format, but it seemed easier to do this way.
+
+  // Important note: We've observed some rendering issues in perfetto if the tid or pid are numbers that are "too big",
+  // see https://github.com/ivoanjo/gvl-tracing/pull/4#issuecomment-1196463364 for an example.
+
+  out = (event->flags & EVENT_FLAG_CPU_TIME) ?
+    append_end_with_cpu_time(out, event, process_id, relative_timestamp_ns) :
+    append_end(out, process_id, event->thread_id, relative_timestamp_ns);
+  out = append_begin(out, event, process_id, relative_timestamp_ns);
+
+  if (event->flags & (EVENT_FLAG_OS_THREAD_BEGIN | EVENT_FLAG_OS_THREAD_END)) {
+    out = append_end(out, OS_THREADS_VIEW_PID, event->native_thread_id, relative_timestamp_ns);
+    if (event->flags & EVENT_FLAG_OS_THREAD_BEGIN) out = append_os_thread_begin(out, event, relative_timestamp_ns);
+  }
+
+  if (event->flags & (EVENT_FLAG_FLOW_BEGIN | EVENT_FLAG_FLOW_END)) {
+    out = append_flow(out, event, process_id, relative_timestamp_ns);
+  }
+
+  return out - buffer;
+}
+
+size_t json_output_coalesced_slice(char *buffer, const coalesced_slice *slice, int64_t process_id, int64_t relative_timestamp_ns) {
+  char *out = buffer;
+
+  out = append_end(out, process_id, slice->thread_id, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, "  {\"ph\": \"B\", \"pid\": ");
+  out = append_int64(out, process_id);
+  out = APPEND_LITERAL(out, ", \"tid\": ");
+  out = append_int64(out, slice->thread_id);
+  out = APPEND_LITERAL(out, ", \"ts\": ");
+  out = append_timestamp_us(out, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, ", \"name\": \"");
+  out = append_string(out, event_type_name(EVENT_COALESCED));
+  out = APPEND_LITERAL(out, "\", \"args\": {\"slices\": ");
+  out = append_uint64(out, slice->slices);
+
+  for (int type = 0; type < EVENT_TYPE_COUNT; type++) {
+    if (slice->count[type] == 0) continue;
+
+    out = APPEND_LITERAL(out, ", \"");
+    out = append_string(out, event_type_name(type));
+    out = APPEND_LITERAL(out, "_count\": ");
+    out = append_uint64(out, slice->count[type]);
+    out = APPEND_LITERAL(out, ", \"");
+    out = append_string(out, event_type_name(type));
+    out = APPEND_LITERAL(out, "_ns\": ");
+    out = append_uint64(out, slice->time_ns[type]);
+  }
+
+  out = APPEND_LITERAL(out, "}},\n");
+  return out - buffer;
+}
+
+// "PREFIX_count": N, "PREFIX_marking_us": N, ...
+static char *append_gc_cycle_totals(char *out, const char *prefix, const gc_cycle_totals *totals) {
+  out = APPEND_LITERAL(out, "\"");
+  out = append_string(out, prefix);
+  out = APPEND_LITERAL(out, "_count\": ");
+  out = append_uint64(out, totals->count);
+  out = APPEND_LITERAL(out, ", \"");
+  out = append_string(out, prefix);
+  out = APPEND_LITERAL(out, "_marking_us\": ");
+  out = append_uint64(out, totals->marking_ns / 1000);
+  out = APPEND_LITERAL(out, ", \"");
+  out = append_string(out, prefix);
+  out = APPEND_LITERAL(out, "_sweeping_us\": ");
+  out = append_uint64(out, totals->sweeping_ns / 1000);
+  out = APPEND_LITERAL(out, ", \"");
+  out = append_string(out, prefix);
+  out = APPEND_LITERAL(out, "_marking_pause_us\": ");
+  out = append_uint64(out, totals->marking_pause_ns / 1000);
+  out = APPEND_LITERAL(out, ", \"");
+  out = append_string(out, prefix);
+  out = APPEND_LITERAL(out, "_sweeping_pause_us\": ");
+  return append_uint64(out, totals->sweeping_pause_ns / 1000);
+}
+
+size_t json_output_gc_totals(char *buffer, const gc_totals *totals, int64_t process_id, int64_t relative_timestamp_ns) {
+  char *out = append_instant_start(buffer, "p", "gc_totals", process_id, relative_timestamp_ns);
+  out = append_gc_cycle_totals(out, "minor", &totals->minor);
+  out = APPEND_LITERAL(out, ", ");
+  out = append_gc_cycle_totals(out, "major", &totals->major);
+  out = APPEND_LITERAL(out, "}},\n");
+  return out - buffer;
+}
+
+size_t json_output_fiber_totals(char *buffer, const fiber_totals *totals, int64_t process_id, int64_t relative_timestamp_ns) {
+  char *out = append_instant_start(buffer, "p", "fiber_totals", process_id, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, "\"switches\": ");
+  out = append_uint64(out, totals->switches);
+  out = APPEND_LITERAL(out, ", \"runnable_waiting_for_gvl_count\": ");
+  out = append_uint64(out, totals->wants_gvl_count);
+  out = APPEND_LITERAL(out, ", \"runnable_waiting_for_gvl_us\": ");
+  out = append_uint64(out, totals->wants_gvl_ns / 1000);
+  out = APPEND_LITERAL(out, "}},\n");
+  return out - buffer;
+}
+
+size_t json_output_gvl_holder_stack(
+  char *buffer,
+  uint32_t stack_id,
+  uint64_t count,
+  uint64_t total_wait_ns,
+  const char *frames,
+  size_t frames_length,
+  int64_t process_id,
+  int64_t relative_timestamp_ns
+) {
+  char *out = append_instant_start(buffer, "p", "gvl_holder_stack", process_id, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, "\"stack_id\": ");
+  out = append_uint64(out, stack_id);
+  out = APPEND_LITERAL(out, ", \"count\": ");
+  out = append_uint64(out, count);
+  out = APPEND_LITERAL(out, ", \"total_wait_us\": ");
+  out = append_uint64(out, total_wait_ns / 1000);
+  out = APPEND_LITERAL(out, ", \"frames\": [");
+
+  // Each line becomes an entry
+  const char *frame = frames;
+  const char *frames_end = frames + frames_length;
+  while (frame < frames_end) {
+    const char *newline = memchr(frame, '\n', frames_end - frame);
+    const char *frame_end = newline ? newline : frames_end;
+    if (frame != frames) out = APPEND_LITERAL(out, ", ");
+    out = APPEND_LITERAL(out, "\"");
+    out = append_escaped_string(out, frame, frame_end - frame);
+    out = APPEND_LITERAL(out, "\"");
+    frame = frame_end + 1;
+  }
+
+  out = APPEND_LITERAL(out, "]}},\n");
+  return out - buffer;
+}
+
+size_t json_output_flight_recorder_dump(char *buffer, const char *reason, int64_t wait_ns, int64_t process_id, int64_t relative_timestamp_ns) {
+  char *out = append_instant_start(buffer, "g", "flight_recorder_dump", process_id, relative_timestamp_ns);
+  out = APPEND_LITERAL(out, "\"reason\": \"");
+  out = append_string(out, reason);
+  out = APPEND_LITERAL(out, "\", \"wait_us\": ");
+  out = append_int64(out, wait_ns / 1000);
+  out = APPEND_LITERAL(out, "}}");
+  return out - buffer;
+}
@@ -0,0 +1,91 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Serializes events using the trace event format that perfetto (and chrome://tracing) can read:
+// https://chromium.googlesource.com/catapult/+/refs/heads/main/docs/trace-event-format.md
+//
+// This is the hottest part of the writer thread, so rather than going through printf (which spends most of its time
+// parsing the format string and dealing with locales and floating point), the fixed templates for each event get
+// copied directly into a caller-provided buffer, and the numbers get converted by hand.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coalescer.h"
+#include "fibers.h"
+#include "gc_phases.h"
+#include "gvl_event.h"
+
+// For the OS threads view, we emit data as if it was for another pid so it gets grouped separately in perfetto.
+// This is a really big hack, but I couldn't think of a better way?
+#define OS_THREADS_VIEW_PID (INT64_C(0))
+
+// Custom spans (see gvl_tracing.h) don't nest with the GVL slices on their thread's track, so each thread gets an extra
+// track for its spans, shown as yet another thread. Thread ids always fit in 24 bits (Ruby thread serials are small,
+// and Linux caps native thread ids at 2^22), so these never collide with actual threads.
+#define SPAN_TRACK_TID(thread_id) ((int64_t) (thread_id) + (INT64_C(1) << 24))
+// Same for fibers (see fibers.h)
+#define FIBER_TRACK_TID(thread_id) ((int64_t) (thread_id) + (INT64_C(2) << 24))
+// The GC track (see gc_phases.h) also gets shown as an extra thread, with the id right after the fiber tracks
+#define GC_TRACK_TID (INT64_C(3) << 24)
+
+// Upper bound on how many bytes `json_output_event` can write for a single event
+#define JSON_OUTPUT_MAX_EVENT_SIZE 2048
+
+// Writes the JSON for the event (one or more lines, each ending with ",\n") into `buffer`, which must have space for
+// at least JSON_OUTPUT_MAX_EVENT_SIZE bytes, and returns how many bytes were written. Timestamps get written in
+// microseconds, with the same 6 decimal places that "%f" would produce.
+size_t json_output_event(char *buffer, const gvl_event *event, int64_t process_id, int64_t relative_timestamp_ns);
+
+// Same as `json_output_event`, but for slices that were folded by the coalescer. The number of slices and time spent in
+// each state get written as args.
+size_t json_output_coalesced_slice(char *buffer, const coalesced_slice *slice, int64_t process_id, int64_t relative_timestamp_ns);
+
+// The summaries written at the end of the trace (see gvl_holder.h, gc_phases.h and fibers.h). Each is a single line
+// ending with ",\n", same as the events.
+size_t json_output_gc_totals(char *buffer, const gc_totals *totals, int64_t process_id, int64_t relative_timestamp_ns);
+size_t json_output_fiber_totals(char *buffer, const fiber_totals *totals, int64_t process_id, int64_t relative_timestamp_ns);
+
+// Upper bound on how many bytes `json_output_gvl_holder_stack` can write for `frames_length` bytes of frames, since each
+// byte can take up to 6 once escaped
+#define JSON_OUTPUT_MAX_GVL_HOLDER_STACK_SIZE(frames_length) (JSON_OUTPUT_MAX_EVENT_SIZE + 6 * (size_t) (frames_length))
+
+// `frames` has one frame per line, same as for `perfetto_output_gvl_holder_stack`
+size_t json_output_gvl_holder_stack(
+  char *buffer,
+  uint32_t stack_id,
+  uint64_t count,
+  uint64_t total_wait_ns,
+  const char *frames,
+  size_t frames_length,
+  int64_t process_id,
+  int64_t relative_timestamp_ns
+);
+
+// Marks when a flight recorder dump happened and why. Unlike everything else, this one doesn't end with ",\n", since
+// the thread names that come after it start with a separator. `reason` must be short, and need no escaping.
+size_t json_output_flight_recorder_dump(char *buffer, const char *reason, int64_t wait_ns, int64_t process_id, int64_t relative_timestamp_ns);
@@ -0,0 +1,568 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "extconf.h"
+#include "output.h"
+
+// These get defined by extconf.rb, if the libraries are available
+#ifdef GVL_TRACING_GZIP
+  #include <zlib.h>
+#endif
+
+#ifdef GVL_TRACING_ZSTD
+  #include <zstd.h>
+#endif
+
+#if !defined(GVL_TRACING_GZIP) && !defined(GVL_TRACING_ZSTD)
+  #define UNUSED_ARG_IF_NO_COMPRESSION __attribute__((unused))
+#else
+  #define UNUSED_ARG_IF_NO_COMPRESSION
+#endif
+
+// Size of the blocks that get handed over to the compressor
+#define BLOCK_SIZE (256 * 1024)
+// Size of the batches that get sent to a socket. This is kept well below the default socket buffer size (e.g. ~200KiB
+// on Linux), so that a collector that's keeping up can always take a full batch in one go.
+#define BATCH_SIZE (64 * 1024)
+// Each batch gets sent prefixed by its length, as a 32-bit big-endian integer
+#define FRAME_HEADER_SIZE 4
+// How many batches can be waiting for the socket to take them, before new ones start getting dropped
+#define MAX_PENDING_BATCHES 4
+#define PENDING_CAPACITY (MAX_PENDING_BATCHES * (FRAME_HEADER_SIZE + BATCH_SIZE))
+// How long closing waits for the collector to take the last batches, before giving up on them
+#define CLOSE_TIMEOUT_MS 1000
+// Same as the zstd command line default
+#define ZSTD_COMPRESSION_LEVEL 3
+
+// macOS does not have MSG_NOSIGNAL, and uses the SO_NOSIGPIPE socket option instead
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+static FILE *file = NULL;
+static int socket_fd = -1;
+static output_compression compression = OUTPUT_COMPRESSION_NONE;
+static int write_error = 0; // First error seen while writing, reported on close
+
+// Only used with compression (where each block gets compressed) or when streaming to a socket (where each block is a
+// batch that gets sent as one frame)
+static char *block = NULL;
+static size_t block_size = 0;
+static size_t block_capacity = 0;
+
+// Only used when streaming to a socket. The socket is non-blocking, so it may take only part of a frame; the rest gets
+// kept here (along with any frames queued up behind it), and sent before anything else.
+static char *pending = NULL;
+static size_t pending_size = 0;
+static size_t pending_sent = 0;
+static uint64_t dropped_batches = 0;
+static uint8_t *compressed = NULL;
+static size_t compressed_capacity = 0;
+
+// Only used when writing to a memory-mapped file
+static int mmap_fd = -1;
+static char *mapping = NULL;
+static size_t mapping_size = 0;
+static size_t mapping_used = 0;
+
+#ifdef GVL_TRACING_GZIP
+  static z_stream gzip_stream;
+#endif
+
+#ifdef GVL_TRACING_ZSTD
+  static ZSTD_CStream *zstd_stream = NULL;
+#endif
+
+bool output_compression_supported(output_compression requested) {
+  switch (requested) {
+    case OUTPUT_COMPRESSION_NONE: return true;
+    #ifdef GVL_TRACING_GZIP
+      case OUTPUT_COMPRESSION_GZIP: return true;
+    #endif
+    #ifdef GVL_TRACING_ZSTD
+      case OUTPUT_COMPRESSION_ZSTD: return true;
+    #endif
+    default: return false;
+  }
+}
+
+static inline void write_file(const void *data, size_t length) {
+  if (length > 0 && fwrite(data, 1, length, file) != length && write_error == 0) write_error = errno ? errno : EIO;
+}
+
+// Compresses the current block; when finishing, also flushes out whatever the compressor still had buffered
+static void compress_block(UNUSED_ARG_IF_NO_COMPRESSION bool finish) {
+  #ifdef GVL_TRACING_GZIP
+    if (compression == OUTPUT_COMPRESSION_GZIP) {
+      gzip_stream.next_in = (Bytef *) block;
+      gzip_stream.avail_in = (uInt) block_size;
+      int result;
+      do {
+        gzip_stream.next_out = compressed;
+        gzip_stream.avail_out = (uInt) compressed_capacity;
+        result = deflate(&gzip_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) {
+          if (write_error == 0) write_error = EIO;
+          break;
+        }
+        write_file(compressed, compressed_capacity - gzip_stream.avail_out);
+      } while (gzip_stream.avail_out == 0 || (finish && result != Z_STREAM_END));
+    }
+  #endif
+
+  #ifdef GVL_TRACING_ZSTD
+    if (compression == OUTPUT_COMPRESSION_ZSTD) {
+      ZSTD_inBuffer input = { block, block_size, 0 };
+      size_t remaining;
+      do {
+        ZSTD_outBuffer output = { compressed, compressed_capacity, 0 };
+        remaining = ZSTD_compressStream2(zstd_stream, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining)) {
+          if (write_error == 0) write_error = EIO;
+          break;
+        }
+        write_file(compressed, output.pos);
+      } while (finish ? remaining != 0 : input.pos < input.size);
+    }
+  #endif
+
+  block_size = 0;
+}
+
+// Keeps sending the pending frames until they're done, or until the socket won't take any more of them. When
+// `timeout_ms` is positive, waits (up to that long each time) for the socket to take more, rather than giving up right
+// away.
+static void send_pending(int timeout_ms) {
+  while (pending_sent < pending_size) {
+    ssize_t sent = send(socket_fd, pending + pending_sent, pending_size - pending_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent > 0) {
+      pending_sent += sent;
+    } else if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      // E.g. the collector went away; nothing else is going to get through
+      if (write_error == 0) write_error = errno;
+      pending_size = pending_sent = 0;
+      return;
+    } else if (timeout_ms <= 0 || poll(&(struct pollfd) { .fd = socket_fd, .events = POLLOUT }, 1, timeout_ms) <= 0) {
+      return;
+    }
+  }
+  pending_size = pending_sent = 0;
+}
+
+// Queues up the current block as a frame, and sends as much as the socket takes. A frame that was partly sent always
+// gets finished; it's only when too many frames are already waiting that the whole batch gets dropped, so the
+// collector either gets a batch or not, but never part of one.
+static void send_batch(int timeout_ms) {
+  send_pending(timeout_ms);
+  if (block_size == 0) return;
+
+  // Makes room by moving what's left to send to the front
+  if (pending_sent > 0) {
+    memmove(pending, pending + pending_sent, pending_size - pending_sent);
+    pending_size -= pending_sent;
+    pending_sent = 0;
+  }
+
+  if (write_error != 0 || pending_size + FRAME_HEADER_SIZE + block_size > PENDING_CAPACITY) {
+    dropped_batches++;
+  } else {
+    uint32_t length = htonl((uint32_t) block_size);
+    memcpy(pending + pending_size, &length, FRAME_HEADER_SIZE);
+    memcpy(pending + pending_size + FRAME_HEADER_SIZE, block, block_size);
+    pending_size += FRAME_HEADER_SIZE + block_size;
+    send_pending(timeout_ms);
+  }
+  block_size = 0;
+}
+
+// Records in the trailer how much of the file has been written
+static inline void mmap_commit(void) {
+  uint64_t length = mapping_used;
+  #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    length = __builtin_bswap64(length);
+  #endif
+  // A single aligned store, so that even if the process dies right here, the trailer has either the old or new length
+  __atomic_store_n((uint64_t *) (mapping + mapping_size - OUTPUT_MMAP_TRAILER_SIZE + 8), length, __ATOMIC_RELEASE);
+}
+
+// Makes sure there's room for `needed` more bytes before the trailer, growing the file (and remapping it) if needed.
+// Returns false if the file could not be grown, in which case the output stops at what was written so far.
+static bool mmap_reserve(size_t needed) {
+  if (mapping_used + needed + OUTPUT_MMAP_TRAILER_SIZE <= mapping_size) return true;
+  if (write_error != 0) return false;
+
+  // Growing by half of the current size keeps how often the file gets remapped low for large traces
+  size_t wanted = mapping_used + needed + OUTPUT_MMAP_TRAILER_SIZE + mapping_size / 2;
+  size_t new_size = (wanted + OUTPUT_MMAP_GROW_SIZE - 1) / OUTPUT_MMAP_GROW_SIZE * OUTPUT_MMAP_GROW_SIZE;
+
+  #ifdef HAVE_POSIX_FALLOCATE
+    // The disk space needs to be there before the pages get written: running out of it while writing to the mapping
+    // would get the process killed with a SIGBUS
+    int error = posix_fallocate(mmap_fd, mapping_size, new_size - mapping_size);
+  #else
+    int error = ftruncate(mmap_fd, new_size) == 0 ? 0 : errno;
+  #endif
+  char *new_mapping = MAP_FAILED;
+  if (error == 0) {
+    new_mapping = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+    if (new_mapping == MAP_FAILED) error = errno;
+  }
+  if (error != 0) {
+    write_error = error;
+    return false;
+  }
+
+  // If the process dies before the new trailer gets written, the one at the previous end of the file is still valid
+  if (mapping != NULL) munmap(mapping, mapping_size);
+  mapping = new_mapping;
+  mapping_size = new_size;
+  memcpy(mapping + mapping_size - OUTPUT_MMAP_TRAILER_SIZE, OUTPUT_MMAP_MAGIC, strlen(OUTPUT_MMAP_MAGIC));
+  mmap_commit();
+  return true;
+}
+
+static void mmap_write(const void *data, size_t length) {
+  if (!mmap_reserve(length)) return;
+
+  memcpy(mapping + mapping_used, data, length);
+  mapping_used += length;
+  mmap_commit();
+}
+
+// Releases the mapping and the file, without changing the file
+static void release_mmap(void) {
+  if (mapping != NULL) munmap(mapping, mapping_size);
+  close(mmap_fd);
+  mmap_fd = -1;
+  mapping = NULL;
+  mapping_size = mapping_used = 0;
+}
+
+// Hands over a full block to the compressor or the socket
+static inline void end_block(void) {
+  if (socket_fd >= 0) send_batch(0);
+  else compress_block(false);
+}
+
+int output_open(const char *path, output_compression requested_compression) {
+  if (!output_compression_supported(requested_compression)) return ENOTSUP;
+
+  file = fopen(path, "wb");
+  if (file == NULL) return errno;
+
+  compression = requested_compression;
+  write_error = 0;
+  if (compression == OUTPUT_COMPRESSION_NONE) return 0;
+
+  block = malloc(BLOCK_SIZE);
+  block_capacity = BLOCK_SIZE;
+  compressed_capacity = BLOCK_SIZE;
+  compressed = malloc(compressed_capacity);
+  block_size = 0;
+  int error = (block == NULL || compressed == NULL) ? ENOMEM : 0;
+
+  #ifdef GVL_TRACING_GZIP
+    if (error == 0 && compression == OUTPUT_COMPRESSION_GZIP) {
+      gzip_stream = (z_stream) { 0 };
+      // windowBits + 16 means: write a gzip header and trailer, rather than a raw zlib stream
+      if (deflateInit2(&gzip_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) error = ENOMEM;
+    }
+  #endif
+
+  #ifdef GVL_TRACING_ZSTD
+    if (error == 0 && compression == OUTPUT_COMPRESSION_ZSTD) {
+      zstd_stream = ZSTD_createCStream();
+      if (zstd_stream == NULL || ZSTD_isError(ZSTD_initCStream(zstd_stream, ZSTD_COMPRESSION_LEVEL))) error = ENOMEM;
+    }
+  #endif
+
+  if (error) {
+    free(block);
+    free(compressed);
+    block = NULL;
+    compressed = NULL;
+    fclose(file);
+    file = NULL;
+  }
+  return error;
+}
+
+int output_open_socket(const char *path) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path)) return ENAMETOOLONG;
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return errno;
+  // The writer thread must never block on the socket, nor should it leak into processes started via exec
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+    int error = errno;
+    close(fd);
+    return error;
+  }
+  #ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int) { 1 }, sizeof(int));
+  #endif
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+    int error = errno;
+    close(fd);
+    return error;
+  }
+
+  block = malloc(BATCH_SIZE);
+  pending = malloc(PENDING_CAPACITY);
+  if (block == NULL || pending == NULL) {
+    free(block);
+    free(pending);
+    block = pending = NULL;
+    close(fd);
+    return ENOMEM;
+  }
+
+  socket_fd = fd;
+  compression = OUTPUT_COMPRESSION_NONE;
+  write_error = 0;
+  block_size = pending_size = pending_sent = 0;
+  block_capacity = BATCH_SIZE;
+  dropped_batches = 0;
+  return 0;
+}
+
+int output_open_mmap(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) return errno;
+
+  mmap_fd = fd;
+  mapping = NULL;
+  mapping_size = mapping_used = 0;
+  compression = OUTPUT_COMPRESSION_NONE;
+  write_error = 0;
+  if (mmap_reserve(0)) return 0;
+
+  int error = write_error;
+  release_mmap();
+  write_error = 0;
+  return error;
+}
+
+bool output_is_open(void) { return file != NULL || socket_fd >= 0 || mmap_fd >= 0; }
+
+uint64_t output_dropped_batches(void) { return dropped_batches; }
+
+void output_write(const void *data, size_t length) {
+  if (mmap_fd >= 0) {
+    mmap_write(data, length);
+    return;
+  }
+  if (block == NULL) {
+    write_file(data, length);
+    return;
+  }
+
+  // Blocks only end between records (each call here is a whole record), so that when streaming to a socket, batches
+  // that get dropped take whole records with them. Only records larger than a block get split.
+  if (block_size > 0 && length > block_capacity - block_size) end_block();
+
+  const char *remaining = data;
+  while (length > 0) {
+    size_t chunk = block_capacity - block_size;
+    if (chunk > length) chunk = length;
+    memcpy(block + block_size, remaining, chunk);
+    block_size += chunk;
+    remaining += chunk;
+    length -= chunk;
+    if (block_size == block_capacity) end_block();
+  }
+}
+
+void output_printf(const char *format, ...) {
+  va_list args;
+
+  if (mmap_fd >= 0) {
+    // Same as below: format directly into the file, and if it doesn't fit, grow it and try again
+    for (int attempt = 0; attempt < 2; attempt++) {
+      size_t available = mapping_size - OUTPUT_MMAP_TRAILER_SIZE - mapping_used;
+      va_start(args, format);
+      int length = vsnprintf(mapping + mapping_used, available, format, args);
+      va_end(args);
+
+      if (length < 0) {
+        if (write_error == 0) write_error = EIO;
+        return;
+      } else if ((size_t) length < available) {
+        mapping_used += length;
+        mmap_commit();
+        return;
+      } else if (!mmap_reserve(length + 1)) {
+        return;
+      }
+    }
+    return;
+  }
+
+  if (block == NULL) {
+    va_start(args, format);
+    if (vfprintf(file, format, args) < 0 && write_error == 0) write_error = errno ? errno : EIO;
+    va_end(args);
+    return;
+  }
+
+  // Try to format directly into the current block, and if it doesn't fit, make room and try again
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t available = block_capacity - block_size;
+    va_start(args, format);
+    int length = vsnprintf(block + block_size, available, format, args);
+    va_end(args);
+
+    if (length < 0) {
+      if (write_error == 0) write_error = EIO;
+      return;
+    } else if ((size_t) length < available) {
+      block_size += length;
+      return;
+    }
+    end_block();
+  }
+
+  // Did not fit even in an empty block; this should not happen for the small records we write
+  if (write_error == 0) write_error = EMSGSIZE;
+}
+
+void output_send_batch(void) {
+  if (socket_fd >= 0) send_batch(0);
+}
+
+void output_flush(void) {
+  // Memory-mapped files need no flushing, as what's written is already in the kernel's hands
+  if (socket_fd >= 0) send_batch(0);
+  else if (mmap_fd >= 0) return;
+  else if (fflush(file) != 0 && write_error == 0) write_error = errno;
+}
+
+// Releases everything used for streaming to a socket, without sending anything else
+static void release_socket(void) {
+  free(block);
+  free(pending);
+  block = pending = NULL;
+  block_size = pending_size = pending_sent = 0;
+  close(socket_fd);
+  socket_fd = -1;
+}
+
+void output_abandon(void) {
+  if (socket_fd >= 0) {
+    release_socket();
+    write_error = 0;
+    return;
+  }
+  if (mmap_fd >= 0) {
+    release_mmap();
+    write_error = 0;
+    return;
+  }
+
+  if (compression != OUTPUT_COMPRESSION_NONE) {
+    #ifdef GVL_TRACING_GZIP
+      if (compression == OUTPUT_COMPRESSION_GZIP) deflateEnd(&gzip_stream);
+    #endif
+    #ifdef GVL_TRACING_ZSTD
+      if (compression == OUTPUT_COMPRESSION_ZSTD) {
+        ZSTD_freeCStream(zstd_stream);
+        zstd_stream = NULL;
+      }
+    #endif
+
+    free(block);
+    free(compressed);
+    block = NULL;
+    compressed = NULL;
+    block_size = 0;
+  }
+
+  fclose(file);
+  file = NULL;
+  compression = OUTPUT_COMPRESSION_NONE;
+  write_error = 0;
+}
+
+int output_close(void) {
+  if (socket_fd >= 0) {
+    send_batch(CLOSE_TIMEOUT_MS);
+    int error = write_error;
+    release_socket();
+    return error;
+  }
+  if (mmap_fd >= 0) {
+    // Cutting off the trailer (and whatever the file had been grown by) leaves just the trace
+    int error = write_error;
+    if (mapping != NULL) munmap(mapping, mapping_size);
+    mapping = NULL;
+    if (ftruncate(mmap_fd, mapping_used) != 0 && error == 0) error = errno;
+    release_mmap();
+    return error;
+  }
+
+  if (compression != OUTPUT_COMPRESSION_NONE) {
+    compress_block(true);
+
+    #ifdef GVL_TRACING_GZIP
+      if (compression == OUTPUT_COMPRESSION_GZIP) deflateEnd(&gzip_stream);
+    #endif
+    #ifdef GVL_TRACING_ZSTD
+      if (compression == OUTPUT_COMPRESSION_ZSTD) {
+        ZSTD_freeCStream(zstd_stream);
+        zstd_stream = NULL;
+      }
+    #endif
+
+    free(block);
+    free(compressed);
+    block = NULL;
+    compressed = NULL;
+  }
+
+  int error = write_error;
+  if (fclose(file) != 0 && error == 0) error = errno;
+  file = NULL;
+  compression = OUTPUT_COMPRESSION_NONE;
+
+  return error;
+}
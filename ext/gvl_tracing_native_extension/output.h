@@ -0,0 +1,96 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Where the trace output actually goes. All writes happen from one thread at a time (the Ruby thread calling start/stop,
+// the writer thread while tracing is running, or whoever is holding the dump mutex for flight recorder dumps), so this is
+// not thread-safe.
+//
+// When compression is enabled, output gets accumulated into large blocks, and each block gets compressed in one go,
+// so the cost of compression is paid by the writer thread and not per event.
+//
+// Output can also be streamed to a collector listening on a Unix domain socket. It then gets sent in batches, each one
+// framed by its length (as a 32-bit big-endian integer). The socket is never waited on while tracing, so when the
+// collector is not keeping up, whole batches get dropped (and counted) instead.
+//
+// Finally, output can go to a memory-mapped file, so that a process that gets killed while tracing (e.g. SIGKILL, or the
+// OOM killer) still leaves behind everything written so far: the kernel owns the pages, so they make it to disk even if
+// the process never gets to. While tracing, the file gets grown OUTPUT_MMAP_GROW_SIZE at a time, and it always ends with
+// a trailer that records how much of it was written (the rest is zeroes). Closing the file cuts it down to what was
+// written, so it ends up the same as any other trace; a file that still ends with a trailer belongs to a process that
+// didn't get to close it, and can be fixed up by `gvl-tracing-repair`.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory-mapped files have a size that's always a multiple of this...
+#define OUTPUT_MMAP_GROW_SIZE (4 * 1024 * 1024)
+// ...and end with a trailer: OUTPUT_MMAP_MAGIC, followed by how many bytes at the start of the file were written, as a
+// 64-bit little-endian integer. If the process died while growing the file, the new end may not have a trailer yet, but
+// then the trailer at the previous end is still there.
+#define OUTPUT_MMAP_MAGIC "GVLTMMAP"
+#define OUTPUT_MMAP_TRAILER_SIZE 16
+
+typedef enum {
+  OUTPUT_COMPRESSION_NONE,
+  OUTPUT_COMPRESSION_GZIP,
+  OUTPUT_COMPRESSION_ZSTD,
+} output_compression;
+
+bool output_compression_supported(output_compression compression);
+
+// Returns an errno value on failure, 0 on success
+int output_open(const char *path, output_compression compression);
+// Returns an errno value on failure, 0 on success
+int output_open_socket(const char *path);
+// Returns an errno value on failure, 0 on success
+int output_open_mmap(const char *path);
+bool output_is_open(void);
+// How many batches did not get sent since the socket was opened
+uint64_t output_dropped_batches(void);
+
+void output_write(const void *data, size_t length);
+
+__attribute__((format(printf, 1, 2)))
+void output_printf(const char *format, ...);
+
+// Sends out what was written so far when streaming to a socket (if the socket can take it); called by the writer thread
+// after each pass, so the collector gets events regularly. Does nothing when writing to a file.
+void output_send_batch(void);
+
+// Makes sure everything that was written to the file so far is not sitting in a stdio buffer, e.g. before forking (when
+// streaming to a socket, this is the same as output_send_batch)
+void output_flush(void);
+
+// Closes the file without writing anything else to it (not even the end of the compressed stream). Used in forked
+// children, where the file belongs to the parent; call output_flush before forking, or the child ends up writing out
+// the parent's buffered output as well.
+void output_abandon(void);
+
+// Finishes the compressed stream (if any) and closes the file. When streaming to a socket, this waits a bit (if needed)
+// for the collector to take the last batch. Returns an errno value on failure, 0 on success.
+int output_close(void);
@@ -0,0 +1,754 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "perfetto_output.h"
+#include "ractors.h"
+#include "span_names.h"
+
+// Field numbers, from https://github.com/google/perfetto/tree/master/protos/perfetto/trace
+#define TRACE_PACKET 1
+
+#define TRACE_PACKET_CLOCK_SNAPSHOT 6
+#define TRACE_PACKET_TIMESTAMP 8
+#define TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID 10
+#define TRACE_PACKET_TRACK_EVENT 11
+#define TRACE_PACKET_INTERNED_DATA 12
+#define TRACE_PACKET_SEQUENCE_FLAGS 13
+#define TRACE_PACKET_TIMESTAMP_CLOCK_ID 58
+#define TRACE_PACKET_TRACE_PACKET_DEFAULTS 59
+#define TRACE_PACKET_TRACK_DESCRIPTOR 60
+
+#define TRACE_PACKET_DEFAULTS_TIMESTAMP_CLOCK_ID 58
+
+#define CLOCK_SNAPSHOT_CLOCKS 1
+#define CLOCK_CLOCK_ID 1
+#define CLOCK_TIMESTAMP 2
+#define CLOCK_IS_INCREMENTAL 3
+
+#define TRACK_EVENT_DEBUG_ANNOTATIONS 4
+#define TRACK_EVENT_TYPE 9
+#define TRACK_EVENT_NAME_IID 10
+#define TRACK_EVENT_TRACK_UUID 11
+#define TRACK_EVENT_NAME 23
+#define TRACK_EVENT_FLOW_IDS 47
+#define TRACK_EVENT_TERMINATING_FLOW_IDS 48
+#define TRACK_EVENT_COUNTER_VALUE 30
+
+#define DEBUG_ANNOTATION_INT_VALUE 4
+#define DEBUG_ANNOTATION_STRING_VALUE 6
+#define DEBUG_ANNOTATION_NAME 10
+
+#define INTERNED_DATA_EVENT_NAMES 2
+#define EVENT_NAME_IID 1
+#define EVENT_NAME_NAME 2
+
+#define TRACK_DESCRIPTOR_UUID 1
+#define TRACK_DESCRIPTOR_NAME 2
+#define TRACK_DESCRIPTOR_PROCESS 3
+#define TRACK_DESCRIPTOR_THREAD 4
+#define TRACK_DESCRIPTOR_PARENT_UUID 5
+#define TRACK_DESCRIPTOR_COUNTER 8
+
+#define PROCESS_DESCRIPTOR_PID 1
+#define PROCESS_DESCRIPTOR_PROCESS_NAME 6
+
+#define THREAD_DESCRIPTOR_PID 1
+#define THREAD_DESCRIPTOR_TID 2
+#define THREAD_DESCRIPTOR_THREAD_NAME 5
+
+// Enum values
+#define SEQ_INCREMENTAL_STATE_CLEARED 1
+#define SEQ_NEEDS_INCREMENTAL_STATE 2
+#define TYPE_SLICE_BEGIN 1
+#define TYPE_SLICE_END 2
+#define TYPE_INSTANT 3
+#define TYPE_COUNTER 4
+#define BUILTIN_CLOCK_BOOTTIME 6
+// Clock ids 64-127 are scoped to a single packet sequence. We define 64 as incremental, so each timestamp gets encoded
+// as the delta from the previous one (which usually fits in one or two bytes).
+#define INCREMENTAL_CLOCK_ID 64
+
+// All packets get written by a single thread (the writer thread), so they all belong to the same sequence
+#define SEQUENCE_ID 1
+
+#define WIRE_TYPE_VARINT 0
+#define WIRE_TYPE_FIXED64 1
+#define WIRE_TYPE_LENGTH_DELIMITED 2
+
+// Nested message lengths get reserved upfront and patched in afterwards, encoded as (possibly redundant) 4-byte
+// varints. This is allowed by the protobuf spec, and it's what perfetto's own protozero does.
+#define NESTED_LENGTH_BYTES 4
+
+#define TRACK_KIND_PROCESS 1
+#define TRACK_KIND_THREAD 2
+#define TRACK_KIND_OS_THREADS_VIEW 3
+#define TRACK_KIND_OS_THREAD 4
+#define TRACK_KIND_FLOW 5 // Not really a track, but flow ids also need to be unique
+#define TRACK_KIND_GC 6
+#define TRACK_KIND_COUNTER 7
+#define TRACK_KIND_SPANS 8
+#define TRACK_KIND_FIBERS 9
+
+// Event names get interned upfront for every event type, and lazily for span names (see span_names.h), after those
+#define SPAN_NAME_IID(name_id) ((uint64_t) EVENT_TYPE_COUNT + 1 + (name_id))
+
+// Extra information attached to an event (shown in the "Arguments" section in the Perfetto UI)
+typedef struct {
+  const char *name;
+  const char *string_value; // If NULL, int_value is used instead
+  int64_t int_value;
+} debug_annotation;
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  bool failed;
+} proto_buffer;
+
+// Open-addressing set of the ids of the tracks that we've already emitted descriptors for
+typedef struct {
+  uint64_t *keys; // 0 is used as the empty marker, so keys are stored +1
+  size_t size;
+  size_t capacity;
+} track_set;
+
+static int64_t process_id = 0;
+static proto_buffer packet = { 0 };
+static track_set seen_threads = { 0 };
+static track_set seen_os_threads = { 0 };
+static track_set seen_span_tracks = { 0 };
+static track_set seen_span_names = { 0 };
+static track_set seen_fiber_tracks = { 0 };
+static track_set seen_ractor_groups = { 0 };
+static bool gc_track_described = false;
+static bool counter_tracks_described = false;
+// Last value written for each of the counter tracks, so only the ones that changed get written
+static int64_t counter_values[3];
+static int64_t previous_timestamp_ns = 0;
+
+static void proto_ensure(proto_buffer *buffer, size_t extra) {
+  if (buffer->size + extra <= buffer->capacity) return;
+
+  size_t new_capacity = buffer->capacity ? buffer->capacity : 256;
+  while (new_capacity < buffer->size + extra) new_capacity *= 2;
+
+  uint8_t *new_data = realloc(buffer->data, new_capacity);
+  if (new_data == NULL) {
+    buffer->failed = true;
+    return;
+  }
+  buffer->data = new_data;
+  buffer->capacity = new_capacity;
+}
+
+static void proto_varint(proto_buffer *buffer, uint64_t value) {
+  proto_ensure(buffer, 10);
+  if (buffer->failed) return;
+
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    buffer->data[buffer->size++] = byte | (value ? 0x80 : 0);
+  } while (value);
+}
+
+static inline void proto_tag(proto_buffer *buffer, uint32_t field, uint32_t wire_type) {
+  proto_varint(buffer, (field << 3) | wire_type);
+}
+
+static inline void proto_uint(proto_buffer *buffer, uint32_t field, uint64_t value) {
+  proto_tag(buffer, field, WIRE_TYPE_VARINT);
+  proto_varint(buffer, value);
+}
+
+static void proto_fixed64(proto_buffer *buffer, uint32_t field, uint64_t value) {
+  proto_tag(buffer, field, WIRE_TYPE_FIXED64);
+  proto_ensure(buffer, 8);
+  if (buffer->failed) return;
+  for (int i = 0; i < 8; i++) buffer->data[buffer->size++] = (uint8_t) (value >> (8 * i));
+}
+
+static void proto_string(proto_buffer *buffer, uint32_t field, const char *value) {
+  size_t length = strlen(value);
+  proto_tag(buffer, field, WIRE_TYPE_LENGTH_DELIMITED);
+  proto_varint(buffer, length);
+  proto_ensure(buffer, length);
+  if (buffer->failed) return;
+  memcpy(buffer->data + buffer->size, value, length);
+  buffer->size += length;
+}
+
+// Returns a marker that must be passed to proto_end
+static size_t proto_begin(proto_buffer *buffer, uint32_t field) {
+  proto_tag(buffer, field, WIRE_TYPE_LENGTH_DELIMITED);
+  proto_ensure(buffer, NESTED_LENGTH_BYTES);
+  if (buffer->failed) return 0;
+  buffer->size += NESTED_LENGTH_BYTES;
+  return buffer->size;
+}
+
+static void proto_end(proto_buffer *buffer, size_t marker) {
+  if (buffer->failed) return;
+
+  size_t length = buffer->size - marker;
+  uint8_t *length_bytes = buffer->data + marker - NESTED_LENGTH_BYTES;
+  for (int i = 0; i < NESTED_LENGTH_BYTES; i++) {
+    length_bytes[i] = (length & 0x7f) | (i < NESTED_LENGTH_BYTES - 1 ? 0x80 : 0);
+    length >>= 7;
+  }
+}
+
+static inline size_t packet_begin(void) {
+  packet.size = 0;
+  packet.failed = false;
+  size_t marker = proto_begin(&packet, TRACE_PACKET);
+  proto_uint(&packet, TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID, SEQUENCE_ID);
+  return marker;
+}
+
+static inline void packet_end(size_t marker) {
+  proto_end(&packet, marker);
+  if (!packet.failed) output_write(packet.data, packet.size);
+}
+
+// Track uuids just need to be unique; we use a mix of the kind of track and its id (splitmix64)
+static uint64_t track_uuid(uint64_t kind, uint64_t id) {
+  uint64_t value = (kind << 56) ^ ((uint64_t) process_id << 32) ^ id;
+  value += UINT64_C(0x9e3779b97f4a7c15);
+  value = (value ^ (value >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  value = (value ^ (value >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return value ^ (value >> 31);
+}
+
+static inline uint64_t thread_track_uuid(int32_t thread_id) { return track_uuid(TRACK_KIND_THREAD, (uint32_t) thread_id); }
+static inline uint64_t os_thread_track_uuid(uint32_t native_thread_id) { return track_uuid(TRACK_KIND_OS_THREAD, native_thread_id); }
+
+static void track_set_free(track_set *set) {
+  free(set->keys);
+  *set = (track_set) { 0 };
+}
+
+// Returns true if the id was added (e.g. it was not in the set before)
+static bool track_set_add(track_set *set, uint64_t id) {
+  uint64_t key = id + 1;
+
+  if ((set->size + 1) * 2 > set->capacity) {
+    size_t new_capacity = set->capacity ? set->capacity * 2 : 64;
+    uint64_t *new_keys = calloc(new_capacity, sizeof(uint64_t));
+    if (new_keys == NULL) return false; // Worst case, we skip a descriptor and perfetto shows the track without a name
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->keys[i] == 0) continue;
+      size_t index = set->keys[i] & (new_capacity - 1);
+      while (new_keys[index] != 0) index = (index + 1) & (new_capacity - 1);
+      new_keys[index] = set->keys[i];
+    }
+    free(set->keys);
+    set->keys = new_keys;
+    set->capacity = new_capacity;
+  }
+
+  size_t index = key & (set->capacity - 1);
+  while (set->keys[index] != 0) {
+    if (set->keys[index] == key) return false;
+    index = (index + 1) & (set->capacity - 1);
+  }
+  set->keys[index] = key;
+  set->size++;
+  return true;
+}
+
+// Threads in Ractors other than the main one get shown in a process of their own, see ractors.h
+static void write_ractor_group_descriptor(uint32_t group) {
+  char name[48];
+  snprintf(name, sizeof(name), "Ractor %u%s (Ruby threads view)", group, group == RACTORS_MAX_GROUPS ? "+" : "");
+
+  size_t packet_marker = packet_begin();
+  size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+  proto_uint(&packet, TRACK_DESCRIPTOR_UUID, track_uuid(TRACK_KIND_PROCESS, group));
+  size_t process = proto_begin(&packet, TRACK_DESCRIPTOR_PROCESS);
+  proto_uint(&packet, PROCESS_DESCRIPTOR_PID, ractors_pid(process_id, group));
+  proto_string(&packet, PROCESS_DESCRIPTOR_PROCESS_NAME, name);
+  proto_end(&packet, process);
+  proto_end(&packet, descriptor);
+  packet_end(packet_marker);
+}
+
+static void write_thread_descriptor(int32_t thread_id, uint32_t ractor, const char *thread_name) {
+  uint32_t group = ractors_group(ractor);
+  if (group != RACTORS_MAIN && track_set_add(&seen_ractor_groups, group)) write_ractor_group_descriptor(group);
+
+  size_t packet_marker = packet_begin();
+  size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+  proto_uint(&packet, TRACK_DESCRIPTOR_UUID, thread_track_uuid(thread_id));
+  size_t thread = proto_begin(&packet, TRACK_DESCRIPTOR_THREAD);
+  proto_uint(&packet, THREAD_DESCRIPTOR_PID, ractors_pid(process_id, group));
+  proto_uint(&packet, THREAD_DESCRIPTOR_TID, thread_id);
+  if (thread_name) proto_string(&packet, THREAD_DESCRIPTOR_THREAD_NAME, thread_name);
+  proto_end(&packet, thread);
+  proto_end(&packet, descriptor);
+  packet_end(packet_marker);
+}
+
+static inline uint32_t thread_ractor(int32_t thread_id) {
+  return ractors_seen() ? ractors_for_thread(thread_id) : RACTORS_UNKNOWN;
+}
+
+static void write_os_thread_descriptor(uint32_t native_thread_id) {
+  char name[32];
+  snprintf(name, sizeof(name), "Native thread %u", native_thread_id);
+
+  size_t packet_marker = packet_begin();
+  size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+  proto_uint(&packet, TRACK_DESCRIPTOR_UUID, os_thread_track_uuid(native_thread_id));
+  proto_uint(&packet, TRACK_DESCRIPTOR_PARENT_UUID, track_uuid(TRACK_KIND_OS_THREADS_VIEW, 0));
+  proto_string(&packet, TRACK_DESCRIPTOR_NAME, name);
+  proto_end(&packet, descriptor);
+  packet_end(packet_marker);
+}
+
+// Events get a delta-encoded timestamp, except in the (rare) case where an event shows up out-of-order (e.g. its thread
+// recorded it right after the writer thread was done draining its buffer); those get an absolute timestamp.
+static void packet_timestamp(int64_t timestamp_ns) {
+  if (timestamp_ns >= previous_timestamp_ns) {
+    proto_uint(&packet, TRACE_PACKET_TIMESTAMP, timestamp_ns - previous_timestamp_ns);
+    previous_timestamp_ns = timestamp_ns;
+  } else {
+    proto_uint(&packet, TRACE_PACKET_TIMESTAMP, timestamp_ns > 0 ? timestamp_ns : 0);
+    proto_uint(&packet, TRACE_PACKET_TIMESTAMP_CLOCK_ID, BUILTIN_CLOCK_BOOTTIME);
+  }
+  proto_uint(&packet, TRACE_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+}
+
+static void write_event(
+  int64_t timestamp_ns,
+  uint64_t track_uuid,
+  uint32_t type,
+  uint64_t name_iid,
+  const char *name,
+  const debug_annotation *annotations,
+  int annotations_count,
+  uint64_t flow_id,
+  uint64_t terminating_flow_id
+) {
+  size_t packet_marker = packet_begin();
+  packet_timestamp(timestamp_ns);
+
+  size_t track_event = proto_begin(&packet, TRACE_PACKET_TRACK_EVENT);
+  proto_uint(&packet, TRACK_EVENT_TYPE, type);
+  proto_uint(&packet, TRACK_EVENT_TRACK_UUID, track_uuid);
+  if (name_iid) proto_uint(&packet, TRACK_EVENT_NAME_IID, name_iid);
+  if (name) proto_string(&packet, TRACK_EVENT_NAME, name);
+  if (flow_id) proto_fixed64(&packet, TRACK_EVENT_FLOW_IDS, flow_id);
+  if (terminating_flow_id) proto_fixed64(&packet, TRACK_EVENT_TERMINATING_FLOW_IDS, terminating_flow_id);
+  for (int i = 0; i < annotations_count; i++) {
+    size_t annotation = proto_begin(&packet, TRACK_EVENT_DEBUG_ANNOTATIONS);
+    proto_string(&packet, DEBUG_ANNOTATION_NAME, annotations[i].name);
+    if (annotations[i].string_value) {
+      proto_string(&packet, DEBUG_ANNOTATION_STRING_VALUE, annotations[i].string_value);
+    } else {
+      proto_uint(&packet, DEBUG_ANNOTATION_INT_VALUE, annotations[i].int_value);
+    }
+    proto_end(&packet, annotation);
+  }
+  proto_end(&packet, track_event);
+
+  packet_end(packet_marker);
+}
+
+static inline void write_slice(int64_t timestamp_ns, uint64_t track_uuid, uint32_t type, uint64_t name_iid, const char *name) {
+  write_event(timestamp_ns, track_uuid, type, name_iid, name, NULL, 0, 0, 0);
+}
+
+// Same as the JSON format, the GC track only ever has one slice going on: marking starts one, sweeping ends it and
+// starts another, and finished just ends it
+static void write_gc_phase(const gvl_event *event, int64_t relative_timestamp_ns) {
+  uint64_t gc_track = track_uuid(TRACK_KIND_GC, 0);
+
+  if (!gc_track_described) {
+    size_t packet_marker = packet_begin();
+    size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+    proto_uint(&packet, TRACK_DESCRIPTOR_UUID, gc_track);
+    proto_uint(&packet, TRACK_DESCRIPTOR_PARENT_UUID, track_uuid(TRACK_KIND_PROCESS, 0));
+    proto_string(&packet, TRACK_DESCRIPTOR_NAME, "GC");
+    proto_end(&packet, descriptor);
+    packet_end(packet_marker);
+    gc_track_described = true;
+  }
+
+  debug_annotation annotations[6];
+  int annotations_count = 0;
+  annotations[annotations_count++] = (debug_annotation) { .name = "thread_id", .int_value = event->thread_id };
+  if (event->type != EVENT_GC_SWEEPING) {
+    annotations[annotations_count++] = (debug_annotation) { .name = "heap_live_slots", .int_value = event->data.gc.heap_live_slots };
+    annotations[annotations_count++] = (debug_annotation) { .name = "heap_free_slots", .int_value = event->data.gc.heap_free_slots };
+  }
+
+  if (event->type == EVENT_GC_FINISHED) {
+    write_event(relative_timestamp_ns, gc_track, TYPE_SLICE_END, 0, NULL, annotations, annotations_count, 0, 0);
+    return;
+  }
+
+  if (event->type == EVENT_GC_SWEEPING) {
+    write_slice(relative_timestamp_ns, gc_track, TYPE_SLICE_END, 0, NULL);
+  } else {
+    const char *major_by = gc_major_by_name(event->data.gc.major_by);
+    if (major_by) annotations[annotations_count++] = (debug_annotation) { .name = "major_by", .string_value = major_by };
+    annotations[annotations_count++] =
+      (debug_annotation) { .name = "triggered_by", .string_value = gc_triggered_by_name(event->data.gc.triggered_by) };
+    annotations[annotations_count++] = (debug_annotation) { .name = "immediate_sweep", .int_value = event->data.gc.immediate_sweep };
+  }
+  write_event(relative_timestamp_ns, gc_track, TYPE_SLICE_BEGIN, event->type + 1, NULL, annotations, annotations_count, 0, 0);
+}
+
+// Each counter gets its own track, and only counters that changed since the last sample get written
+static void write_gvl_counters(const gvl_event *event, int64_t relative_timestamp_ns) {
+  static const char *names[] = { "gvl_threads wants_gvl", "gvl_threads running", "gvl_threads waiting" };
+  int64_t values[] = { event->data.gvl_counters.wants_gvl, event->data.gvl_counters.running, event->data.gvl_counters.waiting };
+
+  for (int i = 0; i < 3; i++) {
+    if (!counter_tracks_described) {
+      size_t packet_marker = packet_begin();
+      size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+      proto_uint(&packet, TRACK_DESCRIPTOR_UUID, track_uuid(TRACK_KIND_COUNTER, i));
+      proto_uint(&packet, TRACK_DESCRIPTOR_PARENT_UUID, track_uuid(TRACK_KIND_PROCESS, 0));
+      proto_string(&packet, TRACK_DESCRIPTOR_NAME, names[i]);
+      proto_end(&packet, proto_begin(&packet, TRACK_DESCRIPTOR_COUNTER)); // Empty, the defaults are fine
+      proto_end(&packet, descriptor);
+      packet_end(packet_marker);
+    } else if (values[i] == counter_values[i]) {
+      continue;
+    }
+    counter_values[i] = values[i];
+
+    size_t packet_marker = packet_begin();
+    packet_timestamp(relative_timestamp_ns);
+    size_t track_event = proto_begin(&packet, TRACE_PACKET_TRACK_EVENT);
+    proto_uint(&packet, TRACK_EVENT_TYPE, TYPE_COUNTER);
+    proto_uint(&packet, TRACK_EVENT_TRACK_UUID, track_uuid(TRACK_KIND_COUNTER, i));
+    proto_uint(&packet, TRACK_EVENT_COUNTER_VALUE, values[i]);
+    proto_end(&packet, track_event);
+    packet_end(packet_marker);
+  }
+  counter_tracks_described = true;
+}
+
+// Each thread gets a child track for its spans, since these don't nest with its GVL slices
+static void write_span(const gvl_event *event, int64_t relative_timestamp_ns) {
+  uint64_t span_track = track_uuid(TRACK_KIND_SPANS, (uint32_t) event->thread_id);
+
+  if (track_set_add(&seen_span_tracks, (uint32_t) event->thread_id)) {
+    // The parent track needs to be described first, and it's fine if it gets described again by its first GVL slice
+    write_thread_descriptor(event->thread_id, thread_ractor(event->thread_id), NULL);
+
+    size_t packet_marker = packet_begin();
+    size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+    proto_uint(&packet, TRACK_DESCRIPTOR_UUID, span_track);
+    proto_uint(&packet, TRACK_DESCRIPTOR_PARENT_UUID, thread_track_uuid(event->thread_id));
+    proto_string(&packet, TRACK_DESCRIPTOR_NAME, "spans");
+    proto_end(&packet, descriptor);
+    packet_end(packet_marker);
+  }
+
+  if (event->type == EVENT_SPAN_END) {
+    write_slice(relative_timestamp_ns, span_track, TYPE_SLICE_END, 0, NULL);
+    return;
+  }
+
+  uint32_t name_id = event->data.span.name_id;
+  if (track_set_add(&seen_span_names, name_id)) {
+    size_t packet_marker = packet_begin();
+    proto_uint(&packet, TRACE_PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+    size_t interned_data = proto_begin(&packet, TRACE_PACKET_INTERNED_DATA);
+    size_t event_name = proto_begin(&packet, INTERNED_DATA_EVENT_NAMES);
+    proto_uint(&packet, EVENT_NAME_IID, SPAN_NAME_IID(name_id));
+    proto_string(&packet, EVENT_NAME_NAME, span_names_get(name_id));
+    proto_end(&packet, event_name);
+    proto_end(&packet, interned_data);
+    packet_end(packet_marker);
+  }
+  write_slice(relative_timestamp_ns, span_track, TYPE_SLICE_BEGIN, SPAN_NAME_IID(name_id), NULL);
+}
+
+// Same as spans, each thread gets a child track for its fibers. Only one fiber runs at a time, so each switch ends the
+// previous slice; fiber serials are unbounded, so the names don't get interned.
+static void write_fiber_switch(const gvl_event *event, int64_t relative_timestamp_ns) {
+  uint64_t fiber_track = track_uuid(TRACK_KIND_FIBERS, (uint32_t) event->thread_id);
+
+  if (track_set_add(&seen_fiber_tracks, (uint32_t) event->thread_id)) {
+    write_thread_descriptor(event->thread_id, thread_ractor(event->thread_id), NULL);
+
+    size_t packet_marker = packet_begin();
+    size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+    proto_uint(&packet, TRACK_DESCRIPTOR_UUID, fiber_track);
+    proto_uint(&packet, TRACK_DESCRIPTOR_PARENT_UUID, thread_track_uuid(event->thread_id));
+    proto_string(&packet, TRACK_DESCRIPTOR_NAME, "fibers");
+    proto_end(&packet, descriptor);
+    packet_end(packet_marker);
+  } else {
+    write_slice(relative_timestamp_ns, fiber_track, TYPE_SLICE_END, 0, NULL);
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "fiber %u", event->data.fiber.serial);
+  write_slice(relative_timestamp_ns, fiber_track, TYPE_SLICE_BEGIN, 0, name);
+}
+
+void perfetto_output_start(int64_t pid, const char *process_name, bool os_threads_view_enabled) {
+  process_id = pid;
+  previous_timestamp_ns = 0;
+  gc_track_described = false;
+  counter_tracks_described = false;
+
+  // First packet: reset the sequence state, set the default clock, intern event names, and describe the process
+  size_t packet_marker = packet_begin();
+  proto_uint(&packet, TRACE_PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+
+  size_t defaults = proto_begin(&packet, TRACE_PACKET_TRACE_PACKET_DEFAULTS);
+  proto_uint(&packet, TRACE_PACKET_DEFAULTS_TIMESTAMP_CLOCK_ID, INCREMENTAL_CLOCK_ID);
+  proto_end(&packet, defaults);
+
+  size_t interned_data = proto_begin(&packet, TRACE_PACKET_INTERNED_DATA);
+  for (int type = 0; type < EVENT_TYPE_COUNT; type++) {
+    size_t event_name = proto_begin(&packet, INTERNED_DATA_EVENT_NAMES);
+    proto_uint(&packet, EVENT_NAME_IID, type + 1);
+    proto_string(&packet, EVENT_NAME_NAME, event_type_name(type));
+    proto_end(&packet, event_name);
+  }
+  proto_end(&packet, interned_data);
+
+  size_t descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+  proto_uint(&packet, TRACK_DESCRIPTOR_UUID, track_uuid(TRACK_KIND_PROCESS, 0));
+  size_t process = proto_begin(&packet, TRACK_DESCRIPTOR_PROCESS);
+  proto_uint(&packet, PROCESS_DESCRIPTOR_PID, process_id);
+  proto_string(&packet, PROCESS_DESCRIPTOR_PROCESS_NAME, process_name);
+  proto_end(&packet, process);
+  proto_end(&packet, descriptor);
+
+  packet_end(packet_marker);
+
+  // Second packet: Timestamps in the incremental clock start at 0 == when tracing started
+  packet_marker = packet_begin();
+  size_t clock_snapshot = proto_begin(&packet, TRACE_PACKET_CLOCK_SNAPSHOT);
+  size_t clock = proto_begin(&packet, CLOCK_SNAPSHOT_CLOCKS);
+  proto_uint(&packet, CLOCK_CLOCK_ID, BUILTIN_CLOCK_BOOTTIME);
+  proto_uint(&packet, CLOCK_TIMESTAMP, 0);
+  proto_end(&packet, clock);
+  clock = proto_begin(&packet, CLOCK_SNAPSHOT_CLOCKS);
+  proto_uint(&packet, CLOCK_CLOCK_ID, INCREMENTAL_CLOCK_ID);
+  proto_uint(&packet, CLOCK_TIMESTAMP, 0);
+  proto_uint(&packet, CLOCK_IS_INCREMENTAL, 1);
+  proto_end(&packet, clock);
+  proto_end(&packet, clock_snapshot);
+  packet_end(packet_marker);
+
+  if (os_threads_view_enabled) {
+    packet_marker = packet_begin();
+    descriptor = proto_begin(&packet, TRACE_PACKET_TRACK_DESCRIPTOR);
+    proto_uint(&packet, TRACK_DESCRIPTOR_UUID, track_uuid(TRACK_KIND_OS_THREADS_VIEW, 0));
+    proto_string(&packet, TRACK_DESCRIPTOR_NAME, "OS threads view");
+    proto_end(&packet, descriptor);
+    packet_end(packet_marker);
+  }
+}
+
+void perfetto_output_event(const gvl_event *event, int64_t relative_timestamp_ns) {
+  if (event_type_is_gc_phase(event->type)) {
+    write_gc_phase(event, relative_timestamp_ns);
+    return;
+  }
+  if (event->type == EVENT_GVL_COUNTERS) {
+    write_gvl_counters(event, relative_timestamp_ns);
+    return;
+  }
+  if (event_type_is_span(event->type)) {
+    write_span(event, relative_timestamp_ns);
+    return;
+  }
+  if (event->type == EVENT_FIBER_SWITCH) {
+    write_fiber_switch(event, relative_timestamp_ns);
+    return;
+  }
+
+  uint64_t thread_track = thread_track_uuid(event->thread_id);
+
+  bool new_thread = track_set_add(&seen_threads, (uint32_t) event->thread_id);
+  if (new_thread) write_thread_descriptor(event->thread_id, thread_ractor(event->thread_id), NULL);
+
+  if (event->type == EVENT_GVL_HOLDER) {
+    debug_annotation annotations[] = {
+      { .name = "holder_thread_id", .int_value = event->data.gvl_holder.thread_id },
+      { .name = "stack_id", .int_value = event->data.gvl_holder.stack_id },
+      { .name = "wait_us", .int_value = event->data.gvl_holder.wait_us },
+    };
+    write_event(relative_timestamp_ns, thread_track, TYPE_INSTANT, event->type + 1, NULL, annotations, 3, 0, 0);
+    return;
+  }
+
+  // Same as the JSON format, each event ends the previous slice for the thread and starts a new one
+  if (!new_thread && (event->flags & EVENT_FLAG_CPU_TIME)) {
+    debug_annotation annotations[] = {
+      { .name = "cpu_us", .int_value = event->data.flow.on_cpu_us },
+      { .name = "cpu", .int_value = event->data.flow.cpu },
+    };
+    write_event(relative_timestamp_ns, thread_track, TYPE_SLICE_END, 0, NULL, annotations, event->data.flow.cpu >= 0 ? 2 : 1, 0, 0);
+  } else if (!new_thread) {
+    write_slice(relative_timestamp_ns, thread_track, TYPE_SLICE_END, 0, NULL);
+  }
+  // GVL handoffs get shown as arrows from the slice of the thread that released the GVL to the thread that got it
+  uint64_t flow_id = track_uuid(TRACK_KIND_FLOW, event->data.flow.id);
+  // Label set with GvlTracing.set_context
+  debug_annotation context = { .name = "context", .string_value = event->context_id ? span_names_get(event->context_id) : NULL };
+  write_event(
+    relative_timestamp_ns, thread_track, TYPE_SLICE_BEGIN, event->type + 1, NULL, &context, event->context_id ? 1 : 0,
+    (event->flags & EVENT_FLAG_FLOW_BEGIN) ? flow_id : 0,
+    (event->flags & EVENT_FLAG_FLOW_END) ? flow_id : 0
+  );
+
+  if (event->flags & (EVENT_FLAG_OS_THREAD_BEGIN | EVENT_FLAG_OS_THREAD_END)) {
+    uint64_t os_thread_track = os_thread_track_uuid(event->native_thread_id);
+
+    if (track_set_add(&seen_os_threads, event->native_thread_id)) {
+      write_os_thread_descriptor(event->native_thread_id);
+    } else {
+      write_slice(relative_timestamp_ns, os_thread_track, TYPE_SLICE_END, 0, NULL);
+    }
+
+    if (event->flags & EVENT_FLAG_OS_THREAD_BEGIN) {
+      // See render_os_thread_event in gvl_tracing.c for why we add the letter
+      char name[32];
+      snprintf(name, sizeof(name), "Thread %d (%c)", event->thread_id, 'a' + (event->thread_id % 26));
+      write_slice(relative_timestamp_ns, os_thread_track, TYPE_SLICE_BEGIN, 0, name);
+    }
+  }
+}
+
+void perfetto_output_coalesced_slice(const coalesced_slice *slice, int64_t relative_timestamp_ns) {
+  uint64_t thread_track = thread_track_uuid(slice->thread_id);
+
+  if (track_set_add(&seen_threads, (uint32_t) slice->thread_id)) {
+    write_thread_descriptor(slice->thread_id, thread_ractor(slice->thread_id), NULL);
+  } else {
+    write_slice(relative_timestamp_ns, thread_track, TYPE_SLICE_END, 0, NULL);
+  }
+
+  char names[EVENT_TYPE_COUNT * 2][32];
+  debug_annotation annotations[1 + EVENT_TYPE_COUNT * 2];
+  int annotations_count = 0;
+
+  annotations[annotations_count++] = (debug_annotation) { .name = "slices", .int_value = slice->slices };
+  for (int type = 0; type < EVENT_TYPE_COUNT; type++) {
+    if (slice->count[type] == 0) continue;
+
+    char *count_name = names[type * 2];
+    char *time_name = names[type * 2 + 1];
+    snprintf(count_name, sizeof(names[0]), "%s_count", event_type_name(type));
+    snprintf(time_name, sizeof(names[0]), "%s_ns", event_type_name(type));
+    annotations[annotations_count++] = (debug_annotation) { .name = count_name, .int_value = slice->count[type] };
+    annotations[annotations_count++] = (debug_annotation) { .name = time_name, .int_value = (int64_t) slice->time_ns[type] };
+  }
+
+  write_event(relative_timestamp_ns, thread_track, TYPE_SLICE_BEGIN, EVENT_COALESCED + 1, NULL, annotations, annotations_count, 0, 0);
+}
+
+void perfetto_output_thread_name(int32_t thread_id, uint32_t ractor, const char *thread_name) {
+  // Track descriptors can be emitted more than once; the last one wins
+  write_thread_descriptor(thread_id, ractor, thread_name);
+}
+
+void perfetto_output_gvl_holder_stack(
+  int64_t relative_timestamp_ns,
+  uint32_t stack_id,
+  uint64_t count,
+  uint64_t total_wait_ns,
+  const char *frames
+) {
+  debug_annotation annotations[] = {
+    { .name = "stack_id", .int_value = stack_id },
+    { .name = "count", .int_value = (int64_t) count },
+    { .name = "total_wait_us", .int_value = (int64_t) (total_wait_ns / 1000) },
+    { .name = "frames", .string_value = frames },
+  };
+  write_event(relative_timestamp_ns, track_uuid(TRACK_KIND_PROCESS, 0), TYPE_INSTANT, 0, "gvl_holder_stack", annotations, 4, 0, 0);
+}
+
+void perfetto_output_flight_recorder_dump(int64_t relative_timestamp_ns, const char *reason, int64_t wait_ns) {
+  debug_annotation annotations[] = {
+    { .name = "reason", .string_value = reason },
+    { .name = "wait_us", .int_value = wait_ns / 1000 },
+  };
+  write_event(relative_timestamp_ns, track_uuid(TRACK_KIND_PROCESS, 0), TYPE_INSTANT, 0, "flight_recorder_dump", annotations, 2, 0, 0);
+}
+
+void perfetto_output_gc_totals(int64_t relative_timestamp_ns, const gc_totals *totals) {
+  debug_annotation annotations[] = {
+    { .name = "minor_count", .int_value = (int64_t) totals->minor.count },
+    { .name = "minor_marking_us", .int_value = (int64_t) (totals->minor.marking_ns / 1000) },
+    { .name = "minor_sweeping_us", .int_value = (int64_t) (totals->minor.sweeping_ns / 1000) },
+    { .name = "minor_marking_pause_us", .int_value = (int64_t) (totals->minor.marking_pause_ns / 1000) },
+    { .name = "minor_sweeping_pause_us", .int_value = (int64_t) (totals->minor.sweeping_pause_ns / 1000) },
+    { .name = "major_count", .int_value = (int64_t) totals->major.count },
+    { .name = "major_marking_us", .int_value = (int64_t) (totals->major.marking_ns / 1000) },
+    { .name = "major_sweeping_us", .int_value = (int64_t) (totals->major.sweeping_ns / 1000) },
+    { .name = "major_marking_pause_us", .int_value = (int64_t) (totals->major.marking_pause_ns / 1000) },
+    { .name = "major_sweeping_pause_us", .int_value = (int64_t) (totals->major.sweeping_pause_ns / 1000) },
+  };
+  write_event(relative_timestamp_ns, track_uuid(TRACK_KIND_PROCESS, 0), TYPE_INSTANT, 0, "gc_totals", annotations, 10, 0, 0);
+}
+
+void perfetto_output_fiber_totals(int64_t relative_timestamp_ns, const fiber_totals *totals) {
+  debug_annotation annotations[] = {
+    { .name = "switches", .int_value = (int64_t) totals->switches },
+    { .name = "runnable_waiting_for_gvl_count", .int_value = (int64_t) totals->wants_gvl_count },
+    { .name = "runnable_waiting_for_gvl_us", .int_value = (int64_t) (totals->wants_gvl_ns / 1000) },
+  };
+  write_event(relative_timestamp_ns, track_uuid(TRACK_KIND_PROCESS, 0), TYPE_INSTANT, 0, "fiber_totals", annotations, 3, 0, 0);
+}
+
+void perfetto_output_clock_calibration(const timestamps_calibration *calibration) {
+  debug_annotation annotations[] = {
+    { .name = "source", .string_value = "tsc" },
+    { .name = "ticks_per_second", .int_value = (int64_t) calibration->ticks_per_second },
+    { .name = "calibrated_at_ticks", .int_value = (int64_t) calibration->calibrated_at_ticks },
+    { .name = "calibrated_at_ns", .int_value = calibration->calibrated_at_ns },
+  };
+  write_event(0, track_uuid(TRACK_KIND_PROCESS, 0), TYPE_INSTANT, 0, "clock", annotations, 4, 0, 0);
+}
+
+void perfetto_output_finish(void) {
+  free(packet.data);
+  packet = (proto_buffer) { 0 };
+  track_set_free(&seen_threads);
+  track_set_free(&seen_os_threads);
+  track_set_free(&seen_span_tracks);
+  track_set_free(&seen_span_names);
+  track_set_free(&seen_fiber_tracks);
+  track_set_free(&seen_ractor_groups);
+}
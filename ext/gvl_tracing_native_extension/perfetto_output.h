@@ -0,0 +1,80 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Writes traces using the native perfetto protobuf format, which is a lot more compact (and quicker to load) than the
+// JSON format. See https://perfetto.dev/docs/reference/trace-packet-proto for the reference docs.
+//
+// We don't depend on protobuf/protozero; the handful of messages we need are encoded by hand.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "coalescer.h"
+#include "fibers.h"
+#include "gc_phases.h"
+#include "gvl_event.h"
+#include "timestamps.h"
+
+// Emits the initial packets (clock definition, interned event names, process track). Must be called before any other
+// perfetto_output_* function.
+void perfetto_output_start(int64_t process_id, const char *process_name, bool os_threads_view_enabled);
+
+// Timestamp is in nanoseconds since tracing started
+void perfetto_output_event(const gvl_event *event, int64_t relative_timestamp_ns);
+
+// Slices folded by the coalescer get written as a "coalesced" slice, with the number of slices and time spent in each
+// state as debug annotations
+void perfetto_output_coalesced_slice(const coalesced_slice *slice, int64_t relative_timestamp_ns);
+
+// `ractor` is the Ractor the thread belongs to (see ractors.h)
+void perfetto_output_thread_name(int32_t thread_id, uint32_t ractor, const char *thread_name);
+
+// Writes one entry of the GVL holder stacks summary (see gvl_holder.h), as an instant event on the process track.
+// `frames` has one frame per line.
+void perfetto_output_gvl_holder_stack(
+  int64_t relative_timestamp_ns,
+  uint32_t stack_id,
+  uint64_t count,
+  uint64_t total_wait_ns,
+  const char *frames
+);
+
+// Marks when a flight recorder dump was taken (see flight_recorder.h), as an instant event on the process track
+void perfetto_output_flight_recorder_dump(int64_t relative_timestamp_ns, const char *reason, int64_t wait_ns);
+
+// Writes the GC totals (see gc_phases.h), as an instant event on the process track
+void perfetto_output_gc_totals(int64_t relative_timestamp_ns, const gc_totals *totals);
+
+// Writes the fiber totals (see fibers.h), as an instant event on the process track
+void perfetto_output_fiber_totals(int64_t relative_timestamp_ns, const fiber_totals *totals);
+
+// Records how timestamps got converted from the CPU's counter (see timestamps.h), as an instant event on the process
+// track at the start of the trace
+void perfetto_output_clock_calibration(const timestamps_calibration *calibration);
+
+// Releases the memory used by the perfetto output; does not close the output
+void perfetto_output_finish(void);
@@ -0,0 +1,82 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+#include <ruby/ractor.h>
+
+#include <stdint.h>
+
+#include "ractors.h"
+#include "thread_registry.h"
+
+// Direct-mapped by thread id, so that looking up a thread's Ractor when writing its events needs no locks. Each entry
+// is (thread id << 32) | Ractor serial, so readers can tell if it's for the thread they're looking for; threads that
+// don't fit (or got pushed out by another thread) get looked up in the thread registry instead.
+#define THREAD_RACTORS_SIZE 4096
+
+static rb_ractor_local_key_t serial_key;
+static uint32_t next_serial = RACTORS_MAIN + 1;
+static bool seen_other_ractors = false;
+static uint64_t thread_ractors[THREAD_RACTORS_SIZE];
+
+void ractors_init(void) {
+  serial_key = rb_ractor_local_storage_ptr_newkey(NULL);
+  rb_ractor_local_storage_ptr_set(serial_key, (void *) (uintptr_t) RACTORS_MAIN);
+}
+
+uint32_t ractors_current(void) {
+  uint32_t serial = (uint32_t) (uintptr_t) rb_ractor_local_storage_ptr(serial_key);
+  if (serial != RACTORS_UNKNOWN) return serial;
+
+  serial = __atomic_fetch_add(&next_serial, 1, __ATOMIC_RELAXED);
+  rb_ractor_local_storage_ptr_set(serial_key, (void *) (uintptr_t) serial);
+  __atomic_store_n(&seen_other_ractors, true, __ATOMIC_RELEASE);
+  return serial;
+}
+
+bool ractors_seen(void) {
+  return __atomic_load_n(&seen_other_ractors, __ATOMIC_ACQUIRE);
+}
+
+void ractors_set_thread(int32_t thread_id, uint32_t ractor) {
+  uint64_t entry = (((uint64_t) (uint32_t) thread_id) << 32) | ractor;
+  __atomic_store_n(&thread_ractors[(uint32_t) thread_id % THREAD_RACTORS_SIZE], entry, __ATOMIC_RELAXED);
+}
+
+uint32_t ractors_for_thread(int32_t thread_id) {
+  uint64_t entry = __atomic_load_n(&thread_ractors[(uint32_t) thread_id % THREAD_RACTORS_SIZE], __ATOMIC_RELAXED);
+  if ((uint32_t) (entry >> 32) == (uint32_t) thread_id) return (uint32_t) entry;
+
+  return thread_registry_ractor(thread_id);
+}
+
+uint32_t ractors_group(uint32_t ractor) {
+  if (ractor == RACTORS_UNKNOWN) return RACTORS_MAIN;
+  return ractor > RACTORS_MAX_GROUPS ? RACTORS_MAX_GROUPS : ractor;
+}
+
+int64_t ractors_pid(int64_t process_id, uint32_t group) {
+  return process_id + ((int64_t) group - RACTORS_MAIN) * (1 << 22);
+}
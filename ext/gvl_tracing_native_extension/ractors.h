@@ -0,0 +1,71 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Ractors: Each Ractor has its own GVL, so threads in different Ractors don't compete with each other, and a trace
+// that mixes them all together makes it look like they do. Each Ractor gets a serial (the main Ractor is 1, the others
+// get one the first time one of their threads is seen) and its threads get shown in a separate process group, so each
+// Ractor's threads line up with each other and with nothing else.
+//
+// The serial for each thread gets looked up when its events get written, rather than being recorded with every
+// event: this way events stay the same size, and nothing changes unless another Ractor ever shows up.
+//
+// Ractors only get told apart on Ruby 3.3+; on 3.2 every thread counts as being in the main Ractor.
+//
+// Other than `ractors_init` and `ractors_current`, this is Ruby-agnostic, since it gets used from the writer thread.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 0 is used for threads whose Ractor is not known (yet), which get shown with the main Ractor
+#define RACTORS_UNKNOWN 0
+#define RACTORS_MAIN 1
+// Each Ractor other than the main one gets its own pid in the trace (see `ractors_pid`), so only so many fit; any others
+// get shown together with the last of them
+#define RACTORS_MAX_GROUPS 512
+
+// Must be called once, from the extension's init function (which always runs in the main Ractor)
+void ractors_init(void);
+
+// Returns the serial for the current Ractor, assigning one if needed. Must be called while holding the GVL.
+uint32_t ractors_current(void);
+
+// Whether any Ractor other than the main one was ever seen; until then, there's nothing to look up
+bool ractors_seen(void);
+
+// Records which Ractor a thread belongs to. Safe to call without the GVL.
+void ractors_set_thread(int32_t thread_id, uint32_t ractor);
+
+// Returns which Ractor a thread belongs to, or RACTORS_UNKNOWN. Safe to call from any thread.
+uint32_t ractors_for_thread(int32_t thread_id);
+
+// Which group of the trace the Ractor gets shown in: RACTORS_MAIN for the main Ractor (or an unknown one), otherwise the
+// Ractor's serial, capped to RACTORS_MAX_GROUPS
+uint32_t ractors_group(uint32_t ractor);
+
+// The pid that a group gets shown with; for the main Ractor, it's the process id. Linux pids are below 2^22, so these
+// never clash with a real pid (and stay below 2^31).
+int64_t ractors_pid(int64_t process_id, uint32_t group);
@@ -0,0 +1,121 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "span_names.h"
+
+// Twice as many slots as names, so probes stay short
+#define INDEX_SIZE (SPAN_NAMES_MAX * 2)
+
+typedef struct {
+  char *name;
+  char *json_name;
+  size_t length;
+  uint32_t hash;
+} span_name;
+
+static pthread_mutex_t span_names_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Indexed by id; the first entry is never used
+static span_name names[SPAN_NAMES_MAX + 1];
+static uint32_t names_in_use = 1;
+// Open-addressing index from name to id (0 marks empty slots); only used while holding the mutex
+static uint32_t index_by_name[INDEX_SIZE];
+
+// FNV-1a, same as the thread registry
+static uint32_t hash_of(const char *value, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char) value[i]) * 16777619u;
+  return hash;
+}
+
+// Returns NULL on allocation failure
+static char *json_escape(const char *value, size_t length) {
+  char *result = malloc(length * 6 + 1); // Worst case, every character becomes \u00XX
+  if (result == NULL) return NULL;
+
+  char *out = result;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char) value[i];
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = (char) c;
+    } else if (c < 0x20) {
+      out += snprintf(out, 7, "\\u%04x", c);
+    } else {
+      *out++ = (char) c;
+    }
+  }
+  *out = '\0';
+  return result;
+}
+
+uint32_t span_names_intern(const char *name, size_t length) {
+  if (length > SPAN_NAME_MAX_LENGTH) length = SPAN_NAME_MAX_LENGTH;
+  uint32_t hash = hash_of(name, length);
+  uint32_t id = 0;
+
+  pthread_mutex_lock(&span_names_mutex);
+
+  uint32_t slot = hash % INDEX_SIZE;
+  while (index_by_name[slot] != 0) {
+    span_name *existing = &names[index_by_name[slot]];
+    if (existing->hash == hash && existing->length == length && memcmp(existing->name, name, length) == 0) {
+      id = index_by_name[slot];
+      break;
+    }
+    slot = (slot + 1) % INDEX_SIZE;
+  }
+
+  if (id == 0 && names_in_use <= SPAN_NAMES_MAX) {
+    char *copy = malloc(length + 1);
+    char *json_name = json_escape(name, length);
+    if (copy != NULL && json_name != NULL) {
+      memcpy(copy, name, length);
+      copy[length] = '\0';
+      id = names_in_use++;
+      names[id] = (span_name) { .name = copy, .json_name = json_name, .length = length, .hash = hash };
+      index_by_name[slot] = id;
+    } else {
+      free(copy);
+      free(json_name);
+    }
+  }
+
+  pthread_mutex_unlock(&span_names_mutex);
+  return id;
+}
+
+const char *span_names_get(uint32_t id) {
+  return (id > 0 && id <= SPAN_NAMES_MAX && names[id].name != NULL) ? names[id].name : "unknown_span";
+}
+
+const char *span_names_get_json(uint32_t id) {
+  return (id > 0 && id <= SPAN_NAMES_MAX && names[id].json_name != NULL) ? names[id].json_name : "unknown_span";
+}
@@ -0,0 +1,52 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Span names: Custom spans (see gvl_tracing.h) refer to their name by id, so that recording a span costs the same as
+// recording any other event, and each name only gets copied (and escaped for the JSON output) once. The labels set with
+// `GvlTracing.set_context` get interned here as well.
+//
+// Names are never removed, since events referring to them may still be waiting to be written (or sitting in the flight
+// recorder). Applications only have a handful of different span names, so there's a fixed cap on how many there can be.
+//
+// Interning is safe to call from any thread (with or without the GVL). Reading the names back does not take any locks:
+// an id only gets handed out after its name is fully set up.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPAN_NAMES_MAX 4096
+// Longer names get truncated
+#define SPAN_NAME_MAX_LENGTH 128
+
+// Returns the id for `name`, which is never 0, except if there's no space for more names (or allocation failed)
+uint32_t span_names_intern(const char *name, size_t length);
+
+// Returns "unknown_span" for id 0 (and any other id that was not returned by span_names_intern)
+const char *span_names_get(uint32_t id);
+
+// Same as span_names_get, but with quotes, backslashes and control characters escaped, ready to go in a JSON string
+const char *span_names_get_json(uint32_t id);
@@ -0,0 +1,176 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Unlike the event buffers, the list of thread stats only gets read when taking a snapshot, which is not a hot path, so
+// a plain mutex is used for everything.
+static thread_stats *all_stats = NULL;
+static thread_stats dead_threads_stats = { 0 };
+static pthread_mutex_t all_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t current_generation = 1;
+
+thread_stats *thread_stats_new(int32_t thread_id) {
+  // Note: We deliberately don't use ruby_xcalloc here, since this gets called from hooks that don't hold the GVL
+  thread_stats *stats = calloc(1, sizeof(thread_stats));
+  if (stats == NULL) return NULL;
+
+  stats->thread_id = thread_id;
+  stats->current_state = STATS_STATE_UNKNOWN;
+
+  pthread_mutex_lock(&all_stats_mutex);
+  stats->generation = current_generation;
+  stats->next = all_stats;
+  all_stats = stats;
+  pthread_mutex_unlock(&all_stats_mutex);
+
+  return stats;
+}
+
+void thread_stats_release(thread_stats *stats) {
+  if (stats != NULL) __atomic_store_n(&stats->owner_gone, true, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int histogram_bucket(int64_t duration_ns) {
+  uint64_t duration_us = duration_ns > 0 ? ((uint64_t) duration_ns) / 1000 : 0;
+  unsigned int bucket = duration_us == 0 ? 0 : (64 - __builtin_clzll(duration_us));
+  return bucket < STATS_HISTOGRAM_BUCKETS ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+// The owning thread is the only one updating its stats, but a snapshot can be reading them at the same time, so
+// updates use atomic stores to avoid torn values (but there's no attempt at making a snapshot fully consistent).
+static inline void add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void thread_stats_transition(thread_stats *stats, event_type new_state, int64_t now_ns) {
+  uint32_t generation = __atomic_load_n(&current_generation, __ATOMIC_RELAXED);
+  if (stats->generation != generation) {
+    // Stats were reset since this thread last updated them
+    memset(stats->time_ns, 0, sizeof(stats->time_ns));
+    memset(stats->wants_gvl_histogram, 0, sizeof(stats->wants_gvl_histogram));
+    stats->wants_gvl_count = 0;
+    stats->gvl_held_ns = 0;
+    stats->gvl_held_on_cpu_ns = 0;
+    stats->current_state = STATS_STATE_UNKNOWN;
+    __atomic_store_n(&stats->generation, generation, __ATOMIC_RELEASE);
+  }
+
+  uint8_t previous_state = stats->current_state;
+  int64_t elapsed_ns = now_ns - stats->current_state_since_ns;
+
+  if (previous_state != STATS_STATE_UNKNOWN && elapsed_ns > 0) {
+    add(&stats->time_ns[previous_state], elapsed_ns);
+
+    if (previous_state == EVENT_WANTS_GVL && new_state != EVENT_WANTS_GVL) {
+      add(&stats->wants_gvl_count, 1);
+      add(&stats->wants_gvl_histogram[histogram_bucket(elapsed_ns)], 1);
+    }
+  }
+
+  stats->current_state_since_ns = now_ns;
+  __atomic_store_n(&stats->current_state, (uint8_t) new_state, __ATOMIC_RELAXED);
+}
+
+void thread_stats_gvl_released(thread_stats *stats, int64_t held_ns, int64_t on_cpu_ns) {
+  if (held_ns <= 0) return;
+
+  add(&stats->gvl_held_ns, held_ns);
+  // The two clocks don't tick at exactly the same time, so this can be slightly off
+  add(&stats->gvl_held_on_cpu_ns, on_cpu_ns < 0 ? 0 : on_cpu_ns > held_ns ? held_ns : on_cpu_ns);
+}
+
+void stats_reset(void) {
+  pthread_mutex_lock(&all_stats_mutex);
+  __atomic_fetch_add(&current_generation, 1, __ATOMIC_RELAXED);
+  memset(&dead_threads_stats, 0, sizeof(dead_threads_stats));
+  pthread_mutex_unlock(&all_stats_mutex);
+}
+
+static void copy_stats(thread_stats *target, const thread_stats *source) {
+  target->thread_id = source->thread_id;
+  target->ractor = __atomic_load_n(&source->ractor, __ATOMIC_RELAXED);
+  target->current_state = __atomic_load_n(&source->current_state, __ATOMIC_RELAXED);
+  target->current_state_since_ns = __atomic_load_n(&source->current_state_since_ns, __ATOMIC_RELAXED);
+  target->wants_gvl_count = __atomic_load_n(&source->wants_gvl_count, __ATOMIC_RELAXED);
+  target->gvl_held_ns = __atomic_load_n(&source->gvl_held_ns, __ATOMIC_RELAXED);
+  target->gvl_held_on_cpu_ns = __atomic_load_n(&source->gvl_held_on_cpu_ns, __ATOMIC_RELAXED);
+  for (int i = 0; i < EVENT_TYPE_COUNT; i++) target->time_ns[i] = __atomic_load_n(&source->time_ns[i], __ATOMIC_RELAXED);
+  for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    target->wants_gvl_histogram[i] = __atomic_load_n(&source->wants_gvl_histogram[i], __ATOMIC_RELAXED);
+  }
+}
+
+static void accumulate_stats(thread_stats *target, const thread_stats *source) {
+  target->wants_gvl_count += source->wants_gvl_count;
+  target->gvl_held_ns += source->gvl_held_ns;
+  target->gvl_held_on_cpu_ns += source->gvl_held_on_cpu_ns;
+  for (int i = 0; i < EVENT_TYPE_COUNT; i++) target->time_ns[i] += source->time_ns[i];
+  for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) target->wants_gvl_histogram[i] += source->wants_gvl_histogram[i];
+}
+
+void stats_snapshot(
+  int64_t now_ns,
+  void (*consumer)(const thread_stats *stats, void *context),
+  void *context,
+  thread_stats *dead_threads
+) {
+  thread_stats copy;
+
+  pthread_mutex_lock(&all_stats_mutex);
+
+  thread_stats **link = &all_stats;
+  while (*link != NULL) {
+    thread_stats *stats = *link;
+    bool current = __atomic_load_n(&stats->generation, __ATOMIC_ACQUIRE) == current_generation;
+    bool owner_gone = __atomic_load_n(&stats->owner_gone, __ATOMIC_ACQUIRE);
+
+    if (owner_gone) {
+      if (current) accumulate_stats(&dead_threads_stats, stats);
+      *link = stats->next;
+      free(stats);
+      continue;
+    }
+
+    link = &stats->next;
+    if (!current) continue; // No activity since the last reset
+
+    memset(&copy, 0, sizeof(copy));
+    copy_stats(&copy, stats);
+    if (copy.current_state != STATS_STATE_UNKNOWN && now_ns > copy.current_state_since_ns) {
+      copy.time_ns[copy.current_state] += now_ns - copy.current_state_since_ns;
+    }
+    consumer(&copy, context);
+  }
+
+  memcpy(dead_threads, &dead_threads_stats, sizeof(thread_stats));
+  dead_threads->next = NULL;
+
+  pthread_mutex_unlock(&all_stats_mutex);
+}
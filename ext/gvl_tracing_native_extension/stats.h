@@ -0,0 +1,85 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Aggregated GVL statistics: rather than recording every event, each thread keeps a few counters (time spent in each
+// state) and a histogram of how long it waited for the GVL. There's no I/O involved, so this is cheap enough to keep
+// always on.
+//
+// Like the event buffers, this is Ruby-agnostic since the updates happen from the GVL hooks.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gvl_event.h"
+
+// Bucket 0 counts waits shorter than 1us, bucket N counts waits in [2^(N-1), 2^N) us, and the last bucket counts
+// everything longer than that (~1 hour)
+#define STATS_HISTOGRAM_BUCKETS 32
+
+// State that was not known yet (e.g. thread had no events since stats were started)
+#define STATS_STATE_UNKNOWN EVENT_TYPE_COUNT
+
+typedef struct thread_stats {
+  struct thread_stats *next;
+  int32_t thread_id;
+  uint32_t ractor; // See ractors.h; 0 if not known (yet)
+  uint32_t generation;
+  bool owner_gone;
+  uint8_t current_state;
+  int64_t current_state_since_ns;
+  uint64_t time_ns[EVENT_TYPE_COUNT];
+  uint64_t wants_gvl_count;
+  uint64_t wants_gvl_histogram[STATS_HISTOGRAM_BUCKETS];
+  // Only updated when sampling CPU time (see `cpu_time:`): how long the thread held the GVL, and how much of that time
+  // it was actually running on a CPU
+  uint64_t gvl_held_ns;
+  uint64_t gvl_held_on_cpu_ns;
+} thread_stats;
+
+// Allocates and registers stats for a new thread. Safe to call without the GVL. Returns NULL on allocation failure.
+thread_stats *thread_stats_new(int32_t thread_id);
+
+// Signals that the owner is done with the stats; they get folded into the totals for dead threads on the next snapshot
+void thread_stats_release(thread_stats *stats);
+
+// Called from the GVL hooks whenever a thread switches state
+void thread_stats_transition(thread_stats *stats, event_type new_state, int64_t now_ns);
+
+// Called from the GVL hooks when a thread releases the GVL, right after thread_stats_transition
+void thread_stats_gvl_released(thread_stats *stats, int64_t held_ns, int64_t on_cpu_ns);
+
+// Zeroes all stats (lazily, for the stats owned by each thread)
+void stats_reset(void);
+
+// Calls `consumer` with a copy of the stats for every live thread (with time in the current state accounted up to
+// `now_ns`), and returns the combined stats for threads that died since the last reset in `dead_threads`.
+void stats_snapshot(
+  int64_t now_ns,
+  void (*consumer)(const thread_stats *stats, void *context),
+  void *context,
+  thread_stats *dead_threads
+);
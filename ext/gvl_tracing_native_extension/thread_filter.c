@@ -0,0 +1,216 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "thread_filter.h"
+
+// Used to mark function arguments that are deliberately left unused
+#ifdef __GNUC__
+  #define UNUSED_ARG  __attribute__((unused))
+#else
+  #define UNUSED_ARG
+#endif
+
+static VALUE include_filters = Qnil;
+static VALUE exclude_filters = Qnil;
+static bool filter_enabled = false;
+static bool filter_uses_groups = false;
+static uint32_t filter_generation = 0;
+static VALUE picked_key = Qnil; // Thread variable set by `GvlTracing.trace_thread`
+static VALUE thread_group_class = Qnil;
+static ID thread_variable_get_id;
+static ID match_id;
+
+typedef struct {
+  VALUE thread;
+  bool traced;
+} left_decision;
+
+// Decisions for other threads on Ruby 3.2 (see thread_filter.h). Both leaving and picking them up happen while holding
+// the GVL, but each Ractor has its own, hence the mutex. The threads get marked (and so pinned) until they pick up their
+// decision, or until the filters get replaced, so that no other thread can end up at the same address meanwhile.
+static pthread_mutex_t left_decisions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static left_decision *left_decisions = NULL;
+static size_t left_decisions_count = 0;
+static size_t left_decisions_capacity = 0;
+static uint32_t left_generation = 0;
+static VALUE left_decisions_holder = Qnil;
+
+static void left_decisions_mark(UNUSED_ARG void *_unused) {
+  pthread_mutex_lock(&left_decisions_mutex);
+  for (size_t i = 0; i < left_decisions_count; i++) rb_gc_mark(left_decisions[i].thread);
+  pthread_mutex_unlock(&left_decisions_mutex);
+}
+
+static const rb_data_type_t left_decisions_type = {
+  .wrap_struct_name = "GvlTracing::__threadFilterDecisions",
+  .function = { .dmark = left_decisions_mark },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void thread_filter_init(void) {
+  rb_global_variable(&include_filters);
+  rb_global_variable(&exclude_filters);
+  thread_group_class = rb_const_get(rb_cObject, rb_intern("ThreadGroup"));
+  picked_key = ID2SYM(rb_intern("__gvl_tracing_traced"));
+  thread_variable_get_id = rb_intern("thread_variable_get");
+  match_id = rb_intern("match?");
+  rb_global_variable(&left_decisions_holder);
+  // (Ruby skips marking objects with a NULL data pointer, so we pass in a dummy one)
+  left_decisions_holder = TypedData_Wrap_Struct(rb_cObject, &left_decisions_type, &left_decisions);
+}
+
+void thread_filter_check(VALUE filters, const char *option) {
+  if (filters == Qnil) return;
+  if (!RB_TYPE_P(filters, T_ARRAY)) rb_raise(rb_eArgError, "%s must be nil, a Regexp, a ThreadGroup or an Array of those", option);
+
+  for (long i = 0, len = RARRAY_LEN(filters); i < len; i++) {
+    VALUE filter = RARRAY_AREF(filters, i);
+    if (!RB_TYPE_P(filter, T_REGEXP) && !rb_obj_is_kind_of(filter, thread_group_class)) {
+      rb_raise(rb_eArgError, "%s must be nil, a Regexp, a ThreadGroup or an Array of those", option);
+    }
+  }
+}
+
+static bool has_groups(VALUE filters) {
+  if (filters == Qnil) return false;
+
+  for (long i = 0, len = RARRAY_LEN(filters); i < len; i++) {
+    if (!RB_TYPE_P(RARRAY_AREF(filters, i), T_REGEXP)) return true;
+  }
+  return false;
+}
+
+void thread_filter_set(VALUE include, VALUE exclude) {
+  include_filters = include == Qnil ? Qnil : rb_ary_freeze(rb_ary_dup(include));
+  exclude_filters = exclude == Qnil ? Qnil : rb_ary_freeze(rb_ary_dup(exclude));
+  filter_uses_groups = has_groups(include_filters) || has_groups(exclude_filters);
+  filter_generation++;
+  __atomic_store_n(&filter_enabled, include_filters != Qnil || exclude_filters != Qnil, __ATOMIC_RELAXED);
+
+  // Whatever was left for the previous filters does not apply anymore
+  pthread_mutex_lock(&left_decisions_mutex);
+  left_decisions_count = 0;
+  pthread_mutex_unlock(&left_decisions_mutex);
+}
+
+bool thread_filter_enabled(void) { return __atomic_load_n(&filter_enabled, __ATOMIC_RELAXED); }
+
+bool thread_filter_uses_groups(void) { return filter_uses_groups; }
+
+uint32_t thread_filter_generation(void) { return filter_generation; }
+
+bool thread_filter_default(void) { return include_filters == Qnil; }
+
+static VALUE match_name(VALUE args) {
+  VALUE *regexp_and_name = (VALUE *) args;
+  return rb_funcall(regexp_and_name[0], match_id, 1, regexp_and_name[1]);
+}
+
+// Regexp#match? does not touch $~, but it can still raise (e.g. for names with an invalid encoding, or with
+// Regexp.timeout), and that should not make Thread#name= or ThreadGroup#add fail, so it counts as not matching
+static bool name_matches(VALUE regexp, VALUE name) {
+  if (!RB_TYPE_P(name, T_STRING)) return false;
+
+  VALUE regexp_and_name[] = {regexp, name};
+  int exception = 0;
+  VALUE result = rb_protect(match_name, (VALUE) regexp_and_name, &exception);
+  if (exception) {
+    rb_set_errinfo(Qnil);
+    return false;
+  }
+  return RTEST(result);
+}
+
+static bool matches_any(VALUE filters, VALUE name, VALUE group) {
+  for (long i = 0, len = RARRAY_LEN(filters); i < len; i++) {
+    VALUE filter = RARRAY_AREF(filters, i);
+    if (RB_TYPE_P(filter, T_REGEXP) ? name_matches(filter, name) : filter == group) return true;
+  }
+  return false;
+}
+
+// Threads picked with `GvlTracing.trace_thread` always get traced, even if they match the exclude filters
+bool thread_filter_traces(VALUE thread, VALUE name, VALUE group) {
+  if (rb_funcall(thread, thread_variable_get_id, 1, picked_key) == Qtrue) return true;
+  if (exclude_filters != Qnil && matches_any(exclude_filters, name, group)) return false;
+
+  return include_filters == Qnil || matches_any(include_filters, name, group);
+}
+
+VALUE thread_filter_trace_thread(VALUE thread) {
+  if (!rb_obj_is_kind_of(thread, rb_cThread)) rb_raise(rb_eArgError, "Expected a Thread");
+
+  rb_funcall(thread, rb_intern("thread_variable_set"), 2, picked_key, Qtrue);
+  return thread;
+}
+
+void thread_filter_leave_decision(VALUE thread, bool traced) {
+  pthread_mutex_lock(&left_decisions_mutex);
+
+  size_t i = 0;
+  while (i < left_decisions_count && left_decisions[i].thread != thread) i++;
+  if (i == left_decisions_count && left_decisions_count == left_decisions_capacity) {
+    size_t new_capacity = left_decisions_capacity == 0 ? 16 : left_decisions_capacity * 2;
+    left_decision *new_decisions = realloc(left_decisions, new_capacity * sizeof(left_decision));
+    if (new_decisions == NULL) {
+      // The thread just keeps what it had
+      pthread_mutex_unlock(&left_decisions_mutex);
+      return;
+    }
+    left_decisions = new_decisions;
+    left_decisions_capacity = new_capacity;
+  }
+  if (i == left_decisions_count) left_decisions_count++;
+  left_decisions[i] = (left_decision) { .thread = thread, .traced = traced };
+  __atomic_add_fetch(&left_generation, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&left_decisions_mutex);
+}
+
+uint32_t thread_filter_left_generation(void) { return __atomic_load_n(&left_generation, __ATOMIC_ACQUIRE); }
+
+bool thread_filter_take_decision(VALUE thread, bool *traced) {
+  bool found = false;
+
+  pthread_mutex_lock(&left_decisions_mutex);
+  for (size_t i = 0; i < left_decisions_count; i++) {
+    if (left_decisions[i].thread != thread) continue;
+
+    *traced = left_decisions[i].traced;
+    left_decisions[i] = left_decisions[--left_decisions_count];
+    found = true;
+    break;
+  }
+  pthread_mutex_unlock(&left_decisions_mutex);
+
+  return found;
+}
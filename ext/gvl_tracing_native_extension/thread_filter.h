@@ -0,0 +1,72 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Thread filtering: In a process with hundreds of threads, usually only a few of them are interesting (e.g. the web
+// workers), so `GvlTracing.start` can be told to only record events for some threads: the ones whose name matches a
+// Regexp or that are in a ThreadGroup, minus the ones matching the exclude filters, plus any that got picked with
+// `GvlTracing.trace_thread`.
+//
+// Deciding needs Ruby (matching names, looking up groups), and the GVL hooks can't call into Ruby, so decisions only
+// get made from Ruby: for every thread when tracing starts, for a thread picked with `GvlTracing.trace_thread`, and
+// whenever a thread gets created, renamed or added to a ThreadGroup (see the hooks in gvl-tracing.rb). The caller
+// caches the decision in the thread's state along with the generation it was made for, so all the GVL hooks do is check
+// it. Until a thread's first decision, it gets the default: excluded if there are include filters, traced otherwise.
+//
+// On Ruby 3.2, only the current thread's state can be reached, so decisions for other threads get left here, and the
+// threads pick them up the next time they release the GVL.
+
+#pragma once
+
+#include <ruby/ruby.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void thread_filter_init(void);
+
+// Raises ArgumentError unless `filters` is nil or an array of Regexp/ThreadGroup; `option` is used in the message
+void thread_filter_check(VALUE filters, const char *option);
+
+// Replaces the filters, which must have been checked first. Passing nil for both disables filtering.
+void thread_filter_set(VALUE include_filters, VALUE exclude_filters);
+
+bool thread_filter_enabled(void);
+bool thread_filter_uses_groups(void);
+uint32_t thread_filter_generation(void);
+bool thread_filter_default(void);
+
+// Whether events for `thread` should be recorded. Calls into Ruby, so it must never get called from the GVL hooks.
+bool thread_filter_traces(VALUE thread, VALUE name, VALUE group);
+
+// For Ruby 3.2 (see above). Leaving a decision for a thread replaces any it had not picked up yet.
+void thread_filter_leave_decision(VALUE thread, bool traced);
+// Changes every time a decision gets left, so threads only need to look for theirs when it did. Safe to call without
+// the GVL.
+uint32_t thread_filter_left_generation(void);
+// Returns whether there was a decision left for the thread (and removes it). Does not call into Ruby.
+bool thread_filter_take_decision(VALUE thread, bool *traced);
+
+// Implements `GvlTracing.trace_thread`
+VALUE thread_filter_trace_thread(VALUE thread);
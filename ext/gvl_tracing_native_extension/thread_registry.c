@@ -0,0 +1,410 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_registry.h"
+
+#define INITIAL_CAPACITY 64
+#define LIBRARY_SEPARATOR " from "
+#define NO_SLOT 0
+
+typedef struct {
+  char *value; // NULL if this id is not in use
+  size_t length;
+  uint32_t hash;
+  uint32_t references;
+} interned_string;
+
+typedef struct {
+  bool used;
+  int32_t thread_id;
+  uint32_t native_thread_id;
+  uint32_t name_id; // 0 if the thread has no name
+  uint32_t library_id; // 0 if not known
+  bool has_spans;
+  bool has_fibers;
+  bool traced;
+  uint32_t ractor; // See ractors.h
+  uint32_t generation; // Incremented every time the slot gets reused
+  uint32_t next; // Next free slot, or next thread that exited (in the order they exited)
+  int64_t started_at_ns;
+  int64_t exited_at_ns; // 0 while the thread is alive
+} thread_record;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Both of these are indexed by id/slot, and the first entry is never used
+static thread_record *records = NULL;
+static uint32_t records_capacity = 0;
+static uint32_t records_in_use = 1; // Every slot below this was used at some point
+static uint32_t free_slots = NO_SLOT;
+static uint32_t oldest_exited = NO_SLOT;
+static uint32_t newest_exited = NO_SLOT;
+static interned_string *strings = NULL;
+static uint32_t strings_capacity = 0;
+static uint32_t strings_in_use = 1;
+
+// Grows `array` (zeroing the new entries) so that `needed` entries fit
+static bool ensure_capacity(void **array, uint32_t *capacity, uint32_t needed, size_t entry_size) {
+  if (needed <= *capacity) return true;
+
+  uint32_t new_capacity = *capacity == 0 ? INITIAL_CAPACITY : *capacity * 2;
+  while (new_capacity < needed) new_capacity *= 2;
+
+  void *new_array = realloc(*array, new_capacity * entry_size);
+  if (new_array == NULL) return false;
+
+  memset(((char *) new_array) + (*capacity * entry_size), 0, (new_capacity - *capacity) * entry_size);
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+// FNV-1a
+static uint32_t hash_of(const char *value, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char) value[i]) * 16777619u;
+  return hash;
+}
+
+// Names only get interned when a thread starts or changes its name, and there are usually not that many distinct
+// names in use at the same time, so a linear search is good enough. Returns 0 on allocation failure.
+static uint32_t intern(const char *value, size_t length) {
+  uint32_t hash = hash_of(value, length);
+  uint32_t free_id = 0;
+
+  for (uint32_t id = 1; id < strings_in_use; id++) {
+    interned_string *string = &strings[id];
+    if (string->value == NULL) {
+      if (free_id == 0) free_id = id;
+    } else if (string->hash == hash && string->length == length && memcmp(string->value, value, length) == 0) {
+      string->references++;
+      return id;
+    }
+  }
+
+  if (free_id == 0) {
+    if (!ensure_capacity((void **) &strings, &strings_capacity, strings_in_use + 1, sizeof(interned_string))) return 0;
+    free_id = strings_in_use++;
+  }
+
+  char *copy = malloc(length + 1);
+  if (copy == NULL) return 0;
+  memcpy(copy, value, length);
+  copy[length] = '\0';
+
+  strings[free_id] = (interned_string) { .value = copy, .length = length, .hash = hash, .references = 1 };
+  return free_id;
+}
+
+static void release(uint32_t id) {
+  if (id == 0 || --strings[id].references > 0) return;
+
+  free(strings[id].value);
+  strings[id].value = NULL;
+}
+
+static inline thread_registry_handle handle_for(uint32_t slot) {
+  return (((uint64_t) records[slot].generation) << 32) | slot;
+}
+
+static inline thread_record *record_for(thread_registry_handle handle) {
+  uint32_t slot = (uint32_t) handle;
+  if (slot == NO_SLOT || slot >= records_in_use) return NULL;
+
+  thread_record *record = &records[slot];
+  return (record->used && record->generation == (uint32_t) (handle >> 32)) ? record : NULL;
+}
+
+static void remove_record(uint32_t slot) {
+  thread_record *record = &records[slot];
+  release(record->name_id);
+  release(record->library_id);
+  *record = (thread_record) { .generation = record->generation + 1, .next = free_slots };
+  free_slots = slot;
+}
+
+static void trim(int64_t keep_exited_since_ns) {
+  while (oldest_exited != NO_SLOT && records[oldest_exited].exited_at_ns < keep_exited_since_ns) {
+    uint32_t slot = oldest_exited;
+    oldest_exited = records[slot].next;
+    if (oldest_exited == NO_SLOT) newest_exited = NO_SLOT;
+    remove_record(slot);
+  }
+}
+
+thread_registry_handle thread_registry_add(int32_t thread_id, uint32_t native_thread_id, int64_t started_at_ns) {
+  thread_registry_handle handle = THREAD_REGISTRY_NO_HANDLE;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  uint32_t slot = free_slots;
+  if (slot != NO_SLOT) {
+    free_slots = records[slot].next;
+  } else if (ensure_capacity((void **) &records, &records_capacity, records_in_use + 1, sizeof(thread_record))) {
+    slot = records_in_use++;
+  }
+
+  if (slot != NO_SLOT) {
+    records[slot] = (thread_record) {
+      .used = true,
+      .thread_id = thread_id,
+      .native_thread_id = native_thread_id,
+      .generation = records[slot].generation,
+      .next = NO_SLOT,
+      .started_at_ns = started_at_ns,
+    };
+    handle = handle_for(slot);
+  }
+
+  pthread_mutex_unlock(&registry_mutex);
+  return handle;
+}
+
+void thread_registry_remove(thread_registry_handle handle) {
+  pthread_mutex_lock(&registry_mutex);
+  thread_record *record = record_for(handle);
+  // Records for threads that exited are in the exited list, and get removed from there instead
+  if (record != NULL && record->exited_at_ns == 0) remove_record((uint32_t) handle);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+static int compare_thread_ids(const void *a, const void *b) {
+  int32_t a_thread_id = *(const int32_t *) a;
+  int32_t b_thread_id = *(const int32_t *) b;
+  return (a_thread_id > b_thread_id) - (a_thread_id < b_thread_id);
+}
+
+void thread_registry_retain(int32_t *thread_ids, size_t count, int64_t started_before_ns) {
+  qsort(thread_ids, count, sizeof(int32_t), compare_thread_ids);
+
+  pthread_mutex_lock(&registry_mutex);
+  for (uint32_t slot = 1; slot < records_in_use; slot++) {
+    thread_record *record = &records[slot];
+    if (!record->used || record->exited_at_ns != 0 || record->started_at_ns >= started_before_ns) continue;
+    if (bsearch(&record->thread_id, thread_ids, count, sizeof(int32_t), compare_thread_ids) == NULL) remove_record(slot);
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+thread_registry_handle thread_registry_find(int32_t thread_id) {
+  uint32_t found = NO_SLOT;
+
+  pthread_mutex_lock(&registry_mutex);
+  for (uint32_t slot = 1; slot < records_in_use; slot++) {
+    thread_record *record = &records[slot];
+    if (!record->used || record->exited_at_ns != 0 || record->thread_id != thread_id) continue;
+    if (found == NO_SLOT || record->started_at_ns >= records[found].started_at_ns) found = slot;
+  }
+  thread_registry_handle handle = found != NO_SLOT ? handle_for(found) : THREAD_REGISTRY_NO_HANDLE;
+  pthread_mutex_unlock(&registry_mutex);
+
+  return handle;
+}
+
+static void set_string(thread_registry_handle handle, bool is_name, const char *value, size_t length) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL) {
+    uint32_t *id = is_name ? &record->name_id : &record->library_id;
+    // Interning first means a thread setting the same name again never frees it in the meanwhile
+    uint32_t new_id = value != NULL ? intern(value, length) : 0;
+    release(*id);
+    *id = new_id;
+  }
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_set_name(thread_registry_handle handle, const char *name, size_t length) {
+  set_string(handle, true, name, length);
+}
+
+void thread_registry_set_library(thread_registry_handle handle, const char *library, size_t length) {
+  set_string(handle, false, library, length);
+}
+
+void thread_registry_set_has_spans(thread_registry_handle handle) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL) record->has_spans = true;
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_set_has_fibers(thread_registry_handle handle) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL) record->has_fibers = true;
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_set_traced(thread_registry_handle handle, bool traced) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL) record->traced = traced;
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_set_ractor(thread_registry_handle handle, uint32_t ractor) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL) record->ractor = ractor;
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+uint32_t thread_registry_ractor(int32_t thread_id) {
+  uint32_t found = NO_SLOT;
+
+  pthread_mutex_lock(&registry_mutex);
+  for (uint32_t slot = 1; slot < records_in_use; slot++) {
+    thread_record *record = &records[slot];
+    if (!record->used || record->thread_id != thread_id) continue;
+    if (found == NO_SLOT || record->started_at_ns >= records[found].started_at_ns) found = slot;
+  }
+  uint32_t ractor = found != NO_SLOT ? records[found].ractor : 0;
+  pthread_mutex_unlock(&registry_mutex);
+
+  return ractor;
+}
+
+void thread_registry_reset_tracks(void) {
+  pthread_mutex_lock(&registry_mutex);
+  for (uint32_t slot = 1; slot < records_in_use; slot++) {
+    records[slot].has_spans = false;
+    records[slot].has_fibers = false;
+    records[slot].traced = false;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_exited(thread_registry_handle handle, int64_t exited_at_ns, int64_t keep_exited_since_ns) {
+  pthread_mutex_lock(&registry_mutex);
+
+  thread_record *record = record_for(handle);
+  if (record != NULL && record->exited_at_ns == 0) {
+    uint32_t slot = (uint32_t) handle;
+    record->exited_at_ns = exited_at_ns > 0 ? exited_at_ns : 1;
+    record->next = NO_SLOT;
+    if (newest_exited == NO_SLOT) {
+      oldest_exited = slot;
+    } else {
+      records[newest_exited].next = slot;
+    }
+    newest_exited = slot;
+  }
+
+  trim(keep_exited_since_ns);
+
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void thread_registry_trim(int64_t keep_exited_since_ns) {
+  pthread_mutex_lock(&registry_mutex);
+  trim(keep_exited_since_ns);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+// Used for sorting slots by when their threads started; only called while holding the mutex
+static int compare_started_at(const void *a, const void *b) {
+  int64_t a_started_at_ns = records[*(const uint32_t *) a].started_at_ns;
+  int64_t b_started_at_ns = records[*(const uint32_t *) b].started_at_ns;
+  if (a_started_at_ns != b_started_at_ns) return a_started_at_ns < b_started_at_ns ? -1 : 1;
+  return *(const uint32_t *) a < *(const uint32_t *) b ? -1 : 1;
+}
+
+// Only called while holding the mutex; `slots` must have space for every record
+static thread_registry_name *copy_names(uint32_t *slots, int64_t alive_since_ns, size_t *count) {
+  size_t names_size = 0;
+  for (uint32_t slot = 1; slot < records_in_use; slot++) {
+    thread_record *record = &records[slot];
+    if (!record->used || record->name_id == 0) continue;
+    if (record->exited_at_ns != 0 && record->exited_at_ns < alive_since_ns) continue;
+
+    slots[(*count)++] = slot;
+    names_size += strings[record->name_id].length + 1;
+    if (record->library_id != 0) names_size += strlen(LIBRARY_SEPARATOR) + strings[record->library_id].length;
+  }
+  if (*count == 0) return NULL;
+
+  qsort(slots, *count, sizeof(uint32_t), compare_started_at);
+
+  // The names get copied right after the array, so that they're still valid after the mutex is released
+  thread_registry_name *result = malloc(*count * sizeof(thread_registry_name) + names_size);
+  if (result == NULL) {
+    *count = 0;
+    return NULL;
+  }
+
+  char *next_name = (char *) (result + *count);
+  for (size_t i = 0; i < *count; i++) {
+    thread_record *record = &records[slots[i]];
+    result[i] = (thread_registry_name) {
+      .thread_id = record->thread_id,
+      .name = next_name,
+      .has_spans = record->has_spans,
+      .has_fibers = record->has_fibers,
+      .traced = record->traced,
+      .ractor = record->ractor,
+    };
+
+    interned_string *name = &strings[record->name_id];
+    memcpy(next_name, name->value, name->length);
+    next_name += name->length;
+    if (record->library_id != 0) {
+      interned_string *library = &strings[record->library_id];
+      memcpy(next_name, LIBRARY_SEPARATOR, strlen(LIBRARY_SEPARATOR));
+      next_name += strlen(LIBRARY_SEPARATOR);
+      memcpy(next_name, library->value, library->length);
+      next_name += library->length;
+    }
+    *next_name++ = '\0';
+  }
+
+  return result;
+}
+
+thread_registry_name *thread_registry_names(int64_t alive_since_ns, size_t *count) {
+  *count = 0;
+
+  pthread_mutex_lock(&registry_mutex);
+  uint32_t *slots = malloc(records_in_use * sizeof(uint32_t));
+  thread_registry_name *result = slots != NULL ? copy_names(slots, alive_since_ns, count) : NULL;
+  pthread_mutex_unlock(&registry_mutex);
+
+  free(slots);
+  return result;
+}
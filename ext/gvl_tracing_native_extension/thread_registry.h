@@ -0,0 +1,107 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Thread registry: keeps a compact record for every thread that showed up in the trace (its id, native id, name and
+// when it started/exited), so that thread names can be written at the end of the trace without keeping the Ruby thread
+// objects around, and including threads that have since died.
+//
+// Names get interned, since lots of threads usually share the same few names (e.g. thread pools), and each record
+// only keeps ids for its name, and for the library the thread was created from (if any).
+//
+// Records for threads that exited get removed incrementally, once they're older than what the caller still needs;
+// records for threads that are still around get removed when their owner goes away, or when the caller finds out the
+// thread is gone (e.g. because it died while the hooks were not installed, and we never saw it exit).
+//
+// Records are identified by handles, which include both the slot for the record and how many times that slot was
+// used; this way, a handle for a record that got removed never ends up pointing at a different thread.
+//
+// Like the event buffers, this is Ruby-agnostic since it gets updated from the GVL hooks. All functions are safe to
+// call without the GVL; updates only happen when a thread starts, exits or changes its name, so a plain mutex is used
+// for everything.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Zero, so that zero-initialized per-thread state does not point at any record
+#define THREAD_REGISTRY_NO_HANDLE 0
+
+typedef uint64_t thread_registry_handle;
+
+typedef struct {
+  int32_t thread_id;
+  const char *name; // Includes the library, if known, e.g. "worker from puma"
+  bool has_spans;
+  bool has_fibers;
+  bool traced; // Only meaningful when tracing with thread filters (see thread_filter.h)
+  uint32_t ractor; // 0 if not known
+} thread_registry_name;
+
+// Adds a record for a thread, and returns its handle (or THREAD_REGISTRY_NO_HANDLE on allocation failure). The
+// `native_thread_id` can be 0 if it's not known (e.g. the thread got registered by the thread that created it).
+thread_registry_handle thread_registry_add(int32_t thread_id, uint32_t native_thread_id, int64_t started_at_ns);
+
+// Removes the record for a thread that is going away without having exited (e.g. we missed its exit because tracing
+// was not running)
+void thread_registry_remove(thread_registry_handle handle);
+
+// Removes the records for threads that started before `started_before_ns`, have not exited, and are not in
+// `thread_ids` (which gets sorted)
+void thread_registry_retain(int32_t *thread_ids, size_t count, int64_t started_before_ns);
+
+// Returns the handle for a thread that has not exited yet, or THREAD_REGISTRY_NO_HANDLE if there's no such thread
+thread_registry_handle thread_registry_find(int32_t thread_id);
+
+// A `name` of NULL means the thread has no name (or no known library)
+void thread_registry_set_name(thread_registry_handle handle, const char *name, size_t length);
+void thread_registry_set_library(thread_registry_handle handle, const char *library, size_t length);
+
+// Records that the thread recorded custom spans, which get their own track (see gvl_tracing.h)
+void thread_registry_set_has_spans(thread_registry_handle handle);
+// Records that the thread switched fibers while tracing with `fibers: true`, which also get their own track
+void thread_registry_set_has_fibers(thread_registry_handle handle);
+// Records whether the thread passed the thread filters (see thread_filter.h), so its name only gets written if it did
+void thread_registry_set_traced(thread_registry_handle handle, bool traced);
+// Records which Ractor the thread belongs to (see ractors.h)
+void thread_registry_set_ractor(thread_registry_handle handle, uint32_t ractor);
+// Returns the Ractor for the most recent thread with this id, including threads that exited, or 0 if not known
+uint32_t thread_registry_ractor(int32_t thread_id);
+// Used when starting a new trace, since spans, fibers and filter results from previous traces don't apply to it
+void thread_registry_reset_tracks(void);
+
+// Marks the thread as exited; there's no need for the caller to keep the handle afterwards. Any records for threads
+// that exited before `keep_exited_since_ns` get removed.
+void thread_registry_exited(thread_registry_handle handle, int64_t exited_at_ns, int64_t keep_exited_since_ns);
+
+// Removes the records for threads that exited before `keep_exited_since_ns`
+void thread_registry_trim(int64_t keep_exited_since_ns);
+
+// Returns the names of the threads that have a name and were alive at or after `alive_since_ns`, ordered by when the
+// threads started (so that if a thread id got reused, the most recent name comes last), and sets `count`.
+// The result is a single allocation, which the caller must free. Returns NULL (and a `count` of 0) if there are no such
+// threads or if allocation failed.
+thread_registry_name *thread_registry_names(int64_t alive_since_ns, size_t *count);
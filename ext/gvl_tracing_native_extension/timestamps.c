@@ -0,0 +1,182 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+  #include <cpuid.h>
+#endif
+
+#include "timestamps.h"
+
+#if defined(__x86_64__) || defined(__aarch64__)
+  #define HAVE_TSC
+#endif
+
+#define CALIBRATION_SLEEP_NS 20000000 // 20ms
+#define CALIBRATION_SAMPLES 8
+#define TSC_MULT_SHIFT 32
+
+static timestamps_source current_source = TIMESTAMPS_MONOTONIC;
+static timestamps_calibration calibration;
+// Nanoseconds per tick, as a fixed point number with TSC_MULT_SHIFT fractional bits
+static uint64_t tsc_mult;
+
+static inline int64_t monotonic_ns(void) {
+  struct timespec current_monotonic;
+  // Note: This only fails for a bad clock id or pointer, so there's nothing useful to do about it here
+  clock_gettime(CLOCK_MONOTONIC, &current_monotonic);
+  return current_monotonic.tv_nsec + (current_monotonic.tv_sec * INT64_C(1000000000));
+}
+
+#ifdef HAVE_TSC
+  static inline uint64_t read_tsc(void) {
+    #if defined(__x86_64__)
+      return __builtin_ia32_rdtsc();
+    #else
+      uint64_t ticks;
+      __asm__ volatile("mrs %0, cntvct_el0" : "=r" (ticks));
+      return ticks;
+    #endif
+  }
+
+  #if defined(__x86_64__)
+    // Linux only picks the TSC as its clocksource when it trusts it to be in sync across cores (and not to stop), so
+    // we go with its opinion, when there's one available
+    static bool kernel_trusts_tsc(void) {
+      FILE *file = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+      if (file == NULL) return true;
+
+      char clocksource[32] = {0};
+      bool trusted = fgets(clocksource, sizeof(clocksource), file) != NULL && strncmp(clocksource, "tsc", 3) == 0;
+      fclose(file);
+      return trusted;
+    }
+
+    static bool tsc_usable(void) {
+      unsigned int eax, ebx, ecx, edx;
+      if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+      bool invariant_tsc = (edx & (1 << 8)) != 0;
+      return invariant_tsc && kernel_trusts_tsc();
+    }
+  #else
+    static bool tsc_usable(void) { return true; }
+  #endif
+
+  // Reads the counter and CLOCK_MONOTONIC as close together as possible: we keep the attempt where the counter got
+  // read in the shortest time, and assume it matches the middle of the CLOCK_MONOTONIC readings around it.
+  static void sample_tsc(uint64_t *ticks, int64_t *now_ns) {
+    int64_t best_gap_ns = INT64_MAX;
+
+    for (int i = 0; i < CALIBRATION_SAMPLES; i++) {
+      int64_t before_ns = monotonic_ns();
+      uint64_t sample_ticks = read_tsc();
+      int64_t after_ns = monotonic_ns();
+
+      if (after_ns - before_ns < best_gap_ns) {
+        best_gap_ns = after_ns - before_ns;
+        *ticks = sample_ticks;
+        *now_ns = before_ns + (after_ns - before_ns) / 2;
+      }
+    }
+  }
+
+  static uint64_t tsc_frequency(uint64_t start_ticks, int64_t start_ns) {
+    #if defined(__aarch64__)
+      (void) start_ticks;
+      (void) start_ns;
+      uint64_t frequency;
+      __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (frequency));
+      return frequency;
+    #else
+      struct timespec calibration_sleep = {.tv_sec = 0, .tv_nsec = CALIBRATION_SLEEP_NS};
+      while (nanosleep(&calibration_sleep, &calibration_sleep) != 0) { /* Interrupted, keep sleeping */ }
+
+      uint64_t end_ticks = 0;
+      int64_t end_ns = 0;
+      sample_tsc(&end_ticks, &end_ns);
+      if (end_ns <= start_ns || end_ticks <= start_ticks) return 0;
+
+      return (uint64_t) ((double) (end_ticks - start_ticks) * 1e9 / (double) (end_ns - start_ns));
+    #endif
+  }
+
+  static bool calibrate_tsc(void) {
+    if (!tsc_usable()) return false;
+
+    uint64_t start_ticks = 0;
+    int64_t start_ns = 0;
+    sample_tsc(&start_ticks, &start_ns);
+
+    uint64_t ticks_per_second = tsc_frequency(start_ticks, start_ns);
+    // Slower than 1MHz would be too coarse for our events (and is not something we expect to see)
+    if (ticks_per_second < 1000000) return false;
+
+    calibration = (timestamps_calibration) {
+      .ticks_per_second = ticks_per_second,
+      .calibrated_at_ticks = start_ticks,
+      .calibrated_at_ns = start_ns,
+    };
+    tsc_mult = (uint64_t) (((unsigned __int128) 1000000000 << TSC_MULT_SHIFT) / ticks_per_second);
+    return true;
+  }
+
+  static inline int64_t tsc_ns(void) {
+    // Signed, since a core may be a tiny bit behind the one we calibrated on
+    __int128 elapsed_ticks = (__int128) read_tsc() - (__int128) calibration.calibrated_at_ticks;
+    return calibration.calibrated_at_ns + (int64_t) ((elapsed_ticks * (__int128) tsc_mult) >> TSC_MULT_SHIFT);
+  }
+#endif
+
+bool timestamps_init(const char *clock) {
+  struct timespec current_monotonic;
+  if (clock_gettime(CLOCK_MONOTONIC, &current_monotonic) != 0) return false;
+
+  current_source = TIMESTAMPS_MONOTONIC;
+  #ifdef HAVE_TSC
+    if (clock != NULL && strcmp(clock, "tsc") == 0 && calibrate_tsc()) current_source = TIMESTAMPS_TSC;
+  #else
+    (void) clock;
+  #endif
+
+  return true;
+}
+
+int64_t timestamps_now_ns(void) {
+  #ifdef HAVE_TSC
+    if (current_source == TIMESTAMPS_TSC) return tsc_ns();
+  #endif
+  return monotonic_ns();
+}
+
+timestamps_source timestamps_current_source(void) { return current_source; }
+
+const char *timestamps_source_name(timestamps_source source) {
+  return source == TIMESTAMPS_TSC ? "tsc" : "monotonic";
+}
+
+timestamps_calibration timestamps_current_calibration(void) { return calibration; }
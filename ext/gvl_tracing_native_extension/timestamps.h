@@ -0,0 +1,68 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Timestamps: Every event gets a timestamp, which gets read in the GVL hooks, so reading it needs to be cheap, and can't
+// fail in a way that raises (hooks may be running without the GVL).
+//
+// By default timestamps come from CLOCK_MONOTONIC. Setting `GVL_TRACING_CLOCK=tsc` before the gem gets loaded makes
+// it read the CPU's own counter instead (rdtsc on x86_64, cntvct_el0 on aarch64), skipping the clock_gettime() call.
+// The counter gets converted to nanoseconds relative to a CLOCK_MONOTONIC reading taken when it was calibrated, so
+// timestamps from both sources line up, and nothing else needs to know which one is being used.
+//
+// The counter only gets used when it's known to tick at a constant rate and to be in sync across cores: on x86_64 that
+// means the CPU reports an invariant TSC and (on Linux) the kernel is itself using the TSC as its clocksource; on
+// aarch64 the generic timer always is. Otherwise, timestamps quietly keep coming from CLOCK_MONOTONIC.
+//
+// The clock gets picked once, when the gem gets loaded, so timestamps from different sources never get mixed together.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  TIMESTAMPS_MONOTONIC,
+  TIMESTAMPS_TSC,
+} timestamps_source;
+
+// What's needed to go back from nanoseconds to counter ticks, so it gets recorded in traces that used the counter
+typedef struct {
+  uint64_t ticks_per_second;
+  uint64_t calibrated_at_ticks;
+  int64_t calibrated_at_ns;
+} timestamps_calibration;
+
+// Picks the clock, based on `clock` (the value of `GVL_TRACING_CLOCK`, or NULL). May take a few milliseconds, when
+// the counter needs calibrating. Returns false if CLOCK_MONOTONIC can't be read.
+bool timestamps_init(const char *clock);
+
+// Current time, in nanoseconds. Safe to call from anywhere, including without the GVL and from the writer thread.
+int64_t timestamps_now_ns(void);
+
+timestamps_source timestamps_current_source(void);
+const char *timestamps_source_name(timestamps_source source);
+
+// Only meaningful when the current source is TIMESTAMPS_TSC
+timestamps_calibration timestamps_current_calibration(void);
@@ -0,0 +1,187 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <ruby/ruby.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wait_reasons.h"
+
+// Big enough to keep the table mostly empty (and thus probes short) with all of the methods below
+#define TABLE_SIZE 512
+#define MAX_OWNERS 64
+
+typedef struct {
+  // Constant path, e.g. "Thread::Mutex". Classes that are not defined (yet) get skipped.
+  const char *owner;
+  // For methods such as `IO.select`
+  bool singleton;
+  // Space-separated method names
+  const char *methods;
+  event_type type;
+} wait_reason_definition;
+
+static const wait_reason_definition definitions[] = {
+  { "Kernel", false, "sleep", EVENT_SLEEPING },
+  { "Kernel", false, "gets readline readlines", EVENT_WAITING_IO_READ },
+  { "Kernel", false, "puts print printf p putc", EVENT_WAITING_IO_WRITE },
+  { "Kernel", false, "select", EVENT_WAITING_IO_SELECT },
+  { "Kernel", false, "system `", EVENT_WAITING_PROCESS },
+
+  {
+    "IO", false,
+    "read readpartial sysread pread gets readline readlines getc getbyte readchar readbyte each_line each_byte "
+    "each_char wait_readable",
+    EVENT_WAITING_IO_READ
+  },
+  { "IO", true, "read readlines binread foreach", EVENT_WAITING_IO_READ },
+  {
+    "IO", false, "write syswrite pwrite print puts printf << putc flush fsync fdatasync wait_writable",
+    EVENT_WAITING_IO_WRITE
+  },
+  { "IO", true, "write binwrite", EVENT_WAITING_IO_WRITE },
+  { "IO", true, "select", EVENT_WAITING_IO_SELECT },
+  { "IO", false, "wait wait_priority", EVENT_WAITING_IO_SELECT },
+
+  { "Thread::Mutex", false, "lock synchronize", EVENT_WAITING_MUTEX },
+  { "Monitor", false, "enter mon_enter synchronize mon_synchronize", EVENT_WAITING_MUTEX },
+  // ConditionVariable#wait is implemented by calling Mutex#sleep, so that's what shows up for it
+  { "Thread::Mutex", false, "sleep", EVENT_WAITING_CONDVAR },
+  { "Thread::ConditionVariable", false, "wait", EVENT_WAITING_CONDVAR },
+  { "Monitor", false, "wait_for_cond", EVENT_WAITING_CONDVAR },
+  { "Thread::Queue", false, "pop shift deq", EVENT_WAITING_QUEUE },
+  { "Thread::SizedQueue", false, "pop shift deq push << enq", EVENT_WAITING_QUEUE },
+
+  { "Process", true, "wait wait2 waitpid waitpid2 waitall", EVENT_WAITING_PROCESS },
+  { "Process::Status", true, "wait", EVENT_WAITING_PROCESS },
+
+  // These only show up once "socket" has been required
+  { "Addrinfo", true, "getaddrinfo tcp udp ip foreach", EVENT_WAITING_DNS },
+  { "Addrinfo", false, "getnameinfo", EVENT_WAITING_DNS },
+  { "Socket", true, "getaddrinfo gethostbyname gethostbyaddr getnameinfo", EVENT_WAITING_DNS },
+  { "IPSocket", true, "getaddress", EVENT_WAITING_DNS },
+  { "TCPSocket", true, "gethostbyname", EVENT_WAITING_DNS },
+  { "BasicSocket", false, "recv recvmsg send sendmsg", EVENT_WAITING_SOCKET },
+  { "Socket", false, "accept sysaccept connect recvfrom", EVENT_WAITING_SOCKET },
+  { "IPSocket", false, "recvfrom", EVENT_WAITING_SOCKET },
+  // Includes resolving the address, but that's not something we can tell apart from here
+  { "TCPSocket", false, "initialize", EVENT_WAITING_SOCKET },
+  { "TCPServer", false, "accept sysaccept", EVENT_WAITING_SOCKET },
+  { "UNIXSocket", false, "recvfrom recv_io send_io", EVENT_WAITING_SOCKET },
+  { "UNIXServer", false, "accept sysaccept", EVENT_WAITING_SOCKET },
+};
+
+typedef struct {
+  VALUE owner; // 0 for empty slots
+  ID method_id;
+  event_type type;
+} wait_reason_entry;
+
+// We build the new table on the side and then switch to it, so that the hooks never see a half-built table
+static wait_reason_entry tables[2][TABLE_SIZE];
+static wait_reason_entry *current_table = NULL;
+
+// Every owner in the table gets pinned, since the lookups are by address
+static VALUE pinned_owners[MAX_OWNERS];
+static int pinned_owners_count = 0;
+
+static inline uint32_t slot_for(VALUE owner, ID method_id) {
+  uint64_t hash = ((uint64_t) owner ^ ((uint64_t) method_id << 17)) * UINT64_C(0x9E3779B97F4A7C15);
+  return (uint32_t) (hash >> 32) % TABLE_SIZE;
+}
+
+static void insert(wait_reason_entry *table, VALUE owner, ID method_id, event_type type) {
+  uint32_t slot = slot_for(owner, method_id);
+  for (int probes = 0; probes < TABLE_SIZE; probes++, slot = (slot + 1) % TABLE_SIZE) {
+    if (table[slot].owner == 0 || (table[slot].owner == owner && table[slot].method_id == method_id)) {
+      table[slot] = (wait_reason_entry) { .owner = owner, .method_id = method_id, .type = type };
+      return;
+    }
+  }
+}
+
+// Returns Qnil if any part of the path is not defined. Constants that are set to be autoloaded count as not defined,
+// since we don't want to be the ones loading them.
+static VALUE lookup_owner(const char *path) {
+  VALUE scope = rb_cObject;
+  while (*path) {
+    size_t length = strcspn(path, ":");
+    ID name = rb_intern2(path, length);
+    if (!rb_const_defined_at(scope, name) || rb_autoload_p(scope, name) != Qnil) return Qnil;
+    scope = rb_const_get_at(scope, name);
+    if (!RB_TYPE_P(scope, T_CLASS) && !RB_TYPE_P(scope, T_MODULE)) return Qnil;
+    path += length;
+    while (*path == ':') path++;
+  }
+  return scope;
+}
+
+static void pin(VALUE owner) {
+  for (int i = 0; i < pinned_owners_count; i++) {
+    if (pinned_owners[i] == owner) return;
+  }
+  if (pinned_owners_count == MAX_OWNERS) rb_raise(rb_eRuntimeError, "BUG: Too many owners in GvlTracing wait reasons");
+
+  rb_gc_register_mark_object(owner);
+  pinned_owners[pinned_owners_count++] = owner;
+}
+
+void wait_reasons_refresh(void) {
+  wait_reason_entry *table = (current_table == tables[0]) ? tables[1] : tables[0];
+  memset(table, 0, sizeof(tables[0]));
+
+  for (size_t i = 0; i < sizeof(definitions) / sizeof(definitions[0]); i++) {
+    const wait_reason_definition *definition = &definitions[i];
+    VALUE owner = lookup_owner(definition->owner);
+    if (owner == Qnil) continue;
+    if (definition->singleton) owner = rb_singleton_class(owner);
+    pin(owner);
+
+    const char *methods = definition->methods;
+    while (*methods) {
+      size_t length = strcspn(methods, " ");
+      insert(table, owner, rb_intern2(methods, length), definition->type);
+      methods += length;
+      while (*methods == ' ') methods++;
+    }
+  }
+
+  __atomic_store_n(&current_table, table, __ATOMIC_RELEASE);
+}
+
+event_type wait_reason_for(ID method_id, VALUE owner) {
+  const wait_reason_entry *table = __atomic_load_n(&current_table, __ATOMIC_ACQUIRE);
+  if (table == NULL) return EVENT_WAITING;
+
+  uint32_t slot = slot_for(owner, method_id);
+  for (int probes = 0; probes < TABLE_SIZE; probes++, slot = (slot + 1) % TABLE_SIZE) {
+    const wait_reason_entry *entry = &table[slot];
+    if (entry->owner == 0) return EVENT_WAITING;
+    if (entry->owner == owner && entry->method_id == method_id) return entry->type;
+  }
+  return EVENT_WAITING;
+}
@@ -0,0 +1,44 @@
+// gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+// Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of gvl-tracing.
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Wait reasons: When a thread releases the GVL, the method it was in tells us what it's about to block on (e.g.
+// `Queue#pop` or `IO#read`). Looking at the method name every time would be too slow for the GVL hooks, so instead we
+// build a table of the (owner, method) pairs we know about upfront, and each release only needs a single lookup.
+//
+// Methods that are not in the table just get reported as plain "waiting".
+
+#pragma once
+
+#include <ruby/ruby.h>
+
+#include "gvl_event.h"
+
+// (Re)builds the table. Needs to be called with the GVL. Classes that don't exist yet (e.g. `Socket`, when it has not
+// been required) get skipped, which is why this gets called again every time tracing (or stats) get started.
+void wait_reasons_refresh(void);
+
+// Returns the kind of waiting (or EVENT_SLEEPING) for a thread that released the GVL while inside `method_id`, as
+// returned by rb_frame_method_id_and_class(). Only reads the table, so it's safe to call from the GVL hooks.
+event_type wait_reason_for(ID method_id, VALUE owner);
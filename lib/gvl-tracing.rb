@@ -30,14 +30,109 @@ require_relative "gvl_tracing/version"
 require "gvl_tracing_native_extension"
 
 module GvlTracing
+  # Number of events each thread can record before the background writer thread gets to them; events that don't fit get
+  # dropped (see `GvlTracing.dropped_events`)
+  DEFAULT_BUFFER_SIZE = 4096
+  # Number of events the flight recorder keeps in memory (each event takes 32 bytes); once full, the oldest events get
+  # overwritten, so this is an upper bound on how much of the window actually gets kept
+  DEFAULT_FLIGHT_RECORDER_EVENTS = 262_144
+
+  # Keeps tracing going in processes that get forked while tracing (e.g. Puma or Unicorn workers). Each child writes to
+  # its own file, named after the original one plus the child's pid (e.g. "gvl-1234.json"), with timestamps relative to
+  # when tracing started in the parent; see `gvl-tracing-merge` for combining them into a single trace.
+  module ForkHooks
+    def _fork
+      return super unless GvlTracing.send(:_before_fork)
+
+      pid = nil
+      begin
+        pid = super
+      ensure
+        # Also gets called (for the parent) if forking failed
+        recording = GvlTracing.send(:_after_fork, pid == 0)
+      end
+
+      at_exit { GvlTracing.send(:stop_in_forked_child, recording) } if recording
+      pid
+    end
+  end
+
+  # The thread filters (see `start`) can't be checked from the GVL hooks, so threads get checked again here whenever
+  # something the filters look at changes. Threads created with Thread.start/Thread.fork skip `initialize`, so those
+  # only get checked once they're given a name or added to a ThreadGroup.
+  module ThreadFilterHooks
+    def initialize(...)
+      super
+      GvlTracing.send(:_refresh_thread_filter, self)
+    end
+
+    def name=(name)
+      super.tap { GvlTracing.send(:_refresh_thread_filter, self) }
+    end
+  end
+
+  module ThreadGroupFilterHooks
+    def add(thread)
+      super.tap { GvlTracing.send(:_refresh_thread_filter, thread) }
+    end
+  end
+
   class << self
     private :_start
     private :_stop
+    private :_start_stats
+    private :_stats
+    private :_handoff_matrix
+    private :_start_flight_recorder
+    private :_stop_flight_recorder
+    private :_dump
+    private :_begin_span
+    private :_end_span
+    private :_before_fork
+    private :_after_fork
+    private :_refresh_thread_filter
+    private :_analyze
+
+    # Writes the trace to `file`, or streams it to a collector listening on the Unix domain `socket` (see
+    # `gvl-tracing-collector`). With `cpu_time: true`, each thread's CPU time gets sampled whenever it acquires and
+    # releases the GVL, and the slices that end when it releases the GVL record how long it was actually on a CPU.
+    # With `fibers: true`, fiber switches get recorded too, and each thread gets an extra track showing its fibers.
+    # With `mmap: true`, the file gets written through a memory mapping, so that if the process gets killed while
+    # tracing, the trace so far can still be recovered with `gvl-tracing-repair`.
+    # With `include_threads` and/or `exclude_threads` (each a Regexp matched against Thread#name, a ThreadGroup, or an
+    # Array of those), only the matching threads get traced, as well as those picked with `trace_thread`.
+    def start(
+      file = nil,
+      socket: nil,
+      os_threads_view_enabled: false,
+      buffer_size: DEFAULT_BUFFER_SIZE,
+      format: :json,
+      compression: nil,
+      gvl_holder_threshold_us: nil,
+      min_slice_us: nil,
+      cpu_time: false,
+      fibers: false,
+      mmap: false,
+      include_threads: nil,
+      exclude_threads: nil
+    )
+      raise ArgumentError, "Expected either a file or a socket to write to" unless file.nil? ^ socket.nil?
 
-    def start(file, os_threads_view_enabled: false)
-      _start(file, os_threads_view_enabled)
+      _start(file || socket, {
+        socket: !socket.nil?,
+        os_threads_view_enabled: os_threads_view_enabled,
+        buffer_size: buffer_size,
+        format: format,
+        compression: compression,
+        gvl_holder_threshold_us: gvl_holder_threshold_us,
+        min_slice_us: min_slice_us,
+        cpu_time: cpu_time,
+        fibers: fibers,
+        mmap: mmap,
+        include_threads: include_threads && Array(include_threads),
+        exclude_threads: exclude_threads && Array(exclude_threads)
+      })
       _init_local_storage(Thread.list)
-      @path = file
 
       return unless block_given?
 
@@ -48,32 +143,110 @@ module GvlTracing
       end
     end
 
+    # Returns the GVL handoff matrix: how many times each thread released the GVL to each other thread, and how long
+    # (on average) the receiving thread had been waiting for it
     def stop
-      thread_list = _stop
+      _stop
+
+      _handoff_matrix.sort_by { |handoff| -handoff[:count] }
+    end
+
+    # Starts recording events into memory, keeping (roughly) the last `window` seconds; these can then be written out
+    # using `GvlTracing.dump`. If `auto_dump_threshold_ms` is set, a dump also gets written automatically (to
+    # `"#{auto_dump_path}-N.json"`, or `.pftrace` for the perfetto format) whenever a thread waits for the GVL for longer
+    # than that.
+    def start_flight_recorder(
+      window: 10,
+      max_events: DEFAULT_FLIGHT_RECORDER_EVENTS,
+      buffer_size: DEFAULT_BUFFER_SIZE,
+      format: :json,
+      compression: nil,
+      auto_dump_threshold_ms: nil,
+      auto_dump_path: "gvl-tracing-flight-recorder"
+    )
+      _start_flight_recorder({
+        window: window,
+        max_events: max_events,
+        buffer_size: buffer_size,
+        format: format,
+        compression: compression,
+        auto_dump_threshold_ms: auto_dump_threshold_ms,
+        auto_dump_path: auto_dump_path
+      })
+      _init_local_storage(Thread.list)
+
+      return unless block_given?
+
+      begin
+        yield
+      ensure
+        stop_flight_recorder
+      end
+    end
+
+    # Returns the paths of the dumps that were written automatically
+    def stop_flight_recorder
+      _stop_flight_recorder
+    end
 
-      append_thread_names(thread_list)
+    # Writes the events kept by the flight recorder to `path`, using the format/compression given when it was started
+    def dump(path)
+      _dump(path)
 
-      trim_all_seen_threads
+      path
     end
 
-    private
+    # Adds a span named `name` (e.g. "db query") around the block, on an extra track next to the current thread's. Spans
+    # can be nested. When tracing is not running, this just calls the block.
+    def span(name)
+      return yield unless _begin_span(name)
 
-    def append_thread_names(list)
-      thread_names = aggreate_thread_list(list).join(",\n")
-      File.open(@path, "a") do |f|
-        f.puts(thread_names)
-        f.puts("]")
+      begin
+        yield
+      ensure
+        _end_span
       end
     end
 
-    def aggreate_thread_list(list)
-      list.each_with_object([]) do |t, acc|
-        next unless t.name || t == Thread.main
+    # Starts gathering stats (see `GvlTracing.stats`). With `cpu_time: true`, each thread's CPU time also gets sampled
+    # whenever it acquires and releases the GVL, to report how long it held the GVL without being on a CPU.
+    def start_stats(cpu_time: false) = _start_stats(cpu_time)
+
+    # Returns the stats gathered since `GvlTracing.start_stats`. Times are in nanoseconds, and the `wants_gvl_histogram`
+    # has the count of waits for the GVL shorter than 1us in the first bucket, and of waits in [2^(N-1), 2^N) us in
+    # bucket N.
+    def stats
+      thread_stats, dead_threads = _stats
+      threads_by_id = Thread.list.each_with_object({}) { |t, acc| acc[thread_id_for(t)] = t }
+
+      thread_stats.each do |s|
+        thread = threads_by_id[s[:thread_id]]
+        s[:name] = thread_label(thread) if thread && (thread.name || thread == Thread.main)
+      end
 
-        acc << "  {\"ph\": \"M\", \"pid\": #{Process.pid}, \"tid\": #{thread_id_for(t)}, \"name\": \"thread_name\", \"args\": {\"name\": \"#{thread_label(t)}\"}}"
+      all_stats = thread_stats + [dead_threads]
+      totals = dead_threads.keys.grep(STATS_TOTALS).to_h { |key| [key, all_stats.sum { |s| s[key] }] }
+      # Each Ractor has its own GVL, so its threads only compete with each other (dead threads can't be told apart)
+      ractors = thread_stats.group_by { |s| s[:ractor_id] }.transform_values do |ractor_stats|
+        RACTOR_TOTALS.to_h { |key| [key, ractor_stats.sum { |s| s[key] }] }
       end
+
+      {threads: thread_stats, dead_threads: dead_threads, totals: totals, ractors: ractors}
     end
 
+    private
+
+    # Forked children keep tracing into their own file (see ForkHooks), so they need to close it when they exit
+    def stop_in_forked_child(recording)
+      (recording == :flight_recorder) ? stop_flight_recorder : stop
+    rescue RuntimeError
+      # Already stopped
+    end
+
+    # Everything but the histogram, e.g. running_ns, waiting_io_read_ns and wants_gvl_count
+    STATS_TOTALS = /_(ns|count)\z/
+    RACTOR_TOTALS = [:running_ns, :wants_gvl_ns, :wants_gvl_count].freeze
+
     REGEX = /lib(?!.*lib)\/([a-zA-Z-]+)/
     def thread_label(thread)
       if thread == Thread.main
@@ -93,5 +266,9 @@ module GvlTracing
   end
 end
 
+Process.singleton_class.prepend(GvlTracing::ForkHooks)
+Thread.prepend(GvlTracing::ThreadFilterHooks)
+ThreadGroup.prepend(GvlTracing::ThreadGroupFilterHooks)
+
 # Eagerly initialize context for main thread
 GvlTracing.send(:thread_id_for, Thread.main)
@@ -0,0 +1,97 @@
+# gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+# Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of gvl-tracing.
+#
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# frozen_string_literal: true
+
+# frozen_string_literal: true
+
+require "etc"
+require_relative "../gvl-tracing"
+
+module GvlTracing
+  # Summarizes a trace written in the JSON format (see `gvl-tracing-analyze`), without loading it into memory. The
+  # parsing is done by the native extension, using `jobs` threads.
+  module Analyze
+    STATES = [:running, :wants_gvl, :waiting, :sleeping, :gc].freeze
+
+    # Returns a hash with:
+    # * `duration_ns`: from the first to the last event in the trace
+    # * `processes`: for each process, how long its trace was and how long the GC spent marking and sweeping
+    # * `threads`: for each thread, how long it spent in each state (`running_ns`, `wants_gvl_ns`, ...) and how many
+    #   times it waited for the GVL
+    # * `wants_gvl`: percentiles for how long threads waited for the GVL (which are within ~6% of the actual values)
+    # * `longest_stalls`: the `top` longest waits for the GVL, and when they started
+    # * `contended_windows`: the `top` windows of `window_ms` where threads spent the most time waiting for the GVL
+    def self.analyze(path, jobs: Etc.nprocessors, window_ms: 100, top: 10)
+      GvlTracing.send(:_analyze, path, jobs, window_ms, top)
+    end
+
+    def self.report(analysis, io = $stdout)
+      io.puts "Trace duration: #{ms(analysis[:duration_ns])}, #{analysis[:threads].size} threads"
+
+      io.puts "", "Threads (by time spent waiting for the GVL):"
+      io.puts format("  %8s %8s  %-30s %12s %12s %12s %12s %12s %12s", "pid", "thread", "name", *STATES, "utilization")
+      analysis[:threads].sort_by { |thread| -thread[:wants_gvl_ns] }.each do |thread|
+        io.puts format(
+          "  %8d %8d  %-30s %12s %12s %12s %12s %12s %12s",
+          thread[:pid], thread[:thread_id], thread[:name].to_s[0, 30], *STATES.map { |state| ms(thread[:"#{state}_ns"]) },
+          percent(thread[:running_ns], STATES.sum { |state| thread[:"#{state}_ns"] })
+        )
+      end
+
+      wants_gvl = analysis[:wants_gvl]
+      io.puts "", "Waiting for the GVL: #{wants_gvl[:count]} times, #{ms(wants_gvl[:total_ns])} in total"
+      io.puts "  p50 #{ms(wants_gvl[:p50_ns])}, p90 #{ms(wants_gvl[:p90_ns])}, p99 #{ms(wants_gvl[:p99_ns])}, " \
+        "p99.9 #{ms(wants_gvl[:p999_ns])}, max #{ms(wants_gvl[:max_ns])}"
+
+      io.puts "", "Longest waits for the GVL:"
+      analysis[:longest_stalls].each do |stall|
+        io.puts "  #{ms(stall[:duration_ns])} at #{seconds(stall[:started_at_ns])}, thread #{stall[:thread_id]} (pid #{stall[:pid]})"
+      end
+
+      io.puts "", "GC:"
+      analysis[:processes].each do |process|
+        gc_ns = process[:gc_marking_ns] + process[:gc_sweeping_ns]
+        io.puts "  pid #{process[:pid]}: #{percent(gc_ns, process[:duration_ns])} of the time " \
+          "(marking #{ms(process[:gc_marking_ns])}, sweeping #{ms(process[:gc_sweeping_ns])})"
+      end
+
+      io.puts "", "Most contended #{ms(analysis[:window_ns])} windows:"
+      analysis[:contended_windows].each do |window|
+        threads_waiting = window[:wants_gvl_ns].to_f / analysis[:window_ns]
+        io.puts "  at #{seconds(window[:started_at_ns])}: #{ms(window[:wants_gvl_ns])} spent waiting for the GVL " \
+          "(#{format("%.1f", threads_waiting)} threads waiting on average)"
+      end
+    end
+
+    def self.ms(ns) = format("%.3fms", ns / 1_000_000.0)
+
+    def self.seconds(ns) = format("%.6fs", ns / 1_000_000_000.0)
+
+    def self.percent(part, total) = (total > 0) ? format("%.1f%%", part * 100.0 / total) : "-"
+
+    private_class_method :ms, :seconds, :percent
+  end
+end
@@ -0,0 +1,85 @@
+# gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+# Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of gvl-tracing.
+#
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# frozen_string_literal: true
+
+require "socket"
+
+module GvlTracing
+  # Reference collector for `GvlTracing.start(socket: ...)`: accepts connections on a Unix domain socket, and writes what
+  # it receives from each connection (each process that's tracing) to its own trace file.
+  #
+  # Traces get sent as a sequence of batches, each one prefixed with its length as a 32-bit big-endian integer. Batches
+  # that the tracer had to drop because the collector was not keeping up are simply missing. Batches only end between
+  # records (only a record larger than a whole batch gets split across batches), so for JSON traces the rest of the trace
+  # can still be read; for perfetto traces, events after a dropped batch may show up with missing names.
+  module Collector
+    FRAME_HEADER_SIZE = 4
+
+    # Accepts connections until interrupted (or until `server` gets closed)
+    def self.run(socket_path, output_directory)
+      File.delete(socket_path) if File.socket?(socket_path) # Left behind by a previous collector
+      server = UNIXServer.new(socket_path)
+      connection_number = 0
+
+      loop do
+        client = server.accept
+        connection_number += 1
+        Thread.new(client, connection_number) do |connection, number|
+          path = receive(connection, output_directory, "gvl-#{Time.now.strftime("%Y%m%d-%H%M%S")}-#{number}")
+          warn "Wrote #{path}" if path
+        end
+      end
+    rescue IOError # The server got closed
+    ensure
+      server&.close
+      File.delete(socket_path) if File.socket?(socket_path)
+    end
+
+    # Writes out every batch received from `connection` until it gets closed. Returns the path of the trace that was
+    # written, or nil if nothing was received.
+    def self.receive(connection, output_directory, name)
+      file = nil
+      path = nil
+
+      while (header = connection.read(FRAME_HEADER_SIZE))&.bytesize == FRAME_HEADER_SIZE
+        length = header.unpack1("N")
+        batch = connection.read(length)
+        break unless batch&.bytesize == length # The tracer went away in the middle of a batch
+
+        unless file
+          path = File.join(output_directory, "#{name}#{batch.start_with?("[") ? ".json" : ".pftrace"}")
+          file = File.open(path, "wb")
+        end
+        file.write(batch)
+      end
+
+      path
+    ensure
+      file&.close
+      connection.close
+    end
+  end
+end
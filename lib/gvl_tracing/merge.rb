@@ -0,0 +1,156 @@
+# gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+# Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of gvl-tracing.
+#
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# frozen_string_literal: true
+
+require "zlib"
+
+module GvlTracing
+  # Combines the traces written by forked processes (see `GvlTracing::ForkHooks`) into a single trace, so workers can be
+  # compared side by side. Every process already gets its own pid (and thus its own process group in the Perfetto UI),
+  # and timestamps are relative to when tracing started in the parent, so this mostly needs to concatenate the events.
+  module Merge
+    TRACE_PACKET = 1
+    TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID = 10
+
+    WIRE_TYPE_VARINT = 0
+    WIRE_TYPE_FIXED64 = 1
+    WIRE_TYPE_LENGTH_DELIMITED = 2
+    WIRE_TYPE_FIXED32 = 5
+
+    # Writes the merge of `input_paths` to `output_path`; inputs can be in either JSON or perfetto format (all of them
+    # must be in the same format), optionally gzipped. The output gets gzipped if `output_path` ends in ".gz".
+    def self.merge(input_paths, output_path)
+      raise ArgumentError, "Nothing to merge" if input_paths.empty?
+
+      traces = input_paths.map { |path| read(path) }
+      formats = traces.map { |trace| trace.match?(/\A\s*\[/) ? :json : :perfetto }.uniq
+      raise ArgumentError, "Can't merge JSON and perfetto traces together" if formats.size > 1
+
+      merged = (formats.first == :json) ? merge_json(traces) : merge_perfetto(traces)
+
+      if output_path.end_with?(".gz")
+        Zlib::GzipWriter.open(output_path) { |gzip| gzip.write(merged) }
+      else
+        File.binwrite(output_path, merged)
+      end
+    end
+
+    def self.read(path)
+      raise ArgumentError, "Reading zstd-compressed traces is not supported, decompress #{path} first" if path.end_with?(".zst")
+
+      data = File.binread(path)
+      data.start_with?("\x1f\x8b".b) ? Zlib.gunzip(data) : data
+    end
+
+    # Each event is an object on its own line. Traces from processes that didn't get to stop tracing (e.g. because they
+    # got killed) are missing the closing "]", so rather than parsing them we just take every event line.
+    def self.merge_json(traces)
+      events = traces.flat_map do |trace|
+        trace.each_line.filter_map do |line|
+          line = line.strip.delete_prefix("[").delete_suffix("]").strip.delete_suffix(",")
+          line unless line.empty?
+        end
+      end
+
+      "[\n#{events.join(",\n")}\n]\n"
+    end
+
+    # Perfetto traces are a sequence of packets, so they can be concatenated. Interned data and incremental timestamps are
+    # scoped to a packet sequence though, and every trace uses the same sequence id, so each trace gets moved to its own.
+    def self.merge_perfetto(traces)
+      output = +"".b
+      traces.each.with_index(1) do |trace, sequence_id|
+        each_field(trace) do |field, wire_type, value|
+          next unless field == TRACE_PACKET && wire_type == WIRE_TYPE_LENGTH_DELIMITED
+
+          packet = +"".b
+          each_field(value) do |packet_field, packet_wire_type, packet_value, raw|
+            packet << ((packet_field == TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID) ? field_key(packet_field, WIRE_TYPE_VARINT) + varint(sequence_id) : raw)
+          end
+          output << field_key(TRACE_PACKET, WIRE_TYPE_LENGTH_DELIMITED) << varint(packet.bytesize) << packet
+        end
+      end
+      output
+    end
+
+    # Yields field number, wire type, value and the raw bytes of every field in `message`; a truncated field at the end
+    # (e.g. from a process that got killed) gets ignored
+    def self.each_field(message)
+      offset = 0
+      while offset < message.bytesize
+        start = offset
+        key, offset = read_varint(message, offset)
+        return unless key
+
+        wire_type = key & 0x7
+        case wire_type
+        when WIRE_TYPE_VARINT
+          value, offset = read_varint(message, offset)
+          return unless value
+        when WIRE_TYPE_FIXED64, WIRE_TYPE_FIXED32
+          size = (wire_type == WIRE_TYPE_FIXED64) ? 8 : 4
+          return if offset + size > message.bytesize
+          value = message.byteslice(offset, size)
+          offset += size
+        when WIRE_TYPE_LENGTH_DELIMITED
+          size, offset = read_varint(message, offset)
+          return if size.nil? || offset + size > message.bytesize
+          value = message.byteslice(offset, size)
+          offset += size
+        else
+          raise ArgumentError, "Unexpected protobuf wire type #{wire_type}, is this a perfetto trace?"
+        end
+
+        yield key >> 3, wire_type, value, message.byteslice(start, offset - start)
+      end
+    end
+
+    def self.read_varint(message, offset)
+      value = 0
+      shift = 0
+      while offset < message.bytesize
+        byte = message.getbyte(offset)
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        return [value, offset] if byte < 0x80
+        shift += 7
+      end
+      [nil, offset]
+    end
+
+    def self.varint(value)
+      bytes = +"".b
+      loop do
+        byte = value & 0x7f
+        value >>= 7
+        return bytes << byte if value == 0
+        bytes << (byte | 0x80)
+      end
+    end
+
+    def self.field_key(field, wire_type) = varint((field << 3) | wire_type)
+  end
+end
@@ -0,0 +1,58 @@
+# gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+# Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of gvl-tracing.
+#
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# frozen_string_literal: true
+
+require "gvl-tracing"
+
+module GvlTracing
+  # Rack middleware that labels everything a thread does while serving a request (see `GvlTracing.set_context`), so
+  # that time spent waiting for the GVL can be attributed to endpoints:
+  #
+  #   use GvlTracing::RackMiddleware
+  #
+  # By default, the label is the request method and path, with numeric path segments replaced with ":id" (e.g.
+  # "GET /users/:id"). Pass in a `label:` block, taking the Rack env, to use something else. Since each label is kept
+  # around for as long as the process lives, labels should not include unbounded values (such as ids).
+  class RackMiddleware
+    NUMERIC_SEGMENT = %r{/\d+(?=/|\z)}
+
+    def initialize(app, label: nil)
+      @app = app
+      @label = label || method(:default_label)
+    end
+
+    def call(env)
+      GvlTracing.set_context(@label.call(env))
+      @app.call(env)
+    ensure
+      GvlTracing.set_context(nil)
+    end
+
+    private
+
+    def default_label(env) = "#{env["REQUEST_METHOD"]} #{env["PATH_INFO"].to_s.gsub(NUMERIC_SEGMENT, "/:id")}"
+  end
+end
@@ -0,0 +1,83 @@
+# gvl-tracing: Ruby gem for getting a timelinew view of GVL usage
+# Copyright (c) 2022 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of gvl-tracing.
+#
+# MIT License
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+# frozen_string_literal: true
+
+module GvlTracing
+  # Recovers the traces left behind by processes that were tracing with `mmap: true` (see `GvlTracing.start`) but died
+  # before they could stop, e.g. because they got killed. These files end with a trailer recording how much of them got
+  # written, so that's where the trace gets cut; JSON traces then also get the closing "]" they're missing (perfetto
+  # traces are just a sequence of packets, so they need nothing else).
+  module Repair
+    # Same as in output.h
+    MAGIC = "GVLTMMAP".b
+    TRAILER_SIZE = 16
+    GROW_SIZE = 4 * 1024 * 1024
+    # Every JSON event is on its own line, so only the very end of the trace needs to be looked at
+    TAIL_SIZE = 4096
+
+    # Repairs the trace at `path` in place, and returns its new size. Raises ArgumentError if there's nothing to repair,
+    # e.g. because the process did get to stop tracing.
+    def self.repair(path)
+      File.open(path, "r+b") do |file|
+        length = written_length(file)
+        raise ArgumentError, "#{path} does not need repairing (it's complete, or was not written with mmap: true)" unless length
+
+        file.truncate(length)
+        file.seek(0)
+        return length unless file.read(1) == "["
+
+        # The last event is followed by ",\n", and the trace may have stopped at any point after that
+        file.seek(length - [length, TAIL_SIZE].min)
+        tail = file.read
+        kept = tail.rstrip.delete_suffix(",")
+        return length if kept.end_with?("]")
+
+        length -= tail.bytesize - kept.bytesize
+        file.truncate(length)
+        file.seek(length)
+        file.write("\n]\n")
+        length + 3
+      end
+    end
+
+    # The trailer is at the end of the file, unless the process died while growing the file, in which case it's where
+    # the end was before that. Files that got closed don't have a trailer, and are unlikely to be exactly as large as
+    # the files get grown to.
+    def self.written_length(file)
+      return if file.size == 0 || file.size % GROW_SIZE != 0
+
+      (file.size / GROW_SIZE).downto(1) do |size_in_steps|
+        position = size_in_steps * GROW_SIZE - TRAILER_SIZE
+        file.seek(position)
+        trailer = file.read(TRAILER_SIZE)
+        next unless trailer.start_with?(MAGIC)
+
+        length = trailer.byteslice(MAGIC.bytesize, 8).unpack1("Q<")
+        return length if length <= position
+      end
+      nil
+    end
+  end
+end
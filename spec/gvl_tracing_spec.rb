@@ -3,13 +3,24 @@
 require "spec_helper"
 require "json"
 require "net/http"
+require "tmpdir"
+require "zlib"
 require "direct_bind/rspec_helper"
 
+require "gvl_tracing/collector"
+require "gvl_tracing/merge"
+require "gvl_tracing/repair"
 require "perfetto_trace"
 
 RSpec.describe GvlTracing do
   let(:trace_path) { "tmp/gvl.json" }
 
+  # Keeps the current thread running (and holding the GVL) for a while
+  def busy_wait(seconds)
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+    nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+  end
+
   it "has a version number" do
     expect(GvlTracing::VERSION).not_to be nil
   end
@@ -107,6 +118,964 @@ RSpec.describe GvlTracing do
     end
   end
 
+  describe "wait reasons" do
+    it "names waiting slices after what the thread was blocked on" do
+      queue = Thread::Queue.new
+      mutex = Thread::Mutex.new
+
+      GvlTracing.start(trace_path) do
+        mutex.lock
+        consumer = Thread.new { queue.pop }
+        locker = Thread.new { mutex.synchronize {} }
+        Thread.pass until consumer.status == "sleep" && locker.status == "sleep"
+        queue << :done
+        mutex.unlock
+        [consumer, locker].each(&:join)
+      end
+
+      names = PerfettoTrace.new(trace_path).events_by_thread.values.flatten.map(&:name)
+      expect(names).to include("waiting:queue", "waiting:mutex")
+    end
+
+    it "reports the time spent waiting on each kind of thing in the stats" do
+      queue = Thread::Queue.new
+
+      GvlTracing.start_stats
+      consumer = Thread.new { queue.pop }
+      Thread.pass until consumer.status == "sleep"
+      sleep(0.01)
+      queue << :done
+      consumer.join
+      GvlTracing.stop_stats
+
+      totals = GvlTracing.stats[:totals]
+      expect(totals[:waiting_queue_ns]).to be >= 10_000_000
+      expect(totals[:waiting_ns]).to be >= totals[:waiting_queue_ns]
+    end
+  end
+
+  describe "custom spans" do
+    it "records spans on a track next to the thread" do
+      expect(GvlTracing.span("not tracing") { :result }).to be :result
+
+      GvlTracing.start(trace_path) do
+        GvlTracing.span("outer \"span\"") do
+          GvlTracing.span(:inner) { sleep(0.001) }
+        end
+      end
+
+      events_by_thread = PerfettoTrace.new(trace_path).events_by_thread
+      span_tid, span_events = events_by_thread.find { |tid, _| tid >= 1 << 24 }
+
+      expect(events_by_thread.keys).to include(span_tid - (1 << 24))
+      expect(span_events.reject(&:meta?).map(&:phase)).to eq(%w[B B E E])
+      expect(span_events.select(&:phase_begin?).map(&:name)).to eq(['outer "span"', "inner"])
+      expect(span_events.find(&:meta?).thread_name).to eq("Main Thread spans")
+    end
+
+    it "records spans in the perfetto format" do
+      GvlTracing.start(trace_path, format: :perfetto) do
+        GvlTracing.span("db query") { sleep(0.001) }
+      end
+
+      expect(PerfettoProtobufTrace.new(trace_path).interned_event_names.values).to include("db query")
+    end
+  end
+
+  describe "fibers" do
+    it "records the fibers that ran on each thread on a track next to it" do
+      fibers = Array.new(2) { Fiber.new { 2.times { Fiber.yield } } }
+
+      GvlTracing.start(trace_path, fibers: true) do
+        3.times { fibers.each(&:resume) }
+      end
+
+      events_by_thread = PerfettoTrace.new(trace_path).events_by_thread
+      fiber_tid, fiber_events = events_by_thread.find { |tid, _| tid >= 2 << 24 }
+      fiber_names = fiber_events.select(&:phase_begin?).map(&:name)
+
+      expect(events_by_thread.keys).to include(fiber_tid - (2 << 24))
+      # Every resume switches to the fiber and then back to the main fiber
+      expect(fiber_names.size).to be 12
+      expect(fiber_names.uniq.size).to be 3
+      expect(fiber_names.each_slice(2).map(&:last).uniq.size).to be 1
+      expect(fiber_events.find(&:meta?).thread_name).to eq("Main Thread fibers")
+    end
+
+    it "totals how long threads running fibers waited for the GVL" do
+      GvlTracing.start(trace_path, fibers: true) do
+        Fiber.new { 3.times { Thread.new { busy_wait(0.001) }.join } }.resume
+      end
+
+      fiber_totals = JSON.parse(File.read(trace_path)).find { |row| row["name"] == "fiber_totals" }["args"]
+
+      expect(fiber_totals["switches"]).to be 2
+      expect(fiber_totals["runnable_waiting_for_gvl_count"]).to be >= 3
+    end
+
+    it "records fibers in the perfetto format" do
+      GvlTracing.start(trace_path, format: :perfetto, fibers: true) { Fiber.new { :done }.resume }
+
+      trace = PerfettoProtobufTrace.new(trace_path)
+      track_names = trace.packets
+        .flat_map { |packet| packet.fetch(PerfettoProtobufTrace::TRACK_DESCRIPTOR, []) }
+        .filter_map { |descriptor| PerfettoProtobufTrace.decode(descriptor)[2]&.first }
+      slice_names = trace.track_events.filter_map { |track_event| track_event[23]&.first }
+
+      expect(track_names).to include("fibers")
+      expect(slice_names.grep(/\Afiber \d+\z/).size).to be 2
+    end
+  end
+
+  describe "ractors", if: RUBY_VERSION >= "3.3" do
+    around do |example|
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+      example.run
+    ensure
+      Warning[:experimental] = experimental
+    end
+
+    it "shows the threads of each Ractor in a separate process" do
+      GvlTracing.start(trace_path) do
+        Ractor.new { Thread.new { sleep(0.001) }.join }.take
+      end
+
+      rows = JSON.parse(File.read(trace_path))
+      ractor_pid = rows.find { |row| row["name"] == "process_name" && row.dig("args", "name").start_with?("Ractor ") }["pid"]
+      ractor_tids = rows.select { |row| row["pid"] == ractor_pid && row["ph"] == "B" }.map { |row| row["tid"] }.uniq
+
+      expect(ractor_pid).to_not eq(Process.pid)
+      expect(ractor_tids.size).to be 2
+      expect(rows.select { |row| row["pid"] == Process.pid && row["ph"] == "B" }.map { |row| row["tid"] }).to_not include(*ractor_tids)
+    end
+
+    it "only attributes waits for the GVL in the main Ractor" do
+      GvlTracing.start(trace_path, gvl_holder_threshold_us: 1_000) do
+        Ractor.new do
+          waiter = Thread.new {}
+          deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.02
+          nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+          waiter.join
+        end.take
+      end
+
+      expect(GvlTracing.gvl_holder_stacks).to eq([])
+      expect(File.read(trace_path)).to_not include("\"gvl_holder\"")
+    end
+
+    it "sums up the stats for each Ractor" do
+      GvlTracing.start_stats
+      ractor = Ractor.new { Ractor.receive }
+      sleep(0.01)
+      stats = GvlTracing.stats
+      ractor.send(:done)
+      ractor.take
+      GvlTracing.stop_stats
+
+      ractor_ids = stats[:threads].map { |thread_stats| thread_stats[:ractor_id] }.uniq
+
+      expect(ractor_ids.size).to be 2
+      expect(stats[:ractors].keys.sort).to eq(ractor_ids.sort)
+      expect(stats[:ractors][1][:running_ns]).to be > 0
+    end
+  end
+
+  describe "forking" do
+    let(:child_trace_path) { "tmp/gvl-#{@child_pid}.json" }
+    let(:merged_trace_path) { "tmp/gvl-merged.json" }
+
+    def fork_child_while_tracing(**options)
+      GvlTracing.start(trace_path, **options) do
+        @child_pid = fork do
+          Thread.new { sleep(0.001) }.join
+          GvlTracing.stop
+          exit!(0)
+        end
+        Process.wait(@child_pid)
+      end
+    end
+
+    after { [child_trace_path, merged_trace_path].each { |path| File.delete(path) if File.exist?(path) } }
+
+    it "writes a separate trace for each child, which can be merged with the parent's" do
+      fork_child_while_tracing
+
+      expect(PerfettoTrace.new(child_trace_path).events_by_thread.values.flatten.map(&:pid).uniq).to eq([@child_pid])
+
+      GvlTracing::Merge.merge([trace_path, child_trace_path], merged_trace_path)
+
+      expect(PerfettoTrace.new(merged_trace_path).events_by_thread.values.flatten.map(&:pid).uniq).to eq([Process.pid, @child_pid])
+    end
+
+    it "merges perfetto traces, giving each one its own packet sequence" do
+      fork_child_while_tracing(format: :perfetto)
+
+      GvlTracing::Merge.merge([trace_path, child_trace_path], merged_trace_path)
+
+      packets = PerfettoProtobufTrace.new(merged_trace_path).packets
+      expect(packets.map { |packet| packet[10].first }.uniq).to eq([1, 2])
+      expect(packets.size).to eq(PerfettoProtobufTrace.new(trace_path).packets.size + PerfettoProtobufTrace.new(child_trace_path).packets.size)
+    end
+
+    it "keeps the flight recorder working in the child" do
+      Dir.mktmpdir do |dir|
+        dump_path = File.join(dir, "gvl-child-dump.json")
+        GvlTracing.start_flight_recorder
+        @child_pid = fork do
+          Thread.new { sleep(0.001) }.join
+          GvlTracing.dump(dump_path)
+          GvlTracing.stop_flight_recorder
+          exit!(0)
+        end
+        Process.wait(@child_pid)
+        GvlTracing.stop_flight_recorder
+
+        expect($?.exitstatus).to be 0
+        expect(PerfettoTrace.new(dump_path).events_by_thread.values.flatten.map(&:pid).uniq).to eq([@child_pid])
+      end
+    end
+  end
+
+  describe "streaming to a socket" do
+    let(:socket_path) { "tmp/gvl.sock" }
+    let(:collected_trace_path) { "tmp/gvl-collected.json" }
+    let!(:server) do
+      File.delete(socket_path) if File.exist?(socket_path)
+      UNIXServer.new(socket_path)
+    end
+
+    after do
+      server.close
+      [socket_path, collected_trace_path].each { |path| File.delete(path) if File.exist?(path) }
+    end
+
+    it "fails if given both a file and a socket, or neither" do
+      expect { GvlTracing.start(trace_path, socket: socket_path) }.to raise_error(ArgumentError)
+      expect { GvlTracing.start }.to raise_error(ArgumentError)
+    end
+
+    it "fails if compression is requested" do
+      expect { GvlTracing.start(socket: socket_path, compression: :gzip) }.to raise_error(ArgumentError, /compression/)
+    end
+
+    it "sends the trace to the collector" do
+      collector = Thread.new { GvlTracing::Collector.receive(server.accept, "tmp", "gvl-collected") }
+
+      GvlTracing.start(socket: socket_path) do
+        Thread.new { sleep(0.001) }.join
+      end
+
+      expect(collector.value).to eq(collected_trace_path)
+      expect(PerfettoTrace.new(collected_trace_path).events_by_thread.values.flatten.map(&:name)).to include("started_tracing", "started", "stopped_tracing")
+      expect(GvlTracing.dropped_batches).to be 0
+    end
+
+    it "sends only whole records when the socket fills up" do
+      # The collector runs in its own process, so it keeps reading while the tracer fills up the socket faster than it
+      # can keep up with; whatever batches get dropped, what's received still needs to be a valid trace
+      collector = fork do
+        GvlTracing::Collector.receive(server.accept, "tmp", "gvl-collected")
+        exit!(0)
+      end
+
+      GvlTracing.start(socket: socket_path) do
+        Array.new(4) { Thread.new { 2_000.times { sleep(0.00001) } } }.each(&:join)
+      end
+      Process.wait(collector)
+
+      expect(File.size(collected_trace_path)).to be > 1024 * 1024
+      events = JSON.parse(File.read(collected_trace_path))
+      expect(events.map { |event| event["name"] }).to include("started_tracing", "stopped_tracing")
+    end
+
+    it "drops whole batches when the collector is not keeping up" do
+      # Nothing ever reads from the socket, so once its buffer fills up, nothing else fits
+      GvlTracing.start(socket: socket_path) do
+        Array.new(2) { Thread.new { 2_000.times { sleep(0.00001) } } }.each(&:join)
+      end
+
+      expect(GvlTracing.dropped_batches).to be > 0
+    end
+  end
+
+  describe "memory-mapped output" do
+    it "fails if compression is requested" do
+      expect { GvlTracing.start(trace_path, mmap: true, compression: :gzip) }.to raise_error(ArgumentError, /compression/)
+    end
+
+    it "writes a regular trace when tracing stops" do
+      GvlTracing.start(trace_path, mmap: true) { Thread.new { sleep(0.001) }.join }
+
+      expect(PerfettoTrace.new(trace_path).events_by_thread.values.flatten.map(&:name)).to include("started", "stopped_tracing")
+      expect { GvlTracing::Repair.repair(trace_path) }.to raise_error(ArgumentError, /does not need repairing/)
+    end
+
+    it "keeps what was written before the process got killed, so it can be repaired" do
+      pid = fork do
+        GvlTracing.start(trace_path, mmap: true)
+        Thread.new { sleep(0.001) }.join
+        sleep(0.05) # Gives the writer thread time to catch up
+        Process.kill(:KILL, Process.pid)
+      end
+      Process.wait(pid)
+      GvlTracing::Repair.repair(trace_path)
+
+      expect($?.termsig).to be Signal.list.fetch("KILL")
+      expect(PerfettoTrace.new(trace_path).events_by_thread.values.flatten.map(&:name)).to include("started_tracing", "started", "died")
+    end
+  end
+
+  describe "clock" do
+    it "uses CLOCK_MONOTONIC by default" do
+      expect(GvlTracing.clock).to be :monotonic
+    end
+
+    it "can use the CPU's counter instead, recording how it got converted" do
+      script = <<~RUBY
+        require "gvl-tracing"
+        GvlTracing.start(#{trace_path.dump}) { Thread.new { sleep(0.01) }.join }
+        print GvlTracing.clock
+      RUBY
+      clock = IO.popen({"GVL_TRACING_CLOCK" => "tsc"}, [RbConfig.ruby, *$LOAD_PATH.flat_map { |path| ["-I", path] }, "-e", script], &:read)
+      trace = JSON.parse(File.read(trace_path))
+      clock_event = trace.find { |event| event["name"] == "clock" }
+      sleeping_at = trace.index { |event| event["name"] == "sleeping" }
+      sleeping = trace[sleeping_at]
+      woke_up = trace[sleeping_at..].find { |event| event["ph"] == "E" && event["tid"] == sleeping["tid"] }
+
+      expect(%w[tsc monotonic]).to include(clock)
+      expect(clock_event&.dig("args", "source")).to eq((clock == "tsc") ? "tsc" : nil)
+      expect(woke_up["ts"] - sleeping["ts"]).to be_within(5_000).of(10_000)
+    end
+  end
+
+  describe "thread filtering" do
+    def traced_thread_names
+      JSON.parse(File.read(trace_path)).select { |event| event["name"] == "thread_name" }.map { |event| event["args"]["name"] }
+    end
+
+    it "only traces the threads matching the filters, and the ones picked explicitly" do
+      GvlTracing.start(trace_path, include_threads: /worker/) do
+        threads = ["worker 1", "worker 2", "other"].map do |name|
+          Thread.new do
+            Thread.current.name = name
+            3.times { sleep(0.001) }
+          end
+        end
+        picked = Thread.new do
+          Thread.current.name = "picked"
+          sleep(0.001)
+          3.times { sleep(0.001) }
+        end
+        GvlTracing.trace_thread(picked)
+        (threads + [picked]).each(&:join)
+      end
+
+      expect(traced_thread_names).to include("worker 1", "worker 2", "picked")
+      expect(traced_thread_names).to_not include("other")
+      expect { JSON.parse(File.read(trace_path)) }.to_not raise_error
+    end
+
+    it "does not trace the threads in an excluded thread group" do
+      excluded = ThreadGroup.new
+
+      GvlTracing.start(trace_path, exclude_threads: [excluded]) do
+        ["kept", "excluded"].map do |name|
+          Thread.new do
+            excluded.add(Thread.current) if name == "excluded"
+            Thread.current.name = name
+            3.times { sleep(0.001) }
+          end
+        end.each(&:join)
+      end
+
+      expect(traced_thread_names).to include("kept")
+      expect(traced_thread_names).to_not include("excluded")
+    end
+
+    it "checks threads again when they get added to a thread group" do
+      included = ThreadGroup.new
+      go = Queue.new
+
+      GvlTracing.start(trace_path, include_threads: [included]) do
+        thread = Thread.new do
+          go.pop
+          3.times { sleep(0.001) }
+        end
+        thread.name = "added later"
+        Thread.pass until thread.status == "sleep"
+        included.add(thread)
+        go << true
+        thread.join
+      end
+
+      expect(traced_thread_names).to include("added later")
+    end
+
+    # On 3.2 the state of other threads can't be reached, so threads that already exist only pick up their decision once
+    # they release the GVL
+    it "records nothing for an excluded thread, not even the GC it triggers", if: RUBY_VERSION >= "3.3" do
+      excluded = ThreadGroup.new
+      go = Queue.new
+      thread = Thread.new do
+        excluded.add(Thread.current)
+        go.pop
+        GC.start
+      end
+      sleep(0.001) while thread.status != "sleep"
+
+      GvlTracing.start(trace_path, exclude_threads: [excluded]) do
+        go << true
+        thread.join
+      end
+
+      events = JSON.parse(File.read(trace_path))
+      expect(events.map { |event| event["name"] }).to include("major_gc_marking") # The GC did happen
+      expect(events.map { |event| event["tid"] }).to_not include(GvlTracing.send(:thread_id_for, thread))
+    end
+
+    it "fails on an unknown filter" do
+      expect { GvlTracing.start(trace_path, include_threads: "worker") }.to raise_error(ArgumentError, /include_threads/)
+    end
+  end
+
+  describe "analyzing traces" do
+    before { require "gvl_tracing/analyze" }
+
+    it "summarizes what each thread did" do
+      GvlTracing.start(trace_path) do
+        workers = Array.new(2) do |i|
+          Thread.new do
+            Thread.current.name = "worker #{i}"
+            sleep(0.001) # Thread names get picked up when threads release the GVL
+            busy_wait(0.01)
+          end
+        end
+        workers.each(&:join)
+      end
+
+      analysis = GvlTracing::Analyze.analyze(trace_path)
+      workers = analysis[:threads].select { |thread| thread[:name]&.start_with?("worker") }
+
+      expect(workers.size).to be 2
+      expect(workers.map { |thread| thread[:running_ns] }).to all(be >= 10_000_000)
+      expect(analysis[:wants_gvl][:count]).to eq(analysis[:threads].sum { |thread| thread[:wants_gvl_count] })
+      expect(analysis[:longest_stalls].map { |stall| stall[:duration_ns] }.first).to eq(analysis[:wants_gvl][:max_ns])
+      expect(analysis[:processes].map { |process| process[:pid] }).to eq([Process.pid])
+    end
+
+    it "gets the same results when parsing the trace in parallel" do
+      File.open(trace_path, "w") do |file|
+        file.puts "["
+        80_000.times do |i|
+          ts = format("%f", i * 1.5)
+          file.puts %(  {"ph": "E", "pid": 1, "tid": #{i % 3 + 1}, "ts": #{ts}},)
+          file.puts %(  {"ph": "B", "pid": 1, "tid": #{i % 3 + 1}, "ts": #{ts}, "name": "#{%w[running wants_gvl waiting:queue][i % 4 % 3]}"},)
+        end
+        file.puts %(  {"ph": "M", "pid": 1, "tid": 1, "name": "thread_name", "args": {"name": "Main Thread"}}\n])
+      end
+
+      analysis = GvlTracing::Analyze.analyze(trace_path, jobs: 1)
+
+      expect(GvlTracing::Analyze.analyze(trace_path, jobs: 4)).to eq(analysis)
+      expect(analysis[:threads].map { |thread| thread[:running_ns] + thread[:wants_gvl_ns] + thread[:waiting_ns] }.sum)
+        .to be > 100_000_000
+    end
+
+    it "fails for traces that are not in the JSON format" do
+      GvlTracing.start(trace_path, format: :perfetto) {}
+
+      expect { GvlTracing::Analyze.analyze(trace_path) }.to raise_error(ArgumentError, /not a JSON trace/)
+    end
+  end
+
+  describe "context labels" do
+    after { GvlTracing.set_context(nil) }
+
+    it "labels the slices of the thread that set it, and keeps totals for each label" do
+      GvlTracing.start(trace_path) do
+        GvlTracing.set_context("GET /users")
+        Thread.new { sleep(0.001) }.join
+        busy_wait(0.001)
+        GvlTracing.set_context(nil)
+        Thread.new { sleep(0.001) }.join
+      end
+
+      main_thread_events = PerfettoTrace.new(trace_path).events_by_thread.values.first.select(&:phase_begin?)
+      contexts = main_thread_events.map { |event| event.args&.fetch("context") }
+
+      expect(contexts).to include("GET /users", nil)
+      expect(GvlTracing.context_stats["GET /users"][:count]).to be 1
+      expect(GvlTracing.context_stats["GET /users"][:running_ns]).to be >= 1_000_000
+    end
+
+    it "sets the label for each request in the rack middleware" do
+      require "gvl_tracing/rack"
+
+      app = ->(_env) { [200, {}, []] }
+      middleware = GvlTracing::RackMiddleware.new(app)
+
+      GvlTracing.start_stats
+      middleware.call("REQUEST_METHOD" => "GET", "PATH_INFO" => "/users/42/posts")
+      middleware.call("REQUEST_METHOD" => "GET", "PATH_INFO" => "/users/43/posts")
+      GvlTracing.stop_stats
+
+      expect(GvlTracing.context_stats.keys).to eq(["GET /users/:id/posts"])
+      expect(GvlTracing.context_stats["GET /users/:id/posts"][:count]).to be 2
+    end
+  end
+
+  describe "cpu time" do
+    it "records how long threads were on a CPU while holding the GVL" do
+      GvlTracing.start(trace_path, cpu_time: true) do
+        Thread.new do
+          3.times do
+            busy_wait(0.002)
+            sleep(0.0001)
+          end
+        end.join
+      end
+
+      cpu_times = PerfettoTrace.new(trace_path).events_by_thread.values.flatten.select(&:phase_end?).filter_map(&:args)
+
+      expect(cpu_times.map { |args| args["cpu_us"] }.max).to be >= 1_000
+      expect(cpu_times.map { |args| args["cpu"] }).to all(be >= 0) if RUBY_PLATFORM.include?("linux")
+    end
+  end
+
+  describe "event buffers" do
+    it "fails if buffer_size is not a positive integer" do
+      expect { GvlTracing.start(trace_path, buffer_size: 0) }.to raise_error(ArgumentError, /buffer_size/)
+      expect { GvlTracing.start(trace_path, buffer_size: "big") }.to raise_error(ArgumentError, /buffer_size/)
+    end
+
+    it "counts events that did not fit in the buffers and still creates valid json" do
+      GvlTracing.start(trace_path, buffer_size: 1) do
+        100.times { sleep(0.00001) }
+      end
+
+      expect(GvlTracing.dropped_events).to be > 0
+      expect { JSON.parse(File.read(trace_path)) }.to_not raise_error
+    end
+
+    it "resets the dropped events counter on start" do
+      GvlTracing.start(trace_path, buffer_size: 1) { 100.times { sleep(0.00001) } }
+      GvlTracing.start(trace_path) {}
+
+      expect(GvlTracing.dropped_events).to be 0
+    end
+  end
+
+  describe "json format" do
+    it "writes events exactly as the printf-based serializer did" do
+      GvlTracing.start(trace_path, os_threads_view_enabled: true, gvl_holder_threshold_us: 1_000) do
+        waiter = Thread.new { sleep(0.001) }
+        busy_wait(0.01)
+        waiter.join
+      end
+
+      trace = PerfettoTrace.new(trace_path)
+      event_lines = trace.lines.filter_map do |line|
+        expected = PerfettoTrace.printf_formatted(JSON.parse(line.delete_suffix(","))) if line.start_with?("  {")
+        [line, expected] if expected
+      end
+
+      expect(event_lines.map(&:last).map { |line| line[/"ph": "(.)"/, 1] }.uniq.sort).to eq(["B", "E", "f", "i", "s"])
+      event_lines.each { |line, expected| expect(line).to eq(expected) }
+    end
+  end
+
+  describe "thread names" do
+    def thread_names(trace_path)
+      JSON.parse(File.read(trace_path)).select { |event| event["name"] == "thread_name" }.map { |event| event["args"]["name"] }
+    end
+
+    it "includes threads that died while tracing was running" do
+      GvlTracing.start(trace_path) do
+        Thread.new do
+          Thread.current.name = "short-lived"
+          sleep(0.01)
+        end.join
+      end
+
+      expect(thread_names(trace_path)).to include("Main Thread", "short-lived")
+    end
+
+    it "does not include threads that died before tracing started" do
+      GvlTracing.start(trace_path) do
+        3.times do |i|
+          Thread.new do
+            Thread.current.name = "previous-trace-#{i}"
+            sleep(0.01)
+          end.join
+        end
+      end
+
+      GvlTracing.start(trace_path) { Thread.new {}.join }
+
+      expect(thread_names(trace_path)).to include("Main Thread")
+      expect(thread_names(trace_path).grep(/previous-trace-/)).to be_empty
+    end
+  end
+
+  describe "perfetto format" do
+    let(:trace_path) { "tmp/gvl.pftrace" }
+
+    it "fails on an unknown format" do
+      expect { GvlTracing.start(trace_path, format: :xml) }.to raise_error(ArgumentError, /format/)
+    end
+
+    it "writes interned event names, thread names and slices" do
+      finish = Queue.new
+      worker = Thread.new { finish.pop }
+      worker.name = "perfetto-worker"
+
+      GvlTracing.start(trace_path, format: :perfetto) do
+        Thread.new {}.join
+      end
+      finish << true
+      worker.join
+
+      trace = PerfettoProtobufTrace.new(trace_path)
+
+      expect(trace.interned_event_names.values).to include("running", "wants_gvl", "waiting", "gc", "sleeping")
+      expect(trace.thread_names).to include("Main Thread", "perfetto-worker")
+
+      started_iid = trace.interned_event_names.key("started")
+      expect(trace.track_events.map { |event| event[10].first }).to include(started_iid)
+    end
+  end
+
+  describe "gc phases" do
+    it "writes each GC cycle on the GC track, and the totals at the end" do
+      GvlTracing.start(trace_path) { GC.start }
+
+      trace = JSON.parse(File.read(trace_path))
+      gc_track = trace.select { |event| event["tid"] == PerfettoTrace::GC_TRACK_TID }
+      marking = gc_track.find { |event| event["name"] == "major_gc_marking" && event["args"]["triggered_by"] == "method" }
+
+      expect(gc_track.first["args"]).to eq("name" => "GC")
+      expect(marking["args"]["major_by"]).to_not be_nil
+      expect(gc_track.map { |event| event["name"] }).to include("gc_sweeping")
+      expect(trace.find { |event| event["name"] == "gc_totals" }["args"]["major_count"]).to be >= 1
+      expect(PerfettoTrace.new(trace_path).events_by_thread.keys).to_not include(PerfettoTrace::GC_TRACK_TID)
+    end
+  end
+
+  describe "gvl counters" do
+    it "writes samples of how many threads are in each state" do
+      GvlTracing.start(trace_path) do
+        4.times.map { Thread.new { 10.times { sleep(0.0001) } } }.each(&:join)
+      end
+
+      counters = JSON.parse(File.read(trace_path)).select { |event| event["ph"] == "C" }
+
+      expect(counters).to_not be_empty
+      expect(counters.map { |event| event["name"] }.uniq).to eq(["gvl_threads"])
+      expect(counters.map { |event| event["args"].keys }.uniq).to eq([["wants_gvl", "running", "waiting"]])
+      expect(counters.map { |event| event["args"]["waiting"] }.max).to be > 0
+    end
+
+    it "does not write samples after tracing stopped" do
+      GvlTracing.start(trace_path) do
+        4.times.map { Thread.new { 10.times { sleep(0.0001) } } }.each(&:join)
+      end
+
+      trace = JSON.parse(File.read(trace_path))
+      stopped_at = trace.find { |event| event["name"] == "stopped_tracing" }["ts"]
+
+      expect(trace.select { |event| event["ph"] == "C" }.map { |event| event["ts"] }.max).to be <= stopped_at
+    end
+  end
+
+  describe "compression" do
+    let(:trace_path) { "tmp/gvl.json.gz" }
+
+    it "fails on an unknown compression" do
+      expect { GvlTracing.start(trace_path, compression: :lzma) }.to raise_error(ArgumentError, /compression/)
+    end
+
+    it "writes a single valid gzip file, including the thread names" do
+      GvlTracing.start(trace_path, compression: :gzip) do
+        Thread.new {}.join
+      end
+
+      trace = JSON.parse(Zlib::GzipReader.open(trace_path, &:read))
+
+      expect(trace.first["name"]).to eq("process_name")
+      expect(trace.last["name"]).to eq("thread_name")
+    end
+  end
+
+  describe "gvl holder attribution" do
+    it "fails if gvl_holder_threshold_us is not a positive integer" do
+      expect { GvlTracing.start(trace_path, gvl_holder_threshold_us: 0) }
+        .to raise_error(ArgumentError, /gvl_holder_threshold_us/)
+    end
+
+    it "records the stack of the thread that held the GVL while another thread waited for it" do
+      GvlTracing.start(trace_path, gvl_holder_threshold_us: 5_000) do
+        waiter = Thread.new {}
+        busy_wait(0.02)
+        waiter.join
+      end
+
+      stacks = GvlTracing.gvl_holder_stacks
+      expect(stacks.size).to be >= 1
+      expect(stacks.first[:count]).to be >= 1
+      expect(stacks.first[:total_wait_ns]).to be >= 5_000_000
+      expect(stacks.first[:frames].join("\n")).to include("gvl_tracing_spec.rb")
+
+      trace = JSON.parse(File.read(trace_path))
+      holder_event = trace.find { |event| event["name"] == "gvl_holder" }
+      expect(holder_event["args"]["holder_thread_id"]).to eq(GvlTracing.send(:thread_id_for, Thread.main))
+      expect(holder_event["args"]["stack_id"]).to eq(stacks.first[:stack_id])
+      expect(trace.count { |event| event["name"] == "gvl_holder_stack" }).to eq(stacks.size)
+    end
+
+    it "does nothing by default" do
+      GvlTracing.start(trace_path) do
+        waiter = Thread.new {}
+        busy_wait(0.02)
+        waiter.join
+      end
+
+      expect(GvlTracing.gvl_holder_stacks).to eq([])
+      expect(File.read(trace_path)).to_not include("gvl_holder")
+    end
+  end
+
+  describe "gvl handoffs" do
+    it "links the thread that released the GVL to the thread that acquired it" do
+      GvlTracing.start(trace_path) do
+        Thread.new {}.join
+      end
+
+      trace = JSON.parse(File.read(trace_path))
+      flow_begins = trace.select { |event| event["ph"] == "s" }.to_h { |event| [event["id"], event] }
+      flow_ends = trace.select { |event| event["ph"] == "f" }
+
+      expect(flow_ends).to_not be_empty
+      flow_ends.each do |flow_end|
+        flow_begin = flow_begins.fetch(flow_end["id"])
+        expect(flow_begin["tid"]).to_not eq(flow_end["tid"])
+        expect(flow_begin["ts"]).to be <= flow_end["ts"]
+      end
+    end
+
+    it "returns the handoff matrix from stop" do
+      GvlTracing.start(trace_path)
+      Thread.new {}.join
+      handoffs = GvlTracing.stop
+
+      main_thread_id = GvlTracing.send(:thread_id_for, Thread.main)
+      expect(handoffs).to include(a_hash_including(acquirer_thread_id: main_thread_id))
+      expect(handoffs).to all(include(:releaser_thread_id, :acquirer_thread_id, :count, :mean_wait_ns))
+      expect(handoffs.sum { |handoff| handoff[:count] }).to eq(
+        JSON.parse(File.read(trace_path)).count { |event| event["ph"] == "f" }
+      )
+    end
+
+    it "writes the handoffs as perfetto flows" do
+      GvlTracing.start("tmp/gvl.pftrace", format: :perfetto) do
+        Thread.new {}.join
+      end
+
+      track_events = PerfettoProtobufTrace.new("tmp/gvl.pftrace").track_events
+      flow_ids = track_events.flat_map { |event| event[47] }
+      terminating_flow_ids = track_events.flat_map { |event| event[48] }
+
+      expect(terminating_flow_ids).to_not be_empty
+      expect(flow_ids).to include(*terminating_flow_ids)
+    end
+  end
+
+  describe "coalescing" do
+    def ping_pong(threads: 4, iterations: 200)
+      queues = threads.times.map { Queue.new }
+      workers = threads.times.map do |i|
+        Thread.new do
+          iterations.times do
+            queues[i].pop
+            queues[(i + 1) % threads] << :ball
+          end
+        end
+      end
+      queues.first << :ball
+      workers.each(&:join)
+    end
+
+    it "fails if min_slice_us is not a positive integer, or used with the os threads view" do
+      expect { GvlTracing.start(trace_path, min_slice_us: 0) }.to raise_error(ArgumentError, /min_slice_us/)
+      expect { GvlTracing.start(trace_path, min_slice_us: 10, os_threads_view_enabled: true) }
+        .to raise_error(ArgumentError, /min_slice_us/)
+    end
+
+    it "folds consecutive short slices into coalesced slices with per-state counts and times" do
+      GvlTracing.start(trace_path, min_slice_us: 1_000) { ping_pong }
+
+      trace = JSON.parse(File.read(trace_path))
+      coalesced = trace.select { |event| event["name"] == "coalesced" }
+
+      expect(coalesced).to_not be_empty
+      coalesced.each do |event|
+        args = event["args"]
+        expect(args["slices"]).to be >= 2
+        expect(args.select { |key, _| key.end_with?("_count") }.values.sum).to eq(args["slices"])
+        expect(args.select { |key, _| key.end_with?("_ns") }.values.sum).to be < args["slices"] * 1_000_000
+      end
+      expect(trace.count { |event| event["ph"] == "B" }).to be < coalesced.sum { |event| event["args"]["slices"] }
+      expect(trace.select { |event| event["name"] == "died" }.size).to eq(4)
+      expect(trace.select { |event| event["name"] == "stopped_tracing" }.size).to eq(1)
+    end
+
+    it "writes coalesced slices in the perfetto format" do
+      GvlTracing.start("tmp/gvl.pftrace", format: :perfetto, min_slice_us: 1_000) { ping_pong }
+
+      trace = PerfettoProtobufTrace.new("tmp/gvl.pftrace")
+      coalesced_iid = trace.interned_event_names.key("coalesced")
+      coalesced = trace.track_events.select { |event| event[10] == [coalesced_iid] }
+
+      expect(coalesced).to_not be_empty
+      annotation_names = coalesced.first[4].map { |annotation| PerfettoProtobufTrace.decode(annotation)[10].first }
+      expect(annotation_names).to include("slices")
+    end
+
+    it "does not carry over anything to the next start" do
+      GvlTracing.start(trace_path, min_slice_us: 1_000) { ping_pong }
+      GvlTracing.start(trace_path) { ping_pong(iterations: 10) }
+
+      trace = JSON.parse(File.read(trace_path))
+      expect(trace.count { |event| event["name"] == "coalesced" }).to eq(0)
+      expect(trace.map { |event| event["ts"] }.compact).to all(be >= 0)
+    end
+  end
+
+  describe "flight recorder" do
+    after { GvlTracing.stop_flight_recorder rescue nil }
+
+    it "fails if not started, or if tracing is already running" do
+      expect { GvlTracing.stop_flight_recorder }.to raise_error(RuntimeError, "Flight recorder not running")
+      expect { GvlTracing.dump(trace_path) }.to raise_error(RuntimeError, "Flight recorder not running")
+      GvlTracing.start(trace_path) do
+        expect { GvlTracing.start_flight_recorder }.to raise_error(/Already started/)
+      end
+    end
+
+    it "only writes the events in the window, when asked to" do
+      GvlTracing.start_flight_recorder(window: 0.2)
+      # Kept alive, so that on Ruby 3.2 the new thread can't reuse its native thread (and thus its id)
+      old_thread_queue = Queue.new
+      old_thread = Thread.new { old_thread_queue.pop }
+      Thread.pass until old_thread.status == "sleep"
+      old_thread_id = GvlTracing.send(:thread_id_for, old_thread)
+      sleep(0.3)
+      new_thread = Thread.new { sleep }
+      new_thread.name = "flight-recorder-thread"
+      Thread.pass until new_thread.status == "sleep"
+      sleep(0.05) # Give the writer thread a chance to pick up the events
+
+      expect(GvlTracing.dump(trace_path)).to eq(trace_path)
+      new_thread_id = GvlTracing.send(:thread_id_for, new_thread)
+      new_thread.kill.join
+      old_thread_queue << :done
+      old_thread.join
+      expect(GvlTracing.stop_flight_recorder).to eq([])
+
+      trace = JSON.parse(File.read(trace_path))
+      thread_ids = trace.map { |event| event["tid"] }.uniq
+      expect(thread_ids).to include(new_thread_id)
+      expect(thread_ids).to_not include(old_thread_id)
+      expect(trace).to include(a_hash_including("name" => "thread_name", "args" => {"name" => "flight-recorder-thread"}))
+      expect(trace.find { |event| event["name"] == "flight_recorder_dump" }["args"]["reason"]).to eq("manual")
+      expect(trace.map { |event| event["ts"] }.compact).to all(be >= 0)
+    end
+
+    it "dumps automatically when a thread waits for the GVL for too long" do
+      Dir.mktmpdir do |dir|
+        auto_dump_path = File.join(dir, "gvl-flight-recorder")
+        GvlTracing.start_flight_recorder(auto_dump_threshold_ms: 5, auto_dump_path: auto_dump_path, format: :perfetto)
+        waiter = Thread.new {}
+        busy_wait(0.02)
+        waiter.join
+        sleep(0.05) # Give the writer thread a chance to pick up the request
+
+        paths = GvlTracing.stop_flight_recorder
+
+        expect(paths).to eq(["#{auto_dump_path}-1.pftrace"])
+        dump_event = PerfettoProtobufTrace.new(paths.first).track_events.find { |event| event[23] == ["flight_recorder_dump"] }
+        expect(dump_event).to_not be_nil
+      end
+    end
+  end
+
+  describe "stats" do
+    after { GvlTracing.stop_stats rescue nil }
+
+    it "fails if not started" do
+      expect { GvlTracing.stop_stats }.to raise_error(RuntimeError, "Stats not running")
+    end
+
+    it "tracks time per state and the wants_gvl histogram" do
+      GvlTracing.start_stats
+      worker = Thread.new { 3.times { sleep(0.001) } }
+      worker.name = "stats-worker"
+      Thread.pass until worker.status == "sleep"
+      100_000.times { worker.status }
+      worker.join
+      worker.name = "stats-worker"
+      GvlTracing.stop_stats
+
+      stats = GvlTracing.stats
+
+      main = stats[:threads].find { |s| s[:name] == "Main Thread" }
+      expect(main[:running_ns]).to be > 0
+      expect(stats[:totals][:sleeping_ns]).to be >= 3_000_000
+      expect(stats[:totals][:wants_gvl_count]).to eq(stats[:threads].sum { |s| s[:wants_gvl_histogram].sum } +
+        stats[:dead_threads][:wants_gvl_histogram].sum)
+    end
+
+    it "does not change after being stopped and resets on start" do
+      GvlTracing.start_stats
+      Thread.new {}.join
+      GvlTracing.stop_stats
+
+      expect(GvlTracing.stats).to eq(GvlTracing.stats)
+
+      GvlTracing.start_stats
+
+      expect(GvlTracing.stats[:totals][:wants_gvl_count]).to be 0
+    end
+
+    it "can be used at the same time as tracing" do
+      GvlTracing.start_stats
+      GvlTracing.start(trace_path) { Thread.new {}.join }
+
+      expect(GvlTracing.stats[:totals][:running_ns]).to be > 0
+      expect { JSON.parse(File.read(trace_path)) }.to_not raise_error
+    end
+
+    it "reports how long threads held the GVL without being on a CPU, if asked to" do
+      GvlTracing.start_stats(cpu_time: true)
+      Thread.new do
+        5.times do
+          busy_wait(0.001)
+          sleep(0.0001)
+        end
+      end.join
+      GvlTracing.stop_stats
+
+      totals = GvlTracing.stats[:totals]
+      expect(totals[:gvl_held_on_cpu_ns]).to be >= 4_000_000
+      expect(totals[:gvl_held_off_cpu_ns]).to be >= 0
+
+      GvlTracing.start_stats
+
+      expect(GvlTracing.stats[:totals].keys).to_not include(:gvl_held_on_cpu_ns)
+    end
+  end
+
   it "uses the correct direct-bind gem version" do
     DirectBind::RSpecHelper.expect_direct_bind_version_to_be_up_to_date_in(GvlTracing)
   end
@@ -1,13 +1,43 @@
 # frozen_string_literal: true
 
 class PerfettoTrace
+  FLOW_PHASES = ["s", "t", "f"].freeze
+  GC_TRACK_TID = 3 << 24
+
+  attr_reader :lines
+
   def initialize(file_path)
-    @trace = JSON.parse(File.read(file_path))
+    @lines = File.readlines(file_path, chomp: true)
+    @trace = JSON.parse(@lines.join("\n"))
+  end
+
+  # Formats an event the same way the original printf-based serializer did (e.g. timestamps using "%f"), to check that
+  # the output did not change. Returns nil for rows that the serializer does not write.
+  def self.printf_formatted(row)
+    ts = format("%f", row["ts"]) if row["ts"]
+
+    case row["ph"]
+    when "E"
+      %(  {"ph": "E", "pid": #{row["pid"]}, "tid": #{row["tid"]}, "ts": #{ts}},)
+    when "B"
+      return if row["args"] # E.g. the GC track, which the printf-based serializer did not have
+
+      %(  {"ph": "B", "pid": #{row["pid"]}, "tid": #{row["tid"]}, "ts": #{ts}, "name": "#{row["name"]}"},)
+    when "s", "f"
+      %(  {"ph": "#{row["ph"]}", "id": #{row["id"]}, "pid": #{row["pid"]}, "tid": #{row["tid"]}, "ts": #{ts}, ) +
+        %("name": "gvl_handoff", "cat": "gvl"#{row["bp"] ? %(, "bp": "#{row["bp"]}") : ""}},)
+    when "i"
+      return unless row["name"] == "gvl_holder"
+
+      args = row["args"]
+      %(  {"ph": "i", "s": "t", "pid": #{row["pid"]}, "tid": #{row["tid"]}, "ts": #{ts}, "name": "gvl_holder", ) +
+        %("args": {"holder_thread_id": #{args["holder_thread_id"]}, "stack_id": #{args["stack_id"]}, "wait_us": #{args["wait_us"]}}},)
+    end
   end
 
   def threads
     @trace
-      .select { |j| j["ph"] == "M" && j["name"] == "thread_name" }
+      .select { |j| j["ph"] == "M" && j["name"] == "thread_name" && j["tid"] != GC_TRACK_TID }
       .uniq { |j| j["args"]["tid"] }
       .map { |j| Row.new(j) }
   end
@@ -16,20 +46,21 @@ class PerfettoTrace
     threads.select { |t| t.thread_name != "Main Thread" }
   end
 
+  # Note: Does not include flow events (e.g. GVL handoffs) or the GC track, since those are not really events for the thread
   def events_by_thread
     @trace
-      .select { |j| j["tid"] }
+      .select { |j| j["tid"] && j["tid"] != GC_TRACK_TID && !FLOW_PHASES.include?(j["ph"]) }
       .group_by { |j| j["tid"] }
       .map { |tid, events| [tid, events.map { |j| Row.new(j) }] }
       .to_h
   end
 
   Row = Data.define(:row) do
-    def meta? = ph == "M"
+    def meta? = phase == "M"
 
-    def phase_begin? = ph == "B"
+    def phase_begin? = phase == "B"
 
-    def phase_end? = ph == "E"
+    def phase_end? = phase == "E"
 
     def phase = row["ph"]
 
@@ -46,3 +77,62 @@ class PerfettoTrace
     def thread_name = row.dig("args", "name")
   end
 end
+
+# Minimal decoder for the perfetto protobuf format, enough to check the output of `format: :perfetto`.
+# Each message is decoded into a hash of field number => array of values (integers, or strings for nested data).
+class PerfettoProtobufTrace
+  TRACE_PACKET = 1
+  TRACK_EVENT = 11
+  INTERNED_DATA = 12
+  TRACK_DESCRIPTOR = 60
+
+  attr_reader :packets
+
+  def initialize(file_path)
+    @packets = self.class.decode(File.binread(file_path))[TRACE_PACKET].map { |packet| self.class.decode(packet) }
+  end
+
+  def interned_event_names
+    packets
+      .flat_map { |packet| packet.fetch(INTERNED_DATA, []) }
+      .flat_map { |interned_data| self.class.decode(interned_data).fetch(2, []) }
+      .to_h { |event_name| event_name = self.class.decode(event_name); [event_name[1].first, event_name[2].first] }
+  end
+
+  def thread_names
+    packets
+      .flat_map { |packet| packet.fetch(TRACK_DESCRIPTOR, []) }
+      .flat_map { |descriptor| self.class.decode(descriptor).fetch(4, []) }
+      .filter_map { |thread| self.class.decode(thread)[5]&.first }
+  end
+
+  def track_events
+    packets.flat_map { |packet| packet.fetch(TRACK_EVENT, []) }.map { |track_event| self.class.decode(track_event) }
+  end
+
+  def self.decode(bytes)
+    fields = Hash.new { |hash, key| hash[key] = [] }
+    io = StringIO.new(bytes)
+    until io.eof?
+      tag = read_varint(io)
+      case tag & 7
+      when 0 then fields[tag >> 3] << read_varint(io)
+      when 1 then fields[tag >> 3] << io.read(8).unpack1("Q<")
+      when 2 then fields[tag >> 3] << io.read(read_varint(io))
+      else raise "Unsupported wire type in #{tag}"
+      end
+    end
+    fields
+  end
+
+  def self.read_varint(io)
+    value = 0
+    shift = 0
+    loop do
+      byte = io.readbyte
+      value |= (byte & 0x7f) << shift
+      shift += 7
+      return value if byte < 0x80
+    end
+  end
+end